@@ -125,6 +125,25 @@ kill_curthread(vaddr_t epc, unsigned code, vaddr_t vaddr)
 	thread_exit();
 }
 
+/*
+ * Call vm_fault, tracing the outcome if asked to.
+ */
+static
+int
+trap_vmfault(int faulttype, vaddr_t faultaddress)
+{
+	uint32_t start;
+	int result;
+
+	if (!KTRACE_ON(KTRACE_FAULT)) {
+		return vm_fault(faulttype, faultaddress);
+	}
+	start = cpu_getcycles();
+	result = vm_fault(faulttype, faultaddress);
+	ktrace_record(KTRACE_FAULT, faulttype, start, faultaddress, result);
+	return result;
+}
+
 /*
  * General trap (exception) handling function for mips.
  * This is called by the assembly-language exception handler once
@@ -157,6 +176,11 @@ mips_trap(struct trapframe *tf)
 						+ STACK_SIZE));
 	}
 
+	/* Time up to here was spent in user mode. */
+	if (!iskern) {
+		thread_chargeuser();
+	}
+
 	/* Interrupt? Call the interrupt handler and return. */
 	if (code == EX_IRQ) {
 		int old_in;
@@ -203,6 +227,16 @@ mips_trap(struct trapframe *tf)
 		}
 
 		curthread->t_in_interrupt = old_in;
+
+		/*
+		 * If we interrupted a user thread whose process is
+		 * exiting, don't go back; turn interrupts on (the
+		 * recorded state is already on) and leave.
+		 */
+		if (!iskern && curproc->p_exiting) {
+			splx(splhigh());
+			proc_exitthread(_MKWAIT_EXIT(0));
+		}
 		goto done2;
 	}
 
@@ -240,17 +274,17 @@ mips_trap(struct trapframe *tf)
 	 */
 	switch (code) {
 	case EX_MOD:
-		if (vm_fault(VM_FAULT_READONLY, tf->tf_vaddr)==0) {
+		if (trap_vmfault(VM_FAULT_READONLY, tf->tf_vaddr)==0) {
 			goto done;
 		}
 		break;
 	case EX_TLBL:
-		if (vm_fault(VM_FAULT_READ, tf->tf_vaddr)==0) {
+		if (trap_vmfault(VM_FAULT_READ, tf->tf_vaddr)==0) {
 			goto done;
 		}
 		break;
 	case EX_TLBS:
-		if (vm_fault(VM_FAULT_WRITE, tf->tf_vaddr)==0) {
+		if (trap_vmfault(VM_FAULT_WRITE, tf->tf_vaddr)==0) {
 			goto done;
 		}
 		break;
@@ -323,6 +357,15 @@ mips_trap(struct trapframe *tf)
 	panic("I can't handle this... I think I'll just die now...\n");
 
  done:
+	/*
+	 * Likewise, a thread whose process is being exited by another
+	 * of its threads doesn't go back to user mode. (The exit
+	 * status doesn't matter; whoever set p_exiting supplies it.)
+	 */
+	if (!iskern && curproc->p_exiting) {
+		proc_exitthread(_MKWAIT_EXIT(0));
+	}
+
 	/*
 	 * Turn interrupts off on the processor, without affecting the
 	 * stored interrupt state.
@@ -343,6 +386,11 @@ mips_trap(struct trapframe *tf)
 	cputhreads[curcpu->c_number] = (vaddr_t)curthread;
 	cpustacks[curcpu->c_number] = (vaddr_t)curthread->t_stack + STACK_SIZE;
 
+	/* Time from the trap to here was spent in the kernel. */
+	if (!iskern) {
+		thread_chargekernel();
+	}
+
 	/*
 	 * This assertion will fail if either
 	 *   (1) curthread->t_stack is corrupted, or
@@ -388,6 +436,8 @@ mips_usermode(struct trapframe *tf)
 	cputhreads[curcpu->c_number] = (vaddr_t)curthread;
 	cpustacks[curcpu->c_number] = (vaddr_t)curthread->t_stack + STACK_SIZE;
 
+	thread_chargekernel();
+
 	/*
 	 * This assertion will fail if either
 	 *   (1) cpustacks[] is corrupted, or
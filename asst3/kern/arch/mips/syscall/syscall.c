@@ -33,6 +33,7 @@
 #include <endian.h>
 #include <lib.h>
 #include <mips/trapframe.h>
+#include <cpu.h>
 #include <thread.h>
 #include <current.h>
 #include <copyinout.h>
@@ -83,6 +84,8 @@ syscall(struct trapframe *tf)
 	int callno;
 	int32_t retval;
 	int err;
+	bool traced;
+	uint32_t start;
 
 	KASSERT(curthread != NULL);
 	KASSERT(curthread->t_curspl == 0);
@@ -90,6 +93,9 @@ syscall(struct trapframe *tf)
 
 	callno = tf->tf_v0;
 
+	traced = KTRACE_ON(KTRACE_SYSCALL);
+	start = traced ? cpu_getcycles() : 0;
+
 	/*
 	 * Initialize retval to 0. Many of the system calls don't
 	 * really return a value, just 0 for success and -1 on
@@ -126,6 +132,15 @@ syscall(struct trapframe *tf)
 			(userptr_t)tf->tf_a1);
 		break;
 
+	    case SYS_spawn:
+		err = sys_spawn(
+			(userptr_t)tf->tf_a0,
+			(userptr_t)tf->tf_a1,
+			(userptr_t)tf->tf_a2,
+			tf->tf_a3,
+			&retval);
+		break;
+
 	    case SYS__exit:
 		sys__exit(tf->tf_a0);
 		panic("Returning from exit\n");
@@ -138,10 +153,49 @@ syscall(struct trapframe *tf)
 			&retval);
 		break;
 
+	    case SYS_waitmany:
+		err = sys_waitmany(
+			(userptr_t)tf->tf_a0,
+			(userptr_t)tf->tf_a1,
+			tf->tf_a2,
+			tf->tf_a3,
+			&retval);
+		break;
+
 	    case SYS_getpid:
 		err = sys_getpid(&retval);
 		break;
 
+	    case SYS_getrusage:
+		err = sys_getrusage(tf->tf_a0, (userptr_t)tf->tf_a1);
+		break;
+
+	    case SYS_ktrace:
+		err = sys_ktrace(tf->tf_a0, tf->tf_a1);
+		break;
+
+	    case SYS_ktrace_read:
+		err = sys_ktrace_read((userptr_t)tf->tf_a0, tf->tf_a1,
+				      &retval);
+		break;
+
+	    case SYS___thread_create:
+		err = sys___thread_create(
+			(userptr_t)tf->tf_a0,
+			(userptr_t)tf->tf_a1,
+			(userptr_t)tf->tf_a2,
+			(userptr_t)tf->tf_a3,
+			&retval);
+		break;
+
+	    case SYS_thread_join:
+		err = sys_thread_join(tf->tf_a0, (userptr_t)tf->tf_a1);
+		break;
+
+	    case SYS_thread_exit:
+		sys_thread_exit((userptr_t)tf->tf_a0);
+		panic("Returning from thread_exit\n");
+
 
 	    /* file calls */
 
@@ -292,6 +346,10 @@ syscall(struct trapframe *tf)
 
 	tf->tf_epc += 4;
 
+	if (traced) {
+		ktrace_record(KTRACE_SYSCALL, callno, start, retval, err);
+	}
+
 	/* Make sure the syscall code didn't forget to lower spl */
 	KASSERT(curthread->t_curspl == 0);
 	/* ...or leak any spinlocks */
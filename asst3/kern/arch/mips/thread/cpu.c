@@ -176,6 +176,22 @@ cpu_identify(char *buf, size_t max)
 	}
 }
 
+/*
+ * Read the cycle counter, coprocessor 0 register 9.
+ */
+uint32_t
+cpu_getcycles(void)
+{
+	uint32_t count;
+
+	__asm volatile(".set push;"		/* save assembler mode */
+		       ".set mips32;"		/* allow mips32 instructions */
+		       "mfc0 %0,$9;"		/* get cop0 reg 9 (count) */
+		       ".set pop"		/* restore assembler mode */
+		       : "=r" (count));
+	return count;
+}
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -59,7 +59,8 @@ static uint32_t last_frame;
  * uniprocessor) as this implementation does not block.
  */ 
 
-static struct spinlock frame_table_spinlock = SPINLOCK_INITIALIZER;
+static struct spinlock frame_table_spinlock =
+	SPINLOCK_INITIALIZER_NAMED("frame_table");
 
 /*
  * Called very early in system boot to figure out how much physical
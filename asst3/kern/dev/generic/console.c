@@ -135,18 +135,23 @@ putch_intr(struct con_softc *cs, int ch)
 
 /*
  * Read a character, using interrupts to wait for I/O completion.
+ * Fails with EINTR if the thread is interrupted while waiting (see
+ * thread_interrupt).
  */
 static
 int
-getch_intr(struct con_softc *cs)
+getch_intr(struct con_softc *cs, int *ret)
 {
-	unsigned char ret;
+	int result;
 
-	P(cs->cs_rsem);
-	ret = cs->cs_gotchars[cs->cs_gotchars_tail];
+	result = P_intr(cs->cs_rsem);
+	if (result) {
+		return result;
+	}
+	*ret = cs->cs_gotchars[cs->cs_gotchars_tail];
 	cs->cs_gotchars_tail =
 		(cs->cs_gotchars_tail + 1) % CONSOLE_INPUT_BUFFER_SIZE;
-	return ret;
+	return 0;
 }
 
 /*
@@ -219,10 +224,15 @@ int
 getch(void)
 {
 	struct con_softc *cs = the_console;
+	int ch, result;
+
 	KASSERT(cs != NULL);
 	KASSERT(!curthread->t_in_interrupt && curthread->t_iplhigh_count == 0);
 
-	return getch_intr(cs);
+	/* Only threads of exiting user processes get interrupted. */
+	result = getch_intr(cs, &ch);
+	KASSERT(result == 0);
+	return ch;
 }
 
 ////////////////////////////////////////////////////////////
@@ -244,25 +254,38 @@ static
 int
 con_io(struct device *dev, struct uio *uio)
 {
-	int result;
+	int result, inch;
 	char ch;
 	struct lock *lk;
 
 	(void)dev;  // unused
 
+	/*
+	 * Reads can wait forever for input, so they give up if the
+	 * process is exiting (see proc_exit); writes always finish.
+	 */
 	if (uio->uio_rw==UIO_READ) {
 		lk = con_userlock_read;
+		KASSERT(lk != NULL);
+		result = lock_acquire_intr(lk);
+		if (result) {
+			return result;
+		}
 	}
 	else {
 		lk = con_userlock_write;
+		KASSERT(lk != NULL);
+		lock_acquire(lk);
 	}
 
-	KASSERT(lk != NULL);
-	lock_acquire(lk);
-
 	while (uio->uio_resid > 0) {
 		if (uio->uio_rw==UIO_READ) {
-			ch = getch();
+			result = getch_intr(the_console, &inch);
+			if (result) {
+				lock_release(lk);
+				return result;
+			}
+			ch = inch;
 			if (ch=='\r') {
 				ch = '\n';
 			}
@@ -36,7 +36,8 @@
 #include <lib.h>
 #include <uio.h>
 #include <membar.h>
-#include <synch.h>
+#include <spinlock.h>
+#include <wchan.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -60,6 +61,12 @@
 /* Buffer (offset within slot)  */
 #define LHD_BUFFER      32768
 
+/* Requests passed over this many times go next regardless. */
+#define LHD_DEADLINE    32
+
+/* Size of the bounce buffer for user I/O, in sectors. */
+#define LHD_BOUNCE      16
+
 /*
  * Shortcut for reading a register.
  */
@@ -96,41 +103,238 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Pick the next request to start: normally the first one at or past
+ * the head position, going round to the lowest block when there's
+ * nothing further on (C-LOOK), so the head sweeps across the disk in
+ * one direction. But if something has been passed over for more
+ * than LHD_DEADLINE starts, it goes next regardless.
+ *
+ * Because the head position is the sector after the last request,
+ * a request that picks up where the previous one ended is always
+ * next, and follows it onto the disk without a gap. That's as close
+ * to merging them as this disk gets, since it can only transfer one
+ * sector per command anyway.
+ */
+static
+struct devrequest *
+lhd_pick(struct lhd_softc *lh)
+{
+	struct devrequest *r, *next, *oldest;
+
+	next = oldest = NULL;
+	for (r = lh->lh_queue; r != NULL; r = r->dr_next) {
+		if (oldest == NULL || (int)(r->dr_seq - oldest->dr_seq) < 0) {
+			oldest = r;
+		}
+		if (next == NULL && r->dr_block >= lh->lh_head) {
+			next = r;
+		}
+	}
+	if (oldest != NULL && lh->lh_nstarted - oldest->dr_seq > LHD_DEADLINE) {
+		return oldest;
+	}
+	if (next == NULL) {
+		/* wrap around */
+		next = lh->lh_queue;
+	}
+	return next;
+}
+
+/*
+ * Start the current sector of the active request.
+ */
+static
+void
+lhd_startsect(struct lhd_softc *lh)
+{
+	struct devrequest *r = lh->lh_active;
+	char *ptr;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+	KASSERT(r != NULL);
+
+	ptr = (char *)r->dr_data + lh->lh_activesect * LHD_SECTSIZE;
+
+	/* If writing, transfer the data to the on-card buffer. */
+	if (r->dr_write) {
+		memcpy(lh->lh_buf, ptr, LHD_SECTSIZE);
+		membar_store_store();
+	}
+
+	/* Tell it what sector we want... */
+	lhd_wreg(lh, LHD_REG_SECT, r->dr_block + lh->lh_activesect);
+
+	/* and start the operation. */
+	lhd_wreg(lh, LHD_REG_STAT,
+		 r->dr_write ? (LHD_WORKING | LHD_ISWRITE) : LHD_WORKING);
+}
+
+/*
+ * If the disk is idle and there's something queued, start it.
  */
 static
 void
-lhd_iodone(struct lhd_softc *lh, int err)
+lhd_startnext(struct lhd_softc *lh)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct devrequest *r, **pp;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (lh->lh_active != NULL || lh->lh_queue == NULL) {
+		return;
+	}
+
+	r = lhd_pick(lh);
+	for (pp = &lh->lh_queue; *pp != r; pp = &(*pp)->dr_next) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = r->dr_next;
+	r->dr_next = NULL;
+
+	lh->lh_active = r;
+	lh->lh_activesect = 0;
+	lh->lh_nstarted++;
+	lhd_startsect(lh);
 }
 
 /*
  * Interrupt handler for lhd.
  * Read the status register; if an operation finished, clear the status
- * register and report completion.
+ * register, then go on to the next sector of the request or, when the
+ * request is done, start the next one and wake up whoever queued it.
  */
 void
 lhd_irq(void *vlh)
 {
 	struct lhd_softc *lh = vlh;
+	struct devrequest *r;
 	uint32_t val;
+	int err;
 
 	val = lhd_rdreg(lh, LHD_REG_STAT);
 
 	switch (val & LHD_STATEMASK) {
 	    case LHD_IDLE:
 	    case LHD_WORKING:
-		break;
+		return;
 	    case LHD_OK:
 	    case LHD_INVSECT:
 	    case LHD_MEDIA:
-		lhd_wreg(lh, LHD_REG_STAT, 0);
-		lhd_iodone(lh, lhd_code_to_errno(lh, val));
 		break;
+	    default:
+		/* lhd_code_to_errno will complain */
+		break;
+	}
+	lhd_wreg(lh, LHD_REG_STAT, 0);
+	err = lhd_code_to_errno(lh, val);
+
+	spinlock_acquire(&lh->lh_lock);
+	r = lh->lh_active;
+	if (r == NULL) {
+		/* Nothing was going on; ignore it. */
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	/* If reading, transfer the data out of the on-card buffer. */
+	if (err == 0 && !r->dr_write) {
+		membar_load_load();
+		memcpy((char *)r->dr_data + lh->lh_activesect * LHD_SECTSIZE,
+		       lh->lh_buf, LHD_SECTSIZE);
+	}
+
+	lh->lh_activesect++;
+	if (err == 0 && lh->lh_activesect < r->dr_nblocks) {
+		lhd_startsect(lh);
+		spinlock_release(&lh->lh_lock);
+		return;
 	}
+
+	/* This request is done; get the disk going on the next. */
+	lh->lh_head = r->dr_block + lh->lh_activesect;
+	lh->lh_active = NULL;
+	lhd_startnext(lh);
+
+	r->dr_result = err;
+	r->dr_done = true;
+	wchan_wakeall(lh->lh_wchan, &lh->lh_lock);
+	spinlock_release(&lh->lh_lock);
+}
+
+/*
+ * Queue a request.
+ */
+static
+int
+lhd_submit(struct device *d, struct devrequest *r)
+{
+	struct lhd_softc *lh = d->d_data;
+	struct devrequest **pp;
+
+	/* Don't allow I/O past the end of the disk. */
+	if (r->dr_nblocks == 0 || r->dr_block >= lh->lh_dev.d_blocks ||
+	    r->dr_nblocks > lh->lh_dev.d_blocks - r->dr_block) {
+		return EINVAL;
+	}
+
+	r->dr_done = false;
+	r->dr_result = 0;
+
+	spinlock_acquire(&lh->lh_lock);
+
+	r->dr_seq = lh->lh_nstarted;
+
+	/* Insert in block order, after any for the same block. */
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->dr_next) {
+		if ((*pp)->dr_block > r->dr_block) {
+			break;
+		}
+	}
+	r->dr_next = *pp;
+	*pp = r;
+
+	lhd_startnext(lh);
+	spinlock_release(&lh->lh_lock);
+	return 0;
+}
+
+/*
+ * Wait for a queued request to finish.
+ */
+static
+int
+lhd_wait(struct device *d, struct devrequest *r)
+{
+	struct lhd_softc *lh = d->d_data;
+
+	spinlock_acquire(&lh->lh_lock);
+	while (!r->dr_done) {
+		wchan_sleep(lh->lh_wchan, &lh->lh_lock);
+	}
+	spinlock_release(&lh->lh_lock);
+
+	return r->dr_result;
+}
+
+/*
+ * Queue a request, which must be within the disk, and wait for it.
+ */
+static
+int
+lhd_syncio(struct lhd_softc *lh, uint32_t block, unsigned nblocks,
+	   void *data, bool write)
+{
+	struct devrequest r;
+	int result;
+
+	r.dr_block = block;
+	r.dr_nblocks = nblocks;
+	r.dr_data = data;
+	r.dr_write = write;
+
+	result = lhd_submit(&lh->lh_dev, &r);
+	KASSERT(result == 0);
+	return lhd_wait(&lh->lh_dev, &r);
 }
 
 /*
@@ -181,19 +385,25 @@ lhd_reset(struct lhd_softc *lh)
 
 /*
  * I/O function (for both reads and writes)
+ *
+ * A kernel buffer in one piece (which is what filesystems hand us)
+ * is transferred to directly. Anything else goes through a bounce
+ * buffer, LHD_BOUNCE sectors at a time, since the interrupt handler
+ * can't copy to or from user space.
  */
 static
 int
 lhd_io(struct device *d, struct uio *uio)
 {
 	struct lhd_softc *lh = d->d_data;
-
+	struct iovec *iov;
+	char *bounce;
 	uint32_t sector = uio->uio_offset / LHD_SECTSIZE;
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
+	uint32_t n;
+	bool write = (uio->uio_rw == UIO_WRITE);
 	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
@@ -202,72 +412,65 @@ lhd_io(struct device *d, struct uio *uio)
 	}
 
 	/* Don't allow I/O past the end of the disk. */
-	/* XXX this check can overflow */
-	if (sector+len > lh->lh_dev.d_blocks) {
+	if (sector > lh->lh_dev.d_blocks ||
+	    len > lh->lh_dev.d_blocks - sector) {
 		return EINVAL;
 	}
-
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (len == 0) {
+		return 0;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
-
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+	iov = uio->uio_iov;
+	if (uio->uio_segflg == UIO_SYSSPACE && uio->uio_iovcnt == 1 &&
+	    iov->iov_len == uio->uio_resid) {
+		result = lhd_syncio(lh, sector, len, iov->iov_kbase, write);
+		if (result) {
+			return result;
+		}
+		/* Move the uio along as uiomove would have. */
+		iov->iov_kbase = (char *)iov->iov_kbase + uio->uio_resid;
+		iov->iov_len = 0;
+		uio->uio_offset += uio->uio_resid;
+		uio->uio_resid = 0;
+		return 0;
+	}
 
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			membar_store_store();
+	bounce = kmalloc(LHD_BOUNCE * LHD_SECTSIZE);
+	if (bounce == NULL) {
+		return ENOMEM;
+	}
+	result = 0;
+	while (len > 0) {
+		n = (len < LHD_BOUNCE) ? len : LHD_BOUNCE;
+		if (write) {
+			result = uiomove(bounce, n * LHD_SECTSIZE, uio);
 			if (result) {
-				V(lh->lh_clear);
-				return result;
+				break;
 			}
 		}
-
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			membar_load_load();
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-		}
-
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
+		result = lhd_syncio(lh, sector, n, bounce, write);
 		if (result) {
-			return result;
+			break;
 		}
+		if (!write) {
+			result = uiomove(bounce, n * LHD_SECTSIZE, uio);
+			if (result) {
+				break;
+			}
+		}
+		sector += n;
+		len -= n;
 	}
-
-	return 0;
+	kfree(bounce);
+	return result;
 }
 
 static const struct device_ops lhd_devops = {
 	.devop_eachopen = lhd_eachopen,
 	.devop_io = lhd_io,
 	.devop_ioctl = lhd_ioctl,
+	.devop_submit = lhd_submit,
+	.devop_wait = lhd_wait,
 };
 
 /*
@@ -284,15 +487,16 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
+	/* Set up the request queue. */
+	spinlock_init(&lh->lh_lock);
+	lh->lh_queue = NULL;
+	lh->lh_active = NULL;
+	lh->lh_activesect = 0;
+	lh->lh_head = 0;
+	lh->lh_nstarted = 0;
+	lh->lh_wchan = wchan_create(name);
+	if (lh->lh_wchan == NULL) {
+		spinlock_cleanup(&lh->lh_lock);
 		return ENOMEM;
 	}
 
@@ -30,6 +30,7 @@
 #ifndef _LAMEBUS_LHD_H_
 #define _LAMEBUS_LHD_H_
 
+#include <spinlock.h>
 #include <device.h>
 
 /*
@@ -51,9 +52,21 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+
+	/*
+	 * Request queue, sorted by block; the request in progress
+	 * and how far it's got; where the disk head is (the sector
+	 * after the last one done); and a count of requests started,
+	 * for the deadline. All protected by lh_lock. Threads wait
+	 * on lh_wchan for their requests' dr_done.
+	 */
+	struct spinlock lh_lock;
+	struct devrequest *lh_queue;
+	struct devrequest *lh_active;
+	unsigned lh_activesect;
+	uint32_t lh_head;
+	unsigned lh_nstarted;
+	struct wchan *lh_wchan;
 
 	struct device lh_dev;		/* VFS device structure */
 };
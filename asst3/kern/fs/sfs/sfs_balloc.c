@@ -33,59 +33,237 @@
  * Block allocation.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
+#include <synch.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 /*
- * Zero out a disk block.
+ * Zero out a disk block. This only happens in the buffer cache; the
+ * zeros get to disk whenever the buffer is written back.
  */
 static
 int
 sfs_clearblock(struct sfs_fs *sfs, daddr_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
+	struct buf *buf;
+	int result;
 
-	return sfs_writeblock(sfs, block, zeros, SFS_BLOCKSIZE);
+	result = buffer_get(&sfs->sfs_absfs, block, &buf);
+	if (result) {
+		return result;
+	}
+	bzero(buffer_map(buf), SFS_BLOCKSIZE);
+	buffer_mark_dirty(buf);
+	buffer_release(buf);
+	return 0;
 }
 
 /*
- * Allocate a block.
+ * The disk is divided into groups of SFS_GROUPSIZE blocks, and we
+ * keep a count of the free blocks in each, so we can find a group
+ * with room without scanning the bitmap. These live only in memory;
+ * they're computed from the freemap at mount time.
  */
 int
-sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
+sfs_countfree(struct sfs_fs *sfs)
+{
+	unsigned i;
+	daddr_t block;
+
+	sfs->sfs_ngroups = DIVROUNDUP(sfs->sfs_sb.sb_nblocks, SFS_GROUPSIZE);
+	sfs->sfs_groupfree = kmalloc(sfs->sfs_ngroups * sizeof(uint32_t));
+	if (sfs->sfs_groupfree == NULL) {
+		return ENOMEM;
+	}
+
+	sfs->sfs_nfree = 0;
+	for (i=0; i<sfs->sfs_ngroups; i++) {
+		sfs->sfs_groupfree[i] = 0;
+	}
+	for (block=0; block<sfs->sfs_sb.sb_nblocks; block++) {
+		if (!bitmap_isset(sfs->sfs_freemap, block)) {
+			sfs->sfs_groupfree[block / SFS_GROUPSIZE]++;
+			sfs->sfs_nfree++;
+		}
+	}
+	return 0;
+}
+
+/*
+ * First block past the end of a group. The last group may be short.
+ */
+static
+daddr_t
+sfs_groupend(struct sfs_fs *sfs, unsigned group)
+{
+	daddr_t end;
+
+	end = (group+1) * SFS_GROUPSIZE;
+	if (end > sfs->sfs_sb.sb_nblocks) {
+		end = sfs->sfs_sb.sb_nblocks;
+	}
+	return end;
+}
+
+/*
+ * Pick a free block, as close after GOAL as we can. First try the
+ * rest of GOAL's group; failing that, move forward (wrapping around)
+ * to the first group that has at least its share of the free space,
+ * so a new run of blocks doesn't start in a group that's about to
+ * fill up. If there's no such group take any with a block free.
+ *
+ * Must hold sfs_freemaplock.
+ */
+static
+int
+sfs_findfree(struct sfs_fs *sfs, daddr_t goal, daddr_t *diskblock)
+{
+	uint32_t nblocks = sfs->sfs_sb.sb_nblocks;
+	unsigned group, i, pass;
+	uint32_t want;
+
+	if (sfs->sfs_nfree == 0) {
+		return ENOSPC;
+	}
+	if (goal >= nblocks) {
+		goal = 0;
+	}
+
+	group = goal / SFS_GROUPSIZE;
+	if (sfs->sfs_groupfree[group] > 0 &&
+	    bitmap_findzero(sfs->sfs_freemap, goal,
+			    sfs_groupend(sfs, group), diskblock) == 0) {
+		return 0;
+	}
+
+	want = DIVROUNDUP(sfs->sfs_nfree, sfs->sfs_ngroups);
+	for (pass=0; pass<2; pass++) {
+		for (i=1; i<=sfs->sfs_ngroups; i++) {
+			group = (goal / SFS_GROUPSIZE + i) % sfs->sfs_ngroups;
+			if (sfs->sfs_groupfree[group] < want) {
+				continue;
+			}
+			if (bitmap_findzero(sfs->sfs_freemap,
+					    group * SFS_GROUPSIZE,
+					    sfs_groupend(sfs, group),
+					    diskblock) == 0) {
+				return 0;
+			}
+			panic("sfs: %s: group %u has %u free blocks but "
+			      "none in the freemap\n",
+			      sfs->sfs_sb.sb_volname, group,
+			      sfs->sfs_groupfree[group]);
+		}
+		want = 1;
+	}
+
+	panic("sfs: %s: %u free blocks but none in any group\n",
+	      sfs->sfs_sb.sb_volname, sfs->sfs_nfree);
+	return ENOSPC;
+}
+
+/*
+ * Mark a block used or free, keeping the counts in step. Must hold
+ * sfs_freemaplock.
+ */
+static
+void
+sfs_markblock(struct sfs_fs *sfs, daddr_t block, bool inuse)
+{
+	if (inuse) {
+		bitmap_mark(sfs->sfs_freemap, block);
+		KASSERT(sfs->sfs_groupfree[block / SFS_GROUPSIZE] > 0);
+		sfs->sfs_groupfree[block / SFS_GROUPSIZE]--;
+		sfs->sfs_nfree--;
+	}
+	else {
+		bitmap_unmark(sfs->sfs_freemap, block);
+		sfs->sfs_groupfree[block / SFS_GROUPSIZE]++;
+		sfs->sfs_nfree++;
+	}
+	sfs->sfs_freemapdirty = true;
+}
+
+/*
+ * Allocate a block, as near after GOAL as possible. Passing the
+ * block after the previous one of a file keeps the file in one
+ * contiguous run for as long as the disk allows, and passing the
+ * block after an inode keeps what it points to close by. A GOAL of
+ * 0 (the superblock, which is never free) means no preference.
+ */
+int
+sfs_balloc_near(struct sfs_fs *sfs, daddr_t goal, daddr_t *diskblock)
 {
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	result = sfs_findfree(sfs, goal, diskblock);
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
-	sfs->sfs_freemapdirty = true;
-
 	if (*diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: balloc: invalid block %u\n",
 		      sfs->sfs_sb.sb_volname, *diskblock);
 	}
+	sfs_markblock(sfs, *diskblock, true);
+	lock_release(sfs->sfs_freemaplock);
 
-	/* Clear block before returning it */
+	/*
+	 * Clear block before returning it. The block is already marked
+	 * in use, so nobody else can get it while we're doing this.
+	 */
 	result = sfs_clearblock(sfs, *diskblock);
 	if (result) {
-		bitmap_unmark(sfs->sfs_freemap, *diskblock);
+		lock_acquire(sfs->sfs_freemaplock);
+		sfs_markblock(sfs, *diskblock, false);
+		lock_release(sfs->sfs_freemaplock);
 	}
 	return result;
 }
 
 /*
- * Free a block.
+ * Allocate a block, anywhere.
+ */
+int
+sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
+{
+	return sfs_balloc_near(sfs, 0, diskblock);
+}
+
+/*
+ * Free a block. Whatever's cached or journaled for it is garbage
+ * now; get rid of it before the block can be allocated again. On a
+ * journaled volume that isn't until the freeing is committed; the
+ * journal calls sfs_bsetfree then.
  */
 void
 sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 {
-	bitmap_unmark(sfs->sfs_freemap, diskblock);
-	sfs->sfs_freemapdirty = true;
+	buffer_drop(&sfs->sfs_absfs, diskblock);
+	if (sfs_jnl_revoke(sfs, diskblock)) {
+		return;
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
+	sfs_markblock(sfs, diskblock, false);
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Mark a block whose freeing the journal held back free, or
+ * allocated again (ISFREE false) if it didn't get committed.
+ */
+void
+sfs_bsetfree(struct sfs_fs *sfs, daddr_t diskblock, bool isfree)
+{
+	lock_acquire(sfs->sfs_freemaplock);
+	sfs_markblock(sfs, diskblock, !isfree);
+	lock_release(sfs->sfs_freemaplock);
 }
 
 /*
@@ -94,10 +272,17 @@ sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 int
 sfs_bused(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: sfs_bused called on out of range block %u\n",
 		      sfs->sfs_sb.sb_volname, diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+
+	return ret;
 }
 
@@ -35,10 +35,87 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/*
+ * Note that a volume has (or is about to have) files using double
+ * or triple indirect blocks. The superblock lock here is the freemap
+ * lock, as for sfs_sync_superblock.
+ */
+static
+void
+sfs_usebigfile(struct sfs_fs *sfs)
+{
+	lock_acquire(sfs->sfs_freemaplock);
+	if ((sfs->sfs_sb.sb_features & SFS_FEATURE_BIGFILE) == 0) {
+		sfs->sfs_sb.sb_features |= SFS_FEATURE_BIGFILE;
+		sfs->sfs_superdirty = true;
+	}
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Find which of the inode's indirect block pointers covers
+ * FILEBLOCK, which must be past the direct blocks. Returns the
+ * indirection level (1-3) and sets *IDPTR to the pointer and
+ * *FILEBLOCK to the offset within the range it maps, or returns 0 if
+ * the block is past the largest file we can have.
+ */
+static
+unsigned
+sfs_whichindirect(struct sfs_vnode *sv, uint32_t *fileblock,
+		  uint32_t **idptr)
+{
+	uint32_t range = SFS_DBPERIDB;
+
+	KASSERT(*fileblock >= SFS_NDIRECT);
+	*fileblock -= SFS_NDIRECT;
+
+	if (*fileblock < range) {
+		*idptr = &sv->sv_i.sfi_indirect;
+		return 1;
+	}
+	*fileblock -= range;
+	range *= SFS_DBPERIDB;
+
+	if (*fileblock < range) {
+		*idptr = &sv->sv_i.sfi_dindirect;
+		return 2;
+	}
+	*fileblock -= range;
+	range *= SFS_DBPERIDB;
+
+	if (*fileblock < range) {
+		*idptr = &sv->sv_i.sfi_tindirect;
+		return 3;
+	}
+	return 0;
+}
+
+/*
+ * Pick where to try to put FILEBLOCK of a file: right after the
+ * block before it, if there is one, or else right after the inode.
+ * Blocks get allocated in the order they're written, so for the
+ * usual sequential writer this keeps the whole file in one run.
+ * Don't call this holding a buffer from the file's indirect blocks.
+ */
+static
+daddr_t
+sfs_bmapgoal(struct sfs_vnode *sv, uint32_t fileblock)
+{
+	daddr_t prev;
+
+	if (fileblock > 0 &&
+	    sfs_bmap(sv, fileblock-1, false, &prev) == 0 && prev != 0) {
+		return prev + 1;
+	}
+	return sv->sv_ino + 1;
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
@@ -49,25 +126,25 @@ int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	 daddr_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *idbuf;
+	uint32_t *iddata;
+	uint32_t *idptr;
 	daddr_t block;
 	daddr_t idblock;
-	uint32_t idnum, idoff;
+	daddr_t goal;
+	uint32_t idoff, offset, range;
+	unsigned indirection, i;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	COMPILE_ASSERT(SFS_DBPERIDB*sizeof(iddata[0])==SFS_BLOCKSIZE);
 
-	/* Since we're using a static buffer, we'd better be locked. */
-	KASSERT(vfs_biglock_do_i_hold());
+	/* The inode's block pointers belong to sv_lock. */
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_EXTENTS) {
+		return sfs_ext_bmap(sv, fileblock, doalloc, diskblock, NULL);
+	}
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -82,14 +159,15 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			result = sfs_balloc_near(sfs,
+					sfs_bmapgoal(sv, fileblock), &block);
 			if (result) {
 				return result;
 			}
 
 			/* Remember what we allocated; mark inode dirty */
 			sv->sv_i.sfi_direct[fileblock] = block;
-			sv->sv_dirty = true;
+			sfs_markdirty(sv);
 		}
 
 		/*
@@ -105,27 +183,17 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	}
 
 	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
-	 */
-
-	fileblock -= SFS_NDIRECT;
-
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
-
-	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
+	 * It's not a direct block; find which of the indirect blocks
+	 * in the inode it's under, and the offset within that.
 	 */
-	if (idnum >= SFS_NINDIRECT) {
+	offset = fileblock;
+	indirection = sfs_whichindirect(sv, &offset, &idptr);
+	if (indirection == 0) {
 		return EFBIG;
 	}
 
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
+	/* Get the disk block number of the top indirect block. */
+	idblock = *idptr;
 
 	if (idblock==0 && !doalloc) {
 		/*
@@ -136,55 +204,86 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		*diskblock = 0;
 		return 0;
 	}
-	else if (idblock==0) {
+
+	if (idblock==0) {
 		/*
 		 * There's no indirect block allocated, but we need to
 		 * allocate a block whose number needs to be stored in
 		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
+		 * indirect block. (It comes back zeroed.)
 		 */
-		result = sfs_balloc(sfs, &idblock);
+		if (indirection > 1) {
+			sfs_usebigfile(sfs);
+		}
+		result = sfs_balloc_near(sfs, sfs_bmapgoal(sv, fileblock),
+					 &idblock);
 		if (result) {
 			return result;
 		}
 
 		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
+		*idptr = idblock;
 
 		/* Mark the inode dirty */
-		sv->sv_dirty = true;
-
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
+		sfs_markdirty(sv);
 	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
-		}
+
+	/* Size of the range mapped by each entry in the top block */
+	range = 1;
+	for (i=1; i<indirection; i++) {
+		range *= SFS_DBPERIDB;
 	}
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	/*
+	 * Walk down through the indirect blocks. At each level,
+	 * pick the entry covering OFFSET, allocating it if needed,
+	 * until we get to the data block.
+	 */
+	for (; indirection > 0; indirection--) {
+		idoff = offset / range;
+		offset %= range;
+		range /= SFS_DBPERIDB;
 
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+		/* Get the indirect block. */
+		result = buffer_read(&sfs->sfs_absfs, idblock, &idbuf);
 		if (result) {
 			return result;
 		}
+		iddata = buffer_map(idbuf);
 
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
+		/* Get the next block out of the indirect block */
+		block = iddata[idoff];
 
-		/* The indirect block is now dirty; write it back */
-		result = sfs_writeblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
+		/*
+		 * If there's no block there, allocate one. Put it
+		 * after the entry before it, which at the bottom
+		 * level is the previous block of the file; failing
+		 * that, after this indirect block.
+		 */
+		if (block==0 && doalloc) {
+			if (idoff > 0 && iddata[idoff-1] != 0) {
+				goal = iddata[idoff-1] + 1;
+			}
+			else {
+				goal = idblock + 1;
+			}
+			result = sfs_balloc_near(sfs, goal, &block);
+			if (result) {
+				buffer_release(idbuf);
+				return result;
+			}
+
+			/* Remember the block we allocated */
+			iddata[idoff] = block;
+			sfs_jnl_markdirty(sfs, idbuf);
 		}
+		buffer_release(idbuf);
+
+		if (block == 0) {
+			/* A hole */
+			break;
+		}
+		idblock = block;
 	}
 
 	/* Hand back the result and return. */
@@ -198,34 +297,166 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Look up FILEBLOCK without allocating, and also count how many
+ * blocks from there (up to MAX) follow it consecutively on disk, so
+ * they can be read in one request. A hole counts as a run of 1.
  */
 int
-sfs_itrunc(struct sfs_vnode *sv, off_t len)
+sfs_bmaprun(struct sfs_vnode *sv, uint32_t fileblock, uint32_t max,
+	    daddr_t *diskblock, uint32_t *nblocks)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	daddr_t next;
+	uint32_t n;
+	int result;
+
+	KASSERT(max > 0);
+
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_EXTENTS) {
+		/* One lookup gives the whole run. */
+		result = sfs_ext_bmap(sv, fileblock, false, diskblock, &n);
+		if (result) {
+			return result;
+		}
+		*nblocks = (n < max) ? n : max;
+		return 0;
+	}
+
+	result = sfs_bmap(sv, fileblock, false, diskblock);
+	if (result) {
+		return result;
+	}
+	n = 1;
+	if (*diskblock != 0) {
+		while (n < max) {
+			result = sfs_bmap(sv, fileblock + n, false, &next);
+			if (result || next != *diskblock + n) {
+				break;
+			}
+			n++;
+		}
+	}
+	*nblocks = n;
+	return 0;
+}
+
+/*
+ * Truncate within the indirect block *IDBLOCKP, which is at level
+ * INDIRECTION and maps the file blocks starting at BASEBLOCK.
+ * Discards everything at or past file block BLOCKLEN, including the
+ * indirect block itself if it ends up empty; in that case *IDBLOCKP
+ * is cleared and *CHANGED set.
+ */
+static
+int
+sfs_itrunc_indirect(struct sfs_fs *sfs, uint32_t *idblockp,
+		    unsigned indirection, uint32_t baseblock,
+		    uint32_t blocklen, bool *changed)
+{
+	struct buf *idbuf;
+	uint32_t *iddata;
+	uint32_t range, j;
+	daddr_t idblock = *idblockp;
+	bool hasnonzero, iddirty;
+	unsigned i;
+	int result;
+
+	/* Blocks mapped by each entry */
+	range = 1;
+	for (i=1; i<indirection; i++) {
+		range *= SFS_DBPERIDB;
+	}
+
+	if (idblock == 0 || blocklen >= baseblock + range * SFS_DBPERIDB) {
+		/* Nothing here, or nothing past the proposed EOF */
+		return 0;
+	}
+
+	/* Get the indirect block */
+	result = buffer_read(&sfs->sfs_absfs, idblock, &idbuf);
+	if (result) {
+		return result;
+	}
+	iddata = buffer_map(idbuf);
+
+	hasnonzero = false;
+	iddirty = false;
+	for (j=0; j<SFS_DBPERIDB; j++) {
+		if (iddata[j] == 0 || blocklen >= baseblock + (j+1) * range) {
+			/* Nothing to discard under this entry */
+		}
+		else if (indirection > 1) {
+			result = sfs_itrunc_indirect(sfs, &iddata[j],
+						     indirection - 1,
+						     baseblock + j * range,
+						     blocklen, &iddirty);
+			if (result) {
+				if (iddirty) {
+					sfs_jnl_markdirty(sfs, idbuf);
+				}
+				buffer_release(idbuf);
+				return result;
+			}
+		}
+		else if (blocklen <= baseblock + j) {
+			/* Discard any blocks that are past the new EOF */
+			sfs_bfree(sfs, iddata[j]);
+			iddata[j] = 0;
+			iddirty = true;
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (iddata[j] != 0) {
+			hasnonzero = true;
+		}
+	}
 
+	if (!hasnonzero) {
+		/*
+		 * The whole indirect block is empty now; free it.
+		 * Let go of the buffer first, since sfs_bfree
+		 * drops it.
+		 */
+		buffer_release_and_invalidate(idbuf);
+		sfs_bfree(sfs, idblock);
+		*idblockp = 0;
+		*changed = true;
+	}
+	else {
+		if (iddirty) {
+			/* The indirect block is dirty */
+			sfs_jnl_markdirty(sfs, idbuf);
+		}
+		buffer_release(idbuf);
+	}
+	return 0;
+}
+
+/*
+ * Called for ftruncate() and from sfs_reclaim. The caller must hold
+ * the vnode's sv_lock.
+ */
+int
+sfs_itrunc(struct sfs_vnode *sv, off_t len)
+{
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 
 	/* Length in blocks (divide rounding up) */
 	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
 
-	uint32_t i, j;
-	daddr_t block, idblock;
-	uint32_t baseblock, highblock;
+	uint32_t i;
+	daddr_t block;
+	uint32_t baseblock;
+	bool changed;
 	int result;
-	int hasnonzero, iddirty;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
-	vfs_biglock_acquire();
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_EXTENTS) {
+		result = sfs_ext_trunc(sv, blocklen);
+		if (result) {
+			return result;
+		}
+		goto done;
+	}
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -236,68 +467,46 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 		if (i >= blocklen && block != 0) {
 			sfs_bfree(sfs, block);
 			sv->sv_i.sfi_direct[i] = 0;
-			sv->sv_dirty = true;
+			sfs_markdirty(sv);
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
+	/* Then the single, double, and triple indirect blocks */
+	changed = false;
 	baseblock = SFS_NDIRECT;
+	result = sfs_itrunc_indirect(sfs, &sv->sv_i.sfi_indirect, 1,
+				     baseblock, blocklen, &changed);
+	if (result) {
+		goto fail;
+	}
 
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
-
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
-
-		/* Read the indirect block */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
+	baseblock += SFS_DBPERIDB;
+	result = sfs_itrunc_indirect(sfs, &sv->sv_i.sfi_dindirect, 2,
+				     baseblock, blocklen, &changed);
+	if (result) {
+		goto fail;
+	}
 
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
-		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_writeblock(sfs, idblock, idbuf,
-						sizeof(idbuf));
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
-		}
+	baseblock += SFS_DBPERIDB * SFS_DBPERIDB;
+	result = sfs_itrunc_indirect(sfs, &sv->sv_i.sfi_tindirect, 3,
+				     baseblock, blocklen, &changed);
+	if (result) {
+		goto fail;
 	}
 
+ done:
 	/* Set the file size */
 	sv->sv_i.sfi_size = len;
 
 	/* Mark the inode dirty */
-	sv->sv_dirty = true;
+	sfs_markdirty(sv);
 
-	vfs_biglock_release();
 	return 0;
-}
 
+ fail:
+	/* Some indirect block pointers may have been cleared */
+	if (changed) {
+		sfs_markdirty(sv);
+	}
+	return result;
+}
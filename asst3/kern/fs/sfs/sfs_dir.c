@@ -35,6 +35,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
@@ -85,6 +86,7 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 	off_t size;
 
 	KASSERT(sv->sv_i.sfi_type == SFS_TYPE_DIR);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	size = sv->sv_i.sfi_size;
 	if (size % sizeof(struct sfs_direntry) != 0) {
@@ -107,6 +109,11 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 	struct sfs_direntry tsd;
 	int found, nentries, i, result;
 
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_DIRHASH) {
+		KASSERT(emptyslot == NULL);
+		return sfs_dirhash_findname(sv, name, ino, slot);
+	}
+
 	nentries = sfs_dir_nentries(sv);
 
 	/* For each slot... */
@@ -157,6 +164,10 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	int result;
 	struct sfs_direntry sd;
 
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_DIRHASH) {
+		return sfs_dirhash_link(sv, name, ino, slot);
+	}
+
 	/* Look up the name. We want to make sure it *doesn't* exist. */
 	result = sfs_dir_findname(sv, name, NULL, NULL, &emptyslot);
 	if (result!=0 && result!=ENOENT) {
@@ -197,6 +208,10 @@ sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
 	struct sfs_direntry sd;
 
+	/* The first slot of a hashed directory block is its header */
+	KASSERT((sv->sv_i.sfi_flags & SFS_IFLAG_DIRHASH) == 0 ||
+		slot % SFS_DIRPERBLOCK != 0);
+
 	/* Initialize a suitable directory entry... */
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
@@ -207,7 +222,8 @@ sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 
 /*
  * Look for a name in a directory and hand back a vnode for the
- * file, if there is one.
+ * file, if there is one. The caller must hold the directory's
+ * sv_lock; the returned vnode is not locked.
  */
 int
 sfs_lookonce(struct sfs_vnode *sv, const char *name,
@@ -216,6 +232,7 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name,
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	uint32_t ino;
+	uint16_t linkcount;
 	int result;
 
 	result = sfs_dir_findname(sv, name, &ino, slot, NULL);
@@ -228,7 +245,17 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		return result;
 	}
 
-	if ((*ret)->sv_i.sfi_linkcount == 0) {
+	if (*ret == sv) {
+		/* "." (or ".." in the root); we already hold the lock */
+		linkcount = sv->sv_i.sfi_linkcount;
+	}
+	else {
+		lock_acquire((*ret)->sv_lock);
+		linkcount = (*ret)->sv_i.sfi_linkcount;
+		lock_release((*ret)->sv_lock);
+	}
+
+	if (linkcount == 0) {
 		panic("sfs: %s: name %s (inode %u) in dir %u has "
 		      "linkcount 0\n", sfs->sfs_sb.sb_volname,
 		      name, (*ret)->sv_ino, sv->sv_ino);
@@ -0,0 +1,562 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SFS filesystem
+ *
+ * Hash-indexed directories.
+ *
+ * A hashed directory is a set of bucket blocks, each covering the
+ * names whose hash ends in the bucket's prefix (see the comment on
+ * struct sfs_dirbucket in kern/sfs.h). This is extendible hashing:
+ * when a bucket fills it splits in two on the next hash bit, so a
+ * lookup reads one block however big the directory is. Which bucket
+ * covers which hash is worked out from the bucket headers the first
+ * time the directory is used and kept in sv_dirtable, indexed by the
+ * low sv_dirdepth bits of the hash. All of this belongs to sv_lock.
+ *
+ * Slot numbers are the same as for a plain directory; the first slot
+ * of each block is the bucket header and never holds a name.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/* sv_dirtable value for a hash no bucket covers (only when empty) */
+#define NOBUCKET ((uint32_t)-1)
+
+/*
+ * Deepest we split buckets to. Past this a full bucket gets overflow
+ * blocks instead, which keeps sv_dirtable to a page (1024 entries)
+ * rather than the 256K SFS_DIRHASH_MAXDEPTH would allow. Buckets made
+ * deeper by something else are still understood.
+ */
+#define DIRHASH_MAXSPLIT 10
+
+/*
+ * Hash a name. This must match what sfsck uses.
+ */
+static
+uint32_t
+sfs_dirhash_hash(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static
+int
+sfs_dirhash_readslot(struct sfs_vnode *sv, uint32_t slot,
+		     struct sfs_direntry *sd)
+{
+	return sfs_metaio(sv, (off_t)slot * sizeof(*sd), sd, sizeof(*sd),
+			  UIO_READ);
+}
+
+static
+int
+sfs_dirhash_writeslot(struct sfs_vnode *sv, uint32_t slot,
+		      struct sfs_direntry *sd)
+{
+	return sfs_metaio(sv, (off_t)slot * sizeof(*sd), sd, sizeof(*sd),
+			  UIO_WRITE);
+}
+
+/*
+ * Read the header of directory block FILEBLOCK.
+ */
+static
+int
+sfs_dirhash_readhdr(struct sfs_vnode *sv, uint32_t fileblock,
+		    struct sfs_dirbucket *sdb)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	int result;
+
+	COMPILE_ASSERT(sizeof(struct sfs_dirbucket) ==
+		       sizeof(struct sfs_direntry));
+	COMPILE_ASSERT(SFS_DIRPERBLOCK * sizeof(struct sfs_direntry) ==
+		       SFS_BLOCKSIZE);
+
+	result = sfs_metaio(sv, (off_t)fileblock * SFS_BLOCKSIZE,
+			    sdb, sizeof(*sdb), UIO_READ);
+	if (result) {
+		return result;
+	}
+	if (sdb->sdb_noino != SFS_NOINO || sdb->sdb_magic != SFS_DIRBUCKET_MAGIC
+	    || sdb->sdb_depth > SFS_DIRHASH_MAXDEPTH) {
+		panic("sfs: %s: directory %u: bad bucket header in block %u\n",
+		      sfs->sfs_sb.sb_volname, sv->sv_ino, fileblock);
+	}
+	return 0;
+}
+
+static
+int
+sfs_dirhash_writehdr(struct sfs_vnode *sv, uint32_t fileblock,
+		     struct sfs_dirbucket *sdb)
+{
+	return sfs_metaio(sv, (off_t)fileblock * SFS_BLOCKSIZE,
+			  sdb, sizeof(*sdb), UIO_WRITE);
+}
+
+/*
+ * Number of blocks in the directory.
+ */
+static
+uint32_t
+sfs_dirhash_nblocks(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	if (sv->sv_i.sfi_size % SFS_BLOCKSIZE != 0) {
+		panic("sfs: %s: hashed directory %u: Invalid size %u\n",
+		      sfs->sfs_sb.sb_volname, sv->sv_ino, sv->sv_i.sfi_size);
+	}
+	return sv->sv_i.sfi_size / SFS_BLOCKSIZE;
+}
+
+/*
+ * Build sv_dirtable from the bucket headers, if it isn't there yet.
+ */
+static
+int
+sfs_dirhash_load(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dirbucket sdb;
+	uint32_t nblocks, block, j, size, step;
+	unsigned depth;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (sv->sv_dirtable != NULL) {
+		return 0;
+	}
+	nblocks = sfs_dirhash_nblocks(sv);
+
+	/* First find the deepest bucket, which sets the table size. */
+	depth = 0;
+	for (block=0; block<nblocks; block++) {
+		result = sfs_dirhash_readhdr(sv, block, &sdb);
+		if (result) {
+			return result;
+		}
+		if (sdb.sdb_depth > depth) {
+			depth = sdb.sdb_depth;
+		}
+	}
+
+	size = (uint32_t)1 << depth;
+	sv->sv_dirtable = kmalloc(size * sizeof(uint32_t));
+	if (sv->sv_dirtable == NULL) {
+		return ENOMEM;
+	}
+	sv->sv_dirdepth = depth;
+	for (j=0; j<size; j++) {
+		sv->sv_dirtable[j] = NOBUCKET;
+	}
+
+	/* Then have each bucket claim the hashes it covers. */
+	for (block=0; block<nblocks; block++) {
+		result = sfs_dirhash_readhdr(sv, block, &sdb);
+		if (result) {
+			goto fail;
+		}
+		if (sdb.sdb_flags & SFS_DIRBUCKET_OVERFLOW) {
+			continue;
+		}
+		step = (uint32_t)1 << sdb.sdb_depth;
+		if (sdb.sdb_prefix >= step) {
+			panic("sfs: %s: directory %u: bucket %u has bad "
+			      "prefix\n", sfs->sfs_sb.sb_volname,
+			      sv->sv_ino, block);
+		}
+		for (j = sdb.sdb_prefix; j < size; j += step) {
+			if (sv->sv_dirtable[j] != NOBUCKET) {
+				panic("sfs: %s: directory %u: buckets %u and "
+				      "%u overlap\n", sfs->sfs_sb.sb_volname,
+				      sv->sv_ino, sv->sv_dirtable[j], block);
+			}
+			sv->sv_dirtable[j] = block;
+		}
+	}
+
+	if (nblocks > 0) {
+		for (j=0; j<size; j++) {
+			if (sv->sv_dirtable[j] == NOBUCKET) {
+				panic("sfs: %s: directory %u: no bucket for "
+				      "hash %u\n", sfs->sfs_sb.sb_volname,
+				      sv->sv_ino, j);
+			}
+		}
+	}
+	return 0;
+
+ fail:
+	kfree(sv->sv_dirtable);
+	sv->sv_dirtable = NULL;
+	return result;
+}
+
+/*
+ * Add a block to the end of the directory with the header given.
+ * (It comes from balloc zeroed, so all its slots are free.)
+ */
+static
+int
+sfs_dirhash_newblock(struct sfs_vnode *sv, struct sfs_dirbucket *sdb,
+		     uint32_t *fileblock)
+{
+	struct sfs_direntry sd;
+	int result;
+
+	*fileblock = sfs_dirhash_nblocks(sv);
+
+	/* Write the last slot first so the size covers the whole block */
+	bzero(&sd, sizeof(sd));
+	result = sfs_dirhash_writeslot(sv,
+			(*fileblock + 1) * SFS_DIRPERBLOCK - 1, &sd);
+	if (result) {
+		return result;
+	}
+	return sfs_dirhash_writehdr(sv, *fileblock, sdb);
+}
+
+/*
+ * Search the bucket (and overflow chain) for HASH for NAME. Hands
+ * back the slot it's in, or ENOENT, and optionally a free slot.
+ */
+static
+int
+sfs_dirhash_search(struct sfs_vnode *sv, const char *name, uint32_t hash,
+		   uint32_t *ino, int *slot, int *emptyslot)
+{
+	struct sfs_dirbucket sdb;
+	struct sfs_direntry sd;
+	uint32_t block, i;
+	int result;
+
+	if (sfs_dirhash_nblocks(sv) == 0) {
+		return ENOENT;
+	}
+
+	block = sv->sv_dirtable[hash & (((uint32_t)1 << sv->sv_dirdepth) - 1)];
+	while (1) {
+		for (i=1; i<SFS_DIRPERBLOCK; i++) {
+			result = sfs_dirhash_readslot(sv,
+					block * SFS_DIRPERBLOCK + i, &sd);
+			if (result) {
+				return result;
+			}
+			if (sd.sfd_ino == SFS_NOINO) {
+				if (emptyslot != NULL && *emptyslot < 0) {
+					*emptyslot = block*SFS_DIRPERBLOCK + i;
+				}
+				continue;
+			}
+			sd.sfd_name[sizeof(sd.sfd_name)-1] = 0;
+			if (!strcmp(sd.sfd_name, name)) {
+				if (slot != NULL) {
+					*slot = block * SFS_DIRPERBLOCK + i;
+				}
+				if (ino != NULL) {
+					*ino = sd.sfd_ino;
+				}
+				return 0;
+			}
+		}
+
+		result = sfs_dirhash_readhdr(sv, block, &sdb);
+		if (result) {
+			return result;
+		}
+		if (sdb.sdb_next == 0) {
+			return ENOENT;
+		}
+		block = sdb.sdb_next;
+	}
+}
+
+/*
+ * Split bucket BLOCK on its next hash bit, moving the names with
+ * that bit set into a new bucket. Doubles the table if needed.
+ *
+ * The new bucket is filled in first, then the old one's header and
+ * the table are changed to send those names there, and only then
+ * are they cleared out of the old bucket; until the last step they
+ * can still be found where they were.
+ */
+static
+int
+sfs_dirhash_split(struct sfs_vnode *sv, uint32_t block)
+{
+	struct sfs_dirbucket sdb, newsdb;
+	struct sfs_direntry sd, empty;
+	uint32_t *newtable;
+	uint32_t size, j, i, newblock, newslot, bit;
+	uint32_t moved[SFS_DIRPERBLOCK];
+	unsigned depth, nmoved;
+	int result;
+
+	result = sfs_dirhash_readhdr(sv, block, &sdb);
+	if (result) {
+		return result;
+	}
+	depth = sdb.sdb_depth;
+	KASSERT(depth < DIRHASH_MAXSPLIT);
+	KASSERT((sdb.sdb_flags & SFS_DIRBUCKET_OVERFLOW) == 0);
+	KASSERT(sdb.sdb_next == 0);
+	bit = (uint32_t)1 << depth;
+
+	/* Make room in the table for the extra bit, if needed */
+	if (depth == sv->sv_dirdepth) {
+		size = (uint32_t)1 << sv->sv_dirdepth;
+		newtable = kmalloc(2 * size * sizeof(uint32_t));
+		if (newtable == NULL) {
+			return ENOMEM;
+		}
+		for (j=0; j<2*size; j++) {
+			newtable[j] = sv->sv_dirtable[j & (size-1)];
+		}
+		kfree(sv->sv_dirtable);
+		sv->sv_dirtable = newtable;
+		sv->sv_dirdepth++;
+	}
+
+	bzero(&newsdb, sizeof(newsdb));
+	newsdb.sdb_magic = SFS_DIRBUCKET_MAGIC;
+	newsdb.sdb_depth = depth + 1;
+	newsdb.sdb_prefix = sdb.sdb_prefix | bit;
+	result = sfs_dirhash_newblock(sv, &newsdb, &newblock);
+	if (result) {
+		return result;
+	}
+
+	/* Copy the names over */
+	nmoved = 0;
+	newslot = newblock * SFS_DIRPERBLOCK + 1;
+	for (i=1; i<SFS_DIRPERBLOCK; i++) {
+		result = sfs_dirhash_readslot(sv, block*SFS_DIRPERBLOCK + i,
+					      &sd);
+		if (result) {
+			return result;
+		}
+		if (sd.sfd_ino == SFS_NOINO) {
+			continue;
+		}
+		sd.sfd_name[sizeof(sd.sfd_name)-1] = 0;
+		if ((sfs_dirhash_hash(sd.sfd_name) & bit) == 0) {
+			continue;
+		}
+		result = sfs_dirhash_writeslot(sv, newslot++, &sd);
+		if (result) {
+			return result;
+		}
+		moved[nmoved++] = block*SFS_DIRPERBLOCK + i;
+	}
+
+	/* Switch the new bucket's half of the old one's hashes to it */
+	sdb.sdb_depth = depth + 1;
+	result = sfs_dirhash_writehdr(sv, block, &sdb);
+	if (result) {
+		return result;
+	}
+	size = (uint32_t)1 << sv->sv_dirdepth;
+	for (j = newsdb.sdb_prefix; j < size; j += 2*bit) {
+		KASSERT(sv->sv_dirtable[j] == block);
+		sv->sv_dirtable[j] = newblock;
+	}
+
+	/* Now the old copies can go */
+	bzero(&empty, sizeof(empty));
+	for (i=0; i<nmoved; i++) {
+		result = sfs_dirhash_writeslot(sv, moved[i], &empty);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Chain a new overflow block onto full bucket BLOCK (which can't be
+ * split any further) and hand back its first free slot.
+ */
+static
+int
+sfs_dirhash_overflow(struct sfs_vnode *sv, uint32_t block, int *slot)
+{
+	struct sfs_dirbucket sdb, newsdb;
+	uint32_t newblock;
+	int result;
+
+	result = sfs_dirhash_readhdr(sv, block, &sdb);
+	if (result) {
+		return result;
+	}
+
+	bzero(&newsdb, sizeof(newsdb));
+	newsdb.sdb_magic = SFS_DIRBUCKET_MAGIC;
+	newsdb.sdb_depth = sdb.sdb_depth;
+	newsdb.sdb_prefix = sdb.sdb_prefix;
+	newsdb.sdb_next = sdb.sdb_next;
+	newsdb.sdb_flags = SFS_DIRBUCKET_OVERFLOW;
+	result = sfs_dirhash_newblock(sv, &newsdb, &newblock);
+	if (result) {
+		return result;
+	}
+
+	sdb.sdb_next = newblock;
+	result = sfs_dirhash_writehdr(sv, block, &sdb);
+	if (result) {
+		return result;
+	}
+
+	*slot = newblock * SFS_DIRPERBLOCK + 1;
+	return 0;
+}
+
+/*
+ * Look up NAME.
+ */
+int
+sfs_dirhash_findname(struct sfs_vnode *sv, const char *name,
+		     uint32_t *ino, int *slot)
+{
+	int result;
+
+	result = sfs_dirhash_load(sv);
+	if (result) {
+		return result;
+	}
+	return sfs_dirhash_search(sv, name, sfs_dirhash_hash(name),
+				  ino, slot, NULL);
+}
+
+/*
+ * Add NAME for inode INO, which must not already be there.
+ */
+int
+sfs_dirhash_link(struct sfs_vnode *sv, const char *name, uint32_t ino,
+		 int *slot)
+{
+	struct sfs_dirbucket sdb;
+	struct sfs_direntry sd;
+	uint32_t hash, block;
+	int emptyslot;
+	int result;
+
+	if (strlen(name)+1 > sizeof(sd.sfd_name)) {
+		return ENAMETOOLONG;
+	}
+
+	result = sfs_dirhash_load(sv);
+	if (result) {
+		return result;
+	}
+	hash = sfs_dirhash_hash(name);
+
+	while (1) {
+		if (sfs_dirhash_nblocks(sv) == 0) {
+			/* First name; make the one bucket covering all */
+			bzero(&sdb, sizeof(sdb));
+			sdb.sdb_magic = SFS_DIRBUCKET_MAGIC;
+			result = sfs_dirhash_newblock(sv, &sdb, &block);
+			if (result) {
+				return result;
+			}
+			KASSERT(block == 0 && sv->sv_dirdepth == 0);
+			sv->sv_dirtable[0] = block;
+		}
+
+		emptyslot = -1;
+		result = sfs_dirhash_search(sv, name, hash, NULL, NULL,
+					    &emptyslot);
+		if (result == 0) {
+			return EEXIST;
+		}
+		if (result != ENOENT) {
+			return result;
+		}
+		if (emptyslot >= 0) {
+			break;
+		}
+
+		/* The bucket's full: split it, or if we can't, chain */
+		block = sv->sv_dirtable[hash &
+				(((uint32_t)1 << sv->sv_dirdepth) - 1)];
+		result = sfs_dirhash_readhdr(sv, block, &sdb);
+		if (result) {
+			return result;
+		}
+		if (sdb.sdb_depth < DIRHASH_MAXSPLIT) {
+			result = sfs_dirhash_split(sv, block);
+		}
+		else {
+			result = sfs_dirhash_overflow(sv, block, &emptyslot);
+		}
+		if (result) {
+			return result;
+		}
+		if (emptyslot >= 0) {
+			break;
+		}
+	}
+
+	bzero(&sd, sizeof(sd));
+	sd.sfd_ino = ino;
+	strcpy(sd.sfd_name, name);
+
+	if (slot != NULL) {
+		*slot = emptyslot;
+	}
+	return sfs_dirhash_writeslot(sv, emptyslot, &sd);
+}
+
+/*
+ * Throw away the in-memory table, when the vnode goes away.
+ */
+void
+sfs_dirhash_cleanup(struct sfs_vnode *sv)
+{
+	if (sv->sv_dirtable != NULL) {
+		kfree(sv->sv_dirtable);
+		sv->sv_dirtable = NULL;
+	}
+}
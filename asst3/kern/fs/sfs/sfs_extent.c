@@ -0,0 +1,572 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SFS filesystem
+ *
+ * Extent-mapped files.
+ *
+ * Extents are numbered from 0 to sfi_nextents-1 in file block order.
+ * The first SFS_NIEXTENTS live in the inode and the rest in the chain
+ * of extent blocks, SFS_EXTPERBLOCK to a block. The extent last
+ * looked up or changed is kept in sv_extcache, so a file being read
+ * or written sequentially doesn't search the list for every block.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <buf.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/*
+ * Find extent IDX. If it's in the inode, *BUFRET is set to NULL;
+ * otherwise it's in the extent block handed back busy in *BUFRET,
+ * which the caller must release (after marking it dirty if the
+ * extent was changed). If DOALLOC is set, extent blocks are added
+ * to the end of the chain as needed.
+ */
+static
+int
+sfs_ext_locate(struct sfs_vnode *sv, uint32_t idx, bool doalloc,
+	       struct buf **bufret, struct sfs_extent **extret)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_extentblock *seb;
+	struct buf *buf;
+	daddr_t block, prevblock;
+	uint32_t n;
+	int result;
+
+	COMPILE_ASSERT(sizeof(struct sfs_extentblock) == SFS_BLOCKSIZE);
+
+	if (idx < SFS_NIEXTENTS) {
+		*bufret = NULL;
+		*extret = &sv->sv_i.sfi_extents[idx];
+		return 0;
+	}
+	idx -= SFS_NIEXTENTS;
+
+	block = sv->sv_i.sfi_extblock;
+	if (block == 0) {
+		if (!doalloc) {
+			panic("sfs: %s: inode %u: missing extent block\n",
+			      sfs->sfs_sb.sb_volname, sv->sv_ino);
+		}
+		/* It comes back zeroed. Keep it near the inode. */
+		result = sfs_balloc_near(sfs, sv->sv_ino + 1, &block);
+		if (result) {
+			return result;
+		}
+		sv->sv_i.sfi_extblock = block;
+		sfs_markdirty(sv);
+	}
+	result = buffer_read(&sfs->sfs_absfs, block, &buf);
+	if (result) {
+		return result;
+	}
+
+	for (n = idx / SFS_EXTPERBLOCK; n > 0; n--) {
+		seb = buffer_map(buf);
+		prevblock = block;
+		block = seb->seb_next;
+		if (block == 0) {
+			if (!doalloc) {
+				panic("sfs: %s: inode %u: missing extent "
+				      "block\n", sfs->sfs_sb.sb_volname,
+				      sv->sv_ino);
+			}
+			result = sfs_balloc_near(sfs, prevblock + 1, &block);
+			if (result) {
+				buffer_release(buf);
+				return result;
+			}
+			seb->seb_next = block;
+			sfs_jnl_markdirty(sfs, buf);
+		}
+		buffer_release(buf);
+
+		result = buffer_read(&sfs->sfs_absfs, block, &buf);
+		if (result) {
+			return result;
+		}
+	}
+
+	seb = buffer_map(buf);
+	*bufret = buf;
+	*extret = &seb->seb_extents[idx % SFS_EXTPERBLOCK];
+	return 0;
+}
+
+/*
+ * Fetch a copy of extent IDX.
+ */
+static
+int
+sfs_ext_get(struct sfs_vnode *sv, uint32_t idx, struct sfs_extent *ext)
+{
+	struct sfs_extent *se;
+	struct buf *buf;
+	int result;
+
+	result = sfs_ext_locate(sv, idx, false, &buf, &se);
+	if (result) {
+		return result;
+	}
+	*ext = *se;
+	if (buf != NULL) {
+		buffer_release(buf);
+	}
+	return 0;
+}
+
+/*
+ * Store extent IDX.
+ */
+static
+int
+sfs_ext_put(struct sfs_vnode *sv, uint32_t idx, const struct sfs_extent *ext)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_extent *se;
+	struct buf *buf;
+	int result;
+
+	result = sfs_ext_locate(sv, idx, true, &buf, &se);
+	if (result) {
+		return result;
+	}
+	*se = *ext;
+	if (buf != NULL) {
+		sfs_jnl_markdirty(sfs, buf);
+		buffer_release(buf);
+	}
+	else {
+		sfs_markdirty(sv);
+	}
+	return 0;
+}
+
+/*
+ * Free the extent blocks past the ones needed for sfi_nextents.
+ */
+static
+int
+sfs_ext_trimchain(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_extentblock *seb;
+	struct buf *buf;
+	uint32_t nextents = sv->sv_i.sfi_nextents;
+	uint32_t need, n;
+	daddr_t block, next;
+	int result;
+
+	if (nextents <= SFS_NIEXTENTS) {
+		need = 0;
+	}
+	else {
+		need = DIVROUNDUP(nextents - SFS_NIEXTENTS, SFS_EXTPERBLOCK);
+	}
+
+	/* Cut the chain after the NEED'th block. */
+	if (need == 0) {
+		block = sv->sv_i.sfi_extblock;
+		if (block != 0) {
+			sv->sv_i.sfi_extblock = 0;
+			sfs_markdirty(sv);
+		}
+	}
+	else {
+		block = sv->sv_i.sfi_extblock;
+		for (n = 0; ; n++) {
+			result = buffer_read(&sfs->sfs_absfs, block, &buf);
+			if (result) {
+				return result;
+			}
+			seb = buffer_map(buf);
+			if (n == need - 1) {
+				break;
+			}
+			block = seb->seb_next;
+			buffer_release(buf);
+		}
+		block = seb->seb_next;
+		if (block != 0) {
+			seb->seb_next = 0;
+			sfs_jnl_markdirty(sfs, buf);
+		}
+		buffer_release(buf);
+	}
+
+	/* Free what was after it. */
+	while (block != 0) {
+		result = buffer_read(&sfs->sfs_absfs, block, &buf);
+		if (result) {
+			return result;
+		}
+		seb = buffer_map(buf);
+		next = seb->seb_next;
+		buffer_release_and_invalidate(buf);
+		sfs_bfree(sfs, block);
+		block = next;
+	}
+	return 0;
+}
+
+/*
+ * Insert EXT as extent IDX, moving the ones from there on up.
+ */
+static
+int
+sfs_ext_insert(struct sfs_vnode *sv, uint32_t idx,
+	       const struct sfs_extent *ext)
+{
+	struct sfs_extent tmp;
+	uint32_t i;
+	int result;
+
+	/*
+	 * Start at the end, so that if we need another extent block
+	 * and can't get one, we fail before anything has moved.
+	 */
+	for (i = sv->sv_i.sfi_nextents; i > idx; i--) {
+		result = sfs_ext_get(sv, i - 1, &tmp);
+		if (result) {
+			return result;
+		}
+		result = sfs_ext_put(sv, i, &tmp);
+		if (result) {
+			return result;
+		}
+	}
+	result = sfs_ext_put(sv, idx, ext);
+	if (result) {
+		return result;
+	}
+	sv->sv_i.sfi_nextents++;
+	sfs_markdirty(sv);
+	return 0;
+}
+
+/*
+ * Remove extent IDX, moving the ones after it down.
+ */
+static
+int
+sfs_ext_remove(struct sfs_vnode *sv, uint32_t idx)
+{
+	struct sfs_extent tmp;
+	uint32_t i;
+	int result;
+
+	KASSERT(idx < sv->sv_i.sfi_nextents);
+
+	for (i = idx + 1; i < sv->sv_i.sfi_nextents; i++) {
+		result = sfs_ext_get(sv, i, &tmp);
+		if (result) {
+			return result;
+		}
+		result = sfs_ext_put(sv, i - 1, &tmp);
+		if (result) {
+			return result;
+		}
+	}
+	bzero(&tmp, sizeof(tmp));
+	result = sfs_ext_put(sv, i - 1, &tmp);
+	if (result) {
+		return result;
+	}
+	sv->sv_i.sfi_nextents--;
+	sfs_markdirty(sv);
+	return sfs_ext_trimchain(sv);
+}
+
+/*
+ * Find the last extent that starts at or before FILEBLOCK, by binary
+ * search. Sets *IDXRET to its index and *EXT to a copy of it, or
+ * *IDXRET to sfi_nextents if there isn't one.
+ */
+static
+int
+sfs_ext_find(struct sfs_vnode *sv, uint32_t fileblock, uint32_t *idxret,
+	     struct sfs_extent *ext)
+{
+	struct sfs_extent tmp;
+	uint32_t lo, hi, mid;
+	int result;
+
+	/* Find how many extents start at or before FILEBLOCK. */
+	lo = 0;
+	hi = sv->sv_i.sfi_nextents;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		result = sfs_ext_get(sv, mid, &tmp);
+		if (result) {
+			return result;
+		}
+		if (tmp.se_fileblock <= fileblock) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	if (lo == 0) {
+		*idxret = sv->sv_i.sfi_nextents;
+		return 0;
+	}
+	*idxret = lo - 1;
+	return sfs_ext_get(sv, lo - 1, ext);
+}
+
+/*
+ * Allocate a block for FILEBLOCK, which isn't mapped. PREVIDX and
+ * PREV are what sfs_ext_find returned for it. The block is placed
+ * after the previous one if possible, and the extents are extended
+ * or merged to suit.
+ */
+static
+int
+sfs_ext_alloc(struct sfs_vnode *sv, uint32_t fileblock, uint32_t previdx,
+	      struct sfs_extent *prev, daddr_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_extent next, new;
+	uint32_t nextidx;
+	bool haveprev, havenext, recorded = false;
+	daddr_t block, goal;
+	int result;
+
+	haveprev = previdx < sv->sv_i.sfi_nextents;
+	nextidx = haveprev ? previdx + 1 : 0;
+	havenext = nextidx < sv->sv_i.sfi_nextents;
+	if (havenext) {
+		result = sfs_ext_get(sv, nextidx, &next);
+		if (result) {
+			return result;
+		}
+	}
+
+	/*
+	 * Aim for where the block would be if the file were one run;
+	 * the first block of a file goes just after its inode.
+	 */
+	goal = sv->sv_ino + 1;
+	if (haveprev) {
+		goal = prev->se_diskblock + (fileblock - prev->se_fileblock);
+	}
+	else if (havenext && next.se_diskblock > next.se_fileblock - fileblock) {
+		goal = next.se_diskblock - (next.se_fileblock - fileblock);
+	}
+
+	result = sfs_balloc_near(sfs, goal, &block);
+	if (result) {
+		return result;
+	}
+
+	if (haveprev && prev->se_fileblock + prev->se_nblocks == fileblock &&
+	    prev->se_diskblock + prev->se_nblocks == block) {
+		/* It goes on the end of the previous extent... */
+		prev->se_nblocks++;
+		if (havenext && next.se_fileblock == fileblock + 1 &&
+		    next.se_diskblock == block + 1) {
+			/* ...which now runs into the next one. */
+			prev->se_nblocks += next.se_nblocks;
+			result = sfs_ext_put(sv, previdx, prev);
+			if (result == 0) {
+				recorded = true;
+				result = sfs_ext_remove(sv, nextidx);
+			}
+		}
+		else {
+			result = sfs_ext_put(sv, previdx, prev);
+		}
+		sv->sv_extcache = *prev;
+	}
+	else if (havenext && next.se_fileblock == fileblock + 1 &&
+		 next.se_diskblock == block + 1) {
+		/* It goes on the front of the next extent. */
+		next.se_fileblock--;
+		next.se_diskblock--;
+		next.se_nblocks++;
+		result = sfs_ext_put(sv, nextidx, &next);
+		sv->sv_extcache = next;
+	}
+	else {
+		/* It needs an extent of its own. */
+		new.se_fileblock = fileblock;
+		new.se_diskblock = block;
+		new.se_nblocks = 1;
+		result = sfs_ext_insert(sv, nextidx, &new);
+		sv->sv_extcache = new;
+	}
+
+	if (result) {
+		sv->sv_extcache.se_nblocks = 0;
+		if (!recorded) {
+			sfs_bfree(sfs, block);
+		}
+		return result;
+	}
+	*diskblock = block;
+	return 0;
+}
+
+/*
+ * sfs_bmap for extent-mapped files. If NBLOCKS isn't NULL, it's set
+ * to the number of blocks from FILEBLOCK on that are consecutive on
+ * disk (for a hole, 1).
+ */
+int
+sfs_ext_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+	     daddr_t *diskblock, uint32_t *nblocks)
+{
+	struct sfs_extent *cache = &sv->sv_extcache;
+	struct sfs_extent ext;
+	uint32_t idx, off;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(sv->sv_i.sfi_flags & SFS_IFLAG_EXTENTS);
+
+	if (fileblock >= SFS_MAXFILEBLOCKS) {
+		return EFBIG;
+	}
+
+	if (cache->se_nblocks == 0 || fileblock < cache->se_fileblock ||
+	    fileblock - cache->se_fileblock >= cache->se_nblocks) {
+		result = sfs_ext_find(sv, fileblock, &idx, &ext);
+		if (result) {
+			return result;
+		}
+		if (idx == sv->sv_i.sfi_nextents ||
+		    fileblock - ext.se_fileblock >= ext.se_nblocks) {
+			/* Not mapped */
+			if (!doalloc) {
+				*diskblock = 0;
+				if (nblocks != NULL) {
+					*nblocks = 1;
+				}
+				return 0;
+			}
+			result = sfs_ext_alloc(sv, fileblock, idx, &ext,
+					       diskblock);
+			if (result) {
+				return result;
+			}
+		}
+		else {
+			*cache = ext;
+		}
+	}
+
+	off = fileblock - cache->se_fileblock;
+	*diskblock = cache->se_diskblock + off;
+	if (nblocks != NULL) {
+		*nblocks = cache->se_nblocks - off;
+	}
+	return 0;
+}
+
+/*
+ * Free a run of blocks.
+ */
+static
+void
+sfs_ext_freerun(struct sfs_fs *sfs, daddr_t block, uint32_t nblocks)
+{
+	uint32_t i;
+
+	for (i=0; i<nblocks; i++) {
+		sfs_bfree(sfs, block + i);
+	}
+}
+
+/*
+ * sfs_itrunc for extent-mapped files: discard everything at or past
+ * file block BLOCKLEN. Only the extents that go away (or shrink) are
+ * looked at.
+ */
+int
+sfs_ext_trunc(struct sfs_vnode *sv, uint32_t blocklen)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_extent ext, zero;
+	uint32_t n, keep, drop;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(sv->sv_i.sfi_flags & SFS_IFLAG_EXTENTS);
+
+	sv->sv_extcache.se_nblocks = 0;
+	bzero(&zero, sizeof(zero));
+
+	for (n = sv->sv_i.sfi_nextents; n > 0; n--) {
+		result = sfs_ext_get(sv, n - 1, &ext);
+		if (result) {
+			goto out;
+		}
+		if (ext.se_fileblock + ext.se_nblocks <= blocklen) {
+			/* All of it stays */
+			break;
+		}
+		if (ext.se_fileblock < blocklen) {
+			/* Part of it stays */
+			keep = blocklen - ext.se_fileblock;
+			drop = ext.se_nblocks - keep;
+			ext.se_nblocks = keep;
+			result = sfs_ext_put(sv, n - 1, &ext);
+			if (result) {
+				goto out;
+			}
+			sfs_ext_freerun(sfs, ext.se_diskblock + keep, drop);
+			break;
+		}
+		/* None of it stays */
+		result = sfs_ext_put(sv, n - 1, &zero);
+		if (result) {
+			goto out;
+		}
+		sfs_ext_freerun(sfs, ext.se_diskblock, ext.se_nblocks);
+	}
+	result = 0;
+
+ out:
+	if (n != sv->sv_i.sfi_nextents) {
+		sv->sv_i.sfi_nextents = n;
+		sfs_markdirty(sv);
+		if (result == 0) {
+			result = sfs_ext_trimchain(sv);
+		}
+	}
+	return result;
+}
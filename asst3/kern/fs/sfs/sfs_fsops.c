@@ -39,8 +39,10 @@
 #include <array.h>
 #include <bitmap.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -87,14 +89,19 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 		/* Get a pointer to its data */
 		void *ptr = freemapdata + j*SFS_BLOCKSIZE;
 
-		/* and read or write it. The freemap starts at sector 2. */
+		/*
+		 * and read or write it. The freemap starts at sector 2.
+		 * Reading only happens at mount, so go straight to the
+		 * disk; writes go to the buffer cache like everything
+		 * else.
+		 */
 		if (rw == UIO_READ) {
 			result = sfs_readblock(sfs, SFS_FREEMAP_START+j, ptr,
 					       SFS_BLOCKSIZE);
 		}
 		else {
-			result = sfs_writeblock(sfs, SFS_FREEMAP_START+j, ptr,
-						SFS_BLOCKSIZE);
+			result = sfs_bufwrite(sfs, SFS_FREEMAP_START+j, ptr,
+					      SFS_BLOCKSIZE);
 		}
 
 		/* If we failed, stop. */
@@ -106,39 +113,84 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 }
 
 /*
- * Sync routine for the vnode table.
+ * Sync routine for the vnode table. This writes the dirty inodes into
+ * the buffer cache; sfs_sync (or a journal commit) writes the buffers
+ * out afterwards.
+ *
+ * Syncing an inode takes its vnode's sv_lock, which comes before
+ * sfs_vnlock in the lock order, so we can't sync while holding the
+ * table lock. Instead, take a reference to everything on the dirty
+ * list, drop the locks, and sync from the copy. Holding sfs_vnlock
+ * while collecting keeps reclaim from freeing any of them under us.
  */
-static
 int
 sfs_sync_vnodes(struct sfs_fs *sfs)
 {
+	struct vnodearray *tosync;
+	struct sfs_vnode *sv;
 	unsigned i, num;
+	int result;
+
+	tosync = vnodearray_create();
+	if (tosync == NULL) {
+		return ENOMEM;
+	}
+
+	lock_acquire(sfs->sfs_vnlock);
+	lock_acquire(sfs->sfs_dirtylock);
+	num = 0;
+	for (sv = sfs->sfs_dirtyhead; sv != NULL; sv = sv->sv_dirtynext) {
+		num++;
+	}
+	result = vnodearray_setsize(tosync, num);
+	if (result) {
+		lock_release(sfs->sfs_dirtylock);
+		lock_release(sfs->sfs_vnlock);
+		vnodearray_destroy(tosync);
+		return result;
+	}
+	i = 0;
+	for (sv = sfs->sfs_dirtyhead; sv != NULL; sv = sv->sv_dirtynext) {
+		VOP_INCREF(&sv->sv_absvn);
+		vnodearray_set(tosync, i++, &sv->sv_absvn);
+	}
+	lock_release(sfs->sfs_dirtylock);
+	lock_release(sfs->sfs_vnlock);
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	/* Go over the copy, syncing as we go. */
 	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+		struct vnode *v = vnodearray_get(tosync, i);
+
+		sv = v->vn_data;
+		lock_acquire(sv->sv_lock);
+		sfs_sync_inode(sv);
+		lock_release(sv->sv_lock);
+		VOP_DECREF(v);
 	}
+
+	vnodearray_setsize(tosync, 0);
+	vnodearray_destroy(tosync);
 	return 0;
 }
 
 /*
  * Sync routine for the freemap.
  */
-static
 int
 sfs_sync_freemap(struct sfs_fs *sfs)
 {
 	int result;
 
+	lock_acquire(sfs->sfs_freemaplock);
 	if (sfs->sfs_freemapdirty) {
 		result = sfs_freemapio(sfs, UIO_WRITE);
 		if (result) {
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_freemapdirty = false;
 	}
+	lock_release(sfs->sfs_freemaplock);
 
 	return 0;
 }
@@ -146,21 +198,22 @@ sfs_sync_freemap(struct sfs_fs *sfs)
 /*
  * Sync routine for the superblock.
  */
-static
 int
 sfs_sync_superblock(struct sfs_fs *sfs)
 {
-	int result;
+	int result = 0;
 
+	/* sfs_bmap can set feature flags; it uses the freemap lock */
+	lock_acquire(sfs->sfs_freemaplock);
 	if (sfs->sfs_superdirty) {
-		result = sfs_writeblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
-					sizeof(sfs->sfs_sb));
-		if (result) {
-			return result;
+		result = sfs_bufwrite(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
+				      sizeof(sfs->sfs_sb));
+		if (result == 0) {
+			sfs->sfs_superdirty = false;
 		}
-		sfs->sfs_superdirty = false;
 	}
-	return 0;
+	lock_release(sfs->sfs_freemaplock);
+	return result;
 }
 
 /*
@@ -174,8 +227,6 @@ sfs_sync(struct fs *fs)
 	struct sfs_fs *sfs;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -208,28 +259,38 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
+	/*
+	 * With a journal, syncing is committing; this is also where
+	 * the log gets checkpointed, since the syncer calls us.
+	 */
+	if (sfs->sfs_jnl != NULL) {
+		return sfs_jnl_commit(sfs, true);
+	}
+
 	/* If any vnodes need to be written, write them. */
 	result = sfs_sync_vnodes(sfs);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* If the free block map needs to be written, write it. */
 	result = sfs_sync_freemap(sfs);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* If the superblock needs to be written, write it. */
 	result = sfs_sync_superblock(sfs);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
-	vfs_biglock_release();
+	/* All of the above went to the buffer cache; now flush it. */
+	result = buffer_sync_fs(&sfs->sfs_absfs);
+	if (result) {
+		return result;
+	}
+
 	return 0;
 }
 
@@ -237,19 +298,48 @@ sfs_sync(struct fs *fs)
  * Routine to retrieve the volume name. Filesystems can be referred
  * to by their volume name followed by a colon as well as the name
  * of the device they're mounted on.
+ *
+ * The volume name is fixed at mount time, so no lock is needed.
  */
 static
 const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
 
-	vfs_biglock_acquire();
-	ret = sfs->sfs_sb.sb_volname;
-	vfs_biglock_release();
+	return sfs->sfs_sb.sb_volname;
+}
 
-	return ret;
+/*
+ * Block I/O for the buffer cache. This goes through the journal,
+ * which holds back metadata blocks that aren't checkpointed yet.
+ */
+static
+int
+sfs_fs_readblock(struct fs *fs, daddr_t block, void *data, size_t len)
+{
+	return sfs_jnl_readblock(fs->fs_data, block, data, len);
+}
+
+static
+int
+sfs_fs_writeblock(struct fs *fs, daddr_t block, void *data, size_t len)
+{
+	return sfs_jnl_writeblock(fs->fs_data, block, data, len);
+}
+
+static
+int
+sfs_fs_startio(struct fs *fs, struct devrequest *r)
+{
+	return sfs_jnl_startio(fs->fs_data, r);
+}
+
+static
+int
+sfs_fs_finishio(struct fs *fs, struct devrequest *r)
+{
+	return sfs_jnl_finishio(fs->fs_data, r);
 }
 
 /*
@@ -259,10 +349,18 @@ static
 void
 sfs_fs_destroy(struct sfs_fs *sfs)
 {
+	sfs_jnl_destroy(sfs);
+	if (sfs->sfs_groupfree != NULL) {
+		kfree(sfs->sfs_groupfree);
+	}
 	if (sfs->sfs_freemap != NULL) {
 		bitmap_destroy(sfs->sfs_freemap);
 	}
-	vnodearray_destroy(sfs->sfs_vnodes);
+	lock_destroy(sfs->sfs_freemaplock);
+	lock_destroy(sfs->sfs_dirtylock);
+	KASSERT(sfs->sfs_nvnodes == 0);
+	kfree(sfs->sfs_vnhash);
+	lock_destroy(sfs->sfs_vnlock);
 	KASSERT(sfs->sfs_device == NULL);
 	kfree(sfs);
 }
@@ -277,19 +375,32 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-
-	vfs_biglock_acquire();
+	int result;
 
 	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs->sfs_nvnodes > 0) {
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
+	lock_release(sfs->sfs_vnlock);
 
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
 
+	/* Get everything in the journal home. */
+	result = sfs_jnl_unmount(sfs);
+	if (result) {
+		return result;
+	}
+
+	/* Forget our buffers while they can still be checked. */
+	result = buffer_drop_fs(fs);
+	if (result) {
+		return result;
+	}
+
 	/* The vfs layer takes care of the device for us */
 	sfs->sfs_device = NULL;
 
@@ -297,7 +408,6 @@ sfs_unmount(struct fs *fs)
 	sfs_fs_destroy(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -309,6 +419,10 @@ static const struct fs_ops sfs_fsops = {
 	.fsop_getvolname = sfs_getvolname,
 	.fsop_getroot = sfs_getroot,
 	.fsop_unmount = sfs_unmount,
+	.fsop_readblock = sfs_fs_readblock,
+	.fsop_writeblock = sfs_fs_writeblock,
+	.fsop_startio = sfs_fs_startio,
+	.fsop_finishio = sfs_fs_finishio,
 };
 
 /*
@@ -321,6 +435,7 @@ struct sfs_fs *
 sfs_fs_create(void)
 {
 	struct sfs_fs *sfs;
+	unsigned i;
 
 	/*
 	 * Make sure our on-disk structures aren't messed up
@@ -328,6 +443,7 @@ sfs_fs_create(void)
 	COMPILE_ASSERT(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	COMPILE_ASSERT(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
 	COMPILE_ASSERT(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	COMPILE_ASSERT(SFS_BLOCKSIZE == BUFFER_SIZE);
 
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
@@ -351,17 +467,48 @@ sfs_fs_create(void)
 	sfs->sfs_device = NULL;
 
 	/* vnode table */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
+	sfs->sfs_vnlock = lock_create("sfs vnodes");
+	if (sfs->sfs_vnlock == NULL) {
 		goto cleanup_object;
 	}
+	sfs->sfs_vnhash = kmalloc(SFS_VNHASHSIZE * sizeof(*sfs->sfs_vnhash));
+	if (sfs->sfs_vnhash == NULL) {
+		goto cleanup_vnlock;
+	}
+	for (i=0; i<SFS_VNHASHSIZE; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
+	sfs->sfs_nvnodes = 0;
+
+	/* dirty list */
+	sfs->sfs_dirtylock = lock_create("sfs dirty vnodes");
+	if (sfs->sfs_dirtylock == NULL) {
+		goto cleanup_vnodes;
+	}
+	sfs->sfs_dirtyhead = NULL;
 
 	/* freemap */
+	sfs->sfs_freemaplock = lock_create("sfs freemap");
+	if (sfs->sfs_freemaplock == NULL) {
+		goto cleanup_dirtylock;
+	}
 	sfs->sfs_freemap = NULL;
 	sfs->sfs_freemapdirty = false;
+	sfs->sfs_nfree = 0;
+	sfs->sfs_ngroups = 0;
+	sfs->sfs_groupfree = NULL;
+
+	/* journal (set up at mount) */
+	sfs->sfs_jnl = NULL;
 
 	return sfs;
 
+cleanup_dirtylock:
+	lock_destroy(sfs->sfs_dirtylock);
+cleanup_vnodes:
+	kfree(sfs->sfs_vnhash);
+cleanup_vnlock:
+	lock_destroy(sfs->sfs_vnlock);
 cleanup_object:
 	kfree(sfs);
 fail:
@@ -388,8 +535,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	int result;
 	struct sfs_fs *sfs;
 
-	vfs_biglock_acquire();
-
 	/* We don't pass any options through mount */
 	(void)options;
 
@@ -402,7 +547,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	 * don't do that in sfs.)
 	 */
 	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
 		kprintf("sfs: Cannot mount on device with blocksize %zu\n",
 			dev->d_blocksize);
 		return ENXIO;
@@ -410,7 +554,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 
 	sfs = sfs_fs_create();
 	if (sfs == NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
@@ -423,7 +566,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	if (result) {
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -436,7 +578,14 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			SFS_MAGIC);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
+		return EINVAL;
+	}
+
+	if (sfs->sfs_sb.sb_features & ~SFS_FEATURES_KNOWN) {
+		kprintf("sfs: Unsupported features in superblock (0x%x)\n",
+			sfs->sfs_sb.sb_features & ~SFS_FEATURES_KNOWN);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
 		return EINVAL;
 	}
 
@@ -448,26 +597,37 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Ensure null termination of the volume name */
 	sfs->sfs_sb.sb_volname[sizeof(sfs->sfs_sb.sb_volname)-1] = 0;
 
+	/* Set up the journal; replaying it may change anything else */
+	result = sfs_jnl_mount(sfs);
+	if (result) {
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return result;
+	}
+
 	/* Load free block bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_FREEMAPBITS(sfs));
 	if (sfs->sfs_freemap == NULL) {
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 	result = sfs_freemapio(sfs, UIO_READ);
 	if (result) {
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
+		return result;
+	}
+	result = sfs_countfree(sfs);
+	if (result) {
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
 		return result;
 	}
 
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
 }
 
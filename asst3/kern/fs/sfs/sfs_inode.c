@@ -35,13 +35,143 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+////////////////////////////////////////////////////////////
+// Vnode table and dirty list
+
+static
+unsigned
+sfs_vnhashfn(uint32_t ino)
+{
+	return ino % SFS_VNHASHSIZE;
+}
 
 /*
- * Write an on-disk inode structure back out to disk.
+ * Find a loaded vnode by inode number. Must hold sfs_vnlock.
+ */
+static
+struct sfs_vnode *
+sfs_vnfind(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	sv = sfs->sfs_vnhash[sfs_vnhashfn(ino)];
+	while (sv != NULL) {
+		if (sv->sv_ino == ino) {
+			return sv;
+		}
+		sv = sv->sv_hashnext;
+	}
+	return NULL;
+}
+
+static
+void
+sfs_vnhashadd(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned ix;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	ix = sfs_vnhashfn(sv->sv_ino);
+	sv->sv_hashnext = sfs->sfs_vnhash[ix];
+	sfs->sfs_vnhash[ix] = sv;
+	sfs->sfs_nvnodes++;
+}
+
+static
+void
+sfs_vnhashremove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **pp;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	pp = &sfs->sfs_vnhash[sfs_vnhashfn(sv->sv_ino)];
+	while (*pp != sv) {
+		if (*pp == NULL) {
+			panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
+			      sfs->sfs_sb.sb_volname, sv->sv_ino);
+		}
+		pp = &(*pp)->sv_hashnext;
+	}
+	*pp = sv->sv_hashnext;
+	sv->sv_hashnext = NULL;
+	KASSERT(sfs->sfs_nvnodes > 0);
+	sfs->sfs_nvnodes--;
+}
+
+/*
+ * Put a vnode on the dirty list and set sv_dirty.
+ */
+static
+void
+sfs_dirtyadd(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	lock_acquire(sfs->sfs_dirtylock);
+	KASSERT(!sv->sv_dirty);
+	sv->sv_dirty = true;
+	sv->sv_dirtyprev = NULL;
+	sv->sv_dirtynext = sfs->sfs_dirtyhead;
+	if (sfs->sfs_dirtyhead != NULL) {
+		sfs->sfs_dirtyhead->sv_dirtyprev = sv;
+	}
+	sfs->sfs_dirtyhead = sv;
+	lock_release(sfs->sfs_dirtylock);
+}
+
+/*
+ * Take a vnode off the dirty list and clear sv_dirty.
+ */
+static
+void
+sfs_dirtyremove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	lock_acquire(sfs->sfs_dirtylock);
+	KASSERT(sv->sv_dirty);
+	if (sv->sv_dirtyprev != NULL) {
+		sv->sv_dirtyprev->sv_dirtynext = sv->sv_dirtynext;
+	}
+	else {
+		KASSERT(sfs->sfs_dirtyhead == sv);
+		sfs->sfs_dirtyhead = sv->sv_dirtynext;
+	}
+	if (sv->sv_dirtynext != NULL) {
+		sv->sv_dirtynext->sv_dirtyprev = sv->sv_dirtyprev;
+	}
+	sv->sv_dirtyprev = sv->sv_dirtynext = NULL;
+	sv->sv_dirty = false;
+	lock_release(sfs->sfs_dirtylock);
+}
+
+/*
+ * Note that the in-memory inode has been changed and needs to be
+ * written back. The caller must hold the vnode's sv_lock.
+ */
+void
+sfs_markdirty(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (!sv->sv_dirty) {
+		sfs_dirtyadd(sfs, sv);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Inode I/O and lifecycle
+
+/*
+ * Write an on-disk inode structure back out to disk (or at least to
+ * the buffer cache). The caller must hold the vnode's sv_lock.
  */
 int
 sfs_sync_inode(struct sfs_vnode *sv)
@@ -49,13 +179,15 @@ sfs_sync_inode(struct sfs_vnode *sv)
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	int result;
 
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
 	if (sv->sv_dirty) {
-		result = sfs_writeblock(sfs, sv->sv_ino, &sv->sv_i,
-					sizeof(sv->sv_i));
+		result = sfs_bufwrite(sfs, sv->sv_ino, &sv->sv_i,
+				      sizeof(sv->sv_i));
 		if (result) {
 			return result;
 		}
-		sv->sv_dirty = false;
+		sfs_dirtyremove(sfs, sv);
 	}
 	return 0;
 }
@@ -70,15 +202,31 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
-	vfs_biglock_acquire();
+	/*
+	 * Erasing a file is a transaction. (This is why callers mustn't
+	 * drop the last reference to a vnode inside a transaction of
+	 * their own.)
+	 */
+	sfs_jnl_begin(sfs);
+
+	/*
+	 * Holding the vnode table lock keeps sfs_loadvnode from handing
+	 * out new references while we decide.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+
+	/*
+	 * Get it out of the name cache before looking at the refcount.
+	 * Anyone who found it there first holds a reference now, and
+	 * nobody can find it there from here on.
+	 */
+	vfs_dcache_purge(v);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it.
 	 */
 	spinlock_acquire(&v->vn_countlock);
 	if (v->vn_refcount != 1) {
@@ -88,16 +236,25 @@ sfs_reclaim(struct vnode *v)
 		v->vn_refcount--;
 
 		spinlock_release(&v->vn_countlock);
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
+		sfs_jnl_end(sfs);
 		return EBUSY;
 	}
 	spinlock_release(&v->vn_countlock);
 
+	/*
+	 * We hold the only reference, so nobody else can hold or be
+	 * waiting for sv_lock; taking it here cannot deadlock.
+	 */
+	lock_acquire(sv->sv_lock);
+
 	/* If there are no on-disk references to the file either, erase it. */
 	if (sv->sv_i.sfi_linkcount == 0) {
 		result = sfs_itrunc(sv, 0);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sv->sv_lock);
+			lock_release(sfs->sfs_vnlock);
+			sfs_jnl_end(sfs);
 			return result;
 		}
 	}
@@ -105,7 +262,9 @@ sfs_reclaim(struct vnode *v)
 	/* Sync the inode to disk */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		lock_release(sfs->sfs_vnlock);
+		sfs_jnl_end(sfs);
 		return result;
 	}
 
@@ -114,28 +273,20 @@ sfs_reclaim(struct vnode *v)
 		sfs_bfree(sfs, sv->sv_ino);
 	}
 
+	lock_release(sv->sv_lock);
+
 	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
-		      sfs->sfs_sb.sb_volname, sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	KASSERT(!sv->sv_dirty);
+	sfs_vnhashremove(sfs, sv);
 
 	vnode_cleanup(&sv->sv_absvn);
 
-	vfs_biglock_release();
+	lock_release(sfs->sfs_vnlock);
+	sfs_jnl_end(sfs);
 
 	/* Release the storage for the vnode structure itself. */
+	sfs_dirhash_cleanup(sv);
+	lock_destroy(sv->sv_lock);
 	kfree(sv);
 
 	/* Done */
@@ -150,42 +301,45 @@ int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops;
-	unsigned i, num;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+	lock_acquire(sfs->sfs_vnlock);
 
+	/* Look in the vnodes table */
+	sv = sfs_vnfind(sfs, ino);
+	if (sv != NULL) {
 		/* Every inode in memory must be in an allocated block */
 		if (!sfs_bused(sfs, sv->sv_ino)) {
 			panic("sfs: %s: Found inode %u in unallocated block\n",
 			      sfs->sfs_sb.sb_volname, sv->sv_ino);
 		}
 
-		if (sv->sv_ino==ino) {
-			/* Found */
+		/* forcetype is only allowed when creating objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
 
-			/* forcetype is only allowed when creating objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
-
-			VOP_INCREF(&sv->sv_absvn);
-			*ret = sv;
-			return 0;
-		}
+		VOP_INCREF(&sv->sv_absvn);
+		lock_release(sfs->sfs_vnlock);
+		*ret = sv;
+		return 0;
 	}
 
-	/* Didn't have it loaded; load it */
+	/*
+	 * Didn't have it loaded; load it. We keep holding the table
+	 * lock across the read so nobody else loads a second copy.
+	 */
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+
+	sv->sv_lock = lock_create("sfs vnode");
+	if (sv->sv_lock == NULL) {
+		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
@@ -196,14 +350,30 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	}
 
 	/* Read the block the inode is in */
-	result = sfs_readblock(sfs, ino, &sv->sv_i, sizeof(sv->sv_i));
+	result = sfs_bufread(sfs, ino, &sv->sv_i, sizeof(sv->sv_i));
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
-	/* Not dirty yet */
+	/* Not dirty yet (a new object is marked below) */
 	sv->sv_dirty = false;
+	sv->sv_dirtyprev = sv->sv_dirtynext = NULL;
+	sv->sv_hashnext = NULL;
+
+	/* No reads yet */
+	sv->sv_ranext = 0;
+	sv->sv_rawindow = 0;
+	sv->sv_raend = 0;
+
+	/* Nothing in the extent cache */
+	sv->sv_extcache.se_nblocks = 0;
+
+	/* Hashed directory table is loaded on first use */
+	sv->sv_dirtable = NULL;
+	sv->sv_dirdepth = 0;
 
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
@@ -213,7 +383,21 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	if (forcetype != SFS_TYPE_INVAL) {
 		KASSERT(sv->sv_i.sfi_type == SFS_TYPE_INVAL);
 		sv->sv_i.sfi_type = forcetype;
-		sv->sv_dirty = true;
+		if (sfs->sfs_sb.sb_features & SFS_FEATURE_EXTENTS) {
+			sv->sv_i.sfi_flags = SFS_IFLAG_EXTENTS;
+		}
+		if (forcetype == SFS_TYPE_DIR &&
+		    (sfs->sfs_sb.sb_features & SFS_FEATURE_DIRHASH)) {
+			sv->sv_i.sfi_flags |= SFS_IFLAG_DIRHASH;
+		}
+	}
+
+	if ((sv->sv_i.sfi_flags & ~SFS_IFLAGS_KNOWN) ||
+	    ((sv->sv_i.sfi_flags & SFS_IFLAG_DIRHASH) &&
+	     sv->sv_i.sfi_type != SFS_TYPE_DIR)) {
+		panic("sfs: %s: loadvnode: Invalid inode flags "
+		      "(inode %u, flags 0x%x)\n", sfs->sfs_sb.sb_volname,
+		      ino, sv->sv_i.sfi_flags);
 	}
 
 	/*
@@ -235,7 +419,9 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = vnode_init(&sv->sv_absvn, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
@@ -243,33 +429,39 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	sv->sv_ino = ino;
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
-	if (result) {
-		vnode_cleanup(&sv->sv_absvn);
-		kfree(sv);
-		return result;
+	sfs_vnhashadd(sfs, sv);
+
+	/* A new object needs its type written out */
+	if (forcetype != SFS_TYPE_INVAL) {
+		sfs_dirtyadd(sfs, sv);
 	}
 
+	lock_release(sfs->sfs_vnlock);
+
 	/* Hand it back */
 	*ret = sv;
 	return 0;
 }
 
 /*
- * Create a new filesystem object and hand back its vnode.
+ * Create a new filesystem object in directory DIR and hand back its
+ * vnode.
  */
 int
-sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
+sfs_makeobj(struct sfs_fs *sfs, struct sfs_vnode *dir, int type,
+	    struct sfs_vnode **ret)
 {
 	uint32_t ino;
 	int result;
 
 	/*
 	 * First, get an inode. (Each inode is a block, and the inode
-	 * number is the block number, so just get a block.)
+	 * number is the block number, so just get a block.) Put it
+	 * near the directory, so a lookup followed by a stat or an
+	 * open doesn't seek across the disk.
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc_near(sfs, dir->sv_ino + 1, &ino);
 	if (result) {
 		return result;
 	}
@@ -296,25 +488,19 @@ sfs_getroot(struct fs *fs, struct vnode **ret)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOTDIR_INO, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		kprintf("sfs: %s: getroot: Cannot load root vnode\n",
 			sfs->sfs_sb.sb_volname);
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
 		kprintf("sfs: %s: getroot: not directory (type %u)\n",
 			sfs->sfs_sb.sb_volname, sv->sv_i.sfi_type);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
-	vfs_biglock_release();
-
 	*ret = &sv->sv_absvn;
 	return 0;
 }
@@ -36,8 +36,10 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -46,6 +48,10 @@
 // Basic block-level I/O routines
 
 /*
+ * These go straight to the disk. Apart from mount, they're only used
+ * by the buffer cache (via fsop_readblock and fsop_writeblock);
+ * everything else goes through the cache.
+ *
  * Note: sfs_readblock is used to read the superblock
  * early in mount, before sfs is fully (or even mostly)
  * initialized, and so may not use anything from sfs
@@ -62,8 +68,6 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 	int result;
 	int tries=0;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	DEBUG(DB_SFS, "sfs: %s %llu\n",
 	      uio->uio_rw == UIO_READ ? "read" : "write",
 	      uio->uio_offset / SFS_BLOCKSIZE);
@@ -102,7 +106,8 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 }
 
 /*
- * Read a block.
+ * Read a block, or a run of consecutive blocks (LEN bytes' worth)
+ * starting there.
  */
 int
 sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
@@ -110,14 +115,14 @@ sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 	struct iovec iov;
 	struct uio ku;
 
-	KASSERT(len == SFS_BLOCKSIZE);
+	KASSERT(len > 0 && len % SFS_BLOCKSIZE == 0);
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
+	SFSUIO(&iov, &ku, data, block, len, UIO_READ);
 	return sfs_rwblock(sfs, &ku);
 }
 
 /*
- * Write a block.
+ * Write a block, or a run of consecutive blocks.
  */
 int
 sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
@@ -125,21 +130,67 @@ sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 	struct iovec iov;
 	struct uio ku;
 
-	KASSERT(len == SFS_BLOCKSIZE);
+	KASSERT(len > 0 && len % SFS_BLOCKSIZE == 0);
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
+	SFSUIO(&iov, &ku, data, block, len, UIO_WRITE);
 	return sfs_rwblock(sfs, &ku);
 }
 
+////////////////////////////////////////////////////////////
+//
+// Whole blocks through the buffer cache
+
+/*
+ * Copy a block out of the buffer cache, reading it if needed.
+ */
+int
+sfs_bufread(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
+{
+	struct buf *buf;
+	int result;
+
+	KASSERT(len == SFS_BLOCKSIZE);
+
+	result = buffer_read(&sfs->sfs_absfs, block, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(data, buffer_map(buf), len);
+	buffer_release(buf);
+	return 0;
+}
+
+/*
+ * Replace a metadata block in the buffer cache. It gets to disk
+ * later, by way of the journal if there is one.
+ */
+int
+sfs_bufwrite(struct sfs_fs *sfs, daddr_t block, const void *data, size_t len)
+{
+	struct buf *buf;
+	int result;
+
+	KASSERT(len == SFS_BLOCKSIZE);
+
+	/* We're replacing all of it, so don't bother reading it. */
+	result = buffer_get(&sfs->sfs_absfs, block, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(buffer_map(buf), data, len);
+	sfs_jnl_markdirty(sfs, buf);
+	buffer_release(buf);
+	return 0;
+}
+
 ////////////////////////////////////////////////////////////
 //
 // File-level I/O
 
 /*
- * Do I/O to a block of a file that doesn't cover the whole block.  We
- * need to read in the original block first, even if we're writing, so
- * we don't clobber the portion of the block we're not intending to
- * write over.
+ * Do I/O to a block of a file, in the buffer cache. If we're writing
+ * only part of the block, the rest of it has to be read in first so
+ * it doesn't get clobbered; if we're writing all of it, it doesn't.
  *
  * SKIPSTART is the number of bytes to skip past at the beginning of
  * the sector; LEN is the number of bytes to actually read or write.
@@ -150,16 +201,9 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *buf;
+	char *ioptr;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -168,9 +212,7 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
 
 	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
-
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/* Compute the block offset of this block in the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
@@ -184,40 +226,42 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Read zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_readblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the buffer for the block.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	if (uio->uio_rw == UIO_WRITE && len == SFS_BLOCKSIZE) {
+		result = buffer_get(&sfs->sfs_absfs, diskblock, &buf);
+	}
+	else {
+		result = buffer_read(&sfs->sfs_absfs, diskblock, &buf);
+	}
 	if (result) {
 		return result;
 	}
+	ioptr = buffer_map(buf);
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * Now perform the requested operation into/out of the buffer.
 	 */
+	result = uiomove(ioptr+skipstart, len, uio);
+
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_writeblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
+		if (result && !buffer_is_valid(buf)) {
+			/* only part of a block we never read; toss it */
+			buffer_release_and_invalidate(buf);
 			return result;
 		}
+		/* Even a failed copy may have changed some of it. */
+		buffer_mark_dirty(buf);
 	}
-
-	return 0;
+	buffer_release(buf);
+	return result;
 }
 
 /*
@@ -226,63 +270,72 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 static
 int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
+{
+	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
+	return sfs_partialio(sv, uio, 0, SFS_BLOCKSIZE);
+}
+
+/*
+ * Read-ahead. Called after a read that started in file block FIRST
+ * and stopped at byte offset ENDPOS.
+ *
+ * If the read started where the last one left off, the file is being
+ * read sequentially: open up the read-ahead window (or widen it, up
+ * to SFS_RAMAX blocks) and ask the buffer cache to fetch the blocks
+ * in it that we haven't asked for already, in runs that are
+ * contiguous on disk. Otherwise close the window.
+ *
+ * This is tracked per vnode rather than per open file, since that's
+ * all we see down here; two readers interleaving on the same file
+ * just turn it off.
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, uint32_t first, off_t endpos)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t fileblock, end, from, to, runlen;
 	daddr_t diskblock;
-	uint32_t fileblock;
-	int result;
-	bool doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
 
-	/* Get the block number within the file */
-	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
-	/* Look up the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
-	if (result) {
-		return result;
+	/* The next sequential read starts in the block ENDPOS is in. */
+	end = DIVROUNDUP(endpos, SFS_BLOCKSIZE);
+	if (first != sv->sv_ranext) {
+		/* random access */
+		sv->sv_ranext = endpos / SFS_BLOCKSIZE;
+		sv->sv_rawindow = 0;
+		sv->sv_raend = 0;
+		return;
 	}
-
-	if (diskblock == 0) {
-		/*
-		 * No block - fill with zeros.
-		 *
-		 * We must be reading, or sfs_bmap would have
-		 * allocated a block for us.
-		 */
-		KASSERT(uio->uio_rw == UIO_READ);
-		return uiomovezeros(SFS_BLOCKSIZE, uio);
+	sv->sv_ranext = endpos / SFS_BLOCKSIZE;
+	if (sv->sv_rawindow == 0) {
+		sv->sv_rawindow = SFS_RAMIN;
+	}
+	else if (sv->sv_rawindow < SFS_RAMAX) {
+		sv->sv_rawindow *= 2;
 	}
 
-	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
-
-	/*
-	 * Temporarily set the residue to be one block size.
-	 */
-	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
-
-	result = sfs_rwblock(sfs, uio);
-
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	from = end > sv->sv_raend ? end : sv->sv_raend;
+	to = end + sv->sv_rawindow;
+	if (to > DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE)) {
+		to = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	}
+	if (from >= to) {
+		return;
+	}
+	sv->sv_raend = to;
 
-	return result;
+	for (fileblock = from; fileblock < to; fileblock += runlen) {
+		if (sfs_bmaprun(sv, fileblock, to - fileblock,
+				&diskblock, &runlen)) {
+			break;
+		}
+		/* holes have nothing to read */
+		if (diskblock != 0) {
+			buffer_readahead(&sfs->sfs_absfs, diskblock, runlen);
+		}
+	}
 }
 
 /*
@@ -295,8 +348,12 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	uint32_t nblocks, i;
 	int result = 0;
 	uint32_t origresid, extraresid = 0;
+	uint32_t firstblock;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	origresid = uio->uio_resid;
+	firstblock = uio->uio_offset / SFS_BLOCKSIZE;
 
 	/*
 	 * If reading, check for EOF. If we can read a partial area,
@@ -373,12 +430,17 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 
  out:
 
+	/* If reading and we got anywhere, think about reading ahead */
+	if (uio->uio_rw == UIO_READ && uio->uio_resid != origresid) {
+		sfs_readahead(sv, firstblock, uio->uio_offset);
+	}
+
 	/* If writing and we did anything, adjust file length */
 	if (uio->uio_resid != origresid &&
 	    uio->uio_rw == UIO_WRITE &&
 	    uio->uio_offset > (off_t)sv->sv_i.sfi_size) {
 		sv->sv_i.sfi_size = uio->uio_offset;
-		sv->sv_dirty = true;
+		sfs_markdirty(sv);
 	}
 
 	/* Add in any extra amount we couldn't read because of EOF */
@@ -397,10 +459,8 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
  * handled are smaller than whole blocks, do not cross block
  * boundaries, and originate in the kernel.
  *
- * It is separate from sfs_partialio because, although there is no
- * such code in this version of SFS, it is often desirable when doing
- * more advanced things to handle metadata and user data I/O
- * differently.
+ * It is separate from sfs_partialio because metadata and user data
+ * I/O are handled differently: metadata writes go in the journal.
  */
 int
 sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
@@ -412,19 +472,11 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	uint32_t blockoffset;
 	daddr_t diskblock;
 	bool doalloc;
+	struct buf *buf;
+	char *ioptr;
 	int result;
 
-	/*
-	 * I/O buffer for metadata ops.
-	 *
-	 * Note: in real life (and when you've done the fs assignment) you
-	 * would get space from the disk buffer cache for this, not use a
-	 * static area.
-	 */
-	static char metaiobuf[SFS_BLOCKSIZE];
-
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/* Figure out which block of the vnode (directory, whatever) this is */
 	vnblock = actualpos / SFS_BLOCKSIZE;
@@ -446,32 +498,29 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		return 0;
 	}
 
-	/* Read the block */
-	result = sfs_readblock(sfs, diskblock, metaiobuf, sizeof(metaiobuf));
+	/* Get the block */
+	result = buffer_read(&sfs->sfs_absfs, diskblock, &buf);
 	if (result) {
 		return result;
 	}
+	ioptr = buffer_map(buf);
 
 	if (rw == UIO_READ) {
 		/* Copy out the selected region */
-		memcpy(data, metaiobuf + blockoffset, len);
+		memcpy(data, ioptr + blockoffset, len);
+		buffer_release(buf);
 	}
 	else {
 		/* Update the selected region */
-		memcpy(metaiobuf + blockoffset, data, len);
-
-		/* Write the block back */
-		result = sfs_writeblock(sfs, diskblock,
-					metaiobuf, sizeof(metaiobuf));
-		if (result) {
-			return result;
-		}
+		memcpy(ioptr + blockoffset, data, len);
+		sfs_jnl_markdirty(sfs, buf);
+		buffer_release(buf);
 
 		/* Update the vnode size if needed */
 		endpos = actualpos + len;
 		if (endpos > (off_t)sv->sv_i.sfi_size) {
 			sv->sv_i.sfi_size = endpos;
-			sv->sv_dirty = true;
+			sfs_markdirty(sv);
 		}
 	}
 
@@ -0,0 +1,1528 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SFS filesystem
+ *
+ * Metadata journal.
+ *
+ * On a volume with SFS_FEATURE_JOURNAL, changed metadata blocks
+ * (inodes, indirect and extent blocks, directories, the freemap and
+ * the superblock) are written to the journal (see kern/sfs.h) before
+ * they are written in place. After a crash, replaying the journal at
+ * mount puts back every transaction that was committed, and nothing
+ * of one that wasn't, so there's no need for sfsck.
+ *
+ * Operations that change metadata run between sfs_jnl_begin and
+ * sfs_jnl_end. They all add to a single running transaction, which
+ * sfs_jnl_commit writes out as a whole once none is in progress.
+ * Sync and fsync commit, so one sequential journal write covers
+ * everything done since the last one.
+ *
+ * When a metadata buffer is changed, sfs_jnl_markdirty keeps a copy
+ * of the block. The buffer cache still writes the buffer back as
+ * usual, but sfs_jnl_writeblock skips blocks we have a copy of,
+ * since those may only go home once committed. Instead we write them
+ * home from the copies (checkpointing), mostly from the syncer, after
+ * which the log is empty again. Until then the copies are newer than
+ * what's on disk, so sfs_jnl_readblock reads those blocks from them.
+ *
+ * A freed block is revoked, so that replay doesn't write an old copy
+ * of it over whatever it's used for next. It also stays allocated
+ * until the transaction freeing it commits; otherwise it could be
+ * reused, and written, while a crash would still bring back the
+ * metadata pointing to it, or an old copy of it from the log.
+ *
+ * File data isn't journaled, but a commit writes back the dirty
+ * buffers before writing the log, so the data a file points to is
+ * normally on disk before the metadata that points to it.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <current.h>
+#include <bitmap.h>
+#include <device.h>
+#include <buf.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/* Size of the table of logged blocks. */
+#define JNL_HASHSIZE	61
+
+/* Most log blocks written in one go; at least 2. */
+#define JNL_MAXIO	16
+
+/* Starting value for the transaction checksum (FNV-1a). */
+#define JNL_SUMINIT	2166136261U
+
+/* dr_tag of a write that sfs_jnl_startio left for sfs_jnl_finishio. */
+#define JNL_IODEFERRED	1
+
+/*
+ * A block logged since the last checkpoint, with a copy of its
+ * contents as of the last time it was changed.
+ */
+struct sfs_jblock {
+	daddr_t jb_block;		/* home location */
+	struct sfs_jblock *jb_hashnext;	/* hash chain */
+	struct sfs_jblock *jb_runnext;	/* running transaction list */
+	bool jb_running;		/* on the running transaction list */
+	bool jb_committed;		/* a copy of it is in the log */
+	bool jb_revoked;		/* freed since; ignore the copy */
+	char jb_data[SFS_BLOCKSIZE];	/* latest contents */
+};
+
+/*
+ * The journal of a mounted volume.
+ *
+ * j_lock protects the operation count and j_committer. The log
+ * position and I/O fields belong to the committing thread.
+ * j_tablelock protects the table and the running transaction list
+ * (including the blocks it frees, which the committing thread also
+ * uses without it, as nobody else can be freeing anything then);
+ * the contents of a copy belong to whoever has the block's buffer
+ * busy, except during a commit, when nobody else changes anything.
+ * j_homelock is held for reading around reading blocks from disk and
+ * for writing while writing copies home, so nobody can read a block
+ * just before its copy is written home and then find the copy gone.
+ * Reads that don't hold it throughout (sfs_jnl_startio) check
+ * j_ckptgen, which each such write bumps, to see if they raced.
+ */
+struct sfs_journal {
+	uint32_t j_start;		/* first block of the journal */
+	uint32_t j_size;		/* its size in blocks, header included */
+
+	struct lock *j_lock;
+	struct cv *j_cv;		/* wait for j_handles or j_committer */
+	unsigned j_handles;		/* operations in progress */
+	struct thread *j_committer;	/* thread committing, if any */
+
+	uint32_t j_seq;			/* running transaction */
+	uint32_t j_tail;		/* where it goes in the log */
+	uint32_t j_used;		/* log blocks holding transactions */
+
+	struct lock *j_tablelock;
+	struct sfs_jblock *j_hash[JNL_HASHSIZE];
+	struct sfs_jblock *j_runhead;	/* changed in running transaction */
+	unsigned j_nrunning;
+	struct bitmap *j_freeing;	/* freed in running transaction */
+	unsigned j_nfreeing;
+	bool j_freesout;		/* j_freeing is in the freemap */
+
+	struct rwlock *j_homelock;
+	uint32_t j_ckptgen;		/* bumped under j_homelock */
+
+	struct sfs_jnlrec *j_rec;	/* record being built */
+	char *j_iobuf;			/* log blocks waiting to be written */
+	uint32_t j_iostart;		/* log position of j_iobuf */
+	unsigned j_ionum;		/* blocks in j_iobuf */
+	unsigned j_iocount;		/* blocks in this transaction so far */
+	uint32_t j_iosum;		/* and their checksum */
+};
+
+/*
+ * A block revoked by a transaction, found during replay.
+ */
+struct jnlrevoke {
+	uint32_t jv_block;
+	uint32_t jv_seq;
+};
+
+/*
+ * What a pass over the log during replay finds.
+ */
+struct jnlscan {
+	uint32_t js_ntxns;		/* complete transactions */
+	uint32_t js_end;		/* log position after them */
+	unsigned js_nrevokes;		/* blocks they revoke */
+	struct jnlrevoke *js_revokes;	/* which (once collected) */
+	bool js_live;			/* volume in use; see replayblock */
+};
+
+/* What sfs_jnl_scan does with what it finds. */
+#define SCAN_CHECK	0	/* find the complete transactions */
+#define SCAN_REVOKES	1	/* collect the revoked blocks */
+#define SCAN_REPLAY	2	/* write the logged blocks home */
+
+////////////////////////////////////////////////////////////
+// Utilities
+
+/*
+ * Add the bytes of a block to the checksum SUM.
+ */
+static
+uint32_t
+sfs_jnl_sum(uint32_t sum, const void *block)
+{
+	const unsigned char *p = block;
+	unsigned i;
+
+	for (i=0; i<SFS_BLOCKSIZE; i++) {
+		sum ^= p[i];
+		sum *= 16777619U;
+	}
+	return sum;
+}
+
+/*
+ * Step to the next position in the log, which is every block of the
+ * journal but the header, used round and round.
+ */
+static
+uint32_t
+sfs_jnl_next(struct sfs_journal *j, uint32_t pos)
+{
+	pos++;
+	return pos == j->j_size ? 1 : pos;
+}
+
+/*
+ * Write the journal header, saying the log starts at HEAD with
+ * transaction SEQ.
+ */
+static
+int
+sfs_jnl_writeheader(struct sfs_fs *sfs, uint32_t seq, uint32_t head)
+{
+	struct sfs_journal *j = sfs->sfs_jnl;
+	struct sfs_jnlheader *jh = (struct sfs_jnlheader *)j->j_rec;
+
+	COMPILE_ASSERT(sizeof(*jh) == SFS_BLOCKSIZE);
+	COMPILE_ASSERT(sizeof(*j->j_rec) == SFS_BLOCKSIZE);
+
+	bzero(jh, sizeof(*jh));
+	jh->jh_magic = SFS_JNL_MAGIC;
+	jh->jh_seq = seq;
+	jh->jh_head = head;
+	return sfs_writeblock(sfs, j->j_start, jh, sizeof(*jh));
+}
+
+////////////////////////////////////////////////////////////
+// Table of logged blocks
+
+/*
+ * Find our copy of a block, if we have one (revoked or not).
+ */
+static
+struct sfs_jblock *
+sfs_jnl_find(struct sfs_journal *j, daddr_t block)
+{
+	struct sfs_jblock *jb;
+
+	KASSERT(lock_do_i_hold(j->j_tablelock));
+
+	jb = j->j_hash[block % JNL_HASHSIZE];
+	while (jb != NULL && jb->jb_block != block) {
+		jb = jb->jb_hashnext;
+	}
+	return jb;
+}
+
+/*
+ * Find our copy of a block if it's one that matters: that is, one
+ * that's newer than what's on disk.
+ */
+static
+struct sfs_jblock *
+sfs_jnl_findlive(struct sfs_journal *j, daddr_t block)
+{
+	struct sfs_jblock *jb;
+
+	jb = sfs_jnl_find(j, block);
+	if (jb != NULL && jb->jb_revoked) {
+		jb = NULL;
+	}
+	return jb;
+}
+
+/*
+ * Throw away a copy.
+ */
+static
+void
+sfs_jnl_forget(struct sfs_journal *j, struct sfs_jblock *jb)
+{
+	struct sfs_jblock **p;
+
+	KASSERT(lock_do_i_hold(j->j_tablelock));
+	KASSERT(!jb->jb_running);
+
+	p = &j->j_hash[jb->jb_block % JNL_HASHSIZE];
+	while (*p != jb) {
+		KASSERT(*p != NULL);
+		p = &(*p)->jb_hashnext;
+	}
+	*p = jb->jb_hashnext;
+	kfree(jb);
+}
+
+/*
+ * Done with the running transaction, which has been committed or
+ * written home: take everything off the running list. Revoked copies
+ * aren't needed any more.
+ */
+static
+void
+sfs_jnl_retire(struct sfs_journal *j)
+{
+	struct sfs_jblock *jb, *next;
+
+	lock_acquire(j->j_tablelock);
+	for (jb = j->j_runhead; jb != NULL; jb = next) {
+		next = jb->jb_runnext;
+		jb->jb_running = false;
+		jb->jb_runnext = NULL;
+		if (jb->jb_revoked) {
+			sfs_jnl_forget(j, jb);
+		}
+		else {
+			jb->jb_committed = true;
+		}
+	}
+	j->j_runhead = NULL;
+	j->j_nrunning = 0;
+	lock_release(j->j_tablelock);
+}
+
+/*
+ * Write every copy we have home, then throw them all away. Only for
+ * the committing thread.
+ */
+static
+int
+sfs_jnl_writehome(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_jnl;
+	struct sfs_jblock *jb;
+	unsigned i;
+	int result;
+
+	rwlock_acquire_write(j->j_homelock);
+
+	/* Nobody else changes the table during a commit. */
+	for (i=0; i<JNL_HASHSIZE; i++) {
+		for (jb = j->j_hash[i]; jb != NULL; jb = jb->jb_hashnext) {
+			if (jb->jb_revoked) {
+				continue;
+			}
+			result = sfs_writeblock(sfs, jb->jb_block,
+						jb->jb_data, SFS_BLOCKSIZE);
+			if (result) {
+				rwlock_release_write(j->j_homelock);
+				return result;
+			}
+		}
+	}
+
+	lock_acquire(j->j_tablelock);
+	for (i=0; i<JNL_HASHSIZE; i++) {
+		while (j->j_hash[i] != NULL) {
+			jb = j->j_hash[i];
+			j->j_hash[i] = jb->jb_hashnext;
+			kfree(jb);
+		}
+	}
+	j->j_runhead = NULL;
+	j->j_nrunning = 0;
+	lock_release(j->j_tablelock);
+
+	j->j_ckptgen++;
+	rwlock_release_write(j->j_homelock);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Replay
+
+/*
+ * Write a block found in the log home, unless it was revoked by its
+ * own or a later transaction.
+ *
+ * If the volume is in use (JS_LIVE), the block also stays put if it
+ * has been freed since, as it may already hold something else, and
+ * the superblock in memory is newer than the one logged.
+ */
+static
+int
+sfs_jnl_replayblock(struct sfs_fs *sfs, struct sfs_journal *j,
+		    struct jnlscan *js, uint32_t block, uint32_t seq,
+		    void *data)
+{
+	struct sfs_jblock *jb;
+	bool revoked;
+	unsigned i;
+
+	for (i=0; i<js->js_nrevokes; i++) {
+		if (js->js_revokes[i].jv_block == block &&
+		    js->js_revokes[i].jv_seq >= seq) {
+			return 0;
+		}
+	}
+
+	if (js->js_live) {
+		lock_acquire(j->j_tablelock);
+		jb = sfs_jnl_find(j, block);
+		revoked = jb != NULL && jb->jb_revoked;
+		lock_release(j->j_tablelock);
+		if (revoked) {
+			return 0;
+		}
+	}
+
+	if (block >= sfs->sfs_sb.sb_nblocks ||
+	    (block >= j->j_start && block < j->j_start + j->j_size)) {
+		kprintf("sfs: %s: Journal logs invalid block %u\n",
+			sfs->sfs_sb.sb_volname, block);
+		return EINVAL;
+	}
+
+	if (block == SFS_SUPER_BLOCK && !js->js_live) {
+		memcpy(&sfs->sfs_sb, data, sizeof(sfs->sfs_sb));
+		sfs->sfs_sb.sb_volname[sizeof(sfs->sfs_sb.sb_volname)-1] = 0;
+	}
+	return sfs_writeblock(sfs, block, data, SFS_BLOCKSIZE);
+}
+
+/*
+ * Go over the transactions in the log, starting where the header
+ * says. With SCAN_CHECK, find how many are complete; the other modes
+ * go over that many again.
+ */
+static
+int
+sfs_jnl_scan(struct sfs_fs *sfs, struct sfs_journal *j,
+	     const struct sfs_jnlheader *jh, int mode, struct jnlscan *js)
+{
+	struct sfs_jnlrec *rec = j->j_rec;
+	char *data = j->j_iobuf;
+	uint32_t pos, seq, count, sum, i, t, txnstart;
+	unsigned nrevokes, txnrevokes;
+	int result;
+
+	pos = jh->jh_head;
+	seq = jh->jh_seq;
+	nrevokes = 0;
+	for (t=0; mode == SCAN_CHECK || t < js->js_ntxns; t++, seq++) {
+		txnstart = pos;
+		txnrevokes = nrevokes;
+		count = 0;
+		sum = JNL_SUMINIT;
+
+		/* Read records until the commit */
+		while (1) {
+			if (count >= j->j_size - 1) {
+				/* longer than the log; it's old junk */
+				goto incomplete;
+			}
+			result = sfs_readblock(sfs, j->j_start + pos, rec,
+					       SFS_BLOCKSIZE);
+			if (result) {
+				return result;
+			}
+			if (rec->jr_magic != SFS_JNL_MAGIC ||
+			    rec->jr_seq != seq ||
+			    rec->jr_count > SFS_JNLRECBLOCKS) {
+				goto incomplete;
+			}
+			if (rec->jr_type == SFS_JNLREC_COMMIT) {
+				if (rec->jr_count != count ||
+				    rec->jr_sum != sum) {
+					goto incomplete;
+				}
+				pos = sfs_jnl_next(j, pos);
+				break;
+			}
+			if (rec->jr_type != SFS_JNLREC_DESC &&
+			    rec->jr_type != SFS_JNLREC_REVOKE) {
+				goto incomplete;
+			}
+			sum = sfs_jnl_sum(sum, rec);
+			count++;
+			pos = sfs_jnl_next(j, pos);
+
+			if (rec->jr_type == SFS_JNLREC_REVOKE) {
+				if (mode == SCAN_REVOKES) {
+					for (i=0; i<rec->jr_count; i++) {
+						js->js_revokes[nrevokes+i].jv_block =
+							rec->jr_blocks[i];
+						js->js_revokes[nrevokes+i].jv_seq =
+							seq;
+					}
+				}
+				nrevokes += rec->jr_count;
+				continue;
+			}
+
+			/* The blocks listed follow the descriptor */
+			for (i=0; i<rec->jr_count; i++) {
+				if (count >= j->j_size - 1) {
+					goto incomplete;
+				}
+				result = sfs_readblock(sfs, j->j_start + pos,
+						       data, SFS_BLOCKSIZE);
+				if (result) {
+					return result;
+				}
+				sum = sfs_jnl_sum(sum, data);
+				count++;
+				pos = sfs_jnl_next(j, pos);
+				if (mode == SCAN_REPLAY) {
+					result = sfs_jnl_replayblock(sfs, j, js,
+						rec->jr_blocks[i], seq, data);
+					if (result) {
+						return result;
+					}
+				}
+			}
+		}
+	}
+	return 0;
+
+ incomplete:
+	/* The first one that didn't make it; the log ends before it */
+	if (mode != SCAN_CHECK) {
+		panic("sfs: %s: Journal changed during replay\n",
+		      sfs->sfs_sb.sb_volname);
+	}
+	js->js_ntxns = t;
+	js->js_end = txnstart;
+	js->js_nrevokes = txnrevokes;
+	return 0;
+}
+
+/*
+ * Replay the log: find the complete transactions, then the blocks
+ * they revoke, then write home the blocks they log. Afterwards the
+ * log is empty. LIVE is false at mount, and true when checkpointing
+ * a volume in use, in which case the log had better hold exactly
+ * what we wrote to it.
+ */
+static
+int
+sfs_jnl_replay(struct sfs_fs *sfs, const struct sfs_jnlheader *jh,
+	       bool live)
+{
+	struct sfs_journal *j = sfs->sfs_jnl;
+	struct jnlscan js;
+	int result;
+
+	js.js_revokes = NULL;
+	js.js_live = live;
+	result = sfs_jnl_scan(sfs, j, jh, SCAN_CHECK, &js);
+	if (result) {
+		return result;
+	}
+	if (live && (jh->jh_seq + js.js_ntxns != j->j_seq ||
+		     js.js_end != j->j_tail)) {
+		kprintf("sfs: %s: Journal doesn't match what was logged\n",
+			sfs->sfs_sb.sb_volname);
+		return EIO;
+	}
+
+	j->j_seq = jh->jh_seq + js.js_ntxns;
+	j->j_tail = js.js_end;
+	j->j_used = 0;
+	if (js.js_ntxns == 0) {
+		return 0;
+	}
+
+	if (js.js_nrevokes > 0) {
+		js.js_revokes = kmalloc(js.js_nrevokes *
+					sizeof(*js.js_revokes));
+		if (js.js_revokes == NULL) {
+			return ENOMEM;
+		}
+		result = sfs_jnl_scan(sfs, j, jh, SCAN_REVOKES, &js);
+		if (result) {
+			goto out;
+		}
+	}
+	result = sfs_jnl_scan(sfs, j, jh, SCAN_REPLAY, &js);
+	if (result) {
+		goto out;
+	}
+
+	/* It's all home; empty the log. */
+	result = sfs_jnl_writeheader(sfs, j->j_seq, j->j_tail);
+	if (result) {
+		goto out;
+	}
+	if (!live) {
+		kprintf("sfs: %s: Replayed %u journal transaction%s\n",
+			sfs->sfs_sb.sb_volname, js.js_ntxns,
+			js.js_ntxns == 1 ? "" : "s");
+	}
+
+ out:
+	if (js.js_revokes != NULL) {
+		kfree(js.js_revokes);
+	}
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// Writing the log
+
+/*
+ * Write out the log blocks collected in j_iobuf.
+ */
+static
+int
+sfs_jnl_flushio(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_jnl;
+	int result;
+
+	if (j->j_ionum == 0) {
+		return 0;
+	}
+	result = sfs_writeblock(sfs, j->j_start + j->j_iostart, j->j_iobuf,
+				j->j_ionum * SFS_BLOCKSIZE);
+	j->j_iostart = j->j_tail;
+	j->j_ionum = 0;
+	return result;
+}
+
+/*
+ * Add a block to the transaction being written to the log. Blocks
+ * are collected until there's a full run or the log wraps.
+ */
+static
+int
+sfs_jnl_put(struct sfs_fs *sfs, const void *data)
+{
+	struct sfs_journal *j = sfs->sfs_jnl;
+
+	memcpy(j->j_iobuf + j->j_ionum * SFS_BLOCKSIZE, data, SFS_BLOCKSIZE);
+	j->j_ionum++;
+	j->j_iocount++;
+	j->j_iosum = sfs_jnl_sum(j->j_iosum, data);
+	j->j_tail = sfs_jnl_next(j, j->j_tail);
+	if (j->j_ionum == JNL_MAXIO || j->j_tail == 1) {
+		return sfs_jnl_flushio(sfs);
+	}
+	return 0;
+}
+
+/*
+ * Start a record of type TYPE in j_rec.
+ */
+static
+void
+sfs_jnl_startrec(struct sfs_journal *j, uint32_t type)
+{
+	bzero(j->j_rec, sizeof(*j->j_rec));
+	j->j_rec->jr_magic = SFS_JNL_MAGIC;
+	j->j_rec->jr_type = type;
+	j->j_rec->jr_seq = j->j_seq;
+}
+
+/*
+ * The running transaction doesn't fit in the space left in the log:
+ * make room by checkpointing the transactions already there. Our
+ * copies can't be used for this, because some of them have changed
+ * since they were committed, so replay the log instead, as mount
+ * would. Only for the committing thread.
+ *
+ * Afterwards the copies that aren't in the running transaction are
+ * the same as what's home, and can go; the rest are no longer in the
+ * log, so freeing them needs no revoke.
+ */
+static
+int
+sfs_jnl_ckptlog(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_jnl;
+	struct sfs_jnlheader jh;
+	struct sfs_jblock *jb, *next;
+	unsigned i;
+	int result;
+
+	rwlock_acquire_write(j->j_homelock);
+
+	result = sfs_readblock(sfs, j->j_start, &jh, sizeof(jh));
+	if (result) {
+		goto out;
+	}
+	result = sfs_jnl_replay(sfs, &jh, true);
+	if (result) {
+		goto out;
+	}
+	KASSERT(j->j_used == 0);
+
+	lock_acquire(j->j_tablelock);
+	for (i=0; i<JNL_HASHSIZE; i++) {
+		for (jb = j->j_hash[i]; jb != NULL; jb = next) {
+			next = jb->jb_hashnext;
+			if (jb->jb_running) {
+				jb->jb_committed = false;
+			}
+			else {
+				sfs_jnl_forget(j, jb);
+			}
+		}
+	}
+	lock_release(j->j_tablelock);
+
+ out:
+	/* The replay may have written home even if it failed. */
+	j->j_ckptgen++;
+	rwlock_release_write(j->j_homelock);
+	return result;
+}
+
+/*
+ * The running transaction is too big for the whole log. Give up on
+ * it being atomic and write home everything we have a copy of. The
+ * log is empty, so nothing committed earlier depends on it. A crash
+ * part way through leaves the volume for sfsck, as it would without
+ * a journal.
+ */
+static
+int
+sfs_jnl_writethrough(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_jnl;
+
+	KASSERT(j->j_used == 0);
+	return sfs_jnl_writehome(sfs);
+}
+
+/*
+ * Write the running transaction to the log. Only for the committing
+ * thread, once all the changes are in.
+ */
+static
+int
+sfs_jnl_writelog(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_jnl;
+	struct sfs_jnlrec *rec = j->j_rec;
+	struct sfs_jblock *jb, *first;
+	unsigned nimages, nrevokes;
+	uint32_t need, start;
+	int result;
+
+	/* See what goes in: copies, and revokes of committed copies. */
+ again:
+	nimages = nrevokes = 0;
+	for (jb = j->j_runhead; jb != NULL; jb = jb->jb_runnext) {
+		if (!jb->jb_revoked) {
+			nimages++;
+		}
+		else if (jb->jb_committed) {
+			nrevokes++;
+		}
+	}
+	if (nimages == 0 && nrevokes == 0) {
+		sfs_jnl_retire(j);
+		return 0;
+	}
+
+	need = DIVROUNDUP(nimages, SFS_JNLRECBLOCKS) + nimages +
+		DIVROUNDUP(nrevokes, SFS_JNLRECBLOCKS) + 1;
+	if (need > j->j_size - 1 - j->j_used) {
+		if (j->j_used == 0) {
+			return sfs_jnl_writethrough(sfs);
+		}
+		result = sfs_jnl_ckptlog(sfs);
+		if (result) {
+			return result;
+		}
+		/* It may need fewer revokes now, as well as fitting. */
+		goto again;
+	}
+
+	start = j->j_tail;
+	j->j_iostart = start;
+	j->j_ionum = 0;
+	j->j_iocount = 0;
+	j->j_iosum = JNL_SUMINIT;
+
+	/* Descriptors, each followed by the blocks it lists */
+	jb = j->j_runhead;
+	while (jb != NULL) {
+		sfs_jnl_startrec(j, SFS_JNLREC_DESC);
+		first = jb;
+		for (; jb != NULL && rec->jr_count < SFS_JNLRECBLOCKS;
+		     jb = jb->jb_runnext) {
+			if (!jb->jb_revoked) {
+				rec->jr_blocks[rec->jr_count++] = jb->jb_block;
+			}
+		}
+		if (rec->jr_count == 0) {
+			break;
+		}
+		result = sfs_jnl_put(sfs, rec);
+		if (result) {
+			goto fail;
+		}
+		for (; first != jb; first = first->jb_runnext) {
+			if (first->jb_revoked) {
+				continue;
+			}
+			result = sfs_jnl_put(sfs, first->jb_data);
+			if (result) {
+				goto fail;
+			}
+		}
+	}
+
+	/* Revoke records */
+	jb = j->j_runhead;
+	while (jb != NULL) {
+		sfs_jnl_startrec(j, SFS_JNLREC_REVOKE);
+		for (; jb != NULL && rec->jr_count < SFS_JNLRECBLOCKS;
+		     jb = jb->jb_runnext) {
+			if (jb->jb_revoked && jb->jb_committed) {
+				rec->jr_blocks[rec->jr_count++] = jb->jb_block;
+			}
+		}
+		if (rec->jr_count == 0) {
+			break;
+		}
+		result = sfs_jnl_put(sfs, rec);
+		if (result) {
+			goto fail;
+		}
+	}
+
+	/* And the commit record, which makes it count */
+	KASSERT(j->j_iocount == need - 1);
+	sfs_jnl_startrec(j, SFS_JNLREC_COMMIT);
+	rec->jr_count = j->j_iocount;
+	rec->jr_sum = j->j_iosum;
+	result = sfs_jnl_put(sfs, rec);
+	if (result) {
+		goto fail;
+	}
+	result = sfs_jnl_flushio(sfs);
+	if (result) {
+		goto fail;
+	}
+
+	j->j_used += need;
+	j->j_seq++;
+	sfs_jnl_retire(j);
+	return 0;
+
+ fail:
+	/* Nothing is committed without the commit record; try again later */
+	j->j_tail = start;
+	j->j_ionum = 0;
+	return result;
+}
+
+/*
+ * Checkpoint: write everything in the log home and empty it. Only for
+ * the committing thread, after writing the log.
+ */
+static
+int
+sfs_jnl_checkpoint(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_jnl;
+	int result;
+
+	KASSERT(j->j_runhead == NULL);
+
+	result = sfs_jnl_writehome(sfs);
+	if (result) {
+		return result;
+	}
+	result = sfs_jnl_writeheader(sfs, j->j_seq, j->j_tail);
+	if (result) {
+		/* Keep the old transactions' space until this works. */
+		return result;
+	}
+	j->j_used = 0;
+	return 0;
+}
+
+/*
+ * Mark the blocks freed by the running transaction free in the
+ * freemap, so the freemap it commits has them free, or (ISFREE
+ * false) allocated again because it didn't commit after all. Only
+ * for the committing thread, between syncing the vnodes and writing
+ * the log; nothing can allocate them meanwhile, since nobody else
+ * runs during a commit and committing itself doesn't allocate.
+ */
+static
+void
+sfs_jnl_putfrees(struct sfs_fs *sfs, bool isfree)
+{
+	struct sfs_journal *j = sfs->sfs_jnl;
+	unsigned found;
+	daddr_t block;
+
+	KASSERT(j->j_freesout != isfree);
+	found = 0;
+	for (block=0; found < j->j_nfreeing; block++) {
+		KASSERT(block < sfs->sfs_sb.sb_nblocks);
+		if (bitmap_isset(j->j_freeing, block)) {
+			sfs_bsetfree(sfs, block, isfree);
+			found++;
+		}
+	}
+	j->j_freesout = isfree;
+}
+
+/*
+ * The running transaction, and with it the revokes of the blocks it
+ * freed, is on disk: those blocks are free for good.
+ */
+static
+void
+sfs_jnl_forgetfrees(struct sfs_journal *j)
+{
+	daddr_t block;
+
+	KASSERT(j->j_freesout);
+	for (block=0; j->j_nfreeing > 0; block++) {
+		if (bitmap_isset(j->j_freeing, block)) {
+			bitmap_unmark(j->j_freeing, block);
+			j->j_nfreeing--;
+		}
+	}
+	j->j_freesout = false;
+}
+
+/*
+ * Commit, then checkpoint if more than CKPTABOVE log blocks are in
+ * use.
+ */
+static
+int
+sfs_jnl_docommit(struct sfs_fs *sfs, uint32_t ckptabove)
+{
+	struct sfs_journal *j = sfs->sfs_jnl;
+	int result;
+
+	/* Wait our turn, then for the operations in progress to finish. */
+	lock_acquire(j->j_lock);
+	KASSERT(j->j_committer != curthread);
+	while (j->j_committer != NULL) {
+		cv_wait(j->j_cv, j->j_lock);
+	}
+	j->j_committer = curthread;
+	while (j->j_handles > 0) {
+		cv_wait(j->j_cv, j->j_lock);
+	}
+	lock_release(j->j_lock);
+
+	/* Get the changes that are only in memory into the transaction. */
+	result = sfs_sync_vnodes(sfs);
+	if (result) {
+		goto done;
+	}
+	sfs_jnl_putfrees(sfs, true);
+	result = sfs_sync_freemap(sfs);
+	if (result) {
+		goto done;
+	}
+	result = sfs_sync_superblock(sfs);
+	if (result) {
+		goto done;
+	}
+
+	/* The data goes out before the metadata that points to it. */
+	result = buffer_sync_fs(&sfs->sfs_absfs);
+	if (result) {
+		goto done;
+	}
+
+	result = sfs_jnl_writelog(sfs);
+	if (result) {
+		goto done;
+	}
+	sfs_jnl_forgetfrees(j);
+
+	if (j->j_used > ckptabove) {
+		result = sfs_jnl_checkpoint(sfs);
+	}
+
+ done:
+	if (j->j_freesout) {
+		/* Not committed; they stay allocated until it is. */
+		sfs_jnl_putfrees(sfs, false);
+	}
+	lock_acquire(j->j_lock);
+	j->j_committer = NULL;
+	cv_broadcast(j->j_cv, j->j_lock);
+	lock_release(j->j_lock);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// Setup and teardown
+
+/*
+ * Create the in-memory journal for a journal of SIZE blocks at
+ * START.
+ */
+static
+struct sfs_journal *
+sfs_jnl_create(uint32_t start, uint32_t size, uint32_t nblocks)
+{
+	struct sfs_journal *j;
+	unsigned i;
+
+	j = kmalloc(sizeof(*j));
+	if (j == NULL) {
+		goto fail;
+	}
+	j->j_start = start;
+	j->j_size = size;
+
+	j->j_lock = lock_create("sfs journal");
+	if (j->j_lock == NULL) {
+		goto cleanup_object;
+	}
+	j->j_cv = cv_create("sfs commit");
+	if (j->j_cv == NULL) {
+		goto cleanup_lock;
+	}
+	j->j_handles = 0;
+	j->j_committer = NULL;
+
+	j->j_seq = 0;
+	j->j_tail = 1;
+	j->j_used = 0;
+
+	j->j_tablelock = lock_create("sfs journal table");
+	if (j->j_tablelock == NULL) {
+		goto cleanup_cv;
+	}
+	for (i=0; i<JNL_HASHSIZE; i++) {
+		j->j_hash[i] = NULL;
+	}
+	j->j_runhead = NULL;
+	j->j_nrunning = 0;
+	j->j_freeing = bitmap_create(nblocks);
+	if (j->j_freeing == NULL) {
+		goto cleanup_tablelock;
+	}
+	j->j_nfreeing = 0;
+	j->j_freesout = false;
+
+	j->j_homelock = rwlock_create("sfs home blocks");
+	if (j->j_homelock == NULL) {
+		goto cleanup_freeing;
+	}
+	j->j_ckptgen = 0;
+
+	j->j_rec = kmalloc(sizeof(*j->j_rec));
+	if (j->j_rec == NULL) {
+		goto cleanup_homelock;
+	}
+	j->j_iobuf = kmalloc(JNL_MAXIO * SFS_BLOCKSIZE);
+	if (j->j_iobuf == NULL) {
+		goto cleanup_rec;
+	}
+	j->j_iostart = 1;
+	j->j_ionum = 0;
+	j->j_iocount = 0;
+	j->j_iosum = JNL_SUMINIT;
+
+	return j;
+
+cleanup_rec:
+	kfree(j->j_rec);
+cleanup_homelock:
+	rwlock_destroy(j->j_homelock);
+cleanup_freeing:
+	bitmap_destroy(j->j_freeing);
+cleanup_tablelock:
+	lock_destroy(j->j_tablelock);
+cleanup_cv:
+	cv_destroy(j->j_cv);
+cleanup_lock:
+	lock_destroy(j->j_lock);
+cleanup_object:
+	kfree(j);
+fail:
+	return NULL;
+}
+
+/*
+ * Set up the journal at mount time, and replay whatever is in it.
+ * This has to happen before anything else is read from the volume.
+ */
+int
+sfs_jnl_mount(struct sfs_fs *sfs)
+{
+	struct sfs_superblock *sb = &sfs->sfs_sb;
+	struct sfs_jnlheader jh;
+	uint32_t firstfree;
+	int result;
+
+	KASSERT(sfs->sfs_jnl == NULL);
+
+	if ((sb->sb_features & SFS_FEATURE_JOURNAL) == 0) {
+		return 0;
+	}
+
+	/* Check the start before subtracting it, so nothing wraps. */
+	firstfree = SFS_FREEMAP_START + SFS_FREEMAPBLOCKS(sb->sb_nblocks);
+	if (sb->sb_journalstart < firstfree ||
+	    sb->sb_journalstart > sb->sb_nblocks ||
+	    sb->sb_journalblocks < SFS_JNL_MINBLOCKS ||
+	    sb->sb_journalblocks > sb->sb_nblocks - sb->sb_journalstart) {
+		kprintf("sfs: %s: Invalid journal location %u size %u\n",
+			sb->sb_volname, sb->sb_journalstart,
+			sb->sb_journalblocks);
+		return EINVAL;
+	}
+
+	sfs->sfs_jnl = sfs_jnl_create(sb->sb_journalstart,
+				      sb->sb_journalblocks, sb->sb_nblocks);
+	if (sfs->sfs_jnl == NULL) {
+		return ENOMEM;
+	}
+
+	result = sfs_readblock(sfs, sfs->sfs_jnl->j_start, &jh, sizeof(jh));
+	if (result) {
+		return result;
+	}
+	if (jh.jh_magic != SFS_JNL_MAGIC || jh.jh_head == 0 ||
+	    jh.jh_head >= sfs->sfs_jnl->j_size) {
+		kprintf("sfs: %s: Invalid journal header\n", sb->sb_volname);
+		return EINVAL;
+	}
+
+	return sfs_jnl_replay(sfs, &jh, false);
+}
+
+/*
+ * Commit and checkpoint for unmount, so the log is empty and
+ * everything is home. The caller has just synced the volume.
+ */
+int
+sfs_jnl_unmount(struct sfs_fs *sfs)
+{
+	if (sfs->sfs_jnl == NULL) {
+		return 0;
+	}
+	return sfs_jnl_docommit(sfs, 0);
+}
+
+/*
+ * Free the in-memory journal, if any. At unmount there are no copies
+ * left; if mount failed there never were any.
+ */
+void
+sfs_jnl_destroy(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_jnl;
+	unsigned i;
+
+	if (j == NULL) {
+		return;
+	}
+	KASSERT(j->j_handles == 0);
+	KASSERT(j->j_committer == NULL);
+	KASSERT(j->j_runhead == NULL);
+	KASSERT(j->j_nfreeing == 0);
+	for (i=0; i<JNL_HASHSIZE; i++) {
+		KASSERT(j->j_hash[i] == NULL);
+	}
+
+	kfree(j->j_iobuf);
+	kfree(j->j_rec);
+	rwlock_destroy(j->j_homelock);
+	bitmap_destroy(j->j_freeing);
+	lock_destroy(j->j_tablelock);
+	cv_destroy(j->j_cv);
+	lock_destroy(j->j_lock);
+	kfree(j);
+	sfs->sfs_jnl = NULL;
+}
+
+////////////////////////////////////////////////////////////
+// Transactions
+
+/*
+ * Start an operation that changes metadata. This waits out a commit
+ * in progress, so it must be called before taking any SFS locks, and
+ * not by a thread already between sfs_jnl_begin and sfs_jnl_end
+ * (except the committing thread itself, which may need to reclaim
+ * vnodes while syncing them).
+ */
+void
+sfs_jnl_begin(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_jnl;
+
+	if (j == NULL) {
+		return;
+	}
+
+	lock_acquire(j->j_lock);
+	while (j->j_committer != NULL && j->j_committer != curthread) {
+		cv_wait(j->j_cv, j->j_lock);
+	}
+	j->j_handles++;
+	lock_release(j->j_lock);
+}
+
+/*
+ * Finish an operation. If the running transaction has grown big
+ * enough, and nothing else is going on, commit it now rather than
+ * waiting for the syncer, so it stays small enough to fit in the
+ * log. Must be called after letting go of any SFS locks.
+ */
+void
+sfs_jnl_end(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_jnl;
+	bool full;
+
+	if (j == NULL) {
+		return;
+	}
+
+	lock_acquire(j->j_lock);
+	KASSERT(j->j_handles > 0);
+	j->j_handles--;
+	if (j->j_handles == 0) {
+		cv_broadcast(j->j_cv, j->j_lock);
+	}
+	full = false;
+	if (j->j_handles == 0 && j->j_committer == NULL) {
+		lock_acquire(j->j_tablelock);
+		full = j->j_nrunning >= (j->j_size - 1) / 8;
+		lock_release(j->j_tablelock);
+	}
+	lock_release(j->j_lock);
+
+	if (full) {
+		/* If this fails, the next sync will try again. */
+		(void)sfs_jnl_commit(sfs, false);
+	}
+}
+
+/*
+ * Commit the running transaction: bring the changes that are only in
+ * memory (inodes, freemap, superblock) into the buffer cache, write
+ * back the dirty buffers, which leaves mostly file data, and then
+ * write the changed metadata blocks to the log in one go.
+ *
+ * Checkpointing is the syncer's job: with BACKGROUND set, as it is
+ * when the syncer calls us every few seconds, checkpoint if the log
+ * is more than half full. Otherwise only do it if the log is nearly
+ * full, so the next transaction will fit.
+ *
+ * Must not be called between sfs_jnl_begin and sfs_jnl_end.
+ */
+int
+sfs_jnl_commit(struct sfs_fs *sfs, bool background)
+{
+	struct sfs_journal *j = sfs->sfs_jnl;
+	uint32_t logsize;
+
+	KASSERT(j != NULL);
+	logsize = j->j_size - 1;
+	return sfs_jnl_docommit(sfs, background ? logsize / 2 :
+				logsize - logsize / 4);
+}
+
+/*
+ * Mark a buffer holding a metadata block dirty, and if the volume
+ * has a journal, keep a copy of the block for the running
+ * transaction. The caller must be between sfs_jnl_begin and
+ * sfs_jnl_end, or committing.
+ *
+ * If there's no memory for the copy the block doesn't get journaled,
+ * and is written back like any other, as without a journal. (It
+ * can't be in the log already, or we'd still have a copy.)
+ */
+void
+sfs_jnl_markdirty(struct sfs_fs *sfs, struct buf *buf)
+{
+	struct sfs_journal *j = sfs->sfs_jnl;
+	struct sfs_jblock *jb;
+	daddr_t block;
+
+	buffer_mark_dirty(buf);
+	if (j == NULL) {
+		return;
+	}
+	block = buffer_get_block(buf);
+
+	lock_acquire(j->j_tablelock);
+	jb = sfs_jnl_find(j, block);
+	if (jb == NULL) {
+		/* Nobody else can add it while we have the buffer busy. */
+		lock_release(j->j_tablelock);
+		jb = kmalloc(sizeof(*jb));
+		if (jb == NULL) {
+			return;
+		}
+		jb->jb_block = block;
+		jb->jb_runnext = NULL;
+		jb->jb_running = false;
+		jb->jb_committed = false;
+		lock_acquire(j->j_tablelock);
+		KASSERT(sfs_jnl_find(j, block) == NULL);
+		jb->jb_hashnext = j->j_hash[block % JNL_HASHSIZE];
+		j->j_hash[block % JNL_HASHSIZE] = jb;
+	}
+	memcpy(jb->jb_data, buffer_map(buf), SFS_BLOCKSIZE);
+	jb->jb_revoked = false;
+	if (!jb->jb_running) {
+		jb->jb_running = true;
+		jb->jb_runnext = j->j_runhead;
+		j->j_runhead = jb;
+		j->j_nrunning++;
+	}
+	lock_release(j->j_tablelock);
+}
+
+/*
+ * A block is being freed. Our copy of it, if any, is no longer of
+ * interest; if the log has one, the running transaction has to say
+ * not to replay it.
+ *
+ * The block goes on the running transaction's list of blocks to
+ * free, and stays allocated until the transaction commits. Returns
+ * false if there's no journal, and the caller should free it now.
+ */
+bool
+sfs_jnl_revoke(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_journal *j = sfs->sfs_jnl;
+	struct sfs_jblock *jb;
+
+	if (j == NULL) {
+		return false;
+	}
+
+	lock_acquire(j->j_tablelock);
+	/* Not once the commit has put the list in the freemap. */
+	KASSERT(!j->j_freesout);
+	KASSERT(!bitmap_isset(j->j_freeing, block));
+	bitmap_mark(j->j_freeing, block);
+	j->j_nfreeing++;
+	jb = sfs_jnl_find(j, block);
+	if (jb != NULL) {
+		jb->jb_revoked = true;
+		if (!jb->jb_running) {
+			/* It must be in the log, or we'd have dropped it */
+			KASSERT(jb->jb_committed);
+			jb->jb_running = true;
+			jb->jb_runnext = j->j_runhead;
+			j->j_runhead = jb;
+			j->j_nrunning++;
+		}
+	}
+	lock_release(j->j_tablelock);
+	return true;
+}
+
+////////////////////////////////////////////////////////////
+// Block I/O for the buffer cache
+
+/*
+ * Substitute our copies for any of the NUM blocks just read from
+ * disk into DATA, since those are newer. j_homelock must be held.
+ */
+static
+void
+sfs_jnl_patch(struct sfs_journal *j, daddr_t block, void *data,
+	      unsigned num)
+{
+	struct sfs_jblock *jb;
+	unsigned i;
+
+	lock_acquire(j->j_tablelock);
+	for (i=0; i<num; i++) {
+		jb = sfs_jnl_findlive(j, block + i);
+		if (jb != NULL) {
+			memcpy((char *)data + i * SFS_BLOCKSIZE,
+			       jb->jb_data, SFS_BLOCKSIZE);
+		}
+	}
+	lock_release(j->j_tablelock);
+}
+
+/*
+ * Read blocks from disk, substituting our copies of any that have
+ * them.
+ */
+int
+sfs_jnl_readblock(struct sfs_fs *sfs, daddr_t block, void *data,
+		  size_t len)
+{
+	struct sfs_journal *j = sfs->sfs_jnl;
+	int result;
+
+	if (j == NULL) {
+		return sfs_readblock(sfs, block, data, len);
+	}
+
+	rwlock_acquire_read(j->j_homelock);
+	result = sfs_readblock(sfs, block, data, len);
+	if (result == 0) {
+		sfs_jnl_patch(j, block, data, len / SFS_BLOCKSIZE);
+	}
+	rwlock_release_read(j->j_homelock);
+	return result;
+}
+
+/*
+ * Write blocks back to disk, except those we have copies of, which
+ * have to wait to be checkpointed. Those count as written; our copy
+ * is the same as what the buffer has.
+ */
+int
+sfs_jnl_writeblock(struct sfs_fs *sfs, daddr_t block, void *data,
+		   size_t len)
+{
+	struct sfs_journal *j = sfs->sfs_jnl;
+	unsigned i, n, run;
+	int result;
+
+	if (j == NULL) {
+		return sfs_writeblock(sfs, block, data, len);
+	}
+
+	n = len / SFS_BLOCKSIZE;
+	i = 0;
+	while (i < n) {
+		/* Skip what's ours, then find a run that isn't */
+		lock_acquire(j->j_tablelock);
+		while (i < n && sfs_jnl_findlive(j, block + i) != NULL) {
+			i++;
+		}
+		run = 0;
+		while (i + run < n &&
+		       sfs_jnl_findlive(j, block + i + run) == NULL) {
+			run++;
+		}
+		lock_release(j->j_tablelock);
+
+		if (run > 0) {
+			result = sfs_writeblock(sfs, block + i,
+						(char *)data + i * SFS_BLOCKSIZE,
+						run * SFS_BLOCKSIZE);
+			if (result) {
+				return result;
+			}
+			i += run;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Start a transfer for the buffer cache without waiting for it.
+ *
+ * A read goes straight to the disk. Rather than holding j_homelock
+ * until it's done, we remember j_ckptgen; if copies were written
+ * home meanwhile, sfs_jnl_finishio reads again the slow way.
+ *
+ * A write that covers blocks we have copies of has to skip them, so
+ * it's left for sfs_jnl_finishio to do with sfs_jnl_writeblock. The
+ * buffers stay busy throughout, so no copies can appear for the
+ * rest once we've looked.
+ */
+int
+sfs_jnl_startio(struct sfs_fs *sfs, struct devrequest *r)
+{
+	struct sfs_journal *j = sfs->sfs_jnl;
+	unsigned i;
+	int result;
+
+	KASSERT(sfs->sfs_device->d_blocksize == SFS_BLOCKSIZE);
+
+	r->dr_tag = 0;
+	if (j == NULL) {
+		return dev_submit(sfs->sfs_device, r);
+	}
+
+	if (r->dr_write) {
+		lock_acquire(j->j_tablelock);
+		for (i=0; i<r->dr_nblocks; i++) {
+			if (sfs_jnl_findlive(j, r->dr_block + i) != NULL) {
+				r->dr_tag = JNL_IODEFERRED;
+				break;
+			}
+		}
+		lock_release(j->j_tablelock);
+		if (r->dr_tag == JNL_IODEFERRED) {
+			return 0;
+		}
+		return dev_submit(sfs->sfs_device, r);
+	}
+
+	rwlock_acquire_read(j->j_homelock);
+	r->dr_tag = j->j_ckptgen;
+	result = dev_submit(sfs->sfs_device, r);
+	rwlock_release_read(j->j_homelock);
+	return result;
+}
+
+/*
+ * Finish a transfer started with sfs_jnl_startio. I/O errors are
+ * retried the slow way, which knows how.
+ */
+int
+sfs_jnl_finishio(struct sfs_fs *sfs, struct devrequest *r)
+{
+	struct sfs_journal *j = sfs->sfs_jnl;
+	size_t len = r->dr_nblocks * SFS_BLOCKSIZE;
+	int result;
+
+	if (r->dr_write && r->dr_tag == JNL_IODEFERRED) {
+		return sfs_jnl_writeblock(sfs, r->dr_block, r->dr_data, len);
+	}
+
+	result = dev_wait(sfs->sfs_device, r);
+	if (result == EIO) {
+		if (r->dr_write) {
+			return sfs_jnl_writeblock(sfs, r->dr_block,
+						  r->dr_data, len);
+		}
+		return sfs_jnl_readblock(sfs, r->dr_block, r->dr_data, len);
+	}
+	if (result || r->dr_write || j == NULL) {
+		return result;
+	}
+
+	rwlock_acquire_read(j->j_homelock);
+	if (j->j_ckptgen != r->dr_tag) {
+		rwlock_release_read(j->j_homelock);
+		return sfs_jnl_readblock(sfs, r->dr_block, r->dr_data, len);
+	}
+	sfs_jnl_patch(j, r->dr_block, r->dr_data, r->dr_nblocks);
+	rwlock_release_read(j->j_homelock);
+	return 0;
+}
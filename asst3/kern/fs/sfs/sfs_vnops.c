@@ -38,7 +38,9 @@
 #include <stat.h>
 #include <lib.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -102,9 +104,9 @@ sfs_read(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 
 	return result;
 }
@@ -116,14 +118,17 @@ static
 int
 sfs_write(struct vnode *v, struct uio *uio)
 {
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	struct sfs_vnode *sv = v->vn_data;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
+	sfs_jnl_begin(sfs);
+	lock_acquire(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
+	sfs_jnl_end(sfs);
 
 	return result;
 }
@@ -164,8 +169,10 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	lock_acquire(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
 	statbuf->st_nlink = sv->sv_i.sfi_linkcount;
+	lock_release(sv->sv_lock);
 
 	/* We don't support this yet */
 	statbuf->st_blocks = 0;
@@ -177,6 +184,9 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 
 /*
  * Return the type of the file (types as per kern/stat.h)
+ *
+ * The type never changes once the vnode is loaded, so no lock is
+ * needed.
  */
 static
 int
@@ -185,16 +195,12 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
 
-	vfs_biglock_acquire();
-
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: %s: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -214,21 +220,36 @@ sfs_isseekable(struct vnode *v)
 }
 
 /*
- * Called for fsync(), and also on filesystem unmount, global sync(),
- * and some other cases.
+ * Called for fsync(). (Filesystem-wide sync writes the inodes itself;
+ * see sfs_sync_vnodes.)
+ *
+ * With a journal, this is a commit: the file's changes go out along
+ * with everything else done since the last one, in one log write.
  */
 static
 int
 sfs_fsync(struct vnode *v)
 {
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	struct sfs_vnode *sv = v->vn_data;
 	int result;
 
-	vfs_biglock_acquire();
+	if (sfs->sfs_jnl != NULL) {
+		return sfs_jnl_commit(sfs, false);
+	}
+
+	lock_acquire(sv->sv_lock);
 	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
+	if (result) {
+		return result;
+	}
 
-	return result;
+	/*
+	 * The file's blocks are in the buffer cache somewhere; we
+	 * don't keep track of which, so flush the lot.
+	 */
+	return buffer_sync_fs(v->vn_fs);
 }
 
 /*
@@ -249,9 +270,21 @@ static
 int
 sfs_truncate(struct vnode *v, off_t len)
 {
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	struct sfs_vnode *sv = v->vn_data;
+	int result;
+
+	if (len > (off_t)SFS_MAXFILEBLOCKS * SFS_BLOCKSIZE) {
+		return EFBIG;
+	}
+
+	sfs_jnl_begin(sfs);
+	lock_acquire(sv->sv_lock);
+	result = sfs_itrunc(sv, len);
+	lock_release(sv->sv_lock);
+	sfs_jnl_end(sfs);
 
-	return sfs_itrunc(sv, len);
+	return result;
 }
 
 /*
@@ -289,18 +322,21 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	sfs_jnl_begin(sfs);
+	lock_acquire(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jnl_end(sfs);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jnl_end(sfs);
 		return EEXIST;
 	}
 
@@ -308,18 +344,21 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 		/* We got something; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sv->sv_lock);
+			sfs_jnl_end(sfs);
 			return result;
 		}
 		*ret = &newguy->sv_absvn;
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jnl_end(sfs);
 		return 0;
 	}
 
 	/* Didn't exist - create it */
-	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
+	result = sfs_makeobj(sfs, sv, SFS_TYPE_FILE, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jnl_end(sfs);
 		return result;
 	}
 
@@ -329,20 +368,28 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	/* Link it into the directory */
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
+		lock_release(sv->sv_lock);
+		sfs_jnl_end(sfs);
+		/* Reclaiming it needs its own transaction; see sfs_reclaim */
 		VOP_DECREF(&newguy->sv_absvn);
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* Update the linkcount of the new file */
+	lock_acquire(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
 
 	/* and consequently mark it dirty. */
-	newguy->sv_dirty = true;
+	sfs_markdirty(newguy);
+	lock_release(newguy->sv_lock);
+
+	/* The name cache may think it doesn't exist */
+	vfs_dcache_enter(&sv->sv_absvn, name, &newguy->sv_absvn);
 
 	*ret = &newguy->sv_absvn;
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
+	sfs_jnl_end(sfs);
 	return 0;
 }
 
@@ -355,32 +402,41 @@ static
 int
 sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 {
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
 	struct sfs_vnode *sv = dir->vn_data;
 	struct sfs_vnode *f = file->vn_data;
 	int result;
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
+	sfs_jnl_begin(sfs);
+	lock_acquire(sv->sv_lock);
 
 	/* Hard links to directories aren't allowed. */
 	if (f->sv_i.sfi_type == SFS_TYPE_DIR) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jnl_end(sfs);
 		return EINVAL;
 	}
 
 	/* Create the link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jnl_end(sfs);
 		return result;
 	}
 
 	/* and update the link count, marking the inode dirty */
+	lock_acquire(f->sv_lock);
 	f->sv_i.sfi_linkcount++;
-	f->sv_dirty = true;
+	sfs_markdirty(f);
+	lock_release(f->sv_lock);
+
+	vfs_dcache_enter(&sv->sv_absvn, name, &f->sv_absvn);
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
+	sfs_jnl_end(sfs);
 	return 0;
 }
 
@@ -391,33 +447,56 @@ static
 int
 sfs_remove(struct vnode *dir, const char *name)
 {
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
 	struct sfs_vnode *sv = dir->vn_data;
 	struct sfs_vnode *victim;
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	sfs_jnl_begin(sfs);
+	lock_acquire(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jnl_end(sfs);
 		return result;
 	}
 
+	/*
+	 * Directories can't be removed this way. (The only ones there
+	 * can be are "." and "..", which are the directory itself.)
+	 */
+	if (victim->sv_i.sfi_type == SFS_TYPE_DIR) {
+		lock_release(sv->sv_lock);
+		sfs_jnl_end(sfs);
+		VOP_DECREF(&victim->sv_absvn);
+		return EISDIR;
+	}
+
 	/* Erase its directory entry. */
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		lock_acquire(victim->sv_lock);
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
-		victim->sv_dirty = true;
+		sfs_markdirty(victim);
+		lock_release(victim->sv_lock);
+
+		vfs_dcache_enter(&sv->sv_absvn, name, NULL);
 	}
 
-	/* Discard the reference that sfs_lookonce got us */
+	lock_release(sv->sv_lock);
+	sfs_jnl_end(sfs);
+
+	/*
+	 * Discard the reference that sfs_lookonce got us. This may
+	 * reclaim the file, which is a transaction of its own.
+	 */
 	VOP_DECREF(&victim->sv_absvn);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -438,7 +517,8 @@ sfs_rename(struct vnode *d1, const char *n1,
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
+	sfs_jnl_begin(sfs);
+	lock_acquire(sv->sv_lock);
 
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOTDIR_INO);
@@ -446,7 +526,8 @@ sfs_rename(struct vnode *d1, const char *n1,
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jnl_end(sfs);
 		return result;
 	}
 
@@ -467,8 +548,10 @@ sfs_rename(struct vnode *d1, const char *n1,
 	}
 
 	/* Increment the link count, and mark inode dirty */
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount++;
-	g1->sv_dirty = true;
+	sfs_markdirty(g1);
+	lock_release(g1->sv_lock);
 
 	/* Unlink the old slot */
 	result = sfs_dir_unlink(sv, slot1);
@@ -480,14 +563,21 @@ sfs_rename(struct vnode *d1, const char *n1,
 	 * Decrement the link count again, and mark the inode dirty again,
 	 * in case it's been synced behind our back.
 	 */
+	lock_acquire(g1->sv_lock);
 	KASSERT(g1->sv_i.sfi_linkcount>0);
 	g1->sv_i.sfi_linkcount--;
-	g1->sv_dirty = true;
+	sfs_markdirty(g1);
+	lock_release(g1->sv_lock);
+
+	/* Update the name cache to match */
+	vfs_dcache_enter(&sv->sv_absvn, n1, NULL);
+	vfs_dcache_enter(&sv->sv_absvn, n2, &g1->sv_absvn);
+
+	lock_release(sv->sv_lock);
+	sfs_jnl_end(sfs);
 
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_absvn);
-
-	vfs_biglock_release();
 	return 0;
 
  puke_harder:
@@ -503,11 +593,16 @@ sfs_rename(struct vnode *d1, const char *n1,
 		panic("sfs: %s: rename: Cannot recover\n",
 		      sfs->sfs_sb.sb_volname);
 	}
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount--;
+	sfs_markdirty(g1);
+	lock_release(g1->sv_lock);
  puke:
+	lock_release(sv->sv_lock);
+	sfs_jnl_end(sfs);
+
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_absvn);
-	vfs_biglock_release();
 	return result;
 }
 
@@ -525,15 +620,12 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
+	/* This touches nothing but the immutable inode type; no lock. */
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -541,7 +633,6 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_absvn);
 	*ret = &sv->sv_absvn;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -549,7 +640,8 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
  * Lookup gets a vnode for a pathname.
  *
  * Since we don't support subdirectories, it's easy - just look up the
- * name.
+ * name. A name with a slash in it is still looked up as a whole, but
+ * the name cache won't keep it, hit or miss.
  */
 static
 int
@@ -559,22 +651,27 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	struct sfs_vnode *final;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return ENOTDIR;
 	}
 
 	result = sfs_lookonce(sv, path, &final, NULL);
 	if (result) {
-		vfs_biglock_release();
+		if (result == ENOENT) {
+			vfs_dcache_enter(&sv->sv_absvn, path, NULL);
+		}
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
+	/* Next time vfs_lookup won't need to come here */
+	vfs_dcache_enter(&sv->sv_absvn, path, &final->sv_absvn);
 	*ret = &final->sv_absvn;
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 }
 
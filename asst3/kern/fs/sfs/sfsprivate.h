@@ -32,24 +32,46 @@
 
 #include <uio.h> /* for uio_rw */
 
+struct buf;
+
 
 /* ops tables (in sfs_vnops.c) */
 extern const struct vnode_ops sfs_fileops;
 extern const struct vnode_ops sfs_dirops;
 
 /* Macro for initializing a uio structure */
-#define SFSUIO(iov, uio, ptr, block, rw) \
-    uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
+#define SFSUIO(iov, uio, ptr, block, len, rw) \
+    uio_kinit(iov, uio, ptr, len, ((off_t)(block))*SFS_BLOCKSIZE, rw)
+
+/* Read-ahead window for sequential reads, in blocks */
+#define SFS_RAMIN 4
+#define SFS_RAMAX 16
+
+/* Buckets in the vnode table */
+#define SFS_VNHASHSIZE 509
+
+/* Blocks per allocation group */
+#define SFS_GROUPSIZE 1024
+
+/* Largest file we can map, in blocks */
+#define SFS_MAXFILEBLOCKS (SFS_NDIRECT + SFS_DBPERIDB + \
+			   SFS_DBPERIDB * SFS_DBPERIDB + \
+			   SFS_DBPERIDB * SFS_DBPERIDB * SFS_DBPERIDB)
 
 
 /* Functions in sfs_balloc.c */
+int sfs_countfree(struct sfs_fs *sfs);
+int sfs_balloc_near(struct sfs_fs *sfs, daddr_t goal, daddr_t *diskblock);
 int sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock);
 void sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock);
+void sfs_bsetfree(struct sfs_fs *sfs, daddr_t diskblock, bool isfree);
 int sfs_bused(struct sfs_fs *sfs, daddr_t diskblock);
 
 /* Functions in sfs_bmap.c */
 int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		daddr_t *diskblock);
+int sfs_bmaprun(struct sfs_vnode *sv, uint32_t fileblock, uint32_t max,
+		daddr_t *diskblock, uint32_t *nblocks);
 int sfs_itrunc(struct sfs_vnode *sv, off_t len);
 
 /* Functions in sfs_dir.c */
@@ -62,20 +84,58 @@ int sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		struct sfs_vnode **ret,
 		int *slot);
 
+/* Functions in sfs_dirhash.c */
+int sfs_dirhash_findname(struct sfs_vnode *sv, const char *name,
+		uint32_t *ino, int *slot);
+int sfs_dirhash_link(struct sfs_vnode *sv, const char *name, uint32_t ino,
+		int *slot);
+void sfs_dirhash_cleanup(struct sfs_vnode *sv);
+
+/* Functions in sfs_extent.c */
+int sfs_ext_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+		daddr_t *diskblock, uint32_t *nblocks);
+int sfs_ext_trunc(struct sfs_vnode *sv, uint32_t blocklen);
+
+/* Functions in sfs_fsops.c */
+int sfs_sync_vnodes(struct sfs_fs *sfs);
+int sfs_sync_freemap(struct sfs_fs *sfs);
+int sfs_sync_superblock(struct sfs_fs *sfs);
+
 /* Functions in sfs_inode.c */
+void sfs_markdirty(struct sfs_vnode *sv);
 int sfs_sync_inode(struct sfs_vnode *sv);
 int sfs_reclaim(struct vnode *v);
 int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		struct sfs_vnode **ret);
-int sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret);
+int sfs_makeobj(struct sfs_fs *sfs, struct sfs_vnode *dir, int type,
+		struct sfs_vnode **ret);
 int sfs_getroot(struct fs *fs, struct vnode **ret);
 
 /* Functions in sfs_io.c */
 int sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
 int sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
+int sfs_bufread(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
+int sfs_bufwrite(struct sfs_fs *sfs, daddr_t block, const void *data,
+		 size_t len);
 int sfs_io(struct sfs_vnode *sv, struct uio *uio);
 int sfs_metaio(struct sfs_vnode *sv, off_t pos, void *data, size_t len,
 	       enum uio_rw rw);
 
+/* Functions in sfs_journal.c */
+int sfs_jnl_mount(struct sfs_fs *sfs);
+int sfs_jnl_unmount(struct sfs_fs *sfs);
+void sfs_jnl_destroy(struct sfs_fs *sfs);
+void sfs_jnl_begin(struct sfs_fs *sfs);
+void sfs_jnl_end(struct sfs_fs *sfs);
+int sfs_jnl_commit(struct sfs_fs *sfs, bool background);
+void sfs_jnl_markdirty(struct sfs_fs *sfs, struct buf *buf);
+bool sfs_jnl_revoke(struct sfs_fs *sfs, daddr_t block);
+int sfs_jnl_readblock(struct sfs_fs *sfs, daddr_t block, void *data,
+		size_t len);
+int sfs_jnl_writeblock(struct sfs_fs *sfs, daddr_t block, void *data,
+		size_t len);
+int sfs_jnl_startio(struct sfs_fs *sfs, struct devrequest *r);
+int sfs_jnl_finishio(struct sfs_fs *sfs, struct devrequest *r);
+
 
 #endif /* _SFSPRIVATE_H_ */
@@ -39,6 +39,7 @@
 #include "opt-dumbvm.h"
 
 struct vnode;
+struct rwlock;
 
 
 /*
@@ -72,6 +73,8 @@ struct addrspace {
         struct region *region;
         // page table
         struct PTE **hash_table;
+        // page table lock: shared for lookups, exclusive for changes
+        struct rwlock *pt_lock;
 #endif
 };
 
@@ -146,9 +149,12 @@ int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
  *    load_elf - load an ELF user program executable into the current
  *               address space. Returns the entry point (initial PC)
  *               in the space pointed to by ENTRYPOINT.
+ *
+ *    execcache_bootstrap - set up the cache of executable images.
  */
 
 int load_elf(struct vnode *v, vaddr_t *entrypoint);
+void execcache_bootstrap(void);
 
 
 #endif /* _ADDRSPACE_H_ */
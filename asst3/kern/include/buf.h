@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _BUF_H_
+#define _BUF_H_
+
+/*
+ * Buffer cache.
+ *
+ * This is a cache of disk blocks shared by all mounted filesystems
+ * that use it. Buffers are named by filesystem and block number and
+ * are all BUFFER_SIZE bytes. The filesystem supplies the actual I/O
+ * through fsop_readblock and fsop_writeblock.
+ *
+ * A buffer handed out by buffer_get or buffer_read is busy: nobody
+ * else can get it until it's released, so the holder may read and
+ * change the contents freely. Don't sleep on other locks while
+ * holding a buffer if the holder of those locks might want it.
+ *
+ * Changes are written back later (on eviction, by the syncer, or by
+ * buffer_sync_fs), not when the buffer is released; call
+ * buffer_mark_dirty after changing the contents.
+ */
+
+#include <kern/types.h>
+
+struct fs;
+struct buf;
+
+/* Size of every buffer. */
+#define BUFFER_SIZE 512
+
+/*
+ * Buffer ops:
+ *
+ * bootstrap -      Allocate the buffers and start the syncer.
+ * get -            Get a buffer for a block without reading it, for
+ *                  callers that are about to overwrite all of it.
+ *                  Check buffer_is_valid before using the contents.
+ * read -           Get a buffer for a block, reading it if needed.
+ * map -            Get the data pointer.
+ * get_block -      Get the block number.
+ * is_valid -       Check if the contents match the block (or newer).
+ * mark_valid -     Declare the contents valid (after filling a
+ *                  buffer from buffer_get).
+ * mark_dirty -     Declare the contents changed; implies valid.
+ * release -        Give a buffer back.
+ * release_and_invalidate - Give a buffer back and discard the
+ *                  contents, e.g. because the block was freed.
+ * drop -           Discard any cached copy of a block, e.g. because
+ *                  it was freed. Must not be busy for the caller.
+ * readahead -      Start reading blocks in the background, for a
+ *                  caller that expects to want them soon.
+ * sync_fs -        Write back all dirty buffers of a filesystem.
+ * drop_fs -        Discard all buffers of a filesystem, for unmount;
+ *                  none may be dirty or busy.
+ */
+void buffer_bootstrap(void);
+
+int buffer_get(struct fs *fs, daddr_t block, struct buf **ret);
+int buffer_read(struct fs *fs, daddr_t block, struct buf **ret);
+void *buffer_map(struct buf *buf);
+daddr_t buffer_get_block(struct buf *buf);
+bool buffer_is_valid(struct buf *buf);
+void buffer_mark_valid(struct buf *buf);
+void buffer_mark_dirty(struct buf *buf);
+void buffer_release(struct buf *buf);
+void buffer_release_and_invalidate(struct buf *buf);
+void buffer_drop(struct fs *fs, daddr_t block);
+void buffer_readahead(struct fs *fs, daddr_t block, unsigned count);
+
+int buffer_sync_fs(struct fs *fs);
+int buffer_drop_fs(struct fs *fs);
+
+
+#endif /* _BUF_H_ */
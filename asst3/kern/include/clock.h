@@ -73,6 +73,15 @@ void timespec_sub(const struct timespec *t1,
 		  const struct timespec *t2,
 		  struct timespec *ret);
 
+/*
+ * clock_calibrate() measures the rate of the cpu cycle counter
+ * against the real-time clock; it's called once at boot, after the
+ * devices are attached. cycles_totimeval() then converts a count of
+ * cycles to a time.
+ */
+void clock_calibrate(void);
+void cycles_totimeval(uint64_t cycles, struct timeval *ret);
+
 /*
  * clocksleep() suspends execution for the requested number of seconds,
  * like userlevel sleep(3). (Don't confuse it with wchan_sleep.)
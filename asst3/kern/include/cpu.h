@@ -36,6 +36,62 @@
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
 
+/*
+ * Scheduler statistics and event trace, kept per cpu.
+ *
+ * Both are written only by the cpu they belong to, and only with
+ * interrupts off (the scheduler code that updates them holds a run
+ * queue lock, or is in the idle loop at splhigh), so updating them
+ * needs no locks. Other cpus read them unlocked when printing; a
+ * reader may see a partly-updated counter or trace entry, which is
+ * acceptable for statistics and much cheaper than locking every
+ * context switch.
+ *
+ * Times are in cycles from cpu_getcycles().
+ */
+
+#define SCHED_RQHIST_SIZE   8	/* run queue length buckets; last is N+ */
+#define SCHEDTRACE_SIZE     64	/* events per cpu; must be power of 2 */
+#define SCHEDTRACE_NAMELEN  12	/* thread name bytes kept per event */
+
+/* Trace event types */
+#define SCHEDEV_SWITCH   0	/* switched to thread; arg is its latency */
+#define SCHEDEV_WAKEUP   1	/* made thread runnable; arg is its cpu */
+#define SCHEDEV_IDLE     2	/* cpu went idle */
+#define SCHEDEV_UNIDLE   3	/* cpu stopped idling; arg is cycles idle */
+#define SCHEDEV_MIGRATE  4	/* moved thread; arg is its new cpu */
+
+struct schedevent {
+	uint32_t se_cycles;		/* when */
+	uint32_t se_arg;		/* event-dependent value */
+	unsigned se_type;		/* SCHEDEV_* */
+	const void *se_thread;		/* thread, for identification only */
+	char se_name[SCHEDTRACE_NAMELEN]; /* its name, possibly truncated */
+};
+
+/*
+ * Event trace ring for ktrace (see <kern/ktrace.h>). Same rules as
+ * the scheduler trace: written only by the owning cpu with interrupts
+ * off, read unlocked. The ring is allocated the first time tracing is
+ * turned on; c_ktrace_read is the reader's position, protected by
+ * the reader's lock in thread.c.
+ */
+#define KTRACE_SIZE  1024	/* events per cpu; must be power of 2 */
+
+struct ktrace_event;
+
+struct schedstats {
+	unsigned ss_switches;		/* context switches */
+	unsigned ss_idles;		/* times the cpu went idle */
+	uint64_t ss_idlecycles;		/* total time spent idle */
+	unsigned ss_migrations;		/* threads sent to other cpus */
+	unsigned ss_rqhist[SCHED_RQHIST_SIZE]; /* run queue length at switch */
+	unsigned ss_latcount;		/* latency samples */
+	uint64_t ss_lattotal;		/* sum of wakeup-to-run latencies */
+	uint32_t ss_latmax;		/* worst wakeup-to-run latency */
+};
+
+
 /*
  * Per-cpu structure
  *
@@ -61,6 +117,12 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	struct schedstats c_schedstats;	/* Scheduler counters */
+	struct schedevent c_schedtrace[SCHEDTRACE_SIZE]; /* Event ring */
+	unsigned c_schedtrace_next;	/* Total events recorded */
+	struct ktrace_event *c_ktrace;	/* ktrace ring, or NULL */
+	unsigned c_ktrace_next;		/* Total ktrace events recorded */
+	unsigned c_ktrace_read;		/* Events read so far */
 
 	/*
 	 * Accessed by other cpus.
@@ -117,6 +179,14 @@ void cpu_hatch(unsigned software_number);
  */
 void cpu_identify(char *buf, size_t max);
 
+/*
+ * Read the current CPU's free-running cycle counter. The counter is
+ * 32 bits and wraps, so it is only good for measuring short
+ * intervals (compute those by unsigned subtraction), and values read
+ * on different CPUs are not comparable.
+ */
+uint32_t cpu_getcycles(void);
+
 /*
  * Hardware-level interrupt on/off, for the current CPU.
  *
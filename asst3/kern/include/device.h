@@ -51,16 +51,48 @@ struct device {
 	void *d_data;		/* device-specific data */
 };
 
+/*
+ * Asynchronous transfer of whole blocks to or from a kernel buffer
+ * (see devop_submit). The caller fills in the first part; after
+ * that the request and the buffer belong to the device until
+ * devop_wait returns. The request itself is the wait handle.
+ */
+struct devrequest {
+	uint32_t dr_block;		/* first block */
+	unsigned dr_nblocks;		/* number of blocks */
+	void *dr_data;			/* kernel buffer */
+	bool dr_write;			/* write (true) or read (false) */
+	uint32_t dr_tag;		/* for the submitter's use */
+
+	/* For the driver's use. */
+	volatile bool dr_done;		/* finished */
+	int dr_result;			/* 0 or errno, once finished */
+	unsigned dr_seq;
+	struct devrequest *dr_next;
+};
+
 /*
  * Device operations.
  *      devop_eachopen - called on each open call to allow denying the open
  *      devop_io - for both reads and writes (the uio indicates the direction)
  *      devop_ioctl - miscellaneous control operations
+ *      devop_submit - queue a devrequest and return without waiting
+ *      devop_wait - wait for a submitted devrequest and return its result
+ *
+ * devop_submit and devop_wait are for block devices that can have
+ * several requests outstanding; others leave them NULL, and
+ * dev_submit and dev_wait below do the transfer with devop_io.
+ * devop_submit fails only if the request is bad (e.g. out of range),
+ * in which case there's nothing to wait for. Every request that was
+ * submitted successfully must be waited for, by the thread that
+ * submitted it.
  */
 struct device_ops {
 	int (*devop_eachopen)(struct device *, int flags_from_open);
 	int (*devop_io)(struct device *, struct uio *);
 	int (*devop_ioctl)(struct device *, int op, userptr_t data);
+	int (*devop_submit)(struct device *, struct devrequest *);
+	int (*devop_wait)(struct device *, struct devrequest *);
 };
 
 /*
@@ -70,6 +102,13 @@ struct device_ops {
 #define DEVOP_IO(d, u)		((d)->d_ops->devop_io(d, u))
 #define DEVOP_IOCTL(d, op, p)	((d)->d_ops->devop_ioctl(d, op, p))
 
+/*
+ * Submit a devrequest and wait for it, falling back to a synchronous
+ * devop_io in dev_submit for devices without devop_submit.
+ */
+int dev_submit(struct device *dev, struct devrequest *r);
+int dev_wait(struct device *dev, struct devrequest *r);
+
 
 /* Create vnode for a vfs-level device. */
 struct vnode *dev_create_vnode(struct device *dev);
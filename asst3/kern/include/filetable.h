@@ -38,25 +38,36 @@
 
 
 /*
- * The file table is an array of open files.
+ * The file table is an array of open files, indexed by descriptor.
  *
- * There is no particular reason to use a fixed size array (of size
- * OPEN_MAX) instead of a dynamically sized array (using array.h) --
- * the code was just written this way years ago and there's no
- * compelling reason to change it that outweighs this benefit: you can
- * look through the code to see what it would take to make it dynamic,
- * or even to make it dynamic with the limit being user-settable. (See
- * setrlimit(2) on a Unix machine.)
+ * It starts small and grows (by doubling, up to OPEN_MAX) when a
+ * descriptor past the end is needed, so a process with three files
+ * open doesn't carry 128 slots around. ft_used is a bitmap of the
+ * slots in use, so the lowest free descriptor can be found a word at
+ * a time, and ft_hiwater is one past the highest descriptor in use;
+ * everything from there up is empty, so copy and destroy only look
+ * at the live range.
  *
- * Because we only have single-threaded processes, the file table is
- * never shared and so it doesn't require synchronization. On fork,
- * the table is copied. Another exercise: what would you need to do to
- * make this code safe for multithreaded processes? What happens if
- * one thread calls close() while another one is in the middle of e.g.
- * read() using the same file handle?
+ * Since the threads of a process share its file table, it's
+ * protected by ft_lock. filetable_get returns a reference to the
+ * openfile, which filetable_put drops, so a file stays usable even
+ * if another thread closes its descriptor meanwhile. On fork, the
+ * table is copied.
+ *
+ * Most processes never make a second thread, though, and then the
+ * only thread that can touch the table is the one calling get, so
+ * get and put skip both the lock and the reference. ft_shared is set
+ * (for good) when the process makes its first extra thread; since
+ * that's done by a thread of the process itself, it can't happen
+ * between a get and its put.
  */
 struct filetable {
-	struct openfile *ft_openfiles[OPEN_MAX];
+	struct lock *ft_lock;		/* protects everything below */
+	struct openfile **ft_openfiles;	/* the table */
+	uint32_t *ft_used;		/* bitmap of slots in use */
+	unsigned ft_size;		/* number of slots */
+	unsigned ft_hiwater;		/* one past the highest fd in use */
+	bool ft_shared;			/* used by more than one thread */
 };
 
 /*
@@ -65,26 +76,29 @@ struct filetable {
  * create -  Construct an empty file table.
  * destroy - Wipe out a file table, closing anything open in it.
  * copy -    Clone a file table.
+ * share -   Note that more than one thread now uses the table.
  * okfd -    Check if a file handle is in range.
  * get/put - Retrieve a fd for use and put it back when done. (Checks
  *           okfd and also fails on files not open; returned openfile
  *           is not NULL.) Call put with the file returned from get.
  * place -   Insert a file and return the fd.
  * placeat - Insert a file at a specific slot and return the file
- *           previously there.
+ *           previously there. Can fail (ENOMEM) only if the table
+ *           has to grow, which placing NULL never needs.
  */
 
 struct filetable *filetable_create(void);
 void filetable_destroy(struct filetable *ft);
 int filetable_copy(struct filetable *src, struct filetable **dest_ret);
+void filetable_share(struct filetable *ft);
 
 bool filetable_okfd(struct filetable *ft, int fd);
 int filetable_get(struct filetable *ft, int fd, struct openfile **ret);
 void filetable_put(struct filetable *ft, int fd, struct openfile *file);
 
 int filetable_place(struct filetable *ft, struct openfile *file, int *fd);
-void filetable_placeat(struct filetable *ft, struct openfile *newfile, int fd,
-		       struct openfile **oldfile_ret);
+int filetable_placeat(struct filetable *ft, struct openfile *newfile, int fd,
+		      struct openfile **oldfile_ret);
 
 
 #endif /* _FILETABLE_H_ */
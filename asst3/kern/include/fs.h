@@ -31,6 +31,7 @@
 #define _FS_H_
 
 struct vnode; /* in vnode.h */
+struct devrequest; /* in device.h */
 
 
 /*
@@ -51,6 +52,10 @@ struct fs {
  *      fsop_getvolname - Return volume name of filesystem.
  *      fsop_getroot    - Return root vnode of filesystem.
  *      fsop_unmount    - Attempt unmount of filesystem.
+ *      fsop_readblock  - Read a block from the underlying device.
+ *      fsop_writeblock - Write a block to the underlying device.
+ *      fsop_startio    - Start reading or writing blocks, without waiting.
+ *      fsop_finishio   - Wait for fsop_startio's transfer to finish.
  *
  * fsop_getvolname may return NULL on filesystem types that don't
  * support the concept of a volume name. The string returned is
@@ -68,12 +73,29 @@ struct fs {
  * consequently the struct fs instance should remain valid. On success,
  * however, the filesystem object and all storage associated with the
  * filesystem should have been discarded/released.
+ *
+ * fsop_readblock and fsop_writeblock are how the buffer cache (see
+ * buf.h) does I/O for the filesystem. They go straight to the disk,
+ * and may be asked for several consecutive blocks at once (the
+ * length is always a multiple of the block size). Filesystems that
+ * don't use the buffer cache can leave them NULL.
+ *
+ * fsop_startio and fsop_finishio do the same thing in two halves, so
+ * the buffer cache can keep several transfers going at once. The
+ * caller fills in dr_block, dr_nblocks, dr_data, and dr_write of the
+ * devrequest (in filesystem blocks); the filesystem owns the rest.
+ * If fsop_startio succeeds, the same thread must call fsop_finishio
+ * on the request, which returns the result of the whole transfer.
  */
 struct fs_ops {
 	int           (*fsop_sync)(struct fs *);
 	const char   *(*fsop_getvolname)(struct fs *);
 	int           (*fsop_getroot)(struct fs *, struct vnode **);
 	int           (*fsop_unmount)(struct fs *);
+	int           (*fsop_readblock)(struct fs *, daddr_t, void *, size_t);
+	int           (*fsop_writeblock)(struct fs *, daddr_t, void *, size_t);
+	int           (*fsop_startio)(struct fs *, struct devrequest *);
+	int           (*fsop_finishio)(struct fs *, struct devrequest *);
 };
 
 /*
@@ -83,6 +105,12 @@ struct fs_ops {
 #define FSOP_GETVOLNAME(fs)  ((fs)->fs_ops->fsop_getvolname(fs))
 #define FSOP_GETROOT(fs, ret) ((fs)->fs_ops->fsop_getroot(fs, ret))
 #define FSOP_UNMOUNT(fs)     ((fs)->fs_ops->fsop_unmount(fs))
+#define FSOP_READBLOCK(fs, blk, data, len) \
+	((fs)->fs_ops->fsop_readblock(fs, blk, data, len))
+#define FSOP_WRITEBLOCK(fs, blk, data, len) \
+	((fs)->fs_ops->fsop_writeblock(fs, blk, data, len))
+#define FSOP_STARTIO(fs, r)  ((fs)->fs_ops->fsop_startio(fs, r))
+#define FSOP_FINISHIO(fs, r) ((fs)->fs_ops->fsop_finishio(fs, r))
 
 /* Initialization functions for builtin fake file systems. */
 void semfs_bootstrap(void);
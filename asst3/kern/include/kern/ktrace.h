@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_KTRACE_H_
+#define _KERN_KTRACE_H_
+
+/*
+ * Definitions for the kernel event trace (ktrace() and ktrace_read()).
+ *
+ * While tracing is on, each cpu records selected events into its own
+ * ring of fixed-size binary records. ktrace_read() drains whatever
+ * has been recorded since it was last called, oldest first per cpu.
+ * If a ring wraps before it's read, the reader gets a KTRACE_LOST
+ * record saying how many events were overwritten.
+ *
+ * Events from the process that turned tracing on are not recorded,
+ * so a tool can read the trace while it runs without tracing itself.
+ *
+ * Times are in cycles from that cpu's cycle counter; counters on
+ * different cpus are not synchronized.
+ */
+
+/* Event types */
+#define KTRACE_SYSCALL	0	/* syscall; code is call number */
+#define KTRACE_FAULT	1	/* vm fault; code is fault type, arg address */
+#define KTRACE_SWITCH	2	/* context switch; arg is the new thread */
+#define KTRACE_LOST	3	/* arg events were lost on this cpu */
+
+/* Bits for the ktrace() event mask */
+#define KTRACE_MASK(type)  (1U << (type))
+#define KTRACE_ALL	(KTRACE_MASK(KTRACE_SYSCALL) | \
+			 KTRACE_MASK(KTRACE_FAULT) | \
+			 KTRACE_MASK(KTRACE_SWITCH))
+
+/* ktrace() operations */
+#define KTRACE_START	0	/* start recording events in mask */
+#define KTRACE_STOP	1	/* stop recording */
+#define KTRACE_CLEAR	2	/* throw away everything not yet read */
+
+/* Most records one ktrace_read() call returns. */
+#define KTRACE_READMAX	256
+
+struct ktrace_event {
+	__u32 ke_cycles;	/* when it ended */
+	__u32 ke_latency;	/* how long it took, in cycles */
+	__u32 ke_arg;		/* event-dependent value */
+	__i32 ke_result;	/* error code, or 0 */
+	__i32 ke_pid;		/* process it happened in (0 if none) */
+	__u8 ke_type;		/* KTRACE_* */
+	__u8 ke_cpu;		/* cpu it happened on */
+	__u16 ke_code;		/* event-dependent code */
+};
+
+#endif /* _KERN_KTRACE_H_ */
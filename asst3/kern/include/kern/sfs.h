@@ -41,10 +41,19 @@
 #define SFS_VOLNAME_SIZE  32            /* max length of volume name */
 #define SFS_NDIRECT       15            /* # of direct blocks in inode */
 #define SFS_NINDIRECT     1             /* # of indirect blocks in inode */
-#define SFS_NDINDIRECT    0             /* # of 2x indirect blocks in inode */
-#define SFS_NTINDIRECT    0             /* # of 3x indirect blocks in inode */
+#define SFS_NDINDIRECT    1             /* # of 2x indirect blocks in inode */
+#define SFS_NTINDIRECT    1             /* # of 3x indirect blocks in inode */
 #define SFS_DBPERIDB      128           /* # direct blks per indirect blk */
+#define SFS_NIEXTENTS     34            /* # of extents in inode */
+#define SFS_EXTPERBLOCK   42            /* # of extents per extent block */
 #define SFS_NAMELEN       60            /* max length of filename */
+#define SFS_DIRPERBLOCK   8             /* # of dir slots per block */
+#define SFS_DIRHASH_MAXDEPTH 16         /* max hash bits a dir bucket uses */
+#define SFS_DIRBUCKET_MAGIC 0xb0c4e7d1  /* marks a hashed dir bucket */
+#define SFS_JNL_MAGIC     0x4a6e4c21    /* journal header and records */
+#define SFS_JNL_DEFBLOCKS 128           /* journal size mksfs uses */
+#define SFS_JNL_MINBLOCKS 8             /* smallest usable journal */
+#define SFS_JNLRECBLOCKS  123           /* # of block #s per jnl record */
 #define SFS_SUPER_BLOCK   0             /* block the superblock lives in */
 #define SFS_FREEMAP_START 2             /* 1st block of the freemap */
 #define SFS_NOINO         0             /* inode # for free dir entry */
@@ -62,6 +71,31 @@
 /* Size of free block bitmap (in blocks) */
 #define SFS_FREEMAPBLOCKS(nblocks)  (SFS_FREEMAPBITS(nblocks)/SFS_BITSPERBLOCK)
 
+/*
+ * Feature flags for sb_features. A volume with a flag set may use
+ * the corresponding on-disk structures; a volume with flags we don't
+ * know about must not be touched.
+ */
+#define SFS_FEATURE_BIGFILE  0x00000001	/* 2x/3x indirect blocks */
+#define SFS_FEATURE_EXTENTS  0x00000002	/* extent-mapped inodes */
+#define SFS_FEATURE_DIRHASH  0x00000004	/* hash-indexed directories */
+#define SFS_FEATURE_JOURNAL  0x00000008	/* metadata journal */
+#define SFS_FEATURES_KNOWN   (SFS_FEATURE_BIGFILE | SFS_FEATURE_EXTENTS | \
+			      SFS_FEATURE_DIRHASH | SFS_FEATURE_JOURNAL)
+
+/* Flags for sfi_flags */
+#define SFS_IFLAG_EXTENTS    0x0001	/* mapped by extents, not pointers */
+#define SFS_IFLAG_DIRHASH    0x0002	/* directory is hash-indexed */
+#define SFS_IFLAGS_KNOWN     (SFS_IFLAG_EXTENTS | SFS_IFLAG_DIRHASH)
+
+/* Flags for sdb_flags */
+#define SFS_DIRBUCKET_OVERFLOW 0x0001	/* overflow block, not a bucket */
+
+/* Types for jr_type */
+#define SFS_JNLREC_DESC      1	/* jr_blocks are followed by their images */
+#define SFS_JNLREC_REVOKE    2	/* jr_blocks were freed */
+#define SFS_JNLREC_COMMIT    3	/* end of a transaction */
+
 /* File types for sfi_type */
 #define SFS_TYPE_INVAL    0       /* Should not appear on disk */
 #define SFS_TYPE_FILE     1
@@ -74,11 +108,31 @@ struct sfs_superblock {
 	uint32_t sb_magic;		/* Magic number; should be SFS_MAGIC */
 	uint32_t sb_nblocks;			/* Number of blocks in fs */
 	char sb_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
-	uint32_t reserved[118];			/* unused, set to 0 */
+	uint32_t sb_features;			/* SFS_FEATURE_* flags */
+	uint32_t sb_journalstart;		/* First journal block */
+	uint32_t sb_journalblocks;		/* Journal size in blocks */
+	uint32_t reserved[115];			/* unused, set to 0 */
+};
+
+/*
+ * On-disk extent: a run of SE_NBLOCKS blocks of a file, starting at
+ * file block SE_FILEBLOCK, stored consecutively on disk starting at
+ * SE_DISKBLOCK. An extent-mapped file's extents are kept sorted by
+ * file block and don't overlap; blocks not in any extent are holes.
+ */
+struct sfs_extent {
+	uint32_t se_fileblock;			/* First file block */
+	uint32_t se_diskblock;			/* Where it is on disk */
+	uint32_t se_nblocks;			/* Length of the run */
 };
 
 /*
  * On-disk inode
+ *
+ * An inode with SFS_IFLAG_EXTENTS set uses sfi_extents instead of the
+ * direct and indirect block pointers (which stay 0). The first
+ * SFS_NIEXTENTS extents are in the inode; the rest are in a chain of
+ * extent blocks starting at sfi_extblock.
  */
 struct sfs_dinode {
 	uint32_t sfi_size;			/* Size of this file (bytes) */
@@ -86,7 +140,23 @@ struct sfs_dinode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_dindirect;			/* Double indirect block */
+	uint32_t sfi_tindirect;			/* Triple indirect block */
+	uint32_t sfi_flags;			/* SFS_IFLAG_* */
+	uint32_t sfi_nextents;			/* Number of extents */
+	uint32_t sfi_extblock;			/* First extent block */
+	struct sfs_extent sfi_extents[SFS_NIEXTENTS]; /* First extents */
+	uint32_t sfi_waste[128-8-SFS_NDIRECT-3*SFS_NIEXTENTS];
+						/* unused space, set to 0 */
+};
+
+/*
+ * On-disk extent block
+ */
+struct sfs_extentblock {
+	uint32_t seb_next;			/* Next extent block, or 0 */
+	uint32_t seb_waste;			/* unused, set to 0 */
+	struct sfs_extent seb_extents[SFS_EXTPERBLOCK];
 };
 
 /*
@@ -97,5 +167,65 @@ struct sfs_direntry {
 	char sfd_name[SFS_NAMELEN];		/* Filename */
 };
 
+/*
+ * Header of a block of a hash-indexed (SFS_IFLAG_DIRHASH) directory.
+ * It takes the place of the first directory entry in every block,
+ * and starts with a zero inode number so it reads as a free entry.
+ *
+ * A name belongs in the bucket whose prefix matches the low
+ * sdb_depth bits of its hash, which is 32-bit FNV-1a over the bytes
+ * of the name (offset basis 2166136261, prime 16777619). The buckets
+ * in a directory cover each hash value exactly once. When a bucket
+ * that won't be split any further (at the latest at
+ * SFS_DIRHASH_MAXDEPTH) fills up it is continued in overflow blocks,
+ * chained through sdb_next, which carry the same depth and prefix.
+ * An empty hashed directory has no blocks at all.
+ */
+struct sfs_dirbucket {
+	uint32_t sdb_noino;			/* Always SFS_NOINO */
+	uint32_t sdb_magic;			/* SFS_DIRBUCKET_MAGIC */
+	uint32_t sdb_depth;			/* Hash bits this bucket uses */
+	uint32_t sdb_prefix;			/* Value of those bits */
+	uint32_t sdb_next;			/* Next overflow (file block #) */
+	uint32_t sdb_flags;			/* SFS_DIRBUCKET_* */
+	uint32_t sdb_waste[10];			/* unused, set to 0 */
+};
+
+/*
+ * Metadata journal (SFS_FEATURE_JOURNAL).
+ *
+ * The journal is sb_journalblocks blocks starting at sb_journalstart.
+ * The first is the header; the rest are a circular log of
+ * transactions. A transaction is some SFS_JNLREC_DESC records, each
+ * followed by copies of the blocks it lists, and SFS_JNLREC_REVOKE
+ * records, ended by a SFS_JNLREC_COMMIT record. All records of a
+ * transaction carry its sequence number; the commit record's
+ * jr_count is the number of blocks before it in the transaction and
+ * jr_sum is a 32-bit FNV-1a hash of their bytes, so a transaction
+ * that didn't get all the way to disk can be recognized.
+ *
+ * Recovery starts at jh_head expecting transaction jh_seq and
+ * follows the log until the first transaction that isn't complete,
+ * writing the blocks logged to their home locations, except blocks
+ * revoked by the same or a later transaction. Once the blocks logged
+ * are all home, the header is moved up past them; the log is then
+ * empty and jh_head is where the next transaction will go.
+ */
+struct sfs_jnlheader {
+	uint32_t jh_magic;			/* SFS_JNL_MAGIC */
+	uint32_t jh_seq;			/* First transaction to replay */
+	uint32_t jh_head;			/* Where it is (1..size-1) */
+	uint32_t jh_waste[125];			/* unused, set to 0 */
+};
+
+struct sfs_jnlrec {
+	uint32_t jr_magic;			/* SFS_JNL_MAGIC */
+	uint32_t jr_type;			/* SFS_JNLREC_* */
+	uint32_t jr_seq;			/* Transaction number */
+	uint32_t jr_count;			/* # of jr_blocks used */
+	uint32_t jr_sum;			/* Checksum (commit only) */
+	uint32_t jr_blocks[SFS_JNLRECBLOCKS];	/* Home block numbers */
+};
+
 
 #endif /* _KERN_SFS_H_ */
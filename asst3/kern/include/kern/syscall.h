@@ -86,7 +86,7 @@
 //#define SYS_sigaltstack 33
 //                              (resource tracking and usage)
 //#define SYS_wait4      34
-//#define SYS_getrusage  35
+#define SYS_getrusage    35
 //                              (resource limits)
 //#define SYS_getrlimit  36
 //#define SYS_setrlimit  37
@@ -197,6 +197,15 @@
 #define SYS_reboot       119
 //#define SYS___sysctl   120
 
+//                              -- Local additions --
+#define SYS_waitmany     121
+#define SYS_spawn        122
+#define SYS___thread_create 123
+#define SYS_thread_join  124
+#define SYS_thread_exit  125
+#define SYS_ktrace       126
+#define SYS_ktrace_read  127
+
 /*CALLEND*/
 
 
@@ -67,5 +67,8 @@ int openfile_open(char *filename, int openflags, mode_t mode,
 void openfile_incref(struct openfile *);
 void openfile_decref(struct openfile *);
 
+/* check if the caller's reference is the only one */
+bool openfile_isprivate(struct openfile *);
+
 
 #endif /* _OPENFILE_H_ */
@@ -38,6 +38,8 @@
 #define INVALID_PID	0	/* nothing has this pid */
 #define KERNEL_PID	1	/* kernel proc has this pid */
 
+struct usage;
+
 /*
  * Initialize pid management.
  */
@@ -59,16 +61,32 @@ void pid_unalloc(pid_t targetpid);
 void pid_disown(pid_t targetpid);
 
 /*
- * Set the exit status of the current thread to status.  Wakes up any threads
- * waiting to read this status, and decrefs the current thread's pid.
+ * Set the exit status of the current thread to status, and its final
+ * resource usage to usage. Wakes up any threads waiting to read this
+ * status, and decrefs the current thread's pid.
  */
-void pid_setexitstatus(int status);
+void pid_setexitstatus(int status, const struct usage *usage);
 
 /*
- * Causes the current thread to wait for the thread with pid PID to
- * exit, returning the exit status when it does.
+ * Causes the current thread to wait for the thread with pid PID (or
+ * any child, if PID is WAIT_ANY) to exit, returning the exit status
+ * when it does.
  */
 int pid_wait(pid_t targetpid, int *status, int flags, pid_t *retpid);
 
+/*
+ * Make threads of the current (exiting) process that are waiting
+ * in pid_wait or pid_reap give up with EINTR.
+ */
+void pid_interrupt(void);
+
+/*
+ * Collect the exit status of up to MAX exited children at once. If
+ * UPIDS is not NULL the results are copied out to userspace first,
+ * and nothing is collected if that fails.
+ */
+int pid_reap(pid_t *pids, int *statuses, unsigned max, int flags,
+	     userptr_t upids, userptr_t ustatuses, unsigned *retcount);
+
 
 #endif /* _PID_H_ */
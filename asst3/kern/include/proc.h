@@ -42,19 +42,50 @@
 struct addrspace;
 struct vnode;
 
+/*
+ * Record of a user-level thread made with thread_create, kept until
+ * some other thread joins it. The main thread of a process has no
+ * record and can't be joined. Protected by p_threadslock.
+ */
+struct uthread {
+	int ut_tid;			/* Thread ID */
+	struct thread *ut_thread;	/* The thread, until it exits */
+	bool ut_exited;			/* True once it has exited */
+	bool ut_joining;		/* True if someone's waiting */
+	userptr_t ut_retval;		/* Value passed to thread_exit */
+	struct uthread *ut_next;	/* Next in p_uthreads */
+};
+
 /*
  * Process structure.
  *
- * Note that unless you implement multithreaded processes, p_threads
- * will only contain one thread for all processes other than kproc.
+ * User processes can have more than one thread; all of them share
+ * the address space and file table. When one calls _exit (or dies
+ * of a fatal fault) it sets p_exiting, and the others take
+ * themselves out of the process the next time they're on their way
+ * back to user mode. Any that are waiting for something that may
+ * never happen (console input, children) are interrupted and fail
+ * with EINTR. The exiting thread waits on p_threadscv for them to
+ * be gone.
+ *
+ * Resource usage is kept per thread; a thread's counters are added
+ * into p_usage when it leaves the process. When the process exits,
+ * its total (including p_childusage) goes to its parent when the
+ * parent waits for it. Both are protected by p_threadslock.
  *
  * Note: you can't protect p_threads with a spinlock because it needs
  * to be able to call kmalloc.
  */
 struct proc {
 	char *p_name;			/* Name of this process */
-	struct lock *p_threadslock;	/* Lock for p_threads */
+	struct lock *p_threadslock;	/* Lock for p_threads and p_uthreads */
 	struct threadarray p_threads;	/* Threads in this process */
+	struct cv *p_threadscv;		/* Signalled when a thread leaves */
+	volatile bool p_exiting;	/* Set when the process is exiting */
+	struct uthread *p_uthreads;	/* Threads from thread_create */
+	int p_nexttid;			/* Next thread ID to hand out */
+	struct usage p_usage;		/* Usage of threads that have left */
+	struct usage p_childusage;	/* Usage of children waited for */
 	struct spinlock p_lock;		/* Lock for rest of this structure */
 	pid_t p_pid;			/* Process ID */
 
@@ -80,7 +111,10 @@ int proc_create_runprogram(const char *name, struct proc **ret);
 /* Create a fresh process for use by fork() */
 int proc_fork(struct proc **ret);
 
-/* Undo proc_fork if nothing's run in the new process yet. */
+/* Like proc_fork, but don't copy the address space (for spawn()) */
+int proc_spawn(struct proc **ret);
+
+/* Undo proc_fork or proc_spawn if nothing's run in the new process yet. */
 void proc_unfork(struct proc *proc);
 
 /* Destroy a process. */
@@ -95,12 +129,27 @@ void proc_destroy(struct proc *proc);
  */
 void proc_exit(int status);
 
+/*
+ * Cause the current thread to leave its process and exit. If it's
+ * the last thread, the process exits with STATUS.
+ */
+__DEAD void proc_exitthread(int status);
+
 /* Attach a thread to a process. Must not already have a process. */
 int proc_addthread(struct proc *proc, struct thread *t);
 
 /* Detach a thread from its process. */
 void proc_remthread(struct thread *t);
 
+/*
+ * Resource usage: proc_getusage returns the usage of the process's
+ * threads (past and present), proc_getchildusage that of the
+ * children it's waited for. proc_addchildusage adds to the latter.
+ */
+void proc_getusage(struct proc *proc, struct usage *ret);
+void proc_getchildusage(struct proc *proc, struct usage *ret);
+void proc_addchildusage(struct proc *proc, const struct usage *usage);
+
 /* Fetch the address space of the current process. */
 struct addrspace *proc_getas(void);
 
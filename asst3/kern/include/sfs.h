@@ -48,27 +48,65 @@
  */
 #include <kern/sfs.h>
 
+struct lock;
+
 /*
  * In-memory inode
+ *
+ * sv_lock protects sv_i, sv_dirty, the read-ahead state, and the
+ * extent cache, and for directories also the directory contents.
+ * sv_ino and the inode type never change while the vnode is loaded
+ * and may be read without it.
  */
 struct sfs_vnode {
 	struct vnode sv_absvn;          /* abstract vnode structure */
+	struct lock *sv_lock;           /* lock for this inode */
 	struct sfs_dinode sv_i;		/* copy of on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	uint32_t sv_ranext;             /* block a sequential read starts in */
+	uint32_t sv_rawindow;           /* read-ahead blocks (0 = off) */
+	uint32_t sv_raend;              /* read-ahead asked for up to here */
+	struct sfs_extent sv_extcache;  /* last extent used (if nblocks) */
+	uint32_t *sv_dirtable;          /* hashed dir: bucket for each hash */
+	unsigned sv_dirdepth;           /* hashed dir: hash bits in table */
+	struct sfs_vnode *sv_hashnext;  /* vnode table chain (sfs_vnlock) */
+	struct sfs_vnode *sv_dirtyprev; /* dirty list (sfs_dirtylock) */
+	struct sfs_vnode *sv_dirtynext;
 };
 
 /*
  * In-memory info for a whole fs volume
+ *
+ * Lock order: a directory's sv_lock, then the sv_lock of a file in
+ * it, then sfs_vnlock, then sfs_dirtylock, then sfs_freemaplock.
+ * A vnode is on the dirty list exactly when sv_dirty is set; both
+ * change only under its sv_lock (and sfs_dirtylock for the list).
+ * sfs_reclaim takes a vnode's sv_lock while holding sfs_vnlock; this
+ * is safe because it only does so once it holds the last reference,
+ * so nobody else can be holding or waiting for that lock.
+ * On a journaled volume, operations that change metadata call
+ * sfs_jnl_begin before taking any of these and sfs_jnl_end after.
  */
+struct sfs_journal;	/* Opaque; in sfs_journal.c */
+
 struct sfs_fs {
 	struct fs sfs_absfs;            /* abstract filesystem structure */
 	struct sfs_superblock sfs_sb;	/* copy of on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct lock *sfs_vnlock;        /* lock for the vnode table */
+	struct sfs_vnode **sfs_vnhash;  /* vnodes loaded, hashed by ino */
+	unsigned sfs_nvnodes;           /* number of vnodes loaded */
+	struct lock *sfs_dirtylock;     /* lock for the dirty list */
+	struct sfs_vnode *sfs_dirtyhead; /* vnodes with sv_dirty set */
+	struct lock *sfs_freemaplock;   /* lock for the freemap fields */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	uint32_t sfs_nfree;             /* free blocks (freemaplock) */
+	unsigned sfs_ngroups;           /* number of block groups */
+	uint32_t *sfs_groupfree;        /* free blocks in each group */
+	struct sfs_journal *sfs_jnl;    /* journal, or NULL if none */
 };
 
 /*
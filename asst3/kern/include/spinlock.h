@@ -51,25 +51,58 @@
  *
  * Note that spinlocks are held by CPUs, not by threads.
  *
+ * The lock is a ticket lock: each CPU that wants the lock atomically
+ * takes the next ticket number from splk_next, then spins (reading
+ * only) until splk_serving reaches its ticket. Releasing the lock
+ * advances splk_serving. This hands the lock out in FIFO order, so
+ * no CPU can be starved, and waiters do not all hammer the lock word
+ * with atomic operations every time it is released.
+ *
+ * The contention statistics are only updated by the CPU holding the
+ * lock, so they need no further synchronization. Even
+ * spinlock_resetstats doesn't touch them: it starts a new statistics
+ * generation, and each lock clears its own numbers the next time it
+ * is acquired in a newer generation than splk_statsgen. Locks that
+ * have ever been contended are linked onto a global list so they can
+ * be reported by spinlock_printstats().
+ *
  * This structure is made public so spinlocks do not have to be
  * malloc'd; however, code that uses spinlocks should not look inside
  * the structure directly but always use the spinlock API functions.
  */
 struct spinlock {
-	volatile spinlock_data_t splk_lock; /* Memory word where we spin. */
+	volatile spinlock_data_t splk_next; /* Next ticket to hand out. */
+	volatile spinlock_data_t splk_serving; /* Ticket now holding lock. */
 	struct cpu *splk_holder;	    /* CPU holding this lock. */
+	const char *splk_name;		    /* Name for statistics, or NULL. */
+
+	/* Contention statistics. */
+	uint32_t splk_acquires;		    /* Number of acquisitions. */
+	uint32_t splk_contended;	    /* Acquisitions that had to spin. */
+	uint64_t splk_spins;		    /* Total spin iterations. */
+	uint32_t splk_maxhold;		    /* Longest hold time, in cycles. */
+	uint32_t splk_holdstart;	    /* Cycle count at last acquire. */
+	uint32_t splk_statsgen;		    /* Generation of the above. */
+	bool splk_tracked;		    /* On the contended-locks list. */
+	struct spinlock *splk_nexttracked;  /* Next on that list. */
+
 	HANGMAN_LOCKABLE(splk_hangman);     /* Deadlock detector hook. */
 };
 
 /*
  * Initializer for cases where a spinlock needs to be static or global.
+ * The named form gives the lock a name for the statistics report.
  */
 #ifdef OPT_HANGMAN
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL, \
-				  HANGMAN_LOCKABLE_INITIALIZER }
+#define SPINLOCK_INITIALIZER_NAMED(name) \
+	{ SPINLOCK_DATA_INITIALIZER, SPINLOCK_DATA_INITIALIZER, NULL, \
+	  name, 0, 0, 0, 0, 0, 0, false, NULL, HANGMAN_LOCKABLE_INITIALIZER }
 #else
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#define SPINLOCK_INITIALIZER_NAMED(name) \
+	{ SPINLOCK_DATA_INITIALIZER, SPINLOCK_DATA_INITIALIZER, NULL, \
+	  name, 0, 0, 0, 0, 0, 0, false, NULL }
 #endif
+#define SPINLOCK_INITIALIZER	SPINLOCK_INITIALIZER_NAMED(NULL)
 
 /*
  * Spinlock functions.
@@ -81,6 +114,12 @@ struct spinlock {
  * release	Release the lock. May re-enable interrupts.
  *
  * do_i_hold	Check if the current CPU holds the lock.
+ *
+ * setname	Give the lock a name for the statistics report. NAME is
+ *		not copied and must outlive the lock.
+ *
+ * printstats	Print the most contended spinlocks in the system.
+ * resetstats	Clear the statistics of all contended spinlocks.
  */
 
 void spinlock_init(struct spinlock *lk);
@@ -91,5 +130,9 @@ void spinlock_release(struct spinlock *lk);
 
 bool spinlock_do_i_hold(struct spinlock *lk);
 
+void spinlock_setname(struct spinlock *lk, const char *name);
+void spinlock_printstats(void);
+void spinlock_resetstats(void);
+
 
 #endif /* _SPINLOCK_H_ */
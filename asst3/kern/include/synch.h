@@ -58,10 +58,20 @@ void sem_destroy(struct semaphore *);
  *     P (proberen): decrement count. If the count is 0, block until
  *                   the count is 1 again before decrementing.
  *     V (verhogen): increment count.
+ *
+ * Waiters are served in FIFO order: V hands its unit directly to the
+ * longest-waiting P rather than incrementing the count.
  */
 void P(struct semaphore *);
 void V(struct semaphore *);
 
+/*
+ * Like P, but returns EINTR without decrementing the count if the
+ * thread is interrupted (see thread_interrupt). The semaphore must
+ * not be destroyed while that could happen.
+ */
+int P_intr(struct semaphore *);
+
 
 /*
  * Simple lock for mutual exclusion.
@@ -98,6 +108,13 @@ void lock_acquire(struct lock *);
 void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 
+/*
+ * Like lock_acquire, but returns EINTR without the lock if the
+ * thread is interrupted (see thread_interrupt). The lock must not
+ * be destroyed while that could happen.
+ */
+int lock_acquire_intr(struct lock *);
+
 
 /*
  * Condition variable.
@@ -133,6 +150,9 @@ void cv_destroy(struct cv *);
  * in. Note that under normal circumstances the same lock should be used
  * on all operations with any particular CV.
  *
+ * Signalled threads are not woken immediately; they are queued on the
+ * lock and handed it in turn as it is released.
+ *
  * These operations must be atomic. You get to write them.
  */
 void cv_wait(struct cv *cv, struct lock *lock);
@@ -140,4 +160,50 @@ void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers may hold the lock at once, or one writer.
+ * The lock is writer-preferring: once a writer is waiting, new
+ * readers wait behind it, so a steady stream of readers cannot
+ * starve writers out.
+ *
+ * The name field is for easier debugging. A copy of the name is
+ * made internally.
+ */
+struct rwlock {
+        char *rw_name;
+        struct wchan *rw_readwchan;     /* readers wait here */
+        struct wchan *rw_writewchan;    /* writers wait here */
+        struct spinlock rw_lock;
+        volatile unsigned rw_readers;   /* number of active readers */
+        volatile unsigned rw_writewaiters; /* number of waiting writers */
+        struct thread *volatile rw_writer; /* active writer, if any */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading. May sleep if a
+ *                           writer holds the lock or is waiting.
+ *    rwlock_release_read  - Give up a read hold.
+ *    rwlock_acquire_write - Get the lock exclusively.
+ *    rwlock_release_write - Give up the write hold. Only the thread
+ *                           holding the lock for writing may do this.
+ *    rwlock_do_i_hold_write - Return true if the current thread
+ *                           holds the lock for writing.
+ *
+ * Read holds are not tracked per thread; as with semaphores, it is
+ * up to the caller to release only what it acquired. Upgrading a
+ * read hold to a write hold deadlocks.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
+
 #endif /* _SYNCH_H_ */
@@ -67,9 +67,20 @@ int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
 
 int sys_fork(struct trapframe *tf, pid_t *retval);
 int sys_execv(userptr_t prog, userptr_t args);
+int sys_spawn(userptr_t prog, userptr_t args, userptr_t actions,
+	      unsigned nactions, pid_t *retval);
 __DEAD void sys__exit(int code);
 int sys_waitpid(pid_t pid, userptr_t returncode, int flags, pid_t *retval);
+int sys_waitmany(userptr_t pids, userptr_t returncodes, unsigned max,
+		 int flags, int *retval);
 int sys_getpid(pid_t *retval);
+int sys_getrusage(int who, userptr_t usage);
+int sys_ktrace(int op, unsigned mask);
+int sys_ktrace_read(userptr_t buf, unsigned max, int *retval);
+int sys___thread_create(userptr_t entry, userptr_t arg0, userptr_t arg1,
+			userptr_t stack, int *retval);
+int sys_thread_join(int tid, userptr_t retval);
+__DEAD void sys_thread_exit(userptr_t retval);
 
 int sys_open(const_userptr_t filename, int flags, mode_t mode, int *retval);
 int sys_dup2(int oldfd, int newfd, int *retval);
@@ -57,6 +57,8 @@ int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
 int cvtest2(int, char **);
+int rwtest(int, char **);
+int handofftest(int, char **);
 
 /* semaphore unit tests */
 int semu1(int, char **);
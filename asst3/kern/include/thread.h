@@ -39,6 +39,7 @@
 #include <array.h>
 #include <spinlock.h>
 #include <threadlist.h>
+#include <kern/ktrace.h>
 
 struct cpu;
 
@@ -56,6 +57,21 @@ struct cpu;
 #define SAME_STACK(p1, p2)     (((p1) & STACK_MASK) == ((p2) & STACK_MASK))
 
 
+/*
+ * Resource usage counters. Each thread keeps its own, updated only
+ * by itself, so no locking; processes sum them (see proc.h). Times
+ * are in cycles from cpu_getcycles().
+ */
+struct usage {
+	uint64_t u_ucycles;		/* Time in user mode */
+	uint64_t u_scycles;		/* Time in the kernel */
+	uint32_t u_faults;		/* VM faults taken */
+	uint32_t u_nvcsw;		/* Times we slept */
+	uint32_t u_nivcsw;		/* Times we were preempted */
+	uint64_t u_inbytes;		/* Bytes read with read() */
+	uint64_t u_outbytes;		/* Bytes written with write() */
+};
+
 /* States a thread can be in. */
 typedef enum {
 	S_RUN,		/* running */
@@ -85,6 +101,29 @@ struct thread {
 	struct proc *t_proc;		/* Process thread belongs to */
 	HANGMAN_ACTOR(t_hangman);	/* Deadlock detector hook */
 
+	/*
+	 * Scheduler accounting. Protected by the run queue lock of
+	 * the thread's cpu.
+	 */
+	uint32_t t_readycycles;		/* When last made runnable */
+	uint32_t t_lastlatency;		/* Most recent wakeup-to-run time */
+	uint32_t t_maxlatency;		/* Worst wakeup-to-run time */
+
+	/*
+	 * Resource usage. Time since t_usagemark is charged to user
+	 * or kernel time by mips_trap and thread_switch.
+	 */
+	struct usage t_usage;		/* Counters */
+	uint32_t t_usagemark;		/* Cycle count at last charge */
+
+	/*
+	 * Interruptible sleep (see wchan_sleep_intr). Protected by
+	 * intr_lock in thread.c.
+	 */
+	bool t_intrpending;		/* thread_interrupt was called */
+	struct wchan *t_intrwchan;	/* Interruptible sleep channel */
+	struct spinlock *t_intrlock;	/* ...and its spinlock */
+
 	/*
 	 * Interrupt state fields.
 	 *
@@ -158,6 +197,13 @@ __DEAD void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Interrupt thread T: if it's in wchan_sleep_intr, wake it up and
+ * make that return EINTR, and make any later wchan_sleep_intr return
+ * EINTR at once. The caller must make sure T can't exit meanwhile.
+ */
+void thread_interrupt(struct thread *t);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
@@ -169,5 +215,40 @@ void schedule(void);
  */
 void thread_consider_migration(void);
 
+/*
+ * Scheduler statistics. thread_printschedstats prints the per-cpu
+ * counters; thread_resetschedstats clears them. thread_printschedtrace
+ * prints the most recent MAX events from each cpu's trace ring.
+ */
+void thread_printschedstats(void);
+void thread_resetschedstats(void);
+void thread_printschedtrace(unsigned max);
+
+/*
+ * Resource usage. usage_add adds the counters in FROM to TO.
+ * thread_chargeuser charges the time since the last charge to the
+ * current thread as user time, and thread_chargekernel as kernel
+ * time; both are called with interrupts off.
+ */
+void usage_add(struct usage *to, const struct usage *from);
+void thread_chargeuser(void);
+void thread_chargekernel(void);
+
+/*
+ * Kernel event trace (see <kern/ktrace.h>). Check KTRACE_ON before
+ * calling ktrace_record, which records an event of TYPE that started
+ * at cycle count START. The others back the ktrace() and
+ * ktrace_read() syscalls.
+ */
+extern volatile unsigned ktrace_mask;
+#define KTRACE_ON(type)  ((ktrace_mask & KTRACE_MASK(type)) != 0)
+
+void ktrace_record(unsigned type, unsigned code, uint32_t start,
+		   uint32_t arg, int result);
+int ktrace_start(unsigned mask);
+void ktrace_stop(void);
+void ktrace_clear(void);
+unsigned ktrace_drain(struct ktrace_event *buf, unsigned max);
+
 
 #endif /* _THREAD_H_ */
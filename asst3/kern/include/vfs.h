@@ -81,6 +81,31 @@ int vfs_lookup(char *path, struct vnode **result);
 int vfs_lookparent(char *path, struct vnode **result,
 		   char *buf, size_t buflen);
 
+/*
+ * Name lookup cache. Filesystems that want lookups of single names
+ * cached make the entries; names containing '/' are ignored. See
+ * vfsdcache.c for the rules.
+ *
+ *    vfs_dcache_lookup  - Look up a name in a directory. Returns true
+ *                         if the answer is known: a vnode (with a new
+ *                         reference), or NULL if the name doesn't exist.
+ *    vfs_dcache_enter   - Record a name's vnode, or NULL if it doesn't
+ *                         exist. Call with the directory locked.
+ *    vfs_dcache_remove  - Forget a name. Call with the directory locked.
+ *    vfs_dcache_purge   - Forget everything in or naming a vnode. Call
+ *                         from reclaim, before checking the refcount.
+ *    vfs_dcache_printstats - Print hit counts.
+ *    vfs_dcache_resetstats - Zero hit counts.
+ */
+
+bool vfs_dcache_lookup(struct vnode *dir, const char *name,
+		       struct vnode **ret);
+void vfs_dcache_enter(struct vnode *dir, const char *name, struct vnode *vn);
+void vfs_dcache_remove(struct vnode *dir, const char *name);
+void vfs_dcache_purge(struct vnode *vn);
+void vfs_dcache_printstats(void);
+void vfs_dcache_resetstats(void);
+
 /*
  * VFS layer high-level operations on pathnames
  * Because lookup may destroy pathnames, these all may too.
@@ -64,7 +64,12 @@ void free_kpages(vaddr_t addr);
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
 
-/* Hash table and page table management functions */
+/*
+ * Hash table and page table management functions.
+ *
+ * pte_find needs as->pt_lock held for reading (or writing);
+ * pte_insert and pte_remove need it held for writing.
+ */
 struct addrspace;
 uint32_t hash_func(struct addrspace *as, vaddr_t vaddr);
 struct PTE **allocate_and_initialize_hash_table(void);
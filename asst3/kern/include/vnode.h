@@ -50,7 +50,8 @@ struct stat;
  */
 struct vnode {
 	int vn_refcount;                /* Reference count */
-	struct spinlock vn_countlock;   /* Lock for vn_refcount */
+	struct spinlock vn_countlock;   /* Lock for vn_refcount and vn_gen */
+	uint64_t vn_gen;                /* Changes whenever contents do */
 
 	struct fs *vn_fs;               /* Filesystem vnode belongs to */
 
@@ -231,14 +232,14 @@ struct vnode_ops {
 #define VOP_READ(vn, uio)               (__VOP(vn, read)(vn, uio))
 #define VOP_READLINK(vn, uio)           (__VOP(vn, readlink)(vn, uio))
 #define VOP_GETDIRENTRY(vn, uio)        (__VOP(vn,getdirentry)(vn, uio))
-#define VOP_WRITE(vn, uio)              (__VOP(vn, write)(vn, uio))
+#define VOP_WRITE(vn, uio)              vnode_write(vn, uio)
 #define VOP_IOCTL(vn, code, buf)        (__VOP(vn, ioctl)(vn,code,buf))
 #define VOP_STAT(vn, ptr) 	        (__VOP(vn, stat)(vn, ptr))
 #define VOP_GETTYPE(vn, result)         (__VOP(vn, gettype)(vn, result))
 #define VOP_ISSEEKABLE(vn)              (__VOP(vn, isseekable)(vn))
 #define VOP_FSYNC(vn)                   (__VOP(vn, fsync)(vn))
 #define VOP_MMAP(vn /*add stuff */)     (__VOP(vn, mmap)(vn /*add stuff */))
-#define VOP_TRUNCATE(vn, pos)           (__VOP(vn, truncate)(vn, pos))
+#define VOP_TRUNCATE(vn, pos)           vnode_truncate(vn, pos)
 #define VOP_NAMEFILE(vn, uio)           (__VOP(vn, namefile)(vn, uio))
 
 #define VOP_CREAT(vn,nm,excl,mode,res)  (__VOP(vn, creat)(vn,nm,excl,mode,res))
@@ -266,6 +267,20 @@ void vnode_decref(struct vnode *);
 #define VOP_INCREF(vn) 			vnode_incref(vn)
 #define VOP_DECREF(vn) 			vnode_decref(vn)
 
+/*
+ * Content generation. No two vnodes, even ones that reuse the same
+ * memory, ever share a generation, and a vnode's generation changes
+ * after each write or truncate. So the pair (vnode, generation)
+ * names one version of one file's contents, and anything cached
+ * under it stays good as long as vnode_getgen still returns it.
+ *
+ * VOP_WRITE and VOP_TRUNCATE go through vnode_write and
+ * vnode_truncate to bump the generation.
+ */
+uint64_t vnode_getgen(struct vnode *);
+int vnode_write(struct vnode *, struct uio *);
+int vnode_truncate(struct vnode *, off_t);
+
 /*
  * Vnode initialization (intended for use by filesystem code)
  * The reference count is initialized to 1.
@@ -36,6 +36,7 @@
 
 
 struct spinlock; /* in spinlock.h */
+struct thread; /* in thread.h */
 struct wchan; /* Opaque */
 
 /*
@@ -66,6 +67,23 @@ bool wchan_isempty(struct wchan *wc, struct spinlock *lk);
  */
 void wchan_sleep(struct wchan *wc, struct spinlock *lk);
 
+/*
+ * Like wchan_sleep, but return with the lock unlocked, without ever
+ * touching it again. For sleepers that may be moved elsewhere with
+ * wchan_transfer, whose original channel may be gone by the time
+ * they wake up.
+ */
+void wchan_sleep_norelock(struct wchan *wc, struct spinlock *lk);
+
+/*
+ * Like wchan_sleep, but return EINTR, without having been woken by
+ * anyone, if thread_interrupt is called on the sleeping thread (or
+ * already has been). The lock is relocked either way. WC and LK
+ * must outlive any thread that might be interrupted while sleeping
+ * on them.
+ */
+int wchan_sleep_intr(struct wchan *wc, struct spinlock *lk);
+
 /*
  * Wake up one thread, or all threads, sleeping on a wait channel.
  * The associated spinlock should be locked.
@@ -76,5 +94,32 @@ void wchan_sleep(struct wchan *wc, struct spinlock *lk);
 void wchan_wakeone(struct wchan *wc, struct spinlock *lk);
 void wchan_wakeall(struct wchan *wc, struct spinlock *lk);
 
+/*
+ * Wake up at most N threads sleeping on a wait channel, and return
+ * how many were actually woken. The associated spinlock should be
+ * locked.
+ */
+unsigned wchan_wakemany(struct wchan *wc, struct spinlock *lk, unsigned n);
+
+/*
+ * Wake up one thread sleeping on a wait channel and return it, or
+ * return NULL if nobody was sleeping. This is for handing something
+ * directly to the woken thread: until the caller unlocks the
+ * associated spinlock, the thread cannot get back out of
+ * wchan_sleep, so the caller can record it as the new owner of
+ * whatever it was waiting for.
+ */
+struct thread *wchan_handoff(struct wchan *wc, struct spinlock *lk);
+
+/*
+ * Move at most N threads sleeping on wait channel FROM to wait
+ * channel TO without waking them, and return how many were moved.
+ * Both associated spinlocks should be locked. The threads must have
+ * gone to sleep with wchan_sleep_norelock, so that once moved they
+ * no longer depend on FROM or FROMLK.
+ */
+unsigned wchan_transfer(struct wchan *from, struct spinlock *fromlk,
+			struct wchan *to, struct spinlock *tolk, unsigned n);
+
 
 #endif /* _WCHAN_H_ */
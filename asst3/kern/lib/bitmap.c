@@ -47,6 +47,18 @@
 #define WORD_TYPE       unsigned char
 #define WORD_ALLBITS    (0xff)
 
+/*
+ * For searching, though, we look at four words at once where we can.
+ * Whether a chunk is all ones doesn't depend on byte order. The data
+ * is allocated in whole chunks, with the extra bits marked in use, so
+ * a chunk read never runs off the end. (may_alias because the same
+ * bytes are accessed as WORD_TYPE everywhere else.)
+ */
+#define WORDS_PER_CHUNK 4
+#define BITS_PER_CHUNK  (BITS_PER_WORD * WORDS_PER_CHUNK)
+#define CHUNK_ALLBITS   (0xffffffff)
+typedef uint32_t __attribute__((__may_alias__)) chunk_t;
+
 struct bitmap {
         unsigned nbits;
         WORD_TYPE *v;
@@ -57,9 +69,11 @@ struct bitmap *
 bitmap_create(unsigned nbits)
 {
         struct bitmap *b;
-        unsigned words;
+        unsigned words, i;
 
-        words = DIVROUNDUP(nbits, BITS_PER_WORD);
+        COMPILE_ASSERT(sizeof(chunk_t) == WORDS_PER_CHUNK*sizeof(WORD_TYPE));
+
+        words = DIVROUNDUP(nbits, BITS_PER_CHUNK) * WORDS_PER_CHUNK;
         b = kmalloc(sizeof(struct bitmap));
         if (b == NULL) {
                 return NULL;
@@ -74,17 +88,18 @@ bitmap_create(unsigned nbits)
         b->nbits = nbits;
 
         /* Mark any leftover bits at the end in use */
-        if (words > nbits / BITS_PER_WORD) {
-                unsigned j, ix = words-1;
+        if (nbits % BITS_PER_WORD != 0) {
+                unsigned j, ix = nbits / BITS_PER_WORD;
                 unsigned overbits = nbits - ix*BITS_PER_WORD;
 
-                KASSERT(nbits / BITS_PER_WORD == words-1);
-                KASSERT(overbits > 0 && overbits < BITS_PER_WORD);
-
                 for (j=overbits; j<BITS_PER_WORD; j++) {
                         b->v[ix] |= ((WORD_TYPE)1 << j);
                 }
         }
+        /* ...and any leftover words to fill out the last chunk */
+        for (i = DIVROUNDUP(nbits, BITS_PER_WORD); i < words; i++) {
+                b->v[i] = WORD_ALLBITS;
+        }
 
         return b;
 }
@@ -95,31 +110,6 @@ bitmap_getdata(struct bitmap *b)
         return b->v;
 }
 
-int
-bitmap_alloc(struct bitmap *b, unsigned *index)
-{
-        unsigned ix;
-        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
-        unsigned offset;
-
-        for (ix=0; ix<maxix; ix++) {
-                if (b->v[ix]!=WORD_ALLBITS) {
-                        for (offset = 0; offset < BITS_PER_WORD; offset++) {
-                                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
-
-                                if ((b->v[ix] & mask)==0) {
-                                        b->v[ix] |= mask;
-                                        *index = (ix*BITS_PER_WORD)+offset;
-                                        KASSERT(*index < b->nbits);
-                                        return 0;
-                                }
-                        }
-                        KASSERT(0);
-                }
-        }
-        return ENOSPC;
-}
-
 static
 inline
 void
@@ -131,6 +121,56 @@ bitmap_translate(unsigned bitno, unsigned *ix, WORD_TYPE *mask)
         *mask = ((WORD_TYPE)1) << offset;
 }
 
+/*
+ * Find the first clear bit at or after START and before END, looking
+ * at whole chunks and words at a time where they're all in use.
+ */
+int
+bitmap_findzero(struct bitmap *b, unsigned start, unsigned end,
+                unsigned *index)
+{
+        const chunk_t *chunks = (const chunk_t *)b->v;
+        unsigned bit, ix;
+        WORD_TYPE mask;
+
+        if (end > b->nbits) {
+                end = b->nbits;
+        }
+
+        bit = start;
+        while (bit < end) {
+                if (bit % BITS_PER_CHUNK == 0 &&
+                    chunks[bit / BITS_PER_CHUNK] == CHUNK_ALLBITS) {
+                        bit += BITS_PER_CHUNK;
+                        continue;
+                }
+                bitmap_translate(bit, &ix, &mask);
+                if (bit % BITS_PER_WORD == 0 && b->v[ix] == WORD_ALLBITS) {
+                        bit += BITS_PER_WORD;
+                        continue;
+                }
+                if ((b->v[ix] & mask) == 0) {
+                        *index = bit;
+                        return 0;
+                }
+                bit++;
+        }
+        return ENOSPC;
+}
+
+int
+bitmap_alloc(struct bitmap *b, unsigned *index)
+{
+        int result;
+
+        result = bitmap_findzero(b, 0, b->nbits, index);
+        if (result) {
+                return result;
+        }
+        bitmap_mark(b, *index);
+        return 0;
+}
+
 void
 bitmap_mark(struct bitmap *b, unsigned index)
 {
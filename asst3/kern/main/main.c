@@ -45,6 +45,7 @@
 #include <vm.h>
 #include <mainbus.h>
 #include <vfs.h>
+#include <buf.h>
 #include <device.h>
 #include <pid.h>
 #include <syscall.h>
@@ -121,6 +122,7 @@ boot(void)
 	KASSERT(curthread->t_curspl > 0);
 	mainbus_bootstrap();
 	KASSERT(curthread->t_curspl == 0);
+	clock_calibrate();
 	/* Now do pseudo-devices. */
 	pseudoconfig();
 	kprintf("\n");
@@ -130,6 +132,8 @@ boot(void)
 	vm_bootstrap();
 	kprintf_bootstrap();
 	exec_bootstrap();
+	execcache_bootstrap();
+	buffer_bootstrap();
 	thread_start_cpus();
 
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
@@ -36,6 +36,7 @@
 #include <lib.h>
 #include <uio.h>
 #include <clock.h>
+#include <cpu.h>
 #include <mainbus.h>
 #include <synch.h>
 #include <thread.h>
@@ -500,6 +501,74 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_spinlockstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		spinlock_printstats();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		spinlock_resetstats();
+	}
+	else {
+		kprintf("Usage: splk [reset]\n");
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_dcachestats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		vfs_dcache_printstats();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		vfs_dcache_resetstats();
+	}
+	else {
+		kprintf("Usage: dcache [reset]\n");
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_schedstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		thread_printschedstats();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		thread_resetschedstats();
+	}
+	else {
+		kprintf("Usage: sched [reset]\n");
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_schedtrace(int nargs, char **args)
+{
+	if (nargs == 1) {
+		thread_printschedtrace(SCHEDTRACE_SIZE);
+	}
+	else if (nargs == 2) {
+		thread_printschedtrace(atoi(args[1]));
+	}
+	else {
+		kprintf("Usage: strace [count]\n");
+	}
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -576,6 +645,8 @@ static const char *testmenu[] = {
 	"[sy2] Lock test                     ",
 	"[sy3] CV test                       ",
 	"[sy4] CV test #2                    ",
+	"[sy5] Reader-writer lock test       ",
+	"[sy6] Synch handoff benchmark       ",
 	"[semu1-22] Semaphore unit tests     ",
 	"[wt]  waitpid test                  ",
 	"[fs1] Filesystem test               ",
@@ -606,6 +677,10 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[splk] Spinlock contention stats    ",
+	"[sched] Scheduler stats             ",
+	"[dcache] Name cache stats           ",
+	"[strace] Scheduler event trace      ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -657,6 +732,10 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "splk",       cmd_spinlockstats },
+	{ "sched",      cmd_schedstats },
+	{ "dcache",     cmd_dcachestats },
+	{ "strace",     cmd_schedtrace },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -679,6 +758,8 @@ static struct {
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
 	{ "sy4",	cvtest2 },
+	{ "sy5",	rwtest },
+	{ "sy6",	handofftest },
 
 	/* semaphore unit tests */
 	{ "semu1",	semu1 },
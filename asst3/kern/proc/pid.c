@@ -41,46 +41,146 @@
 #include <thread.h>
 #include <proc.h>
 #include <current.h>
+#include <copyinout.h>
 #include <synch.h>
 #include <pid.h>
 
+struct pidinfo;
+
+/*
+ * List of pidinfos, linked through pi_next/pi_prev.
+ */
+struct pidlist {
+	struct pidinfo *pl_head;
+	struct pidinfo *pl_tail;
+};
+
 /*
  * Structure for holding exit data of a thread.
  *
- * If pi_ppid is INVALID_PID, the parent has gone away and will not be
- * waiting. If pi_ppid is INVALID_PID and pi_exited is true, the
- * structure can be freed.
+ * Each pidinfo's pi_lock protects its two child lists, its
+ * pi_refcount, and the exit data (pi_ppid, pi_exited, pi_exitstatus,
+ * pi_usage) and list links of each of its children. That is, a child's exit
+ * data belongs to the parent's lock, not the child's. A parent that
+ * waits sleeps on its own pi_cv, which any child exiting signals.
+ *
+ * A child is on its parent's pi_running list while it's running and
+ * on its pi_exited list (in order of exit) from when it exits until
+ * it's waited for. If pi_ppid is INVALID_PID, the parent has gone
+ * away or disowned it and will not be waiting, and it's on neither
+ * list.
+ *
+ * pi_parent never changes, even after the parent has gone away; each
+ * child holds a reference to its parent's pidinfo, so the parent's
+ * lock can always be taken. The pidinfo itself holds one more
+ * reference, which is dropped when its pid is released.
  */
 struct pidinfo {
 	pid_t pi_pid;			// process id of this thread
 	pid_t pi_ppid;			// process id of parent thread
 	volatile bool pi_exited;	// true if thread has exited
 	int pi_exitstatus;		// status (only valid if exited)
-	struct cv *pi_cv;		// use to wait for thread exit
+	struct usage pi_usage;		// resource usage (ditto)
+	struct pidinfo *pi_parent;	// parent's pidinfo
+	struct pidinfo *pi_next;	// next on parent's list
+	struct pidinfo *pi_prev;	// previous on parent's list
+	struct lock *pi_lock;		// lock for our children
+	struct cv *pi_cv;		// use to wait for a child's exit
+	struct pidlist pi_running;	// children not yet exited
+	struct pidlist pi_zombies;	// exited children not yet waited for
+	unsigned pi_refcount;		// self + one per child
 };
 
 
 /*
- * Global pid and exit data.
+ * Global pid table.
  *
- * The process table is an el-cheapo hash table. It's indexed by
- * (pid % PROCS_MAX), and only allows one process per slot. If a
- * new pid allocation would cause a hash collision, we just don't
- * use that pid.
+ * The table is indexed directly by pid and grows (by doubling) when
+ * it runs out of free pids, up to what's needed for PROCS_MAX
+ * processes. Free pids are kept in a FIFO ring so allocation is O(1)
+ * and a pid isn't handed out again until every other free pid has
+ * been. The table lock comes after all pi_locks.
  */
-static struct lock *pidlock;		// lock for global exit data
-static struct pidinfo *pidinfo[PROCS_MAX]; // actual pid info
-static pid_t nextpid;			// next candidate pid
+#define PIDTABLE_INITSIZE 64
+
+static struct lock *pidtable_lock;	// lock for the table and free ring
+static struct pidinfo **pidtable;	// pidinfo for each pid, or NULL
+static unsigned pidtable_size;		// number of slots in pidtable
+static pid_t *pidfree;			// ring of free pids
+static unsigned pidfree_head;		// oldest entry in pidfree
+static unsigned pidfree_count;		// number of entries in pidfree
 static int nprocs;			// number of allocated pids
 
 
 
+/*
+ * Append to a pidlist.
+ */
+static
+void
+pidlist_append(struct pidlist *pl, struct pidinfo *pi)
+{
+	pi->pi_next = NULL;
+	pi->pi_prev = pl->pl_tail;
+	if (pl->pl_tail != NULL) {
+		pl->pl_tail->pi_next = pi;
+	}
+	else {
+		pl->pl_head = pi;
+	}
+	pl->pl_tail = pi;
+}
+
+/*
+ * Remove from a pidlist.
+ */
+static
+void
+pidlist_remove(struct pidlist *pl, struct pidinfo *pi)
+{
+	if (pi->pi_prev != NULL) {
+		pi->pi_prev->pi_next = pi->pi_next;
+	}
+	else {
+		KASSERT(pl->pl_head == pi);
+		pl->pl_head = pi->pi_next;
+	}
+	if (pi->pi_next != NULL) {
+		pi->pi_next->pi_prev = pi->pi_prev;
+	}
+	else {
+		KASSERT(pl->pl_tail == pi);
+		pl->pl_tail = pi->pi_prev;
+	}
+	pi->pi_next = NULL;
+	pi->pi_prev = NULL;
+}
+
+/*
+ * Find a pid on a pidlist.
+ */
+static
+struct pidinfo *
+pidlist_find(struct pidlist *pl, pid_t pid)
+{
+	struct pidinfo *pi;
+
+	for (pi = pl->pl_head; pi != NULL; pi = pi->pi_next) {
+		if (pi->pi_pid == pid) {
+			return pi;
+		}
+	}
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////
+
 /*
  * Create a pidinfo structure for the specified pid.
  */
 static
 struct pidinfo *
-pidinfo_create(pid_t pid, pid_t ppid)
+pidinfo_create(pid_t pid, struct pidinfo *parent)
 {
 	struct pidinfo *pi;
 
@@ -91,16 +191,29 @@ pidinfo_create(pid_t pid, pid_t ppid)
 		return NULL;
 	}
 
+	pi->pi_lock = lock_create("pidinfo lock");
+	if (pi->pi_lock == NULL) {
+		kfree(pi);
+		return NULL;
+	}
+
 	pi->pi_cv = cv_create("pidinfo cv");
 	if (pi->pi_cv == NULL) {
+		lock_destroy(pi->pi_lock);
 		kfree(pi);
 		return NULL;
 	}
 
 	pi->pi_pid = pid;
-	pi->pi_ppid = ppid;
+	pi->pi_ppid = parent != NULL ? parent->pi_pid : INVALID_PID;
 	pi->pi_exited = false;
 	pi->pi_exitstatus = 0xbeef;  /* Recognizably invalid value */
+	pi->pi_parent = parent;
+	pi->pi_next = NULL;
+	pi->pi_prev = NULL;
+	pi->pi_running.pl_head = pi->pi_running.pl_tail = NULL;
+	pi->pi_zombies.pl_head = pi->pi_zombies.pl_tail = NULL;
+	pi->pi_refcount = 1;
 
 	return pi;
 }
@@ -114,41 +227,129 @@ pidinfo_destroy(struct pidinfo *pi)
 {
 	KASSERT(pi->pi_exited == true);
 	KASSERT(pi->pi_ppid == INVALID_PID);
+	KASSERT(pi->pi_refcount == 0);
+	KASSERT(pi->pi_running.pl_head == NULL);
+	KASSERT(pi->pi_zombies.pl_head == NULL);
 	cv_destroy(pi->pi_cv);
+	lock_destroy(pi->pi_lock);
 	kfree(pi);
 }
 
+/*
+ * Drop a reference to a pidinfo, destroying it if it was the last.
+ * The caller must not hold any pi_lock.
+ */
+static
+void
+pidinfo_decref(struct pidinfo *pi)
+{
+	unsigned refcount;
+
+	lock_acquire(pi->pi_lock);
+	KASSERT(pi->pi_refcount > 0);
+	refcount = --pi->pi_refcount;
+	lock_release(pi->pi_lock);
+
+	if (refcount == 0) {
+		pidinfo_destroy(pi);
+	}
+}
+
 ////////////////////////////////////////////////////////////
 
+/*
+ * Grow the pid table, adding the new pids to the free ring. Fails
+ * with EAGAIN when the table can't get any bigger.
+ */
+static
+int
+pidtable_grow(void)
+{
+	struct pidinfo **newtable;
+	pid_t *newfree;
+	unsigned newsize, i;
+
+	KASSERT(lock_do_i_hold(pidtable_lock));
+	KASSERT(pidfree_count == 0);
+
+	newsize = pidtable_size * 2;
+	if (newsize > (unsigned)PID_MAX + 1) {
+		newsize = (unsigned)PID_MAX + 1;
+	}
+	if (newsize <= pidtable_size) {
+		return EAGAIN;
+	}
+
+	newtable = kmalloc(newsize * sizeof(newtable[0]));
+	if (newtable == NULL) {
+		return ENOMEM;
+	}
+	newfree = kmalloc(newsize * sizeof(newfree[0]));
+	if (newfree == NULL) {
+		kfree(newtable);
+		return ENOMEM;
+	}
+
+	for (i=0; i<pidtable_size; i++) {
+		newtable[i] = pidtable[i];
+	}
+	for (; i<newsize; i++) {
+		newtable[i] = NULL;
+		newfree[i - pidtable_size] = i;
+	}
+
+	kfree(pidtable);
+	kfree(pidfree);
+	pidfree_head = 0;
+	pidfree_count = newsize - pidtable_size;
+	pidtable = newtable;
+	pidfree = newfree;
+	pidtable_size = newsize;
+	return 0;
+}
+
 /*
  * pid_bootstrap: initialize.
  */
 void
 pid_bootstrap(void)
 {
-	int i;
+	unsigned i;
 
-	pidlock = lock_create("pidlock");
-	if (pidlock == NULL) {
+	pidtable_lock = lock_create("pidtable");
+	if (pidtable_lock == NULL) {
 		panic("Out of memory creating pid lock\n");
 	}
 
-	/* not really necessary - should start zeroed */
-	for (i=0; i<PROCS_MAX; i++) {
-		pidinfo[i] = NULL;
+	pidtable_size = PIDTABLE_INITSIZE;
+	pidtable = kmalloc(pidtable_size * sizeof(pidtable[0]));
+	pidfree = kmalloc(pidtable_size * sizeof(pidfree[0]));
+	if (pidtable == NULL || pidfree == NULL) {
+		panic("Out of memory creating pid table\n");
 	}
 
-	pidinfo[KERNEL_PID] = pidinfo_create(KERNEL_PID, INVALID_PID);
-	if (pidinfo[KERNEL_PID]==NULL) {
+	pidfree_head = 0;
+	pidfree_count = 0;
+	for (i=0; i<pidtable_size; i++) {
+		pidtable[i] = NULL;
+		if (i >= PID_MIN) {
+			pidfree[pidfree_count++] = i;
+		}
+	}
+
+	pidtable[KERNEL_PID] = pidinfo_create(KERNEL_PID, NULL);
+	if (pidtable[KERNEL_PID]==NULL) {
 		panic("Out of memory creating kernel pid data\n");
 	}
 
-	nextpid = PID_MIN;
 	nprocs = 1;
 }
 
 /*
  * pi_get: look up a pidinfo in the process table.
+ *
+ * The result is only safe to use if something else keeps it from
+ * being freed, e.g. it's the caller's own.
  */
 static
 struct pidinfo *
@@ -158,122 +359,127 @@ pi_get(pid_t pid)
 
 	KASSERT(pid>=0);
 	KASSERT(pid != INVALID_PID);
-	KASSERT(lock_do_i_hold(pidlock));
 
-	pi = pidinfo[pid % PROCS_MAX];
-	if (pi==NULL) {
-		return NULL;
+	lock_acquire(pidtable_lock);
+	if ((unsigned)pid >= pidtable_size) {
+		pi = NULL;
 	}
-	if (pi->pi_pid != pid) {
-		return NULL;
+	else {
+		pi = pidtable[pid];
 	}
+	lock_release(pidtable_lock);
+
+	KASSERT(pi == NULL || pi->pi_pid == pid);
 	return pi;
 }
 
 /*
- * pi_put: insert a new pidinfo in the process table. The right slot
- * must be empty.
+ * pi_drop: release the pid of a process that has exited and been
+ * waited for (or been disowned), and drop the references the
+ * pidinfo holds on itself and on its parent. The caller must have
+ * already taken it off its parent's lists and must not hold any
+ * pi_lock.
  */
 static
 void
-pi_put(pid_t pid, struct pidinfo *pi)
+pi_drop(struct pidinfo *pi)
 {
-	KASSERT(lock_do_i_hold(pidlock));
+	struct pidinfo *parent = pi->pi_parent;
+	pid_t pid = pi->pi_pid;
 
-	KASSERT(pid != INVALID_PID);
+	KASSERT(pi->pi_exited == true);
+	KASSERT(pi->pi_ppid == INVALID_PID);
 
-	KASSERT(pidinfo[pid % PROCS_MAX] == NULL);
-	pidinfo[pid % PROCS_MAX] = pi;
-	nprocs++;
-}
+	lock_acquire(pidtable_lock);
 
-/*
- * pi_drop: remove a pidinfo structure from the process table and free
- * it. It should reflect a process that has already exited and been
- * waited for.
- */
-static
-void
-pi_drop(pid_t pid)
-{
-	struct pidinfo *pi;
+	KASSERT((unsigned)pid < pidtable_size);
+	KASSERT(pidtable[pid] == pi);
+	pidtable[pid] = NULL;
 
-	KASSERT(lock_do_i_hold(pidlock));
+	KASSERT(pidfree_count < pidtable_size);
+	pidfree[(pidfree_head + pidfree_count) % pidtable_size] = pid;
+	pidfree_count++;
+	nprocs--;
 
-	pi = pidinfo[pid % PROCS_MAX];
-	KASSERT(pi != NULL);
-	KASSERT(pi->pi_pid == pid);
+	lock_release(pidtable_lock);
 
-	pidinfo_destroy(pi);
-	pidinfo[pid % PROCS_MAX] = NULL;
-	nprocs--;
+	pidinfo_decref(pi);
+	if (parent != NULL) {
+		pidinfo_decref(parent);
+	}
 }
 
-////////////////////////////////////////////////////////////
-
 /*
- * Helper function for pid_alloc.
+ * Drop a chain of pidinfos linked through pi_next, as collected by
+ * the callers below while they held a pi_lock.
  */
 static
 void
-inc_nextpid(void)
+pi_dropchain(struct pidinfo *chain)
 {
-	KASSERT(lock_do_i_hold(pidlock));
+	struct pidinfo *pi;
 
-	nextpid++;
-	if (nextpid > PID_MAX) {
-		nextpid = PID_MIN;
+	while ((pi = chain) != NULL) {
+		chain = pi->pi_next;
+		pi->pi_next = NULL;
+		pi_drop(pi);
 	}
 }
 
+////////////////////////////////////////////////////////////
+
 /*
  * pid_alloc: allocate a process id.
  */
 int
 pid_alloc(pid_t *retval)
 {
-	struct pidinfo *pi;
+	struct pidinfo *parent, *pi;
 	pid_t pid;
-	int count;
+	int result;
 
 	KASSERT(curproc->p_pid != INVALID_PID);
 
+	parent = pi_get(curproc->p_pid);
+	KASSERT(parent != NULL);
+
 	/* lock the table */
-	lock_acquire(pidlock);
+	lock_acquire(pidtable_lock);
 
-	if (nprocs == PROCS_MAX) {
-		lock_release(pidlock);
+	if (nprocs >= PROCS_MAX) {
+		lock_release(pidtable_lock);
 		return EAGAIN;
 	}
 
-	/*
-	 * The above test guarantees that this loop terminates, unless
-	 * our nprocs count is off. Even so, assert we aren't looping
-	 * forever.
-	 */
-	count = 0;
-	while (pidinfo[nextpid % PROCS_MAX] != NULL) {
-
-		/* avoid various boundary cases by allowing extra loops */
-		KASSERT(count < PROCS_MAX*2+5);
-		count++;
-
-		inc_nextpid();
+	if (pidfree_count == 0) {
+		result = pidtable_grow();
+		if (result) {
+			lock_release(pidtable_lock);
+			return result;
+		}
 	}
 
-	pid = nextpid;
+	pid = pidfree[pidfree_head];
+	KASSERT(pidtable[pid] == NULL);
 
-	pi = pidinfo_create(pid, curproc->p_pid);
+	pi = pidinfo_create(pid, parent);
 	if (pi==NULL) {
-		lock_release(pidlock);
+		lock_release(pidtable_lock);
 		return ENOMEM;
 	}
 
-	pi_put(pid, pi);
+	pidfree_head = (pidfree_head + 1) % pidtable_size;
+	pidfree_count--;
+	pidtable[pid] = pi;
+	nprocs++;
 
-	inc_nextpid();
+	lock_release(pidtable_lock);
 
-	lock_release(pidlock);
+	/* Hook it onto our child list. */
+	lock_acquire(parent->pi_lock);
+	parent->pi_refcount++;
+	pidlist_append(&parent->pi_running, pi);
+	lock_release(parent->pi_lock);
 
 	*retval = pid;
 	return 0;
@@ -286,25 +492,27 @@ pid_alloc(pid_t *retval)
 void
 pid_unalloc(pid_t theirpid)
 {
-	struct pidinfo *them;
+	struct pidinfo *us, *them;
 
 	KASSERT(theirpid >= PID_MIN && theirpid <= PID_MAX);
 
-	lock_acquire(pidlock);
+	us = pi_get(curproc->p_pid);
+	KASSERT(us != NULL);
 
-	them = pi_get(theirpid);
+	lock_acquire(us->pi_lock);
+	them = pidlist_find(&us->pi_running, theirpid);
 	KASSERT(them != NULL);
 	KASSERT(them->pi_exited == false);
 	KASSERT(them->pi_ppid == curproc->p_pid);
+	pidlist_remove(&us->pi_running, them);
 
 	/* keep pidinfo_destroy from complaining */
 	them->pi_exitstatus = 0xdead;
 	them->pi_exited = true;
 	them->pi_ppid = INVALID_PID;
+	lock_release(us->pi_lock);
 
-	pi_drop(theirpid);
-
-	lock_release(pidlock);
+	pi_drop(them);
 }
 
 /*
@@ -314,71 +522,115 @@ pid_unalloc(pid_t theirpid)
 void
 pid_disown(pid_t theirpid)
 {
-	struct pidinfo *them;
+	struct pidinfo *us, *them;
 
 	KASSERT(theirpid >= PID_MIN && theirpid <= PID_MAX);
 
-	lock_acquire(pidlock);
+	us = pi_get(curproc->p_pid);
+	KASSERT(us != NULL);
 
-	them = pi_get(theirpid);
-	KASSERT(them != NULL);
-	KASSERT(them->pi_ppid==curproc->p_pid);
+	lock_acquire(us->pi_lock);
+	them = pidlist_find(&us->pi_running, theirpid);
+	if (them != NULL) {
+		/* It will clean up after itself when it exits. */
+		pidlist_remove(&us->pi_running, them);
+		them->pi_ppid = INVALID_PID;
+		lock_release(us->pi_lock);
+		return;
+	}
 
+	them = pidlist_find(&us->pi_zombies, theirpid);
+	KASSERT(them != NULL);
+	pidlist_remove(&us->pi_zombies, them);
 	them->pi_ppid = INVALID_PID;
-	if (them->pi_exited) {
-		pi_drop(them->pi_pid);
-	}
+	lock_release(us->pi_lock);
 
-	lock_release(pidlock);
+	pi_drop(them);
 }
 
 /*
- * pid_setexitstatus: Sets the exit status of this process. Must only
- * be called if the thread actually had a pid assigned. Wakes up any
- * waiters and disposes of the piddata if nobody else is still using it.
+ * pid_setexitstatus: Sets the exit status and final resource usage
+ * of this process. Must only be called if the thread actually had a
+ * pid assigned. Wakes up any waiters and disposes of the piddata if
+ * nobody else is still using it.
  *
  * As far as the process is concerned, this releases its pid for
  * subsequent reuse; thus we set curproc->p_pid to INVALID_PID.
  */
 void
-pid_setexitstatus(int status)
+pid_setexitstatus(int status, const struct usage *usage)
 {
-	struct pidinfo *us;
-	int i;
+	struct pidinfo *us, *parent, *kid, *zombies;
+	bool nowaiter;
 
-	lock_acquire(pidlock);
 	KASSERT(curproc->p_pid != INVALID_PID);
 
-	/* First, disown all children */
-	for (i=0; i<PROCS_MAX; i++) {
-		if (pidinfo[i]==NULL) {
-			continue;
-		}
-		if (pidinfo[i]->pi_ppid == curproc->p_pid) {
-			pidinfo[i]->pi_ppid = INVALID_PID;
-			if (pidinfo[i]->pi_exited) {
-				pi_drop(pidinfo[i]->pi_pid);
-			}
-		}
-	}
-
-	/* Now, wake up our parent */
 	us = pi_get(curproc->p_pid);
 	KASSERT(us != NULL);
+	parent = us->pi_parent;
+	KASSERT(parent != NULL);
 
+	/*
+	 * First, disown all children. Running ones clean up after
+	 * themselves when they exit; exited ones are collected and
+	 * freed once we've let go of our lock.
+	 */
+	lock_acquire(us->pi_lock);
+	while ((kid = us->pi_running.pl_head) != NULL) {
+		pidlist_remove(&us->pi_running, kid);
+		kid->pi_ppid = INVALID_PID;
+	}
+	zombies = us->pi_zombies.pl_head;
+	for (kid = zombies; kid != NULL; kid = kid->pi_next) {
+		kid->pi_ppid = INVALID_PID;
+	}
+	us->pi_zombies.pl_head = us->pi_zombies.pl_tail = NULL;
+	lock_release(us->pi_lock);
+
+	pi_dropchain(zombies);
+
+	/* Now, queue ourselves for our parent and wake it up */
+	lock_acquire(parent->pi_lock);
 	us->pi_exitstatus = status;
+	us->pi_usage = *usage;
 	us->pi_exited = true;
+	nowaiter = (us->pi_ppid == INVALID_PID);
+	if (!nowaiter) {
+		pidlist_remove(&parent->pi_running, us);
+		pidlist_append(&parent->pi_zombies, us);
+		cv_broadcast(parent->pi_cv, parent->pi_lock);
+	}
+	lock_release(parent->pi_lock);
 
-	if (us->pi_ppid == INVALID_PID) {
+	if (nowaiter) {
 		/* no parent */
-		pi_drop(curproc->p_pid);
-	}
-	else {
-		cv_broadcast(us->pi_cv, pidlock);
+		pi_drop(us);
 	}
 
 	curproc->p_pid = INVALID_PID;
-	lock_release(pidlock);
+}
+
+/*
+ * Take an exited child off our zombie list and collect its status,
+ * adding its resource usage to USAGE. Returns the pidinfo; the
+ * caller drops it after unlocking.
+ */
+static
+struct pidinfo *
+pid_collect(struct pidinfo *us, struct pidinfo *them, int *status,
+	    struct usage *usage)
+{
+	KASSERT(lock_do_i_hold(us->pi_lock));
+	KASSERT(them->pi_exited == true);
+	KASSERT(them->pi_ppid == us->pi_pid);
+
+	if (status != NULL) {
+		*status = them->pi_exitstatus;
+	}
+	usage_add(usage, &them->pi_usage);
+	pidlist_remove(&us->pi_zombies, them);
+	them->pi_ppid = INVALID_PID;
+	return them;
 }
 
 /*
@@ -386,13 +638,19 @@ pid_setexitstatus(int status)
  * status and ret are a kernel pointers, but pid/flags may come from
  * userland and may thus be maliciously invalid.
  *
+ * theirpid may be WAIT_ANY to wait for whichever child exits first;
+ * children are reported in the order they exited.
+ *
  * status may be null, in which case the status is thrown away. ret
  * may only be null if WNOHANG is not set.
+ *
+ * The child's resource usage is added to the current process's.
  */
 int
 pid_wait(pid_t theirpid, int *status, int flags, pid_t *ret)
 {
-	struct pidinfo *them;
+	struct pidinfo *us, *them;
+	struct usage usage;
 
 	KASSERT(curproc->p_pid != INVALID_PID);
 
@@ -402,11 +660,11 @@ pid_wait(pid_t theirpid, int *status, int flags, pid_t *ret)
 	}
 
 	/*
-	 * We don't support the Unix meanings of negative pids or 0
-	 * (0 is INVALID_PID) and other code may break on them, so
-	 * check now.
+	 * We don't support process groups, so other negative pids or
+	 * 0 (which is also INVALID_PID) aren't supported and other
+	 * code may break on them, so check now.
 	 */
-	if (theirpid == INVALID_PID || theirpid<0) {
+	if (theirpid != WAIT_ANY && (theirpid == INVALID_PID || theirpid<0)) {
 		return ENOSYS;
 	}
 
@@ -415,51 +673,166 @@ pid_wait(pid_t theirpid, int *status, int flags, pid_t *ret)
 		return EINVAL;
 	}
 
-	lock_acquire(pidlock);
+	us = pi_get(curproc->p_pid);
+	KASSERT(us != NULL);
+
+	/*
+	 * Only allow waiting for own children, so look in our own
+	 * lists. Only if it's not there do we need to know if it
+	 * exists at all.
+	 */
+	lock_acquire(us->pi_lock);
+	while (1) {
+		if (theirpid == WAIT_ANY) {
+			them = us->pi_zombies.pl_head;
+			if (them == NULL && us->pi_running.pl_head == NULL) {
+				lock_release(us->pi_lock);
+				return ECHILD;
+			}
+		}
+		else {
+			them = pidlist_find(&us->pi_zombies, theirpid);
+			if (them == NULL &&
+			    pidlist_find(&us->pi_running, theirpid) == NULL) {
+				lock_release(us->pi_lock);
+				return pi_get(theirpid) == NULL ? ESRCH : EPERM;
+			}
+		}
+		if (them != NULL) {
+			break;
+		}
+
+		if (flags == WNOHANG) {
+			lock_release(us->pi_lock);
+			KASSERT(ret != NULL);
+			*ret = 0;
+			return 0;
+		}
+		if (curproc->p_exiting) {
+			/* see pid_interrupt */
+			lock_release(us->pi_lock);
+			return EINTR;
+		}
+		cv_wait(us->pi_cv, us->pi_lock);
+	}
+
+	bzero(&usage, sizeof(usage));
+	pid_collect(us, them, status, &usage);
+	lock_release(us->pi_lock);
+
+	proc_addchildusage(curproc, &usage);
 
-	them = pi_get(theirpid);
-	if (them==NULL) {
-		lock_release(pidlock);
-		return ESRCH;
+	if (ret != NULL) {
+		*ret = them->pi_pid;
 	}
+	pi_drop(them);
+	return 0;
+}
 
-	KASSERT(them->pi_pid==theirpid);
+/*
+ * Wake up any threads of the current process waiting for its
+ * children, so they notice that it's exiting and fail with EINTR.
+ * p_exiting must already be set.
+ */
+void
+pid_interrupt(void)
+{
+	struct pidinfo *us;
+
+	KASSERT(curproc->p_exiting);
+
+	us = pi_get(curproc->p_pid);
+	KASSERT(us != NULL);
+
+	lock_acquire(us->pi_lock);
+	cv_broadcast(us->pi_cv, us->pi_lock);
+	lock_release(us->pi_lock);
+}
 
-	/* Only allow waiting for own children. */
-	if (them->pi_ppid != curproc->p_pid) {
-		lock_release(pidlock);
-		return EPERM;
+/*
+ * Collects the exit status of up to MAX exited children at once,
+ * in the order they exited, storing pids and statuses in the
+ * (kernel) arrays PIDS and STATUSES. Unless WNOHANG is given, waits
+ * until there's at least one. Returns ECHILD if there are no
+ * children at all.
+ *
+ * If UPIDS is not NULL the results are also copied out to UPIDS and
+ * (if not NULL) USTATUSES before any child is collected; if that
+ * fails, nothing is reaped and the error is returned, so no exit
+ * status is ever lost. We hold our own pi_lock across the copyout;
+ * nothing on the fault path takes a pid lock.
+ */
+int
+pid_reap(pid_t *pids, int *statuses, unsigned max, int flags,
+	 userptr_t upids, userptr_t ustatuses, unsigned *ret)
+{
+	struct pidinfo *us, *them, *reaped;
+	struct usage usage;
+	unsigned n, i;
+	int result;
+
+	KASSERT(curproc->p_pid != INVALID_PID);
+
+	if (flags != 0 && flags != WNOHANG) {
+		return EINVAL;
 	}
 
-	if (them->pi_exited == false) {
-		if (flags == WNOHANG) {
-			lock_release(pidlock);
-			KASSERT(ret != NULL);
+	us = pi_get(curproc->p_pid);
+	KASSERT(us != NULL);
+
+	lock_acquire(us->pi_lock);
+	while (us->pi_zombies.pl_head == NULL) {
+		if (us->pi_running.pl_head == NULL) {
+			lock_release(us->pi_lock);
+			return ECHILD;
+		}
+		if (flags == WNOHANG || max == 0) {
+			lock_release(us->pi_lock);
 			*ret = 0;
 			return 0;
 		}
-		/* don't need to loop on this */
-		cv_wait(them->pi_cv, pidlock);
-		KASSERT(them->pi_exited == true);
+		if (curproc->p_exiting) {
+			/* see pid_interrupt */
+			lock_release(us->pi_lock);
+			return EINTR;
+		}
+		cv_wait(us->pi_cv, us->pi_lock);
 	}
 
-	if (status != NULL) {
-		*status = them->pi_exitstatus;
+	n = 0;
+	for (them = us->pi_zombies.pl_head; them != NULL && n < max;
+	     them = them->pi_next) {
+		pids[n] = them->pi_pid;
+		statuses[n] = them->pi_exitstatus;
+		n++;
 	}
-	if (ret != NULL) {
-		/*
-		 * In Unix you can wait for any of several possible
-		 * processes by passing particular magic values of
-		 * pid. wait then returns the pid you actually
-		 * found. We don't support this, so always return the
-		 * pid we looked for.
-		 */
-		*ret = theirpid;
+
+	if (upids != NULL) {
+		result = copyout(pids, upids, n * sizeof(pid_t));
+		if (result == 0 && ustatuses != NULL) {
+			result = copyout(statuses, ustatuses,
+					 n * sizeof(int));
+		}
+		if (result) {
+			lock_release(us->pi_lock);
+			return result;
+		}
 	}
 
-	them->pi_ppid = 0;
-	pi_drop(them->pi_pid);
+	reaped = NULL;
+	bzero(&usage, sizeof(usage));
+	for (i = 0; i < n; i++) {
+		them = pid_collect(us, us->pi_zombies.pl_head, NULL, &usage);
+		KASSERT(them->pi_pid == pids[i]);
+		them->pi_next = reaped;
+		reaped = them;
+	}
+	lock_release(us->pi_lock);
+
+	proc_addchildusage(curproc, &usage);
+
+	pi_dropchain(reaped);
 
-	lock_release(pidlock);
+	*ret = n;
 	return 0;
 }
@@ -85,6 +85,19 @@ proc_create(const char *name)
 	}
 	threadarray_init(&proc->p_threads);
 
+	proc->p_threadscv = cv_create("p_threads");
+	if (proc->p_threadscv == NULL) {
+		lock_destroy(proc->p_threadslock);
+		kfree(proc->p_name);
+		kfree(proc);
+		return NULL;
+	}
+	proc->p_exiting = false;
+	proc->p_uthreads = NULL;
+	proc->p_nexttid = 2;	/* the main thread is 1 */
+	bzero(&proc->p_usage, sizeof(proc->p_usage));
+	bzero(&proc->p_childusage, sizeof(proc->p_childusage));
+
 	spinlock_init(&proc->p_lock);
 	proc->p_pid = INVALID_PID;
 
@@ -182,9 +195,18 @@ proc_destroy(struct proc *proc)
 		as_destroy(as);
 	}
 
+	/* Thread records nobody joined */
+	while (proc->p_uthreads != NULL) {
+		struct uthread *ut = proc->p_uthreads;
+
+		proc->p_uthreads = ut->ut_next;
+		kfree(ut);
+	}
+
 	KASSERT(proc->p_pid == INVALID_PID);
 	spinlock_cleanup(&proc->p_lock);
 	threadarray_cleanup(&proc->p_threads);
+	cv_destroy(proc->p_threadscv);
 	lock_destroy(proc->p_threadslock);
 
 	kfree(proc->p_name);
@@ -259,11 +281,12 @@ proc_create_runprogram(const char *name, struct proc **ret)
  * is not null. (If RET is null, what we're creating is a kernel-only
  * thread and it doesn't need an address space or file handles.)
  * However, the new thread always inherits its current working
- * directory from the caller. The new thread is given no address space
- * (the caller decides that).
+ * directory from the caller. The new thread gets a copy of the
+ * caller's address space only if COPYAS is set.
  */
+static
 int
-proc_fork(struct proc **ret)
+proc_clone(bool copyas, struct proc **ret)
 {
 	struct proc *newproc;
 	struct addrspace *as;
@@ -292,7 +315,7 @@ proc_fork(struct proc **ret)
 #endif
 
 	/* VM fields */
-	as = proc_getas();
+	as = copyas ? proc_getas() : NULL;
 	if (as != NULL) {
 		result = as_copy(as, &newproc->p_addrspace);
 		if (result) {
@@ -308,8 +331,10 @@ proc_fork(struct proc **ret)
 	if (tbl != NULL) {
 		result = filetable_copy(tbl, &newproc->p_filetable);
 		if (result) {
-			as_destroy(newproc->p_addrspace);
-			newproc->p_addrspace = NULL;
+			if (newproc->p_addrspace != NULL) {
+				as_destroy(newproc->p_addrspace);
+				newproc->p_addrspace = NULL;
+			}
 			pid_unalloc(newproc->p_pid);
 			newproc->p_pid = INVALID_PID;
 			proc_destroy(newproc);
@@ -334,7 +359,27 @@ proc_fork(struct proc **ret)
 }
 
 /*
- * Undo proc_fork if nothing's run in the new process yet.
+ * Create a process for fork(), with a copy of our address space.
+ */
+int
+proc_fork(struct proc **ret)
+{
+	return proc_clone(true, ret);
+}
+
+/*
+ * Create a process for spawn(). It's going to load a new executable
+ * right away, so there's no point copying our address space only to
+ * throw the copy away again.
+ */
+int
+proc_spawn(struct proc **ret)
+{
+	return proc_clone(false, ret);
+}
+
+/*
+ * Undo proc_fork or proc_spawn if nothing's run in the new process yet.
  */
 void
 proc_unfork(struct proc *newproc)
@@ -351,12 +396,56 @@ void
 proc_exit(int status)
 {
 	struct proc *proc = curproc;
+	struct usage usage;
+	struct thread *t;
+	unsigned num, i;
 
 	/* The kernel isn't supposed to exit. */
 	KASSERT(proc != kproc);
 
+	/*
+	 * Get rid of any other threads first. If another thread is
+	 * already doing this, just go away and let it.
+	 */
+	lock_acquire(proc->p_threadslock);
+	if (proc->p_exiting) {
+		lock_release(proc->p_threadslock);
+		proc_exitthread(status);
+	}
+	proc->p_exiting = true;
+	/* wake up any joins so they can bail out */
+	cv_broadcast(proc->p_threadscv, proc->p_threadslock);
+
+	/*
+	 * Other threads asleep in the kernel might never come back
+	 * by themselves (e.g. reading the console), so interrupt
+	 * them; they can't leave while we hold p_threadslock.
+	 * Waiting for children isn't an interruptible sleep, so kick
+	 * that separately.
+	 */
+	num = threadarray_num(&proc->p_threads);
+	for (i=0; i<num; i++) {
+		t = threadarray_get(&proc->p_threads, i);
+		if (t != curthread) {
+			thread_interrupt(t);
+		}
+	}
+	lock_release(proc->p_threadslock);
+	pid_interrupt();
+	lock_acquire(proc->p_threadslock);
+
+	while (threadarray_num(&proc->p_threads) > 1) {
+		cv_wait(proc->p_threadscv, proc->p_threadslock);
+	}
+
+	/* Total up our usage for the parent. */
+	usage = proc->p_usage;
+	usage_add(&usage, &curthread->t_usage);
+	usage_add(&usage, &proc->p_childusage);
+	lock_release(proc->p_threadslock);
+
 	/* Set exit status and wake up anyone waiting for us. */
-	pid_setexitstatus(status);
+	pid_setexitstatus(status, &usage);
 
 	/* Detach from the process and attach to the kernel process. */
 	KASSERT(curthread->t_proc == proc);
@@ -372,6 +461,81 @@ proc_exit(int status)
 	thread_exit();
 }
 
+/*
+ * Take a thread out of its process's thread array, keeping its
+ * resource usage; p_threadslock must be held.
+ */
+static
+void
+proc_unlinkthread(struct proc *proc, struct thread *t)
+{
+	unsigned num, i;
+
+	KASSERT(lock_do_i_hold(proc->p_threadslock));
+
+	/* ugh: find the thread in the array */
+	num = threadarray_num(&proc->p_threads);
+	for (i=0; i<num; i++) {
+		if (threadarray_get(&proc->p_threads, i) == t) {
+			threadarray_remove(&proc->p_threads, i);
+			usage_add(&proc->p_usage, &t->t_usage);
+			bzero(&t->t_usage, sizeof(t->t_usage));
+			return;
+		}
+	}
+	/* Did not find it. */
+	panic("Thread (%p) has escaped from its process (%p)\n", t, proc);
+}
+
+/*
+ * Make the current thread leave its process, either because it
+ * called thread_exit or because another thread is exiting the
+ * process. The last thread out takes the process with it.
+ */
+void
+proc_exitthread(int status)
+{
+	struct proc *proc = curproc;
+	struct uthread *ut;
+	int spl;
+
+	KASSERT(proc != kproc);
+
+	lock_acquire(proc->p_threadslock);
+	if (!proc->p_exiting && threadarray_num(&proc->p_threads) == 1) {
+		/* Last one; proc_exit doesn't return. */
+		lock_release(proc->p_threadslock);
+		proc_exit(status);
+		panic("proc_exit returned\n");
+	}
+
+	/* If we're joinable, mark that we're done. */
+	for (ut = proc->p_uthreads; ut != NULL; ut = ut->ut_next) {
+		if (ut->ut_thread == curthread) {
+			ut->ut_thread = NULL;
+			ut->ut_exited = true;
+			break;
+		}
+	}
+
+	/*
+	 * Leave, and let proc_exit or thread_join know. Once we
+	 * let go of the lock the process may be destroyed, so detach
+	 * from it first.
+	 */
+	proc_unlinkthread(proc, curthread);
+	cv_broadcast(proc->p_threadscv, proc->p_threadslock);
+
+	spl = splhigh();
+	curthread->t_proc = NULL;
+	splx(spl);
+
+	lock_release(proc->p_threadslock);
+
+	proc_addthread(kproc, curthread);
+	thread_exit();
+}
+
 /*
  * Add a thread to a process. Either the thread or the process might
  * or might not be current.
@@ -416,32 +580,63 @@ void
 proc_remthread(struct thread *t)
 {
 	struct proc *proc;
-	unsigned num, i;
 	int spl;
 
 	proc = t->t_proc;
 	KASSERT(proc != NULL);
 
 	lock_acquire(proc->p_threadslock);
-	/* ugh: find the thread in the array */
-	num = threadarray_num(&proc->p_threads);
-	for (i=0; i<num; i++) {
-		if (threadarray_get(&proc->p_threads, i) == t) {
-			threadarray_remove(&proc->p_threads, i);
-			lock_release(proc->p_threadslock);
-			goto finish;
-		}
-	}
-	/* Did not find it. */
+	proc_unlinkthread(proc, t);
 	lock_release(proc->p_threadslock);
-	panic("Thread (%p) has escaped from its process (%p)\n", t, proc);
 
-finish:
 	spl = splhigh();
 	t->t_proc = NULL;
 	splx(spl);
 }
 
+/*
+ * Get the resource usage of a process's threads. The counters of
+ * threads still running are read without stopping them, so the
+ * result is only approximate.
+ */
+void
+proc_getusage(struct proc *proc, struct usage *ret)
+{
+	struct thread *t;
+	unsigned num, i;
+
+	lock_acquire(proc->p_threadslock);
+	*ret = proc->p_usage;
+	num = threadarray_num(&proc->p_threads);
+	for (i=0; i<num; i++) {
+		t = threadarray_get(&proc->p_threads, i);
+		usage_add(ret, &t->t_usage);
+	}
+	lock_release(proc->p_threadslock);
+}
+
+/*
+ * Get the total resource usage of children that have been waited for.
+ */
+void
+proc_getchildusage(struct proc *proc, struct usage *ret)
+{
+	lock_acquire(proc->p_threadslock);
+	*ret = proc->p_childusage;
+	lock_release(proc->p_threadslock);
+}
+
+/*
+ * Add the usage of a child that's been waited for.
+ */
+void
+proc_addchildusage(struct proc *proc, const struct usage *usage)
+{
+	lock_acquire(proc->p_threadslock);
+	usage_add(&proc->p_childusage, usage);
+	lock_release(proc->p_threadslock);
+}
+
 /*
  * Fetch the address space of (the current) process.
  *
@@ -115,7 +115,7 @@ sys_readwrite(int fd, userptr_t buf, size_t size, enum uio_rw rw,
 	      int badaccmode, ssize_t *retval)
 {
 	struct openfile *file;
-	bool locked;
+	bool seekable, locked;
 	off_t pos;
 	struct iovec iov;
 	struct uio useruio;
@@ -127,15 +127,20 @@ sys_readwrite(int fd, userptr_t buf, size_t size, enum uio_rw rw,
 		return result;
 	}
 
-	/* Only lock the seek position if we're really using it. */
-	locked = VOP_ISSEEKABLE(file->of_vnode);
+	/*
+	 * Only lock the seek position if we're really using it, and
+	 * if nobody else can. If the file's only reference is the one
+	 * in our file table and that table isn't shared between
+	 * threads, no other thread can reach the offset. (If the table
+	 * is shared, filetable_get took its own reference, so the count
+	 * is at least 2 and we lock.)
+	 */
+	seekable = VOP_ISSEEKABLE(file->of_vnode);
+	locked = seekable && !openfile_isprivate(file);
 	if (locked) {
 		lock_acquire(file->of_offsetlock);
-		pos = file->of_offset;
-	}
-	else {
-		pos = 0;
 	}
+	pos = seekable ? file->of_offset : 0;
 
 	if (file->of_accmode == badaccmode) {
 		result = EBADF;
@@ -153,9 +158,11 @@ sys_readwrite(int fd, userptr_t buf, size_t size, enum uio_rw rw,
 		goto fail;
 	}
 
-	if (locked) {
+	if (seekable) {
 		/* set the offset to the updated offset in the uio */
 		file->of_offset = useruio.uio_offset;
+	}
+	if (locked) {
 		lock_release(file->of_offsetlock);
 	}
 
@@ -167,6 +174,13 @@ sys_readwrite(int fd, userptr_t buf, size_t size, enum uio_rw rw,
 	 */
 	*retval = size - useruio.uio_resid;
 
+	if (rw == UIO_READ) {
+		curthread->t_usage.u_inbytes += *retval;
+	}
+	else {
+		curthread->t_usage.u_outbytes += *retval;
+	}
+
 	return 0;
 
 fail:
@@ -211,8 +225,12 @@ sys_close(int fd)
 		return EBADF;
 	}
 
-	/* place null in the filetable and get the file previously there */
-	filetable_placeat(ft, NULL, fd, &file);
+	/*
+	 * place null in the filetable and get the file previously
+	 * there (placing null never has to grow the table, so this
+	 * doesn't fail)
+	 */
+	(void)filetable_placeat(ft, NULL, fd, &file);
 
 	if (file == NULL) {
 		/* oops, it wasn't open, that's an error */
@@ -321,7 +339,11 @@ sys_dup2(int oldfd, int newfd, int *retval)
 	filetable_put(ft, oldfd, oldfdfile);
 
 	/* place it */
-	filetable_placeat(ft, oldfdfile, newfd, &newfdfile);
+	result = filetable_placeat(ft, oldfdfile, newfd, &newfdfile);
+	if (result) {
+		openfile_decref(oldfdfile);
+		return result;
+	}
 
 	/* if there was a file already there, drop that reference */
 	if (newfdfile != NULL) {
@@ -34,9 +34,142 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <openfile.h>
 #include <filetable.h>
 
+/* Slots in a new table; must be a multiple of 32 (one bitmap word). */
+#define FILETABLE_INITSIZE 32
+
+#if OPEN_MAX % 32 != 0
+#error "OPEN_MAX must be a multiple of 32"
+#endif
+
+#define FT_WORD(fd)	((fd) / 32)
+#define FT_BIT(fd)	((uint32_t)1 << ((fd) % 32))
+
+/*
+ * Find the lowest clear bit in a word that isn't all ones.
+ */
+static
+unsigned
+ft_firstzero(uint32_t word)
+{
+	unsigned bit = 0;
+
+	word = ~word;
+	KASSERT(word != 0);
+	if ((word & 0xffff) == 0) {
+		word >>= 16;
+		bit += 16;
+	}
+	if ((word & 0xff) == 0) {
+		word >>= 8;
+		bit += 8;
+	}
+	if ((word & 0xf) == 0) {
+		word >>= 4;
+		bit += 4;
+	}
+	if ((word & 0x3) == 0) {
+		word >>= 2;
+		bit += 2;
+	}
+	if ((word & 0x1) == 0) {
+		bit += 1;
+	}
+	return bit;
+}
+
+/*
+ * Resize the slot and bitmap arrays to NEWSIZE slots, which must be
+ * at least ft_hiwater. Slots past the old size start empty.
+ */
+static
+int
+ft_resize(struct filetable *ft, unsigned newsize)
+{
+	struct openfile **newfiles;
+	uint32_t *newused;
+
+	KASSERT(newsize % 32 == 0);
+	KASSERT(newsize >= ft->ft_hiwater);
+
+	newfiles = kmalloc(newsize * sizeof(*newfiles));
+	if (newfiles == NULL) {
+		return ENOMEM;
+	}
+	newused = kmalloc(newsize / 32 * sizeof(*newused));
+	if (newused == NULL) {
+		kfree(newfiles);
+		return ENOMEM;
+	}
+	bzero(newfiles, newsize * sizeof(*newfiles));
+	bzero(newused, newsize / 32 * sizeof(*newused));
+
+	if (ft->ft_openfiles != NULL) {
+		memcpy(newfiles, ft->ft_openfiles,
+		       ft->ft_hiwater * sizeof(*newfiles));
+		memcpy(newused, ft->ft_used,
+		       (ft->ft_hiwater + 31) / 32 * sizeof(*newused));
+		kfree(ft->ft_openfiles);
+		kfree(ft->ft_used);
+	}
+	ft->ft_openfiles = newfiles;
+	ft->ft_used = newused;
+	ft->ft_size = newsize;
+	return 0;
+}
+
+/*
+ * Make sure slot FD exists, growing the table if needed.
+ */
+static
+int
+ft_reserve(struct filetable *ft, unsigned fd)
+{
+	unsigned newsize;
+
+	KASSERT(fd < OPEN_MAX);
+
+	if (fd < ft->ft_size) {
+		return 0;
+	}
+	newsize = ft->ft_size;
+	while (newsize <= fd) {
+		newsize *= 2;
+	}
+	if (newsize > OPEN_MAX) {
+		newsize = OPEN_MAX;
+	}
+	return ft_resize(ft, newsize);
+}
+
+/*
+ * Set slot FD, which must exist, and keep the bitmap and high-water
+ * mark up to date.
+ */
+static
+void
+ft_set(struct filetable *ft, unsigned fd, struct openfile *file)
+{
+	KASSERT(fd < ft->ft_size);
+
+	ft->ft_openfiles[fd] = file;
+	if (file != NULL) {
+		ft->ft_used[FT_WORD(fd)] |= FT_BIT(fd);
+		if (fd >= ft->ft_hiwater) {
+			ft->ft_hiwater = fd + 1;
+		}
+	}
+	else {
+		ft->ft_used[FT_WORD(fd)] &= ~FT_BIT(fd);
+		while (ft->ft_hiwater > 0 &&
+		       ft->ft_openfiles[ft->ft_hiwater - 1] == NULL) {
+			ft->ft_hiwater--;
+		}
+	}
+}
 
 /*
  * Construct a filetable.
@@ -45,16 +178,28 @@ struct filetable *
 filetable_create(void)
 {
 	struct filetable *ft;
-	int fd;
 
 	ft = kmalloc(sizeof(struct filetable));
 	if (ft == NULL) {
 		return NULL;
 	}
 
+	ft->ft_lock = lock_create("filetable");
+	if (ft->ft_lock == NULL) {
+		kfree(ft);
+		return NULL;
+	}
+
 	/* the table starts empty */
-	for (fd = 0; fd < OPEN_MAX; fd++) {
-		ft->ft_openfiles[fd] = NULL;
+	ft->ft_openfiles = NULL;
+	ft->ft_used = NULL;
+	ft->ft_size = 0;
+	ft->ft_hiwater = 0;
+	ft->ft_shared = false;
+	if (ft_resize(ft, FILETABLE_INITSIZE)) {
+		lock_destroy(ft->ft_lock);
+		kfree(ft);
+		return NULL;
 	}
 
 	return ft;
@@ -66,17 +211,19 @@ filetable_create(void)
 void
 filetable_destroy(struct filetable *ft)
 {
-	int fd;
+	unsigned fd;
 
 	KASSERT(ft != NULL);
 
 	/* Close any open files. */
-	for (fd = 0; fd < OPEN_MAX; fd++) {
+	for (fd = 0; fd < ft->ft_hiwater; fd++) {
 		if (ft->ft_openfiles[fd] != NULL) {
 			openfile_decref(ft->ft_openfiles[fd]);
-			ft->ft_openfiles[fd] = NULL;
 		}
 	}
+	kfree(ft->ft_openfiles);
+	kfree(ft->ft_used);
+	lock_destroy(ft->ft_lock);
 	kfree(ft);
 }
 
@@ -100,7 +247,8 @@ filetable_copy(struct filetable *src, struct filetable **dest_ret)
 {
 	struct filetable *dest;
 	struct openfile *file;
-	int fd;
+	unsigned fd;
+	int result;
 
 	/* Copying the nonexistent table avoids special cases elsewhere */
 	if (src == NULL) {
@@ -113,26 +261,54 @@ filetable_copy(struct filetable *src, struct filetable **dest_ret)
 		return ENOMEM;
 	}
 
+	lock_acquire(src->ft_lock);
+
+	/* make it big enough for the live range */
+	if (src->ft_hiwater > dest->ft_size) {
+		result = ft_resize(dest, (src->ft_hiwater + 31) / 32 * 32);
+		if (result) {
+			lock_release(src->ft_lock);
+			filetable_destroy(dest);
+			return result;
+		}
+	}
+
 	/* share the entries */
-	for (fd = 0; fd < OPEN_MAX; fd++) {
+	for (fd = 0; fd < src->ft_hiwater; fd++) {
 		file = src->ft_openfiles[fd];
 		if (file != NULL) {
 			openfile_incref(file);
 		}
 		dest->ft_openfiles[fd] = file;
 	}
+	memcpy(dest->ft_used, src->ft_used,
+	       (src->ft_hiwater + 31) / 32 * sizeof(*dest->ft_used));
+	dest->ft_hiwater = src->ft_hiwater;
+
+	lock_release(src->ft_lock);
 
 	*dest_ret = dest;
 	return 0;
 }
 
 /*
- * Check if a file handle is in range.
+ * Mark a filetable as used by more than one thread. Must be called by
+ * a thread already using it, before the new thread can get at it.
+ * There's no going back, even if the other threads exit.
+ */
+void
+filetable_share(struct filetable *ft)
+{
+	ft->ft_shared = true;
+}
+
+/*
+ * Check if a file handle is in range. (The table itself may not be
+ * that big yet; that's fine.)
  */
 bool
 filetable_okfd(struct filetable *ft, int fd)
 {
-	/* We have a fixed-size table so we don't need to check the size */
 	(void)ft;
 
 	return (fd >= 0 && fd < OPEN_MAX);
@@ -144,7 +320,10 @@ filetable_okfd(struct filetable *ft, int fd)
  *
  * This checks that the file handle is in range and fails rather than
  * returning a null openfile; it only yields files that are actually
- * open.
+ * open. If the table is shared, the caller gets its own reference to
+ * the openfile, so it stays valid until filetable_put even if another
+ * thread closes the fd. If not, nobody else can close it, and the
+ * table's own reference will do.
  */
 int
 filetable_get(struct filetable *ft, int fd, struct openfile **ret)
@@ -155,36 +334,53 @@ filetable_get(struct filetable *ft, int fd, struct openfile **ret)
 		return EBADF;
 	}
 
+	if (!ft->ft_shared) {
+		/* we're the only thread; no lock, no reference */
+		if ((unsigned)fd >= ft->ft_hiwater) {
+			return EBADF;
+		}
+		file = ft->ft_openfiles[fd];
+		if (file == NULL) {
+			return EBADF;
+		}
+		*ret = file;
+		return 0;
+	}
+
+	lock_acquire(ft->ft_lock);
+	if ((unsigned)fd >= ft->ft_hiwater) {
+		lock_release(ft->ft_lock);
+		return EBADF;
+	}
 	file = ft->ft_openfiles[fd];
 	if (file == NULL) {
+		lock_release(ft->ft_lock);
 		return EBADF;
 	}
+	openfile_incref(file);
+	lock_release(ft->ft_lock);
 
 	*ret = file;
 	return 0;
 }
 
 /*
- * Put a file handle back when done with it. This does not actually do
- * anything (other than crosscheck) but it's always good practice to
- * build things so when you take them out you put them back again
- * rather than dropping them on the floor. Then if you need to do
- * something at cleanup time you can put it in this function instead
- * of having to hunt for all the places to insert the new logic.
- *
- * (For example, if you have multithreaded processes you will need to
- * insert additional lock and/or refcount manipulations here and in
- * filetable_get.)
+ * Put a file handle back when done with it, dropping the reference
+ * filetable_get took, if it took one.
  *
- * The openfile should be the one returned from filetable_get. If you
- * want to manipulate the table so the assertion's no longer true, get
- * your own reference to the openfile (with openfile_incref) and call
- * filetable_put before mucking about.
+ * The openfile should be the one returned from filetable_get. If the
+ * table is shared it may no longer be in the table, if some other
+ * thread closed or replaced the fd in the meantime; otherwise it
+ * still has to be.
  */
 void
 filetable_put(struct filetable *ft, int fd, struct openfile *file)
 {
-	KASSERT(ft->ft_openfiles[fd] == file);
+	if (!ft->ft_shared) {
+		KASSERT(ft->ft_openfiles[fd] == file);
+		return;
+	}
+	openfile_decref(file);
 }
 
 /*
@@ -200,17 +396,40 @@ filetable_put(struct filetable *ft, int fd, struct openfile *file)
 int
 filetable_place(struct filetable *ft, struct openfile *file, int *fd_ret)
 {
-	int fd;
+	unsigned word, fd;
+	int result;
 
-	for (fd = 0; fd < OPEN_MAX; fd++) {
-		if (ft->ft_openfiles[fd] == NULL) {
-			ft->ft_openfiles[fd] = file;
-			*fd_ret = fd;
-			return 0;
+	lock_acquire(ft->ft_lock);
+
+	/* Find the first word with a free slot... */
+	for (word = 0; word < ft->ft_size / 32; word++) {
+		if (ft->ft_used[word] != 0xffffffff) {
+			break;
 		}
 	}
+	/* ...and the slot; if there's none, it's the first new one. */
+	if (word < ft->ft_size / 32) {
+		fd = word * 32 + ft_firstzero(ft->ft_used[word]);
+	}
+	else {
+		fd = ft->ft_size;
+	}
+
+	if (fd >= OPEN_MAX) {
+		lock_release(ft->ft_lock);
+		return EMFILE;
+	}
+	result = ft_reserve(ft, fd);
+	if (result) {
+		lock_release(ft->ft_lock);
+		return result;
+	}
+
+	ft_set(ft, fd, file);
+	lock_release(ft->ft_lock);
 
-	return EMFILE;
+	*fd_ret = fd;
+	return 0;
 }
 
 /*
@@ -219,19 +438,37 @@ filetable_place(struct filetable *ft, struct openfile *file, int *fd_ret)
  *
  * Consumes a reference to the passed-in openfile object; returns a
  * reference to the old openfile object (if not NULL); this should
- * generally be decref'd.
- *
- * Doesn't fail.
+ * generally be decref'd. On failure nothing is consumed or returned.
  *
+ * Can fail only if the table has to grow; placing NULL never does.
  * Note that you can use this to place NULL in the filetable, which is
  * potentially handy.
  */
-void
+int
 filetable_placeat(struct filetable *ft, struct openfile *newfile, int fd,
 		  struct openfile **oldfile_ret)
 {
+	int result;
+
 	KASSERT(filetable_okfd(ft, fd));
 
+	lock_acquire(ft->ft_lock);
+	if ((unsigned)fd >= ft->ft_size) {
+		if (newfile == NULL) {
+			/* nothing there, nothing to do */
+			lock_release(ft->ft_lock);
+			*oldfile_ret = NULL;
+			return 0;
+		}
+		result = ft_reserve(ft, fd);
+		if (result) {
+			lock_release(ft->ft_lock);
+			return result;
+		}
+	}
+
 	*oldfile_ret = ft->ft_openfiles[fd];
-	ft->ft_openfiles[fd] = newfile;
+	ft_set(ft, fd, newfile);
+	lock_release(ft->ft_lock);
+	return 0;
 }
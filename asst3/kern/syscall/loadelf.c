@@ -45,6 +45,15 @@
  * If you wanted to support memory-mapped executables you would need
  * to rearrange this to map each segment.
  *
+ * Executables that are run over and over (/bin/true, /bin/cat, ...)
+ * are kept in a small cache of parsed images: the segment list from
+ * the program headers, plus the file contents of the read-only
+ * segments. An exec that hits the cache doesn't need to read or
+ * parse the headers again, and copies text straight from the cache
+ * instead of reading it through the file system. Entries are keyed
+ * by vnode and content generation (see vnode.h), so a write or
+ * truncate makes the old entry miss; it then ages out.
+ *
  * To support dynamically linked executables with shared libraries
  * you'd need to change this to load the "ELF interpreter" (dynamic
  * linker). And you'd have to write a dynamic linker...
@@ -54,17 +63,230 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
+#include <synch.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
 #include <vnode.h>
 #include <elf.h>
 
+/*
+ * Cache sizing. An image with more loadable segments than
+ * EXECCACHE_MAXSEGS is still loaded, but isn't cached and has its
+ * text read from the file as usual; neither is text that would blow
+ * the byte budget.
+ */
+#define EXECCACHE_SIZE		8		/* images */
+#define EXECCACHE_MAXSEGS	8		/* segments per image */
+#define EXECCACHE_MAXBYTES	(256*1024)	/* cached text, total */
+
+/*
+ * One loadable segment.
+ */
+struct execseg {
+	off_t es_offset;	/* where in the file */
+	vaddr_t es_vaddr;	/* where in memory */
+	size_t es_memsize;	/* size in memory */
+	size_t es_filesize;	/* size in the file */
+	uint32_t es_flags;	/* PF_R/PF_W/PF_X */
+	void *es_text;		/* cached file contents, or NULL */
+};
+
+/*
+ * A parsed executable.
+ *
+ * ei_vnode is used only as a key; no reference is held, which is
+ * safe because the generation can't match once the vnode is gone.
+ * ei_refcount counts the cache's reference (if cached) and each
+ * load_elf using the image; it's protected by execcache_lock, and
+ * the rest doesn't change once the image is built.
+ */
+struct execimage {
+	struct vnode *ei_vnode;
+	uint64_t ei_gen;
+	unsigned ei_refcount;
+	vaddr_t ei_entry;
+	unsigned ei_nsegs;
+	unsigned ei_maxsegs;	/* allocated size of ei_segs */
+	struct execseg *ei_segs;
+	size_t ei_textbytes;	/* total size of cached text */
+};
+
+static struct lock *execcache_lock;
+static struct execimage *execcache[EXECCACHE_SIZE]; /* most recent first */
+static size_t execcache_bytes;
+
+/*
+ * Set up the cache.
+ */
+void
+execcache_bootstrap(void)
+{
+	execcache_lock = lock_create("execcache");
+	if (execcache_lock == NULL) {
+		panic("Cannot create exec cache lock\n");
+	}
+}
+
+/*
+ * Free an image.
+ */
+static
+void
+execimage_destroy(struct execimage *ei)
+{
+	unsigned i;
+
+	KASSERT(ei->ei_refcount == 0);
+	for (i=0; i<ei->ei_nsegs; i++) {
+		if (ei->ei_segs[i].es_text != NULL) {
+			kfree(ei->ei_segs[i].es_text);
+		}
+	}
+	kfree(ei->ei_segs);
+	kfree(ei);
+}
+
+/*
+ * Drop a reference to an image.
+ */
+static
+void
+execimage_release(struct execimage *ei)
+{
+	bool destroy;
+
+	lock_acquire(execcache_lock);
+	KASSERT(ei->ei_refcount > 0);
+	ei->ei_refcount--;
+	destroy = (ei->ei_refcount == 0);
+	lock_release(execcache_lock);
+
+	if (destroy) {
+		execimage_destroy(ei);
+	}
+}
+
+/*
+ * Take the image in slot SLOT out of the cache, shifting the ones
+ * after it up. Returns it if that dropped the last reference, so
+ * the caller can destroy it after unlocking.
+ */
+static
+struct execimage *
+execcache_remove(unsigned slot)
+{
+	struct execimage *ei;
+
+	KASSERT(lock_do_i_hold(execcache_lock));
+
+	ei = execcache[slot];
+	for (; slot+1 < EXECCACHE_SIZE; slot++) {
+		execcache[slot] = execcache[slot+1];
+	}
+	execcache[EXECCACHE_SIZE-1] = NULL;
+
+	execcache_bytes -= ei->ei_textbytes;
+	KASSERT(ei->ei_refcount > 0);
+	ei->ei_refcount--;
+	return ei->ei_refcount == 0 ? ei : NULL;
+}
+
+/*
+ * Look up a vnode in the cache. Returns a referenced image, or NULL.
+ */
+static
+struct execimage *
+execcache_lookup(struct vnode *v, uint64_t gen)
+{
+	struct execimage *ei;
+	unsigned i;
+
+	lock_acquire(execcache_lock);
+	for (i=0; i<EXECCACHE_SIZE && execcache[i] != NULL; i++) {
+		ei = execcache[i];
+		if (ei->ei_vnode == v && ei->ei_gen == gen) {
+			/* move to the front */
+			for (; i>0; i--) {
+				execcache[i] = execcache[i-1];
+			}
+			execcache[0] = ei;
+			ei->ei_refcount++;
+			lock_release(execcache_lock);
+			return ei;
+		}
+	}
+	lock_release(execcache_lock);
+	return NULL;
+}
+
+/*
+ * Offer a freshly built image to the cache, which takes its own
+ * reference if it keeps it. Stale images of the same vnode and
+ * whatever's needed to stay within budget are thrown out.
+ */
+static
+void
+execcache_insert(struct execimage *ei)
+{
+	struct execimage *dead[EXECCACHE_SIZE];
+	unsigned i, ndead;
+
+	if (ei->ei_nsegs > EXECCACHE_MAXSEGS ||
+	    ei->ei_textbytes > EXECCACHE_MAXBYTES) {
+		return;
+	}
+
+	ndead = 0;
+	lock_acquire(execcache_lock);
+
+	i = 0;
+	while (i<EXECCACHE_SIZE && execcache[i] != NULL) {
+		if (execcache[i]->ei_vnode == ei->ei_vnode) {
+			dead[ndead] = execcache_remove(i);
+			if (dead[ndead] != NULL) {
+				ndead++;
+			}
+		}
+		else {
+			i++;
+		}
+	}
+
+	/* Evict from the end to make room. */
+	i = EXECCACHE_SIZE;
+	while (i > 0 && (execcache[EXECCACHE_SIZE-1] != NULL ||
+			 execcache_bytes + ei->ei_textbytes >
+			 EXECCACHE_MAXBYTES)) {
+		i--;
+		if (execcache[i] != NULL) {
+			dead[ndead] = execcache_remove(i);
+			if (dead[ndead] != NULL) {
+				ndead++;
+			}
+		}
+	}
+
+	for (i=EXECCACHE_SIZE-1; i>0; i--) {
+		execcache[i] = execcache[i-1];
+	}
+	execcache[0] = ei;
+	ei->ei_refcount++;
+	execcache_bytes += ei->ei_textbytes;
+
+	lock_release(execcache_lock);
+
+	for (i=0; i<ndead; i++) {
+		execimage_destroy(dead[i]);
+	}
+}
+
 /*
  * Load a segment at virtual address VADDR. The segment in memory
  * extends from VADDR up to (but not including) VADDR+MEMSIZE. The
  * segment on disk is located at file offset OFFSET and has length
- * FILESIZE.
+ * FILESIZE. If TEXT is not NULL, it holds the FILESIZE bytes of the
+ * file, and they're copied from there instead of read from V.
  *
  * FILESIZE may be less than MEMSIZE; if so the remaining portion of
  * the in-memory segment should be zero-filled.
@@ -76,7 +298,7 @@
  */
 static
 int
-load_segment(struct addrspace *as, struct vnode *v,
+load_segment(struct addrspace *as, struct vnode *v, void *text,
 	     off_t offset, vaddr_t vaddr,
 	     size_t memsize, size_t filesize,
 	     int is_executable)
@@ -103,7 +325,12 @@ load_segment(struct addrspace *as, struct vnode *v,
 	u.uio_rw = UIO_READ;
 	u.uio_space = as;
 
-	result = VOP_READ(v, &u);
+	if (text != NULL) {
+		result = uiomove(text, filesize, &u);
+	}
+	else {
+		result = VOP_READ(v, &u);
+	}
 	if (result) {
 		return result;
 	}
@@ -146,21 +373,44 @@ load_segment(struct addrspace *as, struct vnode *v,
 }
 
 /*
- * Load an ELF executable user program into the current address space.
- *
- * Returns the entry point (initial PC) for the program in ENTRYPOINT.
+ * Make room for another segment in an image.
  */
+static
 int
-load_elf(struct vnode *v, vaddr_t *entrypoint)
+execimage_growsegs(struct execimage *ei)
+{
+	struct execseg *segs;
+
+	if (ei->ei_nsegs < ei->ei_maxsegs) {
+		return 0;
+	}
+	segs = kmalloc(2 * ei->ei_maxsegs * sizeof(*segs));
+	if (segs == NULL) {
+		return ENOMEM;
+	}
+	memcpy(segs, ei->ei_segs, ei->ei_nsegs * sizeof(*segs));
+	kfree(ei->ei_segs);
+	ei->ei_segs = segs;
+	ei->ei_maxsegs *= 2;
+	return 0;
+}
+
+/*
+ * Read and check the headers of an executable, building an image.
+ * The file contents of read-only segments are read in too, if it
+ * looks like they'll fit in the cache.
+ */
+static
+int
+execimage_read(struct vnode *v, uint64_t gen, struct execimage **ret)
 {
 	Elf_Ehdr eh;   /* Executable header */
 	Elf_Phdr ph;   /* "Program header" = segment header */
+	struct execimage *ei;
+	struct execseg *es;
 	int result, i;
 	struct iovec iov;
 	struct uio ku;
-	struct addrspace *as;
-
-	as = proc_getas();
 
 	/*
 	 * Read the executable header from offset 0 in the file.
@@ -202,8 +452,26 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		return ENOEXEC;
 	}
 
+	ei = kmalloc(sizeof(*ei));
+	if (ei == NULL) {
+		return ENOMEM;
+	}
+	ei->ei_vnode = v;
+	ei->ei_gen = gen;
+	ei->ei_refcount = 1;
+	ei->ei_entry = eh.e_entry;
+	ei->ei_nsegs = 0;
+	ei->ei_maxsegs = EXECCACHE_MAXSEGS;
+	ei->ei_textbytes = 0;
+	ei->ei_segs = kmalloc(ei->ei_maxsegs * sizeof(*ei->ei_segs));
+	if (ei->ei_segs == NULL) {
+		kfree(ei);
+		return ENOMEM;
+	}
+
 	/*
-	 * Go through the list of segments and set up the address space.
+	 * Go through the list of segments and remember the loadable
+	 * ones.
 	 *
 	 * Ordinarily there will be one code segment, one read-only
 	 * data segment, and one data/bss segment, but there might
@@ -223,13 +491,14 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 
 		result = VOP_READ(v, &ku);
 		if (result) {
-			return result;
+			goto fail;
 		}
 
 		if (ku.uio_resid != 0) {
 			/* short read; problem with executable? */
 			kprintf("ELF: short read on phdr - file truncated?\n");
-			return ENOEXEC;
+			result = ENOEXEC;
+			goto fail;
 		}
 
 		switch (ph.p_type) {
@@ -240,68 +509,139 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		    default:
 			kprintf("loadelf: unknown segment type %d\n",
 				ph.p_type);
-			return ENOEXEC;
+			result = ENOEXEC;
+			goto fail;
 		}
 
-		result = as_define_region(as,
-					  ph.p_vaddr, ph.p_memsz,
-					  ph.p_flags & PF_R,
-					  ph.p_flags & PF_W,
-					  ph.p_flags & PF_X);
+		result = execimage_growsegs(ei);
 		if (result) {
-			return result;
+			goto fail;
 		}
-	}
-
-	result = as_prepare_load(as);
-	if (result) {
-		return result;
+		es = &ei->ei_segs[ei->ei_nsegs++];
+		es->es_offset = ph.p_offset;
+		es->es_vaddr = ph.p_vaddr;
+		es->es_memsize = ph.p_memsz;
+		es->es_filesize = ph.p_filesz;
+		es->es_flags = ph.p_flags;
+		es->es_text = NULL;
 	}
 
 	/*
-	 * Now actually load each segment.
+	 * Read in the read-only segments, unless the image is too big
+	 * to be cached anyway. Failing to allocate space for one isn't
+	 * an error; it just won't be cached.
 	 */
+	for (i=0; i<(int)ei->ei_nsegs && ei->ei_nsegs <= EXECCACHE_MAXSEGS;
+	     i++) {
+		es = &ei->ei_segs[i];
+		if ((es->es_flags & PF_W) || es->es_filesize == 0 ||
+		    es->es_filesize > es->es_memsize ||
+		    ei->ei_textbytes + es->es_filesize > EXECCACHE_MAXBYTES) {
+			continue;
+		}
+		es->es_text = kmalloc(es->es_filesize);
+		if (es->es_text == NULL) {
+			continue;
+		}
+		uio_kinit(&iov, &ku, es->es_text, es->es_filesize,
+			  es->es_offset, UIO_READ);
+		result = VOP_READ(v, &ku);
+		if (result == 0 && ku.uio_resid != 0) {
+			kprintf("ELF: short read on segment - "
+				"file truncated?\n");
+			result = ENOEXEC;
+		}
+		if (result) {
+			goto fail;
+		}
+		ei->ei_textbytes += es->es_filesize;
+	}
 
-	for (i=0; i<eh.e_phnum; i++) {
-		off_t offset = eh.e_phoff + i*eh.e_phentsize;
-		uio_kinit(&iov, &ku, &ph, sizeof(ph), offset, UIO_READ);
+	*ret = ei;
+	return 0;
 
-		result = VOP_READ(v, &ku);
+ fail:
+	ei->ei_refcount = 0;
+	execimage_destroy(ei);
+	return result;
+}
+
+/*
+ * Load an ELF executable user program into the current address space.
+ *
+ * Returns the entry point (initial PC) for the program in ENTRYPOINT.
+ */
+int
+load_elf(struct vnode *v, vaddr_t *entrypoint)
+{
+	struct execimage *ei;
+	struct execseg *es;
+	struct addrspace *as;
+	uint64_t gen;
+	unsigned i;
+	int result;
+
+	as = proc_getas();
+
+	/*
+	 * Get the generation before reading anything, so if the file
+	 * changes while we read it the image we cache is already
+	 * stale.
+	 */
+	gen = vnode_getgen(v);
+	ei = execcache_lookup(v, gen);
+	if (ei == NULL) {
+		result = execimage_read(v, gen, &ei);
 		if (result) {
 			return result;
 		}
+		execcache_insert(ei);
+	}
 
-		if (ku.uio_resid != 0) {
-			/* short read; problem with executable? */
-			kprintf("ELF: short read on phdr - file truncated?\n");
-			return ENOEXEC;
-		}
+	/*
+	 * Set up the address space.
+	 */
 
-		switch (ph.p_type) {
-		    case PT_NULL: /* skip */ continue;
-		    case PT_PHDR: /* skip */ continue;
-		    case PT_MIPS_REGINFO: /* skip */ continue;
-		    case PT_LOAD: break;
-		    default:
-			kprintf("loadelf: unknown segment type %d\n",
-				ph.p_type);
-			return ENOEXEC;
+	for (i=0; i<ei->ei_nsegs; i++) {
+		es = &ei->ei_segs[i];
+		result = as_define_region(as,
+					  es->es_vaddr, es->es_memsize,
+					  es->es_flags & PF_R,
+					  es->es_flags & PF_W,
+					  es->es_flags & PF_X);
+		if (result) {
+			goto done;
 		}
+	}
+
+	result = as_prepare_load(as);
+	if (result) {
+		goto done;
+	}
+
+	/*
+	 * Now actually load each segment.
+	 */
 
-		result = load_segment(as, v, ph.p_offset, ph.p_vaddr,
-				      ph.p_memsz, ph.p_filesz,
-				      ph.p_flags & PF_X);
+	for (i=0; i<ei->ei_nsegs; i++) {
+		es = &ei->ei_segs[i];
+		result = load_segment(as, v, es->es_text,
+				      es->es_offset, es->es_vaddr,
+				      es->es_memsize, es->es_filesize,
+				      es->es_flags & PF_X);
 		if (result) {
-			return result;
+			goto done;
 		}
 	}
 
 	result = as_complete_load(as);
 	if (result) {
-		return result;
+		goto done;
 	}
 
-	*entrypoint = eh.e_entry;
+	*entrypoint = ei->ei_entry;
 
-	return 0;
+ done:
+	execimage_release(ei);
+	return result;
 }
@@ -147,3 +147,16 @@ openfile_decref(struct openfile *file)
 		spinlock_release(&file->of_reflock);
 	}
 }
+
+/*
+ * Check if the caller holds the only reference to an openfile, in
+ * which case nobody else can get at it (including its seek position)
+ * until the caller shares it. Nobody else can raise the count from 1
+ * either, so there's no need for the spinlock; a stale larger count
+ * just means the caller takes the slow path.
+ */
+bool
+openfile_isprivate(struct openfile *file)
+{
+	return file->of_refcount == 1;
+}
@@ -33,19 +33,29 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <kern/wait.h>
 #include <lib.h>
 #include <machine/trapframe.h>
 #include <clock.h>
+#include <synch.h>
 #include <thread.h>
 #include <proc.h>
 #include <current.h>
 #include <copyinout.h>
 #include <pid.h>
+#include <filetable.h>
 #include <syscall.h>
 
 /* note that sys_execv is in runprogram.c */
 
+/* most children sys_waitmany will reap at once */
+#define WAITMANY_MAX 16
+
+/* units getrusage reports I/O in */
+#define RUSAGE_BLOCKSIZE 512
+
 
 /*
  * sys_getpid
@@ -157,3 +167,274 @@ sys_waitpid(pid_t pid, userptr_t retstatus, int flags, pid_t *retval)
 	}
 	return result;
 }
+
+/*
+ * sys_waitmany
+ * reap up to MAX exited children at once, returning how many. At
+ * most WAITMANY_MAX are collected per call; the caller can just call
+ * again for more.
+ */
+int
+sys_waitmany(userptr_t pids, userptr_t retstatuses, unsigned max, int flags,
+	     int *retval)
+{
+	pid_t kpids[WAITMANY_MAX];
+	int kstatuses[WAITMANY_MAX];
+	unsigned count;
+	int result;
+
+	if (pids == NULL) {
+		return EFAULT;
+	}
+	if (max > WAITMANY_MAX) {
+		max = WAITMANY_MAX;
+	}
+
+	result = pid_reap(kpids, kstatuses, max, flags, pids, retstatuses,
+			  &count);
+	if (result) {
+		return result;
+	}
+
+	*retval = count;
+	return 0;
+}
+
+/*
+ * sys_getrusage
+ * report resource usage of the current process (RUSAGE_SELF) or of
+ * the children it has waited for (RUSAGE_CHILDREN). Bytes read and
+ * written are reported in ru_inblock/ru_oublock in units of
+ * RUSAGE_BLOCKSIZE; there's nothing to put in most of the rest.
+ */
+int
+sys_getrusage(int who, userptr_t ru)
+{
+	struct usage usage;
+	struct rusage kru;
+
+	switch (who) {
+	    case RUSAGE_SELF:
+		proc_getusage(curproc, &usage);
+		break;
+	    case RUSAGE_CHILDREN:
+		proc_getchildusage(curproc, &usage);
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	bzero(&kru, sizeof(kru));
+	cycles_totimeval(usage.u_ucycles, &kru.ru_utime);
+	cycles_totimeval(usage.u_scycles, &kru.ru_stime);
+	kru.ru_minflt = usage.u_faults;
+	kru.ru_nvcsw = usage.u_nvcsw;
+	kru.ru_nivcsw = usage.u_nivcsw;
+	kru.ru_inblock = (usage.u_inbytes + RUSAGE_BLOCKSIZE - 1) /
+		RUSAGE_BLOCKSIZE;
+	kru.ru_oublock = (usage.u_outbytes + RUSAGE_BLOCKSIZE - 1) /
+		RUSAGE_BLOCKSIZE;
+
+	return copyout(&kru, ru, sizeof(kru));
+}
+
+/*
+ * sys___thread_create
+ *
+ * Make a new thread in the current process. It starts in user mode
+ * at ENTRY, with ARG0 and ARG1 as its first two arguments and the
+ * stack pointer at STACK (which the caller has to supply, since we
+ * have no way to make one for it). The new thread's ID comes back in
+ * RETVAL.
+ */
+
+struct uthread_startinfo {
+	struct uthread *us_ut;
+	vaddr_t us_entry;
+	userptr_t us_arg0;
+	userptr_t us_arg1;
+	vaddr_t us_stack;
+};
+
+static
+void
+uthread_start(void *vinfo, unsigned long junk)
+{
+	struct uthread_startinfo info;
+	struct proc *proc = curproc;
+
+	(void)junk;
+
+	info = *(struct uthread_startinfo *)vinfo;
+	kfree(vinfo);
+
+	lock_acquire(proc->p_threadslock);
+	info.us_ut->ut_thread = curthread;
+	if (proc->p_exiting) {
+		/* Too late. */
+		lock_release(proc->p_threadslock);
+		proc_exitthread(_MKWAIT_EXIT(0));
+	}
+	lock_release(proc->p_threadslock);
+
+	enter_new_process((int)info.us_arg0, info.us_arg1, NULL,
+			  info.us_stack, info.us_entry);
+}
+
+/*
+ * Unlink and free a thread record; p_threadslock must be held.
+ */
+static
+void
+uthread_unlink(struct proc *proc, struct uthread *ut)
+{
+	struct uthread **pp;
+
+	KASSERT(lock_do_i_hold(proc->p_threadslock));
+
+	for (pp = &proc->p_uthreads; *pp != NULL; pp = &(*pp)->ut_next) {
+		if (*pp == ut) {
+			*pp = ut->ut_next;
+			kfree(ut);
+			return;
+		}
+	}
+	panic("uthread_unlink: record %p not found\n", ut);
+}
+
+int
+sys___thread_create(userptr_t entry, userptr_t arg0, userptr_t arg1,
+		    userptr_t stack, int *retval)
+{
+	struct proc *proc = curproc;
+	struct uthread_startinfo *info;
+	struct uthread *ut;
+	int tid;
+	int result;
+
+	if (entry == NULL || stack == NULL) {
+		return EFAULT;
+	}
+
+	ut = kmalloc(sizeof(*ut));
+	if (ut == NULL) {
+		return ENOMEM;
+	}
+	info = kmalloc(sizeof(*info));
+	if (info == NULL) {
+		kfree(ut);
+		return ENOMEM;
+	}
+
+	ut->ut_thread = NULL;
+	ut->ut_exited = false;
+	ut->ut_joining = false;
+	ut->ut_retval = NULL;
+
+	info->us_ut = ut;
+	info->us_entry = (vaddr_t)entry;
+	info->us_arg0 = arg0;
+	info->us_arg1 = arg1;
+	info->us_stack = (vaddr_t)stack;
+
+	lock_acquire(proc->p_threadslock);
+	if (proc->p_exiting) {
+		lock_release(proc->p_threadslock);
+		kfree(info);
+		kfree(ut);
+		return EINTR;
+	}
+	tid = ut->ut_tid = proc->p_nexttid++;
+	ut->ut_next = proc->p_uthreads;
+	proc->p_uthreads = ut;
+	lock_release(proc->p_threadslock);
+
+	/* From now on the file table needs locking. */
+	filetable_share(proc->p_filetable);
+
+	result = thread_fork(curthread->t_name, proc, uthread_start, info, 0);
+	if (result) {
+		lock_acquire(proc->p_threadslock);
+		uthread_unlink(proc, ut);
+		lock_release(proc->p_threadslock);
+		kfree(info);
+		return result;
+	}
+
+	/* Don't touch UT again; it might be joined and gone already. */
+	*retval = tid;
+	return 0;
+}
+
+/*
+ * sys_thread_join
+ *
+ * Wait for thread TID of this process to exit and collect the value
+ * it passed to thread_exit. Each thread can be joined only once.
+ */
+int
+sys_thread_join(int tid, userptr_t retval)
+{
+	struct proc *proc = curproc;
+	struct uthread *ut;
+	userptr_t val;
+
+	lock_acquire(proc->p_threadslock);
+	for (ut = proc->p_uthreads; ut != NULL; ut = ut->ut_next) {
+		if (ut->ut_tid == tid) {
+			break;
+		}
+	}
+	if (ut == NULL) {
+		lock_release(proc->p_threadslock);
+		return ESRCH;
+	}
+	if (ut->ut_thread == curthread || ut->ut_joining) {
+		lock_release(proc->p_threadslock);
+		return EINVAL;
+	}
+
+	ut->ut_joining = true;
+	while (!ut->ut_exited && !proc->p_exiting) {
+		cv_wait(proc->p_threadscv, proc->p_threadslock);
+	}
+	if (!ut->ut_exited) {
+		/* The process is going away under us. */
+		ut->ut_joining = false;
+		lock_release(proc->p_threadslock);
+		return EINTR;
+	}
+	val = ut->ut_retval;
+	uthread_unlink(proc, ut);
+	lock_release(proc->p_threadslock);
+
+	if (retval != NULL) {
+		return copyout(&val, retval, sizeof(val));
+	}
+	return 0;
+}
+
+/*
+ * sys_thread_exit
+ *
+ * Make the current thread exit, leaving RETVAL for whoever joins it.
+ * If it's the last thread, the process exits with status 0.
+ */
+__DEAD
+void
+sys_thread_exit(userptr_t retval)
+{
+	struct proc *proc = curproc;
+	struct uthread *ut;
+
+	lock_acquire(proc->p_threadslock);
+	for (ut = proc->p_uthreads; ut != NULL; ut = ut->ut_next) {
+		if (ut->ut_thread == curthread) {
+			ut->ut_retval = retval;
+			break;
+		}
+	}
+	lock_release(proc->p_threadslock);
+
+	proc_exitthread(_MKWAIT_EXIT(0));
+}
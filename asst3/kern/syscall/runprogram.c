@@ -35,9 +35,12 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/fcntl.h>
+#include <kern/spawn.h>
 #include <kern/unistd.h>
+#include <kern/wait.h>
 #include <limits.h>
 #include <lib.h>
+#include <thread.h>
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
@@ -47,6 +50,7 @@
 #include <vfs.h>
 #include <openfile.h>
 #include <filetable.h>
+#include <pid.h>
 #include <syscall.h>
 #include <test.h>
 
@@ -159,51 +163,72 @@ argbuf_fromkernel(struct argbuf *buf, const char *progname)
 	return 0;
 }
 
+/*
+ * Number of argv pointers argbuf_copyin fetches at once.
+ */
+#define ARGV_BATCH 64
+
 /*
  * Copy an argv array into kernel space, using an argvdata buffer.
+ *
+ * The pointers are fetched in batches rather than one copyin each.
+ * A batch never runs past the end of the page the next pointer is
+ * on, so we can't fault on memory past the end of the argv that the
+ * caller never promised us was there.
  */
 static
 int
 argbuf_copyin(struct argbuf *buf, userptr_t uargv)
 {
-	userptr_t thisarg;
+	userptr_t ptrs[ARGV_BATCH];
 	size_t thisarglen;
+	unsigned i, nptrs;
+	vaddr_t pageleft;
 	int result;
 
 	/* loop through the argv, grabbing each arg string */
 	buf->nargs = 0;
 	while (1) {
 		/*
-		 * First, grab the pointer at argv.
+		 * First, grab as many pointers as we safely can.
 		 * (argv is incremented at the end of the loop)
 		 */
-		result = copyin(uargv, &thisarg, sizeof(userptr_t));
-		if (result) {
-			return result;
+		pageleft = PAGE_SIZE - ((vaddr_t)uargv & ~PAGE_FRAME);
+		nptrs = pageleft / sizeof(userptr_t);
+		if (nptrs == 0) {
+			/* misaligned pointer straddling a page */
+			nptrs = 1;
 		}
-
-		/* If we got NULL, we're at the end of the argv. */
-		if (thisarg == NULL) {
-			break;
+		if (nptrs > ARGV_BATCH) {
+			nptrs = ARGV_BATCH;
 		}
-
-		/* Use the pointer to fetch the argument string. */
-		result = copyinstr(thisarg, buf->data + buf->len,
-				   buf->max - buf->len, &thisarglen);
-		if (result == ENAMETOOLONG) {
-			return E2BIG;
-		}
-		else if (result) {
+		result = copyin(uargv, ptrs, nptrs * sizeof(userptr_t));
+		if (result) {
 			return result;
 		}
 
-		/* Move ahead. Note: thisarglen includes the \0. */
-		buf->len += thisarglen;
-		uargv += sizeof(userptr_t);
-		buf->nargs++;
+		for (i=0; i<nptrs; i++) {
+			/* If we got NULL, we're at the end of the argv. */
+			if (ptrs[i] == NULL) {
+				return 0;
+			}
+
+			/* Use the pointer to fetch the argument string. */
+			result = copyinstr(ptrs[i], buf->data + buf->len,
+					   buf->max - buf->len, &thisarglen);
+			if (result == ENAMETOOLONG) {
+				return E2BIG;
+			}
+			else if (result) {
+				return result;
+			}
+
+			/* Move ahead. Note: thisarglen includes the \0. */
+			buf->len += thisarglen;
+			buf->nargs++;
+		}
+		uargv += nptrs * sizeof(userptr_t);
 	}
-
-	return 0;
 }
 
 /*
@@ -250,6 +275,10 @@ argbuf_fromuser(struct argbuf *buf, userptr_t uargv)
 /*
  * Copy an argv out of kernel space to user space.
  *
+ * The strings are already packed in the buffer exactly as they go
+ * on the stack, so they go out in one copyout; the argv pointers
+ * are worked out in kernel memory and go out ARGV_BATCH at a time.
+ *
  * Note: ustackp is an in/out argument.
  */
 static
@@ -259,10 +288,9 @@ argbuf_copyout(struct argbuf *buf, vaddr_t *ustackp,
 {
 	vaddr_t ustack;
 	userptr_t ustringbase, uargvbase, uargv_i;
-	userptr_t thisarg;
-	size_t thisarglen;
+	userptr_t kargv[ARGV_BATCH];
 	size_t pos;
-	int result;
+	int i, n, result;
 
 	/* Begin the stack at the passed in top. */
 	ustack = *ustackp;
@@ -282,40 +310,39 @@ argbuf_copyout(struct argbuf *buf, vaddr_t *ustackp,
 	ustack -= (buf->nargs + 1) * sizeof(userptr_t);
 	uargvbase = (userptr_t)ustack;
 
-	/* Now copy the data out. */
+	/* Copy the strings out. */
+	result = copyout(buf->data, ustringbase, buf->len);
+	if (result) {
+		return result;
+	}
+
+	/*
+	 * Work out the argv (the strings are at ustringbase + pos)
+	 * and send it out a batch at a time. Use the stack rather
+	 * than allocating, since we mustn't fail now. The extra
+	 * slot at the end is the NULL.
+	 */
 	pos = 0;
 	uargv_i = uargvbase;
-	while (pos < buf->len) {
-		/* The user address of the string will be ustringbase + pos. */
-		thisarg = ustringbase + pos;
-
-		/* Place it in the argv array. */
-		result = copyout(&thisarg, uargv_i, sizeof(thisarg));
-		if (result) {
-			return result;
+	for (i=0; i<=buf->nargs; i += n) {
+		for (n=0; n<ARGV_BATCH && i+n<=buf->nargs; n++) {
+			if (i+n < buf->nargs) {
+				kargv[n] = ustringbase + pos;
+				pos += strlen(buf->data + pos) + 1;
+			}
+			else {
+				kargv[n] = NULL;
+			}
 		}
-
-		/* Push out the string. */
-		result = copyoutstr(buf->data + pos, thisarg,
-				    buf->len - pos, &thisarglen);
+		result = copyout(kargv, uargv_i, n * sizeof(userptr_t));
 		if (result) {
 			return result;
 		}
-
-		/* thisarglen includes the \0 */
-		pos += thisarglen;
-		uargv_i += sizeof(thisarg);
+		uargv_i += n * sizeof(userptr_t);
 	}
 	/* Should have come out even... */
 	KASSERT(pos == buf->len);
 
-	/* Add the NULL. */
-	thisarg = NULL;
-	result = copyout(&thisarg, uargv_i, sizeof(userptr_t));
-	if (result) {
-		return result;
-	}
-
 	*ustackp = ustack;
 	*argc_ret = buf->nargs;
 	*uargv_ret = uargvbase;
@@ -431,7 +458,11 @@ placed_open(const char *path, int openflags, int fd)
 	}
 
 	/* place the file in the filetable in the right slot */
-	filetable_placeat(curproc->p_filetable, newfile, fd, &oldfile);
+	result = filetable_placeat(curproc->p_filetable, newfile, fd, &oldfile);
+	if (result) {
+		openfile_decref(newfile);
+		return result;
+	}
 
 	/* the table should previously have been empty */
 	KASSERT(oldfile == NULL);
@@ -560,6 +591,19 @@ sys_execv(userptr_t prog, userptr_t uargv)
 	int argc;
 	int result;
 
+	/*
+	 * Refuse if there are other threads in the process. loadexec
+	 * destroys the old address space, which they'd still be running
+	 * in. Only our own threads can add more, so the count can't go
+	 * up again once we've seen it at one.
+	 */
+	lock_acquire(curproc->p_threadslock);
+	if (threadarray_num(&curproc->p_threads) > 1) {
+		lock_release(curproc->p_threadslock);
+		return EBUSY;
+	}
+	lock_release(curproc->p_threadslock);
+
 	path = kmalloc(PATH_MAX);
 	if (!path) {
 		return ENOMEM;
@@ -611,3 +655,245 @@ sys_execv(userptr_t prog, userptr_t uargv)
 	panic("enter_new_process returned\n");
 	return EINVAL;
 }
+
+/*
+ * spawn.
+ *
+ * This does the work of fork and execv together: the new process
+ * gets a copy of our file table (adjusted by the file actions) and
+ * loads the executable straight into a fresh address space, so ours
+ * never has to be copied.
+ *
+ * The parent waits until the child has finished loading, so that a
+ * bad executable fails the spawn call itself instead of showing up
+ * later as an exit status.
+ */
+
+struct spawninfo {
+	char *si_path;			/* program to run */
+	struct argbuf si_argv;		/* its argv */
+	struct semaphore *si_done;	/* V'd by the child once loaded */
+	int si_result;			/* result of loading */
+};
+
+/*
+ * Apply one file action to the file table of a process being
+ * spawned. KPATH is a scratch buffer of PATH_MAX bytes.
+ */
+static
+int
+spawn_fileaction(struct filetable *ft, const struct spawn_action *sa,
+		 char *kpath)
+{
+	struct openfile *file, *oldfile;
+	int result;
+
+	if (!filetable_okfd(ft, sa->sa_fd)) {
+		return EBADF;
+	}
+
+	switch (sa->sa_type) {
+	    case SPAWN_CLOSE:
+		(void)filetable_placeat(ft, NULL, sa->sa_fd, &oldfile);
+		if (oldfile == NULL) {
+			return EBADF;
+		}
+		break;
+
+	    case SPAWN_DUP2:
+		/* Get the file first: oldfd has to be open even if == fd. */
+		result = filetable_get(ft, sa->sa_oldfd, &file);
+		if (result) {
+			return result;
+		}
+		if (sa->sa_oldfd == sa->sa_fd) {
+			filetable_put(ft, sa->sa_oldfd, file);
+			return 0;
+		}
+		openfile_incref(file);
+		filetable_put(ft, sa->sa_oldfd, file);
+		result = filetable_placeat(ft, file, sa->sa_fd, &oldfile);
+		if (result) {
+			openfile_decref(file);
+			return result;
+		}
+		break;
+
+	    case SPAWN_OPEN:
+		result = copyinstr((const_userptr_t)sa->sa_path, kpath,
+				   PATH_MAX, NULL);
+		if (result) {
+			return result;
+		}
+		result = openfile_open(kpath, sa->sa_flags, sa->sa_mode,
+				       &file);
+		if (result) {
+			return result;
+		}
+		result = filetable_placeat(ft, file, sa->sa_fd, &oldfile);
+		if (result) {
+			openfile_decref(file);
+			return result;
+		}
+		break;
+
+	    default:
+		return EINVAL;
+	}
+
+	if (oldfile != NULL) {
+		openfile_decref(oldfile);
+	}
+	return 0;
+}
+
+/*
+ * Apply the user's file actions, in order.
+ */
+static
+int
+spawn_fileactions(struct filetable *ft, userptr_t uactions,
+		  unsigned nactions)
+{
+	struct spawn_action sa;
+	char *kpath;
+	unsigned i;
+	int result;
+
+	if (nactions == 0) {
+		return 0;
+	}
+	if (nactions > SPAWN_MAXACTIONS) {
+		return E2BIG;
+	}
+
+	kpath = kmalloc(PATH_MAX);
+	if (kpath == NULL) {
+		return ENOMEM;
+	}
+
+	result = 0;
+	for (i=0; i<nactions; i++) {
+		result = copyin(uactions, &sa, sizeof(sa));
+		if (result) {
+			break;
+		}
+		result = spawn_fileaction(ft, &sa, kpath);
+		if (result) {
+			break;
+		}
+		uactions += sizeof(sa);
+	}
+
+	kfree(kpath);
+	return result;
+}
+
+/*
+ * The child side of spawn: load the executable and go.
+ */
+static
+void
+spawn_newthread(void *vsi, unsigned long junk)
+{
+	struct spawninfo *si = vsi;
+	vaddr_t entrypoint, stackptr;
+	int argc;
+	userptr_t uargv;
+	int result;
+
+	(void)junk;
+
+	/* Load the executable. Note: must not fail after this succeeds. */
+	result = loadexec(si->si_path, &entrypoint, &stackptr);
+	if (result) {
+		si->si_result = result;
+		V(si->si_done);
+		/* The parent will collect our (meaningless) exit status. */
+		proc_exit(_MKWAIT_EXIT(255));
+	}
+
+	result = argbuf_copyout(&si->si_argv, &stackptr, &argc, &uargv);
+	if (result) {
+		/* If copyout fails, *we* messed up, so panic */
+		panic("spawn: copyout_args failed: %s\n", strerror(result));
+	}
+
+	/* After this the parent frees si, so don't touch it again. */
+	si->si_result = 0;
+	V(si->si_done);
+
+	/* Warp to user mode. */
+	enter_new_process(argc, uargv, NULL /*uenv*/, stackptr, entrypoint);
+
+	/* enter_new_process does not return. */
+	panic("enter_new_process returned\n");
+}
+
+int
+sys_spawn(userptr_t prog, userptr_t uargv, userptr_t uactions,
+	  unsigned nactions, pid_t *retval)
+{
+	struct spawninfo si;
+	struct proc *newproc;
+	pid_t pid;
+	int result;
+
+	si.si_path = kmalloc(PATH_MAX);
+	if (si.si_path == NULL) {
+		return ENOMEM;
+	}
+	argbuf_init(&si.si_argv);
+	si.si_result = 0;
+
+	si.si_done = sem_create("spawn", 0);
+	if (si.si_done == NULL) {
+		kfree(si.si_path);
+		return ENOMEM;
+	}
+
+	/* Get the filename and argv, the same way execv does. */
+	result = copyinstr(prog, si.si_path, PATH_MAX, NULL);
+	if (result) {
+		goto fail;
+	}
+	result = argbuf_fromuser(&si.si_argv, uargv);
+	if (result) {
+		goto fail;
+	}
+
+	/* Make the process, and arrange its file table. */
+	result = proc_spawn(&newproc);
+	if (result) {
+		goto fail;
+	}
+	result = spawn_fileactions(newproc->p_filetable, uactions, nactions);
+	if (result) {
+		proc_unfork(newproc);
+		goto fail;
+	}
+
+	pid = newproc->p_pid;
+	result = thread_fork(curthread->t_name, newproc,
+			     spawn_newthread, &si, 0);
+	if (result) {
+		proc_unfork(newproc);
+		goto fail;
+	}
+
+	/* Wait for the load. If it failed, clean up the child. */
+	P(si.si_done);
+	result = si.si_result;
+	if (result) {
+		pid_wait(pid, NULL, 0, NULL);
+		goto fail;
+	}
+
+	*retval = pid;
+
+ fail:
+	argbuf_cleanup(&si.si_argv);
+	sem_destroy(si.si_done);
+	kfree(si.si_path);
+	return result;
+}
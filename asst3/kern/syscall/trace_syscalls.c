@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Kernel event trace system calls. The trace itself is in thread.c.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/ktrace.h>
+#include <lib.h>
+#include <thread.h>
+#include <copyinout.h>
+#include <syscall.h>
+
+/*
+ * sys_ktrace
+ * turn tracing on or off, or throw away what's been recorded.
+ */
+int
+sys_ktrace(int op, unsigned mask)
+{
+	switch (op) {
+	    case KTRACE_START:
+		if (mask == 0 || (mask & ~KTRACE_ALL) != 0) {
+			return EINVAL;
+		}
+		return ktrace_start(mask);
+	    case KTRACE_STOP:
+		ktrace_stop();
+		return 0;
+	    case KTRACE_CLEAR:
+		ktrace_clear();
+		return 0;
+	}
+	return EINVAL;
+}
+
+/*
+ * sys_ktrace_read
+ * copy out up to MAX unread trace records (at most KTRACE_READMAX
+ * per call), returning how many.
+ */
+int
+sys_ktrace_read(userptr_t buf, unsigned max, int *retval)
+{
+	struct ktrace_event *kbuf;
+	unsigned n;
+	int result;
+
+	if (max > KTRACE_READMAX) {
+		max = KTRACE_READMAX;
+	}
+	if (max == 0) {
+		*retval = 0;
+		return 0;
+	}
+
+	kbuf = kmalloc(max * sizeof(*kbuf));
+	if (kbuf == NULL) {
+		return ENOMEM;
+	}
+
+	/*
+	 * Once drained the records are gone, so if the copyout fails
+	 * they're lost. The caller gave us a bad pointer; too bad.
+	 */
+	n = ktrace_drain(kbuf, max);
+	result = copyout(kbuf, buf, n * sizeof(*kbuf));
+	kfree(kbuf);
+	if (result) {
+		return result;
+	}
+
+	*retval = n;
+	return 0;
+}
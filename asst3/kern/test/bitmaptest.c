@@ -28,6 +28,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
 #include <test.h>
@@ -89,6 +90,22 @@ bitmaptest(int nargs, char **args)
 		}
 	}
 
+	for (i=0; i<TESTSIZE; i++) {
+		unsigned end, j;
+
+		end = i + random() % (TESTSIZE + 64 - i);
+		for (j=i; j<end && j<TESTSIZE && !data[j]; j++) {
+			/* nothing */
+		}
+		if (j < end && j < TESTSIZE) {
+			KASSERT(bitmap_findzero(b, i, end, &x)==0);
+			KASSERT(x == j);
+		}
+		else {
+			KASSERT(bitmap_findzero(b, i, end, &x)==ENOSPC);
+		}
+	}
+
 	while (bitmap_alloc(b, &x)==0) {
 		KASSERT(x < TESTSIZE);
 		KASSERT(bitmap_isset(b, x));
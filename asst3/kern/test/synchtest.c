@@ -42,6 +42,7 @@
 #define NSEMLOOPS     63
 #define NLOCKLOOPS    120
 #define NCVLOOPS      5
+#define NRWLOOPS      200
 #define NTHREADS      32
 
 static volatile unsigned long testval1;
@@ -50,6 +51,7 @@ static volatile unsigned long testval3;
 static struct semaphore *testsem;
 static struct lock *testlock;
 static struct cv *testcv;
+static struct rwlock *testrwlock;
 static struct semaphore *donesem;
 
 static
@@ -74,6 +76,12 @@ inititems(void)
 			panic("synchtest: cv_create failed\n");
 		}
 	}
+	if (testrwlock==NULL) {
+		testrwlock = rwlock_create("testrwlock");
+		if (testrwlock == NULL) {
+			panic("synchtest: rwlock_create failed\n");
+		}
+	}
 	if (donesem==NULL) {
 		donesem = sem_create("donesem", 0);
 		if (donesem == NULL) {
@@ -300,6 +308,328 @@ cvtest(int nargs, char **args)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Reader-writer lock test.
+ *
+ * Every fourth thread is a writer; the rest are readers. Writers
+ * update the test values and check that no readers are inside;
+ * readers check that the values are consistent. We also record the
+ * largest number of readers seen inside at once, which should be
+ * more than one if readers really run concurrently.
+ */
+
+static struct spinlock rwtest_lock = SPINLOCK_INITIALIZER;
+static unsigned rwtest_readers;
+static unsigned rwtest_maxreaders;
+static volatile bool rwtest_failed;
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	int i;
+	volatile int j;
+	unsigned long v1, v2;
+
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		if (num % 4 == 0) {
+			rwlock_acquire_write(testrwlock);
+			spinlock_acquire(&rwtest_lock);
+			if (rwtest_readers != 0) {
+				kprintf("thread %lu: %u readers inside "
+					"with writer\n", num, rwtest_readers);
+				rwtest_failed = true;
+			}
+			spinlock_release(&rwtest_lock);
+			testval1 = num + i;
+			testval2 = testval1 * testval1;
+			rwlock_release_write(testrwlock);
+		}
+		else {
+			rwlock_acquire_read(testrwlock);
+			spinlock_acquire(&rwtest_lock);
+			rwtest_readers++;
+			if (rwtest_readers > rwtest_maxreaders) {
+				rwtest_maxreaders = rwtest_readers;
+			}
+			spinlock_release(&rwtest_lock);
+
+			v1 = testval1;
+			/* linger so other readers can get in */
+			for (j=0; j<100; j++);
+			v2 = testval2;
+			if (v2 != v1 * v1) {
+				kprintf("thread %lu: Mismatch on "
+					"testval2/testval1\n", num);
+				rwtest_failed = true;
+			}
+
+			spinlock_acquire(&rwtest_lock);
+			rwtest_readers--;
+			spinlock_release(&rwtest_lock);
+			rwlock_release_read(testrwlock);
+		}
+	}
+	V(donesem);
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting rwlock test...\n");
+
+	testval1 = testval2 = 0;
+	rwtest_readers = 0;
+	rwtest_maxreaders = 0;
+	rwtest_failed = false;
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("rwtest", NULL, rwtestthread, NULL, i);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+
+	kprintf("Most concurrent readers: %u\n", rwtest_maxreaders);
+	if (rwtest_failed) {
+		kprintf("Test failed\n");
+	}
+	kprintf("Rwlock test done.\n");
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Handoff benchmark.
+ *
+ * Measures how fast ownership moves between threads through each
+ * primitive: two threads ping-ponging a pair of semaphores, a group
+ * of threads passing a lock around, and a bounded buffer with one
+ * producer and several consumers using a lock and two CVs. The
+ * producer uses cv_broadcast, which used to wake every consumer for
+ * each item.
+ */
+
+#define NHANDOFFS        2000
+#define NHANDOFFTHREADS  8
+#define HANDOFF_BUFSIZE  4
+
+static struct semaphore *hsem_ping;
+static struct semaphore *hsem_pong;
+static struct lock *hlock;
+static struct cv *hcv_full;
+static struct cv *hcv_empty;
+static volatile unsigned hbuf_count;
+static volatile unsigned hconsumed;
+static volatile bool hproducer_done;
+
+static
+void
+handoff_report(const char *what, unsigned count,
+	       const struct timespec *start)
+{
+	struct timespec ts;
+	uint64_t ns;
+
+	gettime(&ts);
+	timespec_sub(&ts, start, &ts);
+	ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	if (ns == 0) {
+		ns = 1;
+	}
+	kprintf("%-10s %u handoffs in %llu.%09lu seconds: %llu/sec\n",
+		what, count, (unsigned long long)ts.tv_sec,
+		(unsigned long)ts.tv_nsec,
+		(unsigned long long)(count * 1000000000ULL / ns));
+}
+
+static
+void
+handoff_pongthread(void *junk, unsigned long junk2)
+{
+	unsigned i;
+
+	(void)junk;
+	(void)junk2;
+
+	for (i=0; i<NHANDOFFS; i++) {
+		P(hsem_ping);
+		V(hsem_pong);
+	}
+	V(donesem);
+}
+
+static
+void
+handoff_lockthread(void *junk, unsigned long junk2)
+{
+	unsigned i;
+
+	(void)junk;
+	(void)junk2;
+
+	for (i=0; i<NHANDOFFS/NHANDOFFTHREADS; i++) {
+		lock_acquire(hlock);
+		testval1++;
+		/* Let the others pile up behind us. */
+		thread_yield();
+		lock_release(hlock);
+	}
+	V(donesem);
+}
+
+static
+void
+handoff_producer(void *junk, unsigned long junk2)
+{
+	unsigned i;
+
+	(void)junk;
+	(void)junk2;
+
+	for (i=0; i<NHANDOFFS; i++) {
+		lock_acquire(hlock);
+		while (hbuf_count == HANDOFF_BUFSIZE) {
+			cv_wait(hcv_empty, hlock);
+		}
+		hbuf_count++;
+		cv_broadcast(hcv_full, hlock);
+		lock_release(hlock);
+	}
+
+	lock_acquire(hlock);
+	hproducer_done = true;
+	cv_broadcast(hcv_full, hlock);
+	lock_release(hlock);
+
+	V(donesem);
+}
+
+static
+void
+handoff_consumer(void *junk, unsigned long junk2)
+{
+	(void)junk;
+	(void)junk2;
+
+	lock_acquire(hlock);
+	while (1) {
+		while (hbuf_count == 0 && !hproducer_done) {
+			cv_wait(hcv_full, hlock);
+		}
+		if (hbuf_count == 0) {
+			break;
+		}
+		hbuf_count--;
+		hconsumed++;
+		cv_signal(hcv_empty, hlock);
+	}
+	lock_release(hlock);
+
+	V(donesem);
+}
+
+static
+void
+handoff_fork(const char *name, void (*func)(void *, unsigned long))
+{
+	int result;
+
+	result = thread_fork(name, NULL, func, NULL, 0);
+	if (result) {
+		panic("handofftest: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+}
+
+int
+handofftest(int nargs, char **args)
+{
+	struct timespec start;
+	unsigned i;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting handoff benchmark...\n");
+
+	hsem_ping = sem_create("hsem_ping", 0);
+	hsem_pong = sem_create("hsem_pong", 0);
+	hlock = lock_create("hlock");
+	hcv_full = cv_create("hcv_full");
+	hcv_empty = cv_create("hcv_empty");
+	if (hsem_ping == NULL || hsem_pong == NULL || hlock == NULL ||
+	    hcv_full == NULL || hcv_empty == NULL) {
+		panic("handofftest: out of memory\n");
+	}
+
+	/* Semaphore ping-pong: two handoffs per round trip. */
+	gettime(&start);
+	handoff_fork("handoff-pong", handoff_pongthread);
+	for (i=0; i<NHANDOFFS; i++) {
+		V(hsem_ping);
+		P(hsem_pong);
+	}
+	P(donesem);
+	handoff_report("semaphore", 2*NHANDOFFS, &start);
+
+	/* Lock passing. */
+	testval1 = 0;
+	gettime(&start);
+	for (i=0; i<NHANDOFFTHREADS; i++) {
+		handoff_fork("handoff-lock", handoff_lockthread);
+	}
+	for (i=0; i<NHANDOFFTHREADS; i++) {
+		P(donesem);
+	}
+	handoff_report("lock", testval1, &start);
+
+	/* Bounded buffer. */
+	hbuf_count = 0;
+	hconsumed = 0;
+	hproducer_done = false;
+	gettime(&start);
+	handoff_fork("handoff-producer", handoff_producer);
+	for (i=0; i<NHANDOFFTHREADS-1; i++) {
+		handoff_fork("handoff-consumer", handoff_consumer);
+	}
+	for (i=0; i<NHANDOFFTHREADS; i++) {
+		P(donesem);
+	}
+	handoff_report("cv", hconsumed, &start);
+	if (hconsumed != NHANDOFFS) {
+		kprintf("Test failed: consumed %u of %u items\n",
+			hconsumed, NHANDOFFS);
+	}
+
+	cv_destroy(hcv_empty);
+	cv_destroy(hcv_full);
+	lock_destroy(hlock);
+	sem_destroy(hsem_pong);
+	sem_destroy(hsem_ping);
+
+	kprintf("Handoff benchmark done.\n");
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+
 /*
  * Try to find out if going to sleep is really atomic.
  *
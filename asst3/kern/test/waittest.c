@@ -31,6 +31,7 @@
  * Wait test code.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <kern/wait.h>
 #include <lib.h>
 #include <stdarg.h>
@@ -147,6 +148,8 @@ waittest(int nargs, char **args)
 
 	pid_t kids2[NTHREADS];
 	int kids2_head = 0, kids2_tail = 0;
+	int statuses[NTHREADS];
+	unsigned j, nreaped;
 
 	(void)nargs;
 	(void)args;
@@ -257,6 +260,70 @@ waittest(int nargs, char **args)
 		printstatus(kid, err, status);
 	}
 
+	/*
+	 * This fourth set is waited for with WAIT_ANY, so we should
+	 * get every pid back once, in whatever order they exit.
+	 */
+
+	kprintf("\n");
+	kprintf("Set 4 (wait for any should always succeed)\n");
+	kprintf("------------------------------------------\n");
+
+	for (i = 0; i < NTHREADS; i++) {
+		err = dofork("wait test thread", waitfirstthread, NULL, i,
+			     &kid);
+		if (err) {
+			panic("waittest: dofork failed (%d)\n", err);
+		}
+		kprintf("Spawned pid %d\n", kid);
+	}
+
+	for (i = 0; i < NTHREADS; i++) {
+		kprintf("Waiting on any pid...\n");
+		err = pid_wait(WAIT_ANY, &status, 0, &kid);
+		printstatus(kid, err, status);
+	}
+
+	err = pid_wait(WAIT_ANY, &status, WNOHANG, &kid);
+	if (err != ECHILD) {
+		panic("waittest: wait for any with no children gave %d\n",
+		      err);
+	}
+
+	/*
+	 * This fifth set has all exited before we look, and should
+	 * be collected in one go by pid_reap.
+	 */
+
+	kprintf("\n");
+	kprintf("Set 5 (reap should get them all at once)\n");
+	kprintf("----------------------------------------\n");
+
+	for (i = 0; i < NTHREADS; i++) {
+		err = dofork("wait test thread", exitfirstthread, NULL, i,
+			     &kid);
+		if (err) {
+			panic("waittest: dofork failed (%d)\n", err);
+		}
+		kprintf("Spawned pid %d\n", kid);
+	}
+
+	for (i = 0; i < NTHREADS; i++) {
+		P(exitsems[i]);
+	}
+
+	for (i = 0; i < NTHREADS; i += nreaped) {
+		err = pid_reap(kids2, statuses, NTHREADS, 0, NULL, NULL,
+			       &nreaped);
+		if (err) {
+			panic("waittest: pid_reap failed (%d)\n", err);
+		}
+		kprintf("Reaped %u pids\n", nreaped);
+		for (j = 0; j < nreaped; j++) {
+			printstatus(kids2[j], 0, statuses[j]);
+		}
+	}
+
 	kprintf("\nWait test done.\n");
 
 	return 0;
@@ -53,12 +53,23 @@
 #define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
 #define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
 
+/*
+ * How long to spend measuring the cycle counter at boot.
+ */
+#define CALIBRATE_NSECS		10000000	/* 10 ms */
+
 /*
  * Once a second, everything waiting on lbolt is awakened by CPU 0.
  */
 static struct wchan *lbolt;
 static struct spinlock lbolt_lock;
 
+/*
+ * Cycle counter rate, from clock_calibrate(). All cpus are assumed
+ * to run at the same speed.
+ */
+static uint32_t cycles_per_sec;
+
 /*
  * Setup.
  */
@@ -106,6 +117,46 @@ hardclock(void)
 	thread_yield();
 }
 
+/*
+ * Find the cycle counter rate by watching it while the real-time
+ * clock advances a little. Only 32-bit deltas are taken, so the
+ * interval has to be well under a wraparound of the counter.
+ */
+void
+clock_calibrate(void)
+{
+	struct timespec start, now, diff;
+	uint32_t startcycles, cycles;
+	uint64_t nsecs;
+
+	gettime(&start);
+	startcycles = cpu_getcycles();
+	do {
+		gettime(&now);
+		timespec_sub(&now, &start, &diff);
+	} while (diff.tv_sec == 0 && diff.tv_nsec < CALIBRATE_NSECS);
+	cycles = cpu_getcycles() - startcycles;
+
+	nsecs = diff.tv_sec * 1000000000ULL + diff.tv_nsec;
+	cycles_per_sec = cycles * 1000000000ULL / nsecs;
+	kprintf("cpu0: cycle counter runs at %u Hz\n", cycles_per_sec);
+}
+
+/*
+ * Convert cycles to time. Before calibration everything is zero.
+ */
+void
+cycles_totimeval(uint64_t cycles, struct timeval *ret)
+{
+	if (cycles_per_sec == 0) {
+		ret->tv_sec = 0;
+		ret->tv_usec = 0;
+		return;
+	}
+	ret->tv_sec = cycles / cycles_per_sec;
+	ret->tv_usec = (cycles % cycles_per_sec) * 1000000 / cycles_per_sec;
+}
+
 /*
  * Suspend execution for n seconds.
  */
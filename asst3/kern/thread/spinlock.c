@@ -43,6 +43,23 @@
  * Spinlocks.
  */
 
+/*
+ * List of spinlocks that have ever been contended, for the
+ * statistics report. Locks are added the first time they have to
+ * spin and removed by spinlock_cleanup. The list lock itself is
+ * never put on the list.
+ */
+static struct spinlock spinlock_statslock = SPINLOCK_INITIALIZER;
+static struct spinlock *spinlock_contended;
+
+/*
+ * Current statistics generation; see spinlock.h. Only changed under
+ * spinlock_statslock, but read by everyone without it.
+ */
+static volatile uint32_t spinlock_statsgen;
+
+/* Number of locks shown by spinlock_printstats. */
+#define SPINLOCK_NSHOW 10
 
 /*
  * Initialize spinlock.
@@ -50,8 +67,18 @@
 void
 spinlock_init(struct spinlock *splk)
 {
-	spinlock_data_set(&splk->splk_lock, 0);
+	spinlock_data_set(&splk->splk_next, 0);
+	spinlock_data_set(&splk->splk_serving, 0);
 	splk->splk_holder = NULL;
+	splk->splk_name = NULL;
+	splk->splk_acquires = 0;
+	splk->splk_contended = 0;
+	splk->splk_spins = 0;
+	splk->splk_maxhold = 0;
+	splk->splk_holdstart = 0;
+	splk->splk_statsgen = spinlock_statsgen;
+	splk->splk_tracked = false;
+	splk->splk_nexttracked = NULL;
 	HANGMAN_LOCKABLEINIT(&splk->splk_hangman, "spinlock");
 }
 
@@ -61,21 +88,56 @@ spinlock_init(struct spinlock *splk)
 void
 spinlock_cleanup(struct spinlock *splk)
 {
+	struct spinlock **pp;
+
 	KASSERT(splk->splk_holder == NULL);
-	KASSERT(spinlock_data_get(&splk->splk_lock) == 0);
+	KASSERT(spinlock_data_get(&splk->splk_next) ==
+		spinlock_data_get(&splk->splk_serving));
+
+	if (splk->splk_tracked) {
+		spinlock_acquire(&spinlock_statslock);
+		for (pp = &spinlock_contended; *pp != NULL;
+		     pp = &(*pp)->splk_nexttracked) {
+			if (*pp == splk) {
+				*pp = splk->splk_nexttracked;
+				break;
+			}
+		}
+		spinlock_release(&spinlock_statslock);
+		splk->splk_tracked = false;
+		splk->splk_nexttracked = NULL;
+	}
+}
+
+/*
+ * Put a lock on the contended list. Called with the lock held.
+ */
+static
+void
+spinlock_track(struct spinlock *splk)
+{
+	spinlock_acquire(&spinlock_statslock);
+	if (!splk->splk_tracked) {
+		splk->splk_nexttracked = spinlock_contended;
+		spinlock_contended = splk;
+		splk->splk_tracked = true;
+	}
+	spinlock_release(&spinlock_statslock);
 }
 
 /*
  * Get the lock.
  *
  * First disable interrupts (otherwise, if we get a timer interrupt we
- * might come back to this lock and deadlock), then use a machine-level
- * atomic operation to wait for the lock to be free.
+ * might come back to this lock and deadlock), then take a ticket and
+ * wait for it to be served.
  */
 void
 spinlock_acquire(struct spinlock *splk)
 {
 	struct cpu *mycpu;
+	spinlock_data_t ticket;
+	uint32_t spins;
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -93,29 +155,39 @@ spinlock_acquire(struct spinlock *splk)
 		mycpu = NULL;
 	}
 
-	while (1) {
-		/*
-		 * Do test-test-and-set, that is, read first before
-		 * doing test-and-set, to reduce bus contention.
-		 *
-		 * Test-and-set is a machine-level atomic operation
-		 * that writes 1 into the lock word and returns the
-		 * previous value. If that value was 0, the lock was
-		 * previously unheld and we now own it. If it was 1,
-		 * we don't.
-		 */
-		if (spinlock_data_get(&splk->splk_lock) != 0) {
-			continue;
-		}
-		if (spinlock_data_testandset(&splk->splk_lock) != 0) {
-			continue;
-		}
-		break;
+	/*
+	 * Fetch-and-increment is a machine-level atomic operation
+	 * that returns the old value, so every CPU gets a distinct
+	 * ticket. While waiting we only read splk_serving, which
+	 * stays in our cache until the holder releases the lock.
+	 */
+	ticket = spinlock_data_fetchinc(&splk->splk_next);
+	spins = 0;
+	while (spinlock_data_get(&splk->splk_serving) != ticket) {
+		spins++;
 	}
 
 	membar_store_any();
 	splk->splk_holder = mycpu;
 
+	if (splk->splk_statsgen != spinlock_statsgen) {
+		/* The statistics were reset since we last had the lock. */
+		splk->splk_statsgen = spinlock_statsgen;
+		splk->splk_acquires = 0;
+		splk->splk_contended = 0;
+		splk->splk_spins = 0;
+		splk->splk_maxhold = 0;
+	}
+	splk->splk_acquires++;
+	if (spins > 0) {
+		splk->splk_contended++;
+		splk->splk_spins += spins;
+		if (!splk->splk_tracked && splk != &spinlock_statslock) {
+			spinlock_track(splk);
+		}
+	}
+	splk->splk_holdstart = cpu_getcycles();
+
 	if (CURCPU_EXISTS()) {
 		HANGMAN_ACQUIRE(&curcpu->c_hangman, &splk->splk_hangman);
 	}
@@ -127,6 +199,8 @@ spinlock_acquire(struct spinlock *splk)
 void
 spinlock_release(struct spinlock *splk)
 {
+	uint32_t held;
+
 	/* this must work before curcpu initialization */
 	if (CURCPU_EXISTS()) {
 		KASSERT(splk->splk_holder == curcpu->c_self);
@@ -135,9 +209,16 @@ spinlock_release(struct spinlock *splk)
 		HANGMAN_RELEASE(&curcpu->c_hangman, &splk->splk_hangman);
 	}
 
+	held = cpu_getcycles() - splk->splk_holdstart;
+	if (held > splk->splk_maxhold) {
+		splk->splk_maxhold = held;
+	}
+
 	splk->splk_holder = NULL;
 	membar_any_store();
-	spinlock_data_set(&splk->splk_lock, 0);
+	/* Only the holder writes splk_serving, so no atomic op needed. */
+	spinlock_data_set(&splk->splk_serving,
+			  spinlock_data_get(&splk->splk_serving) + 1);
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
@@ -154,3 +235,94 @@ spinlock_do_i_hold(struct spinlock *splk)
 	/* Assume we can read splk_holder atomically enough for this to work */
 	return (splk->splk_holder == curcpu->c_self);
 }
+
+/*
+ * Set the name shown in the statistics report.
+ */
+void
+spinlock_setname(struct spinlock *splk, const char *name)
+{
+	splk->splk_name = name;
+}
+
+/*
+ * Print the SPINLOCK_NSHOW locks that have spun the most.
+ *
+ * Copy the numbers out under the list lock (the locks themselves are
+ * not taken, so the numbers may be very slightly stale) and print
+ * afterwards, so we aren't holding a spinlock across console output.
+ * A lock that hasn't been acquired since the last reset still has
+ * its old numbers, which count as zero.
+ */
+void
+spinlock_printstats(void)
+{
+	struct {
+		const void *addr;
+		const char *name;
+		uint32_t acquires;
+		uint32_t contended;
+		uint64_t spins;
+		uint32_t maxhold;
+	} top[SPINLOCK_NSHOW];
+	struct spinlock *splk;
+	unsigned ntop, total, i, j;
+
+	ntop = total = 0;
+	spinlock_acquire(&spinlock_statslock);
+	for (splk = spinlock_contended; splk != NULL;
+	     splk = splk->splk_nexttracked) {
+		total++;
+		if (splk->splk_statsgen != spinlock_statsgen) {
+			continue;
+		}
+		/* Insertion sort into top[], most spins first. */
+		for (i = 0; i < ntop; i++) {
+			if (splk->splk_spins > top[i].spins) {
+				break;
+			}
+		}
+		if (i == SPINLOCK_NSHOW) {
+			continue;
+		}
+		if (ntop < SPINLOCK_NSHOW) {
+			ntop++;
+		}
+		for (j = ntop - 1; j > i; j--) {
+			top[j] = top[j-1];
+		}
+		top[i].addr = splk;
+		top[i].name = splk->splk_name;
+		top[i].acquires = splk->splk_acquires;
+		top[i].contended = splk->splk_contended;
+		top[i].spins = splk->splk_spins;
+		top[i].maxhold = splk->splk_maxhold;
+	}
+	spinlock_release(&spinlock_statslock);
+
+	kprintf("%u contended spinlocks\n", total);
+	kprintf("%-12s %-10s %10s %10s %12s %10s\n", "lock", "address",
+		"acquires", "contended", "spins", "maxhold");
+	for (i = 0; i < ntop; i++) {
+		kprintf("%-12s %-10p %10u %10u %12llu %10u\n",
+			top[i].name != NULL ? top[i].name : "-", top[i].addr,
+			top[i].acquires, top[i].contended,
+			(unsigned long long)top[i].spins, top[i].maxhold);
+	}
+}
+
+/*
+ * Clear the statistics for all locks on the contended list. The
+ * list itself is kept; locks drop off it only when destroyed.
+ *
+ * We can't take each lock to clear its numbers, since a lock being
+ * tracked is held while taking spinlock_statslock. Instead start a
+ * new generation and let each lock clear its own.
+ */
+void
+spinlock_resetstats(void)
+{
+	spinlock_acquire(&spinlock_statslock);
+	spinlock_statsgen++;
+	spinlock_release(&spinlock_statslock);
+}
@@ -100,26 +100,44 @@ P(struct semaphore *sem)
 
 	/* Use the semaphore spinlock to protect the wchan as well. */
 	spinlock_acquire(&sem->sem_lock);
-	while (sem->sem_count == 0) {
+	if (sem->sem_count > 0) {
+		sem->sem_count--;
+	}
+	else {
 		/*
-		 *
-		 * Note that we don't maintain strict FIFO ordering of
-		 * threads going through the semaphore; that is, we
-		 * might "get" it on the first try even if other
-		 * threads are waiting. Apparently according to some
-		 * textbooks semaphores must for some reason have
-		 * strict ordering. Too bad. :-)
-		 *
-		 * Exercise: how would you implement strict FIFO
-		 * ordering?
+		 * V hands its unit straight to the first sleeper
+		 * instead of adding it to the count, so when we wake
+		 * up we already have it and there's nothing to
+		 * recheck. This also means the count is only ever
+		 * nonzero when nobody is waiting, so threads go
+		 * through the semaphore in FIFO order.
 		 */
 		wchan_sleep(sem->sem_wchan, &sem->sem_lock);
 	}
-	KASSERT(sem->sem_count > 0);
-	sem->sem_count--;
 	spinlock_release(&sem->sem_lock);
 }
 
+int
+P_intr(struct semaphore *sem)
+{
+	int result;
+
+	KASSERT(sem != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&sem->sem_lock);
+	if (sem->sem_count > 0) {
+		sem->sem_count--;
+		result = 0;
+	}
+	else {
+		/* If we're not interrupted, V handed us the unit. */
+		result = wchan_sleep_intr(sem->sem_wchan, &sem->sem_lock);
+	}
+	spinlock_release(&sem->sem_lock);
+	return result;
+}
+
 void
 V(struct semaphore *sem)
 {
@@ -127,9 +145,11 @@ V(struct semaphore *sem)
 
 	spinlock_acquire(&sem->sem_lock);
 
-	sem->sem_count++;
-	KASSERT(sem->sem_count > 0);
-	wchan_wakeone(sem->sem_wchan, &sem->sem_lock);
+	/* Give the unit to a sleeper if there is one; see P. */
+	if (wchan_wakemany(sem->sem_wchan, &sem->sem_lock, 1) == 0) {
+		sem->sem_count++;
+		KASSERT(sem->sem_count > 0);
+	}
 
 	spinlock_release(&sem->sem_lock);
 }
@@ -193,11 +213,14 @@ lock_acquire(struct lock *lock)
 	HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
 
 	KASSERT(lock->lk_holder != curthread);
-	while (lock->lk_holder != NULL) {
-		/* As in the semaphore. */
+	if (lock->lk_holder == NULL) {
+		lock->lk_holder = curthread;
+	}
+	else {
+		/* lock_release makes us the holder before waking us. */
 		wchan_sleep(lock->lk_wchan, &lock->lk_lock);
+		KASSERT(lock->lk_holder == curthread);
 	}
-	lock->lk_holder = curthread;
 
 	/* Call this (atomically) once the lock is acquired */
 	HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
@@ -205,6 +228,40 @@ lock_acquire(struct lock *lock)
 	spinlock_release(&lock->lk_lock);
 }
 
+int
+lock_acquire_intr(struct lock *lock)
+{
+	int result;
+
+	DEBUGASSERT(lock != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&lock->lk_lock);
+
+	HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
+
+	KASSERT(lock->lk_holder != curthread);
+	if (lock->lk_holder == NULL) {
+		lock->lk_holder = curthread;
+		result = 0;
+	}
+	else {
+		/* If we're not interrupted, lock_release handed it over. */
+		result = wchan_sleep_intr(lock->lk_wchan, &lock->lk_lock);
+		KASSERT((lock->lk_holder == curthread) == (result == 0));
+	}
+
+	if (result) {
+		HANGMAN_GIVEUP(&curthread->t_hangman, &lock->lk_hangman);
+	}
+	else {
+		HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
+	}
+
+	spinlock_release(&lock->lk_lock);
+	return result;
+}
+
 void
 lock_release(struct lock *lock)
 {
@@ -213,8 +270,12 @@ lock_release(struct lock *lock)
 	spinlock_acquire(&lock->lk_lock);
 
 	KASSERT(lock->lk_holder == curthread);
-	lock->lk_holder = NULL;
-	wchan_wakeone(lock->lk_wchan, &lock->lk_lock);
+
+	/*
+	 * Pass the lock directly to the first waiter, if any, so
+	 * it doesn't have to wake up and compete for it.
+	 */
+	lock->lk_holder = wchan_handoff(lock->lk_wchan, &lock->lk_lock);
 
 	/* Call this (atomically) when the lock is released */
 	HANGMAN_RELEASE(&curthread->t_hangman, &lock->lk_hangman);
@@ -280,38 +341,209 @@ cv_destroy(struct cv *cv)
 	kfree(cv);
 }
 
+/*
+ * Wake up to N threads waiting on CV. If the caller holds LOCK, as it
+ * normally does, the waiters aren't woken but moved to the lock's wait
+ * channel instead. lock_release then hands them the lock one at a
+ * time, rather than waking them all at once only for all but one to
+ * go straight back to sleep on the lock.
+ *
+ * Lock order: cv_wchanlock before lk_lock, as in cv_wait.
+ */
+static
+void
+cv_wake(struct cv *cv, struct lock *lock, unsigned n)
+{
+	spinlock_acquire(&cv->cv_wchanlock);
+	spinlock_acquire(&lock->lk_lock);
+	if (lock->lk_holder == curthread) {
+		wchan_transfer(cv->cv_wchan, &cv->cv_wchanlock,
+			       lock->lk_wchan, &lock->lk_lock, n);
+		spinlock_release(&lock->lk_lock);
+	}
+	else {
+		spinlock_release(&lock->lk_lock);
+		wchan_wakemany(cv->cv_wchan, &cv->cv_wchanlock, n);
+	}
+	spinlock_release(&cv->cv_wchanlock);
+}
+
 void
 cv_wait(struct cv *cv, struct lock *lock)
 {
 	spinlock_acquire(&cv->cv_wchanlock);
 	lock_release(lock);
-	wchan_sleep(cv->cv_wchan, &cv->cv_wchanlock);
+	wchan_sleep_norelock(cv->cv_wchan, &cv->cv_wchanlock);
+
 	/*
-	 * It is kind of silly to acquire this spinlock in wchan_sleep
-	 * and then release it right away. If we were going for
-	 * performance we might pass a flag to avoid that in this
-	 * case. Or we might use lock->lk_lock to protect the wchan
-	 * and separate out enough of the lock_acquire/lock_release
-	 * logic to make that work cleanly.
+	 * If cv_wake moved us to the lock, we were woken by
+	 * lock_release and already hold it. Otherwise go get it.
+	 * Either way, don't touch CV again: once we're off its wait
+	 * channel, its owner is free to destroy it.
 	 */
-	spinlock_release(&cv->cv_wchanlock);
-	lock_acquire(lock);
+	spinlock_acquire(&lock->lk_lock);
+	if (lock->lk_holder == curthread) {
+		HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
+		HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
+		spinlock_release(&lock->lk_lock);
+	}
+	else {
+		spinlock_release(&lock->lk_lock);
+		lock_acquire(lock);
+	}
 }
 
 void
 cv_signal(struct cv *cv, struct lock *lock)
 {
-	(void)lock;
-	spinlock_acquire(&cv->cv_wchanlock);
-	wchan_wakeone(cv->cv_wchan, &cv->cv_wchanlock);
-	spinlock_release(&cv->cv_wchanlock);
+	cv_wake(cv, lock, 1);
 }
 
 void
 cv_broadcast(struct cv *cv, struct lock *lock)
 {
-	(void)lock;
-	spinlock_acquire(&cv->cv_wchanlock);
-	wchan_wakeall(cv->cv_wchan, &cv->cv_wchanlock);
-	spinlock_release(&cv->cv_wchanlock);
+	cv_wake(cv, lock, (unsigned)-1);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmalloc(sizeof(*rw));
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rw_name = kstrdup(name);
+	if (rw->rw_name == NULL) {
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_readwchan = wchan_create(rw->rw_name);
+	if (rw->rw_readwchan == NULL) {
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_writewchan = wchan_create(rw->rw_name);
+	if (rw->rw_writewchan == NULL) {
+		wchan_destroy(rw->rw_readwchan);
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	spinlock_init(&rw->rw_lock);
+	rw->rw_readers = 0;
+	rw->rw_writewaiters = 0;
+	rw->rw_writer = NULL;
+
+	return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	KASSERT(rw->rw_readers == 0);
+	KASSERT(rw->rw_writewaiters == 0);
+	KASSERT(rw->rw_writer == NULL);
+	spinlock_cleanup(&rw->rw_lock);
+	wchan_destroy(rw->rw_writewchan);
+	wchan_destroy(rw->rw_readwchan);
+
+	kfree(rw->rw_name);
+	kfree(rw);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	/* Stand aside for waiting writers as well as the active one. */
+	while (rw->rw_writer != NULL || rw->rw_writewaiters > 0) {
+		wchan_sleep(rw->rw_readwchan, &rw->rw_lock);
+	}
+	rw->rw_readers++;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_readers > 0);
+	KASSERT(rw->rw_writer == NULL);
+	rw->rw_readers--;
+	if (rw->rw_readers == 0) {
+		wchan_wakeone(rw->rw_writewchan, &rw->rw_lock);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	rw->rw_writewaiters++;
+	while (rw->rw_writer != NULL || rw->rw_readers > 0) {
+		wchan_sleep(rw->rw_writewchan, &rw->rw_lock);
+	}
+	rw->rw_writewaiters--;
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer == curthread);
+	KASSERT(rw->rw_readers == 0);
+	rw->rw_writer = NULL;
+	/*
+	 * Hand off to the next writer if there is one; otherwise let
+	 * all the waiting readers in together.
+	 */
+	if (rw->rw_writewaiters > 0) {
+		wchan_wakeone(rw->rw_writewchan, &rw->rw_lock);
+	}
+	else {
+		wchan_wakeall(rw->rw_readwchan, &rw->rw_lock);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+	bool ret;
+
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	ret = (rw->rw_writer == curthread);
+	spinlock_release(&rw->rw_lock);
+
+	return ret;
 }
@@ -35,6 +35,7 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/ktrace.h>
 #include <kern/wait.h>
 #include <limits.h>
 #include <lib.h>
@@ -42,6 +43,7 @@
 #include <cpu.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <membar.h>
 #include <wchan.h>
 #include <thread.h>
 #include <threadlist.h>
@@ -72,6 +74,21 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/*
+ * Kernel event trace state. ktrace_mask is read without locking on
+ * every traced path; the rest is protected by ktrace_lock, which
+ * also serializes readers.
+ */
+volatile unsigned ktrace_mask;
+static volatile pid_t ktrace_tracer;
+static struct spinlock ktrace_lock = SPINLOCK_INITIALIZER_NAMED("ktrace");
+
+/*
+ * Protects every thread's t_intr* fields. Comes after any wchan's
+ * spinlock in the lock order.
+ */
+static struct spinlock intr_lock = SPINLOCK_INITIALIZER_NAMED("intr");
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -144,6 +161,14 @@ thread_create(const char *name)
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
 	HANGMAN_ACTORINIT(&thread->t_hangman, thread->t_name);
+	thread->t_readycycles = 0;
+	thread->t_lastlatency = 0;
+	thread->t_maxlatency = 0;
+	bzero(&thread->t_usage, sizeof(thread->t_usage));
+	thread->t_usagemark = 0;
+	thread->t_intrpending = false;
+	thread->t_intrwchan = NULL;
+	thread->t_intrlock = NULL;
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
@@ -182,14 +207,21 @@ cpu_create(unsigned hardware_number)
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
+	bzero(&c->c_schedstats, sizeof(c->c_schedstats));
+	c->c_schedtrace_next = 0;
+	c->c_ktrace = NULL;
+	c->c_ktrace_next = 0;
+	c->c_ktrace_read = 0;
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
 	spinlock_init(&c->c_runqueue_lock);
+	spinlock_setname(&c->c_runqueue_lock, "runqueue");
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
 	spinlock_init(&c->c_ipi_lock);
+	spinlock_setname(&c->c_ipi_lock, "ipi");
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
 	if (result != 0) {
@@ -445,6 +477,35 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Record a scheduler event in the current cpu's trace ring. T may be
+ * null. Must be called with interrupts off, so nothing on this cpu
+ * can come in and record over us.
+ */
+static
+void
+schedtrace_record(unsigned type, const struct thread *t, uint32_t arg)
+{
+	struct schedevent *se;
+	unsigned i;
+
+	se = &curcpu->c_schedtrace[curcpu->c_schedtrace_next
+				   & (SCHEDTRACE_SIZE - 1)];
+	curcpu->c_schedtrace_next++;
+
+	se->se_cycles = cpu_getcycles();
+	se->se_arg = arg;
+	se->se_type = type;
+	se->se_thread = t;
+	i = 0;
+	if (t != NULL) {
+		for (; i < SCHEDTRACE_NAMELEN - 1 && t->t_name[i]; i++) {
+			se->se_name[i] = t->t_name[i];
+		}
+	}
+	se->se_name[i] = 0;
+}
+
 /*
  * Make a thread runnable.
  *
@@ -471,6 +532,10 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	target->t_state = S_READY;
 	threadlist_addtail(&targetcpu->c_runqueue, target);
 
+	/* Note when, so thread_switch can tell how long it waited. */
+	target->t_readycycles = cpu_getcycles();
+	schedtrace_record(SCHEDEV_WAKEUP, target, targetcpu->c_number);
+
 	if (targetcpu->c_isidle && targetcpu != curcpu->c_self) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -565,6 +630,10 @@ void
 thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 {
 	struct thread *cur, *next;
+	struct schedstats *ss;
+	uint32_t now, idlestart, latency;
+	unsigned rqlen;
+	bool idled;
 	int spl;
 
 	DEBUGASSERT(curcpu->c_curthread == curthread);
@@ -597,6 +666,15 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		return;
 	}
 
+	/* Charge our time so far, and count the switch. */
+	thread_chargekernel();
+	if (newstate == S_SLEEP) {
+		cur->t_usage.u_nvcsw++;
+	}
+	else if (newstate == S_READY) {
+		cur->t_usage.u_nivcsw++;
+	}
+
 	/* Put the thread in the right place. */
 	switch (newstate) {
 	    case S_RUN:
@@ -642,10 +720,19 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	 */
 
 	/* The current cpu is now idle. */
+	ss = &curcpu->c_schedstats;
+	idled = false;
+	idlestart = 0;
 	curcpu->c_isidle = true;
 	do {
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
+			if (!idled) {
+				idled = true;
+				idlestart = cpu_getcycles();
+				ss->ss_idles++;
+				schedtrace_record(SCHEDEV_IDLE, NULL, 0);
+			}
 			spinlock_release(&curcpu->c_runqueue_lock);
 			cpu_idle();
 			spinlock_acquire(&curcpu->c_runqueue_lock);
@@ -653,6 +740,40 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	} while (next == NULL);
 	curcpu->c_isidle = false;
 
+	/*
+	 * Update the statistics. The ready time may have been taken
+	 * on another cpu, whose cycle counter need not agree with
+	 * ours; throw away latencies that come out negative.
+	 */
+	now = cpu_getcycles();
+	if (idled) {
+		ss->ss_idlecycles += now - idlestart;
+		schedtrace_record(SCHEDEV_UNIDLE, NULL, now - idlestart);
+	}
+	rqlen = curcpu->c_runqueue.tl_count;
+	if (rqlen >= SCHED_RQHIST_SIZE) {
+		rqlen = SCHED_RQHIST_SIZE - 1;
+	}
+	ss->ss_rqhist[rqlen]++;
+	ss->ss_switches++;
+	latency = now - next->t_readycycles;
+	if (latency < 0x80000000) {
+		next->t_lastlatency = latency;
+		if (latency > next->t_maxlatency) {
+			next->t_maxlatency = latency;
+		}
+		ss->ss_latcount++;
+		ss->ss_lattotal += latency;
+		if (latency > ss->ss_latmax) {
+			ss->ss_latmax = latency;
+		}
+	}
+	schedtrace_record(SCHEDEV_SWITCH, next, latency);
+	if (KTRACE_ON(KTRACE_SWITCH)) {
+		ktrace_record(KTRACE_SWITCH, 0, next->t_readycycles,
+			      (uint32_t)next, 0);
+	}
+
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
 	 * curthread and it may not be, depending on how curthread and
@@ -717,6 +838,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	cur->t_wchan_name = NULL;
 	cur->t_state = S_RUN;
 
+	/* Time charged to us starts now. */
+	cur->t_usagemark = cpu_getcycles();
+
 	/* Unlock the run queue. */
 	spinlock_release(&curcpu->c_runqueue_lock);
 
@@ -750,6 +874,9 @@ thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
 	cur->t_wchan_name = NULL;
 	cur->t_state = S_RUN;
 
+	/* Time charged to us starts now. */
+	cur->t_usagemark = cpu_getcycles();
+
 	/* Release the runqueue lock acquired in thread_switch. */
 	spinlock_release(&curcpu->c_runqueue_lock);
 
@@ -924,6 +1051,8 @@ thread_consider_migration(void)
 
 			t->t_cpu = c;
 			threadlist_addtail(&c->c_runqueue, t);
+			curcpu->c_schedstats.ss_migrations++;
+			schedtrace_record(SCHEDEV_MIGRATE, t, c->c_number);
 			DEBUG(DB_THREADS,
 			      "Migrated thread %s: cpu %u -> %u",
 			      t->t_name, curcpu->c_number, c->c_number);
@@ -1019,11 +1148,124 @@ wchan_sleep(struct wchan *wc, struct spinlock *lk)
 	spinlock_acquire(lk);
 }
 
+/*
+ * Same as wchan_sleep, but leave LK unlocked afterwards. The thread
+ * may have been moved to another wait channel, and LK freed, while
+ * it slept.
+ */
+void
+wchan_sleep_norelock(struct wchan *wc, struct spinlock *lk)
+{
+	KASSERT(!curthread->t_in_interrupt);
+	KASSERT(spinlock_do_i_hold(lk));
+	KASSERT(curcpu->c_spinlocks == 1);
+
+	thread_switch(S_SLEEP, wc, lk);
+}
+
+/*
+ * Same as wchan_sleep, but thread_interrupt can cut the sleep short,
+ * in which case EINTR is returned. The thread wasn't woken by
+ * wchan_wake* or wchan_handoff then, so it didn't get whatever the
+ * caller was waiting to be handed.
+ *
+ * thread_interrupt locks LK without any other guarantee that it's
+ * still there, so WC and LK must not be destroyed while a thread
+ * that might be interrupted could be sleeping on them.
+ */
+int
+wchan_sleep_intr(struct wchan *wc, struct spinlock *lk)
+{
+	struct thread *cur = curthread;
+	bool interrupted;
+
+	KASSERT(!cur->t_in_interrupt);
+	KASSERT(spinlock_do_i_hold(lk));
+	KASSERT(curcpu->c_spinlocks == 1);
+
+	spinlock_acquire(&intr_lock);
+	if (cur->t_intrpending) {
+		spinlock_release(&intr_lock);
+		return EINTR;
+	}
+	cur->t_intrwchan = wc;
+	cur->t_intrlock = lk;
+	spinlock_release(&intr_lock);
+
+	thread_switch(S_SLEEP, wc, lk);
+	spinlock_acquire(lk);
+
+	/* thread_interrupt clears t_intrwchan when it wakes us. */
+	spinlock_acquire(&intr_lock);
+	interrupted = (cur->t_intrwchan == NULL);
+	cur->t_intrwchan = NULL;
+	cur->t_intrlock = NULL;
+	spinlock_release(&intr_lock);
+
+	return interrupted ? EINTR : 0;
+}
+
+/*
+ * Interrupt a thread. If it's not in wchan_sleep_intr it will see
+ * t_intrpending the next time it tries. If it is, it's still on the
+ * channel unless something else already woke it; either way it
+ * can't get out of wchan_sleep_intr while we hold the channel lock.
+ */
+void
+thread_interrupt(struct thread *t)
+{
+	struct wchan *wc;
+	struct spinlock *lk;
+	struct threadlistnode *tln;
+	bool found;
+
+	spinlock_acquire(&intr_lock);
+	t->t_intrpending = true;
+	wc = t->t_intrwchan;
+	lk = t->t_intrlock;
+	spinlock_release(&intr_lock);
+
+	if (wc == NULL) {
+		return;
+	}
+
+	spinlock_acquire(lk);
+	found = false;
+	spinlock_acquire(&intr_lock);
+	if (t->t_intrwchan == wc) {
+		for (tln = wc->wc_threads.tl_head.tln_next;
+		     tln->tln_self != NULL; tln = tln->tln_next) {
+			if (tln->tln_self == t) {
+				found = true;
+				break;
+			}
+		}
+	}
+	if (found) {
+		t->t_intrwchan = NULL;
+	}
+	spinlock_release(&intr_lock);
+	if (found) {
+		threadlist_remove(&wc->wc_threads, t);
+		thread_make_runnable(t, false);
+	}
+	spinlock_release(lk);
+}
+
 /*
  * Wake up one thread sleeping on a wait channel.
  */
 void
 wchan_wakeone(struct wchan *wc, struct spinlock *lk)
+{
+	(void)wchan_handoff(wc, lk);
+}
+
+/*
+ * Wake up one thread sleeping on a wait channel and return it.
+ */
+struct thread *
+wchan_handoff(struct wchan *wc, struct spinlock *lk)
 {
 	struct thread *target;
 
@@ -1034,7 +1276,7 @@ wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 
 	if (target == NULL) {
 		/* Nobody was sleeping. */
-		return;
+		return NULL;
 	}
 
 	/*
@@ -1046,6 +1288,7 @@ wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 	 */
 
 	thread_make_runnable(target, false);
+	return target;
 }
 
 /*
@@ -1053,19 +1296,33 @@ wchan_wakeone(struct wchan *wc, struct spinlock *lk)
  */
 void
 wchan_wakeall(struct wchan *wc, struct spinlock *lk)
+{
+	(void)wchan_wakemany(wc, lk, wc->wc_threads.tl_count);
+}
+
+/*
+ * Wake up to N threads sleeping on a wait channel.
+ */
+unsigned
+wchan_wakemany(struct wchan *wc, struct spinlock *lk, unsigned n)
 {
 	struct thread *target;
 	struct threadlist list;
+	unsigned count;
 
 	KASSERT(spinlock_do_i_hold(lk));
 
 	threadlist_init(&list);
 
 	/*
-	 * Grab all the threads from the channel, moving them to a
+	 * Grab the threads from the channel, moving them to a
 	 * private list.
 	 */
-	while ((target = threadlist_remhead(&wc->wc_threads)) != NULL) {
+	for (count = 0; count < n; count++) {
+		target = threadlist_remhead(&wc->wc_threads);
+		if (target == NULL) {
+			break;
+		}
 		threadlist_addtail(&list, target);
 	}
 
@@ -1079,6 +1336,32 @@ wchan_wakeall(struct wchan *wc, struct spinlock *lk)
 	}
 
 	threadlist_cleanup(&list);
+	return count;
+}
+
+/*
+ * Move up to N threads from one wait channel to another without
+ * waking them.
+ */
+unsigned
+wchan_transfer(struct wchan *from, struct spinlock *fromlk,
+	       struct wchan *to, struct spinlock *tolk, unsigned n)
+{
+	struct thread *target;
+	unsigned count;
+
+	KASSERT(spinlock_do_i_hold(fromlk));
+	KASSERT(spinlock_do_i_hold(tolk));
+
+	for (count = 0; count < n; count++) {
+		target = threadlist_remhead(&from->wc_threads);
+		if (target == NULL) {
+			break;
+		}
+		target->t_wchan_name = to->wc_name;
+		threadlist_addtail(&to->wc_threads, target);
+	}
+	return count;
 }
 
 /*
@@ -1098,6 +1381,306 @@ wchan_isempty(struct wchan *wc, struct spinlock *lk)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Scheduler statistics and tracing.
+ *
+ * These read other cpus' counters and trace rings without locking;
+ * see cpu.h.
+ */
+
+void
+thread_printschedstats(void)
+{
+	struct cpu *c;
+	const struct schedstats *ss;
+	unsigned i, j;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		ss = &c->c_schedstats;
+		kprintf("cpu%u: %u switches, %u migrated out, "
+			"idle %u times for %llu cycles\n",
+			c->c_number, ss->ss_switches, ss->ss_migrations,
+			ss->ss_idles, (unsigned long long)ss->ss_idlecycles);
+		kprintf("      latency: %u samples, avg %llu, max %u cycles\n",
+			ss->ss_latcount,
+			ss->ss_latcount == 0 ? 0ULL :
+			(unsigned long long)ss->ss_lattotal / ss->ss_latcount,
+			ss->ss_latmax);
+		kprintf("      runqueue length:");
+		for (j=0; j < SCHED_RQHIST_SIZE; j++) {
+			kprintf(" %u%s:%u", j,
+				j == SCHED_RQHIST_SIZE - 1 ? "+" : "",
+				ss->ss_rqhist[j]);
+		}
+		kprintf("\n");
+	}
+}
+
+void
+thread_resetschedstats(void)
+{
+	struct cpu *c;
+	unsigned i;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		bzero(&c->c_schedstats, sizeof(c->c_schedstats));
+	}
+}
+
+void
+thread_printschedtrace(unsigned max)
+{
+	static const char *const evnames[] = {
+		[SCHEDEV_SWITCH] = "switch",
+		[SCHEDEV_WAKEUP] = "wakeup",
+		[SCHEDEV_IDLE] = "idle",
+		[SCHEDEV_UNIDLE] = "unidle",
+		[SCHEDEV_MIGRATE] = "migrate",
+	};
+	struct schedevent se;
+	struct cpu *c;
+	unsigned i, n, next, first;
+
+	if (max > SCHEDTRACE_SIZE) {
+		max = SCHEDTRACE_SIZE;
+	}
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		next = c->c_schedtrace_next;
+		first = next > max ? next - max : 0;
+		kprintf("cpu%u: last %u of %u events\n", c->c_number,
+			next - first, next);
+		for (n = first; n < next; n++) {
+			/* Copy it out first; the owner may be overwriting it. */
+			se = c->c_schedtrace[n & (SCHEDTRACE_SIZE - 1)];
+			se.se_name[SCHEDTRACE_NAMELEN - 1] = 0;
+			kprintf("  %10u %-8s %-10p %-12s %u\n", se.se_cycles,
+				se.se_type < ARRAYCOUNT(evnames) ?
+				evnames[se.se_type] : "?",
+				se.se_thread, se.se_thread ? se.se_name : "-",
+				se.se_arg);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Resource usage accounting.
+ *
+ * Each thread's time is split at the user/kernel boundary (in
+ * mips_trap) and at context switches. The cycle counters on
+ * different cpus need not agree, so a charge never spans a switch:
+ * thread_switch charges the outgoing thread and the incoming one
+ * starts a new mark.
+ */
+
+void
+usage_add(struct usage *to, const struct usage *from)
+{
+	to->u_ucycles += from->u_ucycles;
+	to->u_scycles += from->u_scycles;
+	to->u_faults += from->u_faults;
+	to->u_nvcsw += from->u_nvcsw;
+	to->u_nivcsw += from->u_nivcsw;
+	to->u_inbytes += from->u_inbytes;
+	to->u_outbytes += from->u_outbytes;
+}
+
+void
+thread_chargeuser(void)
+{
+	struct thread *cur = curthread;
+	uint32_t now;
+
+	now = cpu_getcycles();
+	cur->t_usage.u_ucycles += now - cur->t_usagemark;
+	cur->t_usagemark = now;
+}
+
+void
+thread_chargekernel(void)
+{
+	struct thread *cur = curthread;
+	uint32_t now;
+
+	now = cpu_getcycles();
+	cur->t_usage.u_scycles += now - cur->t_usagemark;
+	cur->t_usagemark = now;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Kernel event trace.
+ *
+ * Callers check KTRACE_ON() first, so that when tracing is off the
+ * cost is one load and a branch. Recording takes no locks: each cpu
+ * writes only its own ring, with interrupts off. The reader copies
+ * entries out unlocked, so one being overwritten as it's copied can
+ * come out mixed; that's the price of not locking the hot paths.
+ */
+
+/*
+ * Record an event that began at cycle count START.
+ */
+void
+ktrace_record(unsigned type, unsigned code, uint32_t start, uint32_t arg,
+	      int result)
+{
+	struct ktrace_event *ke;
+	struct cpu *c;
+	struct proc *proc;
+	pid_t pid;
+	uint32_t now;
+	int spl;
+
+	proc = curthread->t_proc;
+	pid = proc != NULL ? proc->p_pid : 0;
+	if (pid == ktrace_tracer && pid != 0) {
+		return;
+	}
+
+	spl = splhigh();
+	c = curcpu->c_self;
+	if (c->c_ktrace == NULL) {
+		/* Tracing started while we were on our way here. */
+		splx(spl);
+		return;
+	}
+	ke = &c->c_ktrace[c->c_ktrace_next & (KTRACE_SIZE - 1)];
+	c->c_ktrace_next++;
+
+	/*
+	 * If we moved cpus since START, the counters needn't agree;
+	 * as in thread_switch, discard latencies that come out
+	 * negative.
+	 */
+	now = cpu_getcycles();
+	ke->ke_cycles = now;
+	ke->ke_latency = now - start < 0x80000000 ? now - start : 0;
+	ke->ke_arg = arg;
+	ke->ke_result = result;
+	ke->ke_pid = pid;
+	ke->ke_type = type;
+	ke->ke_cpu = c->c_number;
+	ke->ke_code = code;
+	splx(spl);
+}
+
+/*
+ * Turn on tracing of the events in MASK, allocating the rings if
+ * this is the first time. The current process becomes the tracer,
+ * whose own events aren't recorded.
+ */
+int
+ktrace_start(unsigned mask)
+{
+	struct ktrace_event *ring;
+	struct cpu *c;
+	unsigned i;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c->c_ktrace != NULL) {
+			continue;
+		}
+		ring = kmalloc(KTRACE_SIZE * sizeof(*ring));
+		if (ring == NULL) {
+			return ENOMEM;
+		}
+		spinlock_acquire(&ktrace_lock);
+		if (c->c_ktrace == NULL) {
+			c->c_ktrace = ring;
+			ring = NULL;
+		}
+		spinlock_release(&ktrace_lock);
+		if (ring != NULL) {
+			/* Someone else got there first. */
+			kfree(ring);
+		}
+	}
+
+	spinlock_acquire(&ktrace_lock);
+	ktrace_tracer = curproc == kproc ? 0 : curproc->p_pid;
+	/* The rings must be visible before the mask is. */
+	membar_store_store();
+	ktrace_mask = mask & KTRACE_ALL;
+	spinlock_release(&ktrace_lock);
+	return 0;
+}
+
+/*
+ * Turn tracing off. What's been recorded can still be read.
+ */
+void
+ktrace_stop(void)
+{
+	spinlock_acquire(&ktrace_lock);
+	ktrace_mask = 0;
+	ktrace_tracer = 0;
+	spinlock_release(&ktrace_lock);
+}
+
+/*
+ * Throw away everything not yet read.
+ */
+void
+ktrace_clear(void)
+{
+	struct cpu *c;
+	unsigned i;
+
+	spinlock_acquire(&ktrace_lock);
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		c->c_ktrace_read = c->c_ktrace_next;
+	}
+	spinlock_release(&ktrace_lock);
+}
+
+/*
+ * Copy up to MAX unread events into BUF, a cpu at a time. If a ring
+ * has wrapped since it was last read, a KTRACE_LOST record says how
+ * many events were overwritten. Returns the number of records.
+ */
+unsigned
+ktrace_drain(struct ktrace_event *buf, unsigned max)
+{
+	struct cpu *c;
+	unsigned i, n, next;
+
+	n = 0;
+	spinlock_acquire(&ktrace_lock);
+	for (i=0; i < cpuarray_num(&allcpus) && n < max; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c->c_ktrace == NULL) {
+			continue;
+		}
+		next = c->c_ktrace_next;
+		if (next - c->c_ktrace_read > KTRACE_SIZE) {
+			bzero(&buf[n], sizeof(buf[n]));
+			buf[n].ke_type = KTRACE_LOST;
+			buf[n].ke_cpu = c->c_number;
+			buf[n].ke_arg = next - c->c_ktrace_read - KTRACE_SIZE;
+			n++;
+			c->c_ktrace_read = next - KTRACE_SIZE;
+		}
+		while (n < max && c->c_ktrace_read != next) {
+			buf[n++] = c->c_ktrace[c->c_ktrace_read
+					       & (KTRACE_SIZE - 1)];
+			c->c_ktrace_read++;
+		}
+	}
+	spinlock_release(&ktrace_lock);
+	return n;
+}
+
+////////////////////////////////////////////////////////////
+
 /*
  * Machine-independent IPI handling
  */
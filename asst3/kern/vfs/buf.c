@@ -0,0 +1,1053 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Buffer cache.
+ *
+ * There's a fixed pool of buffers, allocated at boot and sized from
+ * the amount of RAM. Buffers with an identity are hashed on
+ * (fs, block). Buffers nobody is holding sit on an LRU list, least
+ * recently used first; new blocks take the buffer at the head,
+ * writing it back first if it's dirty.
+ *
+ * Rather than a sleep lock per buffer, a buffer that's handed out is
+ * marked busy and anyone else who wants it waits on its b_cv. This
+ * lets eviction pass over busy buffers instead of having to block on
+ * them. Sync only waits for buffers that are busy being written back,
+ * since those are sure to come free without help from anyone.
+ *
+ * Writing back a buffer also picks up any dirty neighbors (blocks
+ * just before and after it on the same fs) and writes the whole run
+ * with one transfer. Read-ahead requests are queued for a separate
+ * thread, which reads each run of blocks that aren't cached yet with
+ * one transfer while the requester goes on. Both go through
+ * fsop_startio/fsop_finishio, so sync and read-ahead can have more
+ * than one transfer on the disk at a time.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <synch.h>
+#include <thread.h>
+#include <mainbus.h>
+#include <fs.h>
+#include <vfs.h>
+#include <device.h>
+#include <buf.h>
+
+/*
+ * The cache gets 1/BUFFER_RAMFRACTION of physical memory, but at
+ * least BUFFER_MIN buffers.
+ */
+#define BUFFER_RAMFRACTION	16
+#define BUFFER_MIN		32
+
+/* Seconds between runs of the syncer. */
+#define BUFFER_SYNCINTERVAL	5
+
+/* Most blocks written or read ahead in one go. */
+#define BUFFER_MAXCLUSTER	16
+
+/* Size of the read-ahead queue. */
+#define BUFFER_RAQUEUE		32
+
+/* Most writes sync keeps going at once. */
+#define BUFFER_SYNCPENDING	4
+
+/*
+ * A buffer.
+ *
+ * The identity, hash and LRU links, b_busy, and b_writing are
+ * protected by buffer_lock. The rest belongs to whoever has the buffer busy; it
+ * is only looked at by others when it isn't.
+ */
+struct buf {
+	struct fs *b_fs;		/* filesystem, or NULL if unused */
+	daddr_t b_block;		/* block number */
+	struct buf *b_hashnext;		/* next in hash chain */
+	struct buf *b_lruprev;		/* LRU list (when not busy) */
+	struct buf *b_lrunext;
+	bool b_busy;			/* somebody has it */
+	bool b_writing;			/* busy for buffer_writeout */
+	struct cv *b_cv;		/* wait here for !b_busy */
+	bool b_valid;			/* b_data holds the block */
+	bool b_dirty;			/* b_data needs writing back */
+	void *b_data;			/* the contents */
+};
+
+/*
+ * A transfer of a run of buffers that's been started but not
+ * finished: a cluster being written back, or a read-ahead run.
+ */
+struct bufio {
+	struct buf *bi_buf;		/* buffer it's for (writes) */
+	struct buf *bi_bufs[BUFFER_MAXCLUSTER];	/* the run */
+	unsigned bi_n;			/* buffers in the run */
+	void *bi_data;			/* staging copy, or NULL */
+	int bi_started;			/* result of FSOP_STARTIO */
+	struct devrequest bi_req;
+};
+
+static struct lock *buffer_lock;
+static struct cv *buffer_freecv;	/* wait here for any buffer */
+
+static struct buf *buffers;
+static unsigned buffer_count;
+
+static struct buf **buffer_hash;
+static unsigned buffer_hashsize;
+
+static struct buf *buffer_lruhead;
+static struct buf *buffer_lrutail;
+
+/*
+ * Read-ahead requests, in a ring; protected by buffer_lock. The
+ * read-ahead thread waits on buffer_racv for requests; buffer_rafs
+ * is the fs it's working on, if any, and it signals buffer_radonecv
+ * when it's done with it.
+ */
+struct rarequest {
+	struct fs *ra_fs;
+	daddr_t ra_block;
+	unsigned ra_count;
+};
+static struct rarequest buffer_raqueue[BUFFER_RAQUEUE];
+static unsigned buffer_rahead, buffer_ranum;
+static struct cv *buffer_racv;
+static struct cv *buffer_radonecv;
+static struct fs *buffer_rafs;
+static void *buffer_radata;	/* two runs of BUFFER_MAXCLUSTER blocks */
+
+////////////////////////////////////////////////////////////
+// Hash table and LRU list
+
+static
+unsigned
+buffer_hashfn(struct fs *fs, daddr_t block)
+{
+	return (((uintptr_t)fs >> 4) ^ block) % buffer_hashsize;
+}
+
+static
+struct buf *
+buffer_find(struct fs *fs, daddr_t block)
+{
+	struct buf *b;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	b = buffer_hash[buffer_hashfn(fs, block)];
+	while (b != NULL) {
+		if (b->b_fs == fs && b->b_block == block) {
+			return b;
+		}
+		b = b->b_hashnext;
+	}
+	return NULL;
+}
+
+static
+void
+buffer_hashadd(struct buf *b)
+{
+	unsigned ix;
+
+	ix = buffer_hashfn(b->b_fs, b->b_block);
+	b->b_hashnext = buffer_hash[ix];
+	buffer_hash[ix] = b;
+}
+
+/*
+ * Remove a buffer from the hash table and forget its identity.
+ */
+static
+void
+buffer_hashremove(struct buf *b)
+{
+	struct buf **pp;
+
+	pp = &buffer_hash[buffer_hashfn(b->b_fs, b->b_block)];
+	while (*pp != b) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->b_hashnext;
+	}
+	*pp = b->b_hashnext;
+	b->b_hashnext = NULL;
+	b->b_fs = NULL;
+	b->b_block = 0;
+}
+
+static
+void
+buffer_lruremove(struct buf *b)
+{
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		KASSERT(buffer_lruhead == b);
+		buffer_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		KASSERT(buffer_lrutail == b);
+		buffer_lrutail = b->b_lruprev;
+	}
+	b->b_lruprev = b->b_lrunext = NULL;
+}
+
+/*
+ * Put a buffer on the LRU list: at the tail if it's just been used,
+ * or at the head if it's empty and should be reused first.
+ */
+static
+void
+buffer_lruadd(struct buf *b, bool athead)
+{
+	if (buffer_lruhead == NULL) {
+		b->b_lruprev = b->b_lrunext = NULL;
+		buffer_lruhead = buffer_lrutail = b;
+	}
+	else if (athead) {
+		b->b_lruprev = NULL;
+		b->b_lrunext = buffer_lruhead;
+		buffer_lruhead->b_lruprev = b;
+		buffer_lruhead = b;
+	}
+	else {
+		b->b_lruprev = buffer_lrutail;
+		b->b_lrunext = NULL;
+		buffer_lrutail->b_lrunext = b;
+		buffer_lrutail = b;
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Internal operations
+
+/*
+ * Mark a buffer busy; buffer_lock must be held.
+ */
+static
+void
+buffer_busy(struct buf *b)
+{
+	KASSERT(!b->b_busy);
+	buffer_lruremove(b);
+	b->b_busy = true;
+}
+
+/*
+ * Undo buffer_busy and wake anyone waiting. A buffer whose contents
+ * aren't valid loses its identity, since there's nothing worth
+ * finding in it.
+ */
+static
+void
+buffer_unbusy(struct buf *b)
+{
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(b->b_busy);
+
+	if (!b->b_valid) {
+		KASSERT(!b->b_dirty);
+		if (b->b_fs != NULL) {
+			buffer_hashremove(b);
+		}
+	}
+	b->b_busy = false;
+	buffer_lruadd(b, b->b_fs == NULL);
+	cv_broadcast(b->b_cv, buffer_lock);
+	cv_signal(buffer_freecv, buffer_lock);
+}
+
+/*
+ * Gather dirty buffers that aren't busy on either side of B, which
+ * is, into CLUSTER. Returns the number of buffers, B included, in
+ * block order; all are left busy. buffer_lock must be held.
+ */
+static
+unsigned
+buffer_gather(struct buf *b, struct buf **cluster)
+{
+	struct buf *nb;
+	daddr_t first;
+	unsigned n;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	/* Look backwards for the start of the run... */
+	first = b->b_block;
+	while (first > 0 && b->b_block - first < BUFFER_MAXCLUSTER / 2) {
+		nb = buffer_find(b->b_fs, first - 1);
+		if (nb == NULL || nb->b_busy || !nb->b_dirty) {
+			break;
+		}
+		first--;
+	}
+
+	/* ...then take everything from there on. */
+	n = 0;
+	while (n < BUFFER_MAXCLUSTER) {
+		if (first + n == b->b_block) {
+			nb = b;
+		}
+		else {
+			nb = buffer_find(b->b_fs, first + n);
+			if (nb == NULL || nb->b_busy || !nb->b_dirty) {
+				if (first + n > b->b_block) {
+					break;
+				}
+				/* can't happen; we just looked */
+				panic("buffer_gather: run changed\n");
+			}
+			buffer_busy(nb);
+		}
+		nb->b_writing = true;
+		cluster[n++] = nb;
+	}
+	return n;
+}
+
+/*
+ * Start writing a busy buffer back to disk, along with any dirty
+ * neighbors that can go in the same write, and fill in IO. Called
+ * without buffer_lock. Whatever happens, buffer_finishwrite must be
+ * called on IO afterwards.
+ */
+static
+void
+buffer_startwrite(struct buf *b, struct bufio *io)
+{
+	unsigned i, n;
+
+	KASSERT(b->b_busy);
+	KASSERT(b->b_valid);
+	KASSERT(b->b_dirty);
+
+	lock_acquire(buffer_lock);
+	n = buffer_gather(b, io->bi_bufs);
+	lock_release(buffer_lock);
+
+	io->bi_buf = b;
+	io->bi_n = n;
+
+	/* If we can't get memory for the run, just do the one block. */
+	io->bi_data = (n > 1) ? kmalloc(n * BUFFER_SIZE) : NULL;
+	if (io->bi_data == NULL) {
+		io->bi_req.dr_block = b->b_block;
+		io->bi_req.dr_nblocks = 1;
+		io->bi_req.dr_data = b->b_data;
+	}
+	else {
+		for (i=0; i<n; i++) {
+			memcpy((char *)io->bi_data + i * BUFFER_SIZE,
+			       io->bi_bufs[i]->b_data, BUFFER_SIZE);
+		}
+		io->bi_req.dr_block = io->bi_bufs[0]->b_block;
+		io->bi_req.dr_nblocks = n;
+		io->bi_req.dr_data = io->bi_data;
+	}
+	io->bi_req.dr_write = true;
+	io->bi_started = FSOP_STARTIO(b->b_fs, &io->bi_req);
+}
+
+/*
+ * Wait for a write started with buffer_startwrite, mark what it
+ * wrote clean, and let the neighbors go again. The buffer it was
+ * started on stays busy for the caller.
+ */
+static
+int
+buffer_finishwrite(struct bufio *io)
+{
+	struct buf *b = io->bi_buf;
+	unsigned i;
+	int result;
+
+	result = io->bi_started;
+	if (result == 0) {
+		result = FSOP_FINISHIO(b->b_fs, &io->bi_req);
+	}
+	if (result == 0) {
+		if (io->bi_data == NULL) {
+			b->b_dirty = false;
+		}
+		else {
+			for (i=0; i<io->bi_n; i++) {
+				io->bi_bufs[i]->b_dirty = false;
+			}
+		}
+	}
+	if (io->bi_data != NULL) {
+		kfree(io->bi_data);
+	}
+
+	lock_acquire(buffer_lock);
+	for (i=0; i<io->bi_n; i++) {
+		io->bi_bufs[i]->b_writing = false;
+		if (io->bi_bufs[i] != b) {
+			buffer_unbusy(io->bi_bufs[i]);
+		}
+	}
+	/* wake sync, which may be waiting for the write and not for B */
+	cv_broadcast(b->b_cv, buffer_lock);
+	lock_release(buffer_lock);
+	return result;
+}
+
+/*
+ * Write a busy buffer back to disk, along with its dirty neighbors,
+ * and wait for it. Called without buffer_lock.
+ */
+static
+int
+buffer_writeout(struct buf *b)
+{
+	struct bufio io;
+
+	buffer_startwrite(b, &io);
+	return buffer_finishwrite(&io);
+}
+
+/*
+ * Finish NUM writes started by sync, and let their buffers go.
+ * Records the first error in *RET.
+ */
+static
+void
+buffer_finishsync(struct bufio *io, unsigned num, int *ret)
+{
+	unsigned i;
+	int result;
+
+	for (i=0; i<num; i++) {
+		result = buffer_finishwrite(&io[i]);
+		if (result && *ret == 0) {
+			*ret = result;
+		}
+		lock_acquire(buffer_lock);
+		buffer_unbusy(io[i].bi_buf);
+		lock_release(buffer_lock);
+	}
+}
+
+/*
+ * Take the least recently used buffer, write it back if needed, and
+ * hand it back busy and with no identity. Releases buffer_lock while
+ * writing, so the caller has to recheck anything it looked up.
+ *
+ * If writing a buffer back fails, it stays dirty and we move on to
+ * the next one; only if that happens for as many buffers as there
+ * are is the error returned.
+ *
+ * If WAIT is false and every buffer is busy, fails with EAGAIN
+ * instead of waiting for one.
+ */
+static
+int
+buffer_evict(bool wait, struct buf **ret)
+{
+	struct buf *b;
+	unsigned tries;
+	int result;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	for (tries = 0; ; tries++) {
+		while (buffer_lruhead == NULL) {
+			/* everything's busy */
+			if (!wait) {
+				return EAGAIN;
+			}
+			cv_wait(buffer_freecv, buffer_lock);
+		}
+		b = buffer_lruhead;
+		buffer_busy(b);
+
+		if (!b->b_dirty) {
+			break;
+		}
+		lock_release(buffer_lock);
+		result = buffer_writeout(b);
+		lock_acquire(buffer_lock);
+		if (result == 0) {
+			break;
+		}
+		/* Still dirty; it goes to the tail. */
+		buffer_unbusy(b);
+		if (tries + 1 >= buffer_count) {
+			return result;
+		}
+	}
+
+	if (b->b_fs != NULL) {
+		buffer_hashremove(b);
+		/* anyone waiting for the old block should look again */
+		cv_broadcast(b->b_cv, buffer_lock);
+	}
+	b->b_valid = false;
+
+	*ret = b;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Exported operations
+
+/*
+ * Get a buffer for a block, without reading it.
+ */
+int
+buffer_get(struct fs *fs, daddr_t block, struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	lock_acquire(buffer_lock);
+ again:
+	b = buffer_find(fs, block);
+	if (b != NULL) {
+		if (b->b_busy) {
+			cv_wait(b->b_cv, buffer_lock);
+			goto again;
+		}
+		buffer_busy(b);
+		lock_release(buffer_lock);
+		*ret = b;
+		return 0;
+	}
+
+	result = buffer_evict(true, &b);
+	if (result) {
+		lock_release(buffer_lock);
+		return result;
+	}
+
+	/* Someone may have brought the block in while we were evicting. */
+	if (buffer_find(fs, block) != NULL) {
+		buffer_unbusy(b);
+		goto again;
+	}
+
+	b->b_fs = fs;
+	b->b_block = block;
+	b->b_valid = false;
+	b->b_dirty = false;
+	buffer_hashadd(b);
+	lock_release(buffer_lock);
+
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Get a buffer for a block, reading it in if it's not already there.
+ */
+int
+buffer_read(struct fs *fs, daddr_t block, struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	result = buffer_get(fs, block, &b);
+	if (result) {
+		return result;
+	}
+
+	if (!b->b_valid) {
+		result = FSOP_READBLOCK(fs, block, b->b_data, BUFFER_SIZE);
+		if (result) {
+			buffer_release_and_invalidate(b);
+			return result;
+		}
+		b->b_valid = true;
+	}
+
+	*ret = b;
+	return 0;
+}
+
+void *
+buffer_map(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_data;
+}
+
+daddr_t
+buffer_get_block(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_block;
+}
+
+bool
+buffer_is_valid(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_valid;
+}
+
+void
+buffer_mark_valid(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	b->b_valid = true;
+}
+
+void
+buffer_mark_dirty(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	b->b_valid = true;
+	b->b_dirty = true;
+}
+
+/*
+ * Give a buffer back. Its contents stay cached.
+ */
+void
+buffer_release(struct buf *b)
+{
+	lock_acquire(buffer_lock);
+	buffer_unbusy(b);
+	lock_release(buffer_lock);
+}
+
+/*
+ * Give a buffer back and throw away its contents, dirty or not.
+ */
+void
+buffer_release_and_invalidate(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	b->b_valid = false;
+	b->b_dirty = false;
+	buffer_release(b);
+}
+
+/*
+ * Throw away any cached copy of a block.
+ */
+void
+buffer_drop(struct fs *fs, daddr_t block)
+{
+	struct buf *b;
+
+	lock_acquire(buffer_lock);
+ again:
+	b = buffer_find(fs, block);
+	if (b != NULL) {
+		if (b->b_busy) {
+			cv_wait(b->b_cv, buffer_lock);
+			goto again;
+		}
+		buffer_lruremove(b);
+		buffer_hashremove(b);
+		b->b_valid = false;
+		b->b_dirty = false;
+		buffer_lruadd(b, true);
+	}
+	lock_release(buffer_lock);
+}
+
+/*
+ * Ask for COUNT blocks starting at BLOCK to be read in the
+ * background. This is only advice: if the queue is full, the request
+ * is dropped.
+ */
+void
+buffer_readahead(struct fs *fs, daddr_t block, unsigned count)
+{
+	struct rarequest *ra;
+
+	KASSERT(count > 0);
+	if (count > BUFFER_MAXCLUSTER) {
+		count = BUFFER_MAXCLUSTER;
+	}
+
+	lock_acquire(buffer_lock);
+	if (buffer_ranum < BUFFER_RAQUEUE) {
+		ra = &buffer_raqueue[(buffer_rahead + buffer_ranum) %
+				     BUFFER_RAQUEUE];
+		ra->ra_fs = fs;
+		ra->ra_block = block;
+		ra->ra_count = count;
+		buffer_ranum++;
+		cv_signal(buffer_racv, buffer_lock);
+	}
+	lock_release(buffer_lock);
+}
+
+/*
+ * Write back all dirty buffers belonging to FS. Buffers somebody
+ * has busy are skipped; their holder isn't done with them, and
+ * waiting could deadlock against a caller that holds fs locks. The
+ * exception is a buffer that's busy being written back, perhaps by
+ * eviction: we wait for that write to finish, so that on return
+ * nothing that was dirty when we were called is still on its way
+ * to disk.
+ *
+ * Up to BUFFER_SYNCPENDING writes are kept going at once, so the
+ * disk can get on with the next one while we set up another.
+ *
+ * Returns the first error, but tries all the buffers regardless.
+ */
+int
+buffer_sync_fs(struct fs *fs)
+{
+	struct bufio io[BUFFER_SYNCPENDING];
+	struct buf *b;
+	unsigned i, num = 0;
+	int ret = 0;
+
+	lock_acquire(buffer_lock);
+	for (i=0; i<buffer_count; i++) {
+		b = &buffers[i];
+		while (b->b_fs == fs && b->b_writing) {
+			if (num > 0) {
+				/* it might be one of ours */
+				lock_release(buffer_lock);
+				buffer_finishsync(io, num, &ret);
+				num = 0;
+				lock_acquire(buffer_lock);
+				continue;
+			}
+			cv_wait(b->b_cv, buffer_lock);
+		}
+		if (b->b_fs != fs || b->b_busy || !b->b_dirty) {
+			continue;
+		}
+		buffer_busy(b);
+		lock_release(buffer_lock);
+		if (num == BUFFER_SYNCPENDING) {
+			buffer_finishsync(io, num, &ret);
+			num = 0;
+		}
+		buffer_startwrite(b, &io[num++]);
+		lock_acquire(buffer_lock);
+	}
+	lock_release(buffer_lock);
+
+	buffer_finishsync(io, num, &ret);
+	return ret;
+}
+
+/*
+ * Forget all the buffers belonging to FS, which is being unmounted
+ * and has just been synced. Nobody can be using its buffers any
+ * more, but eviction might still be busy with one; wait for that.
+ *
+ * If any of them is still dirty, because writing it back failed,
+ * nothing is dropped and EIO is returned, so the unmount can fail
+ * instead of losing the data.
+ */
+int
+buffer_drop_fs(struct fs *fs)
+{
+	struct buf *b;
+	unsigned i, j, num;
+
+	lock_acquire(buffer_lock);
+
+	/* Cancel any read-ahead, and wait out one in progress. */
+	num = buffer_ranum;
+	buffer_ranum = 0;
+	for (i=0; i<num; i++) {
+		j = (buffer_rahead + i) % BUFFER_RAQUEUE;
+		if (buffer_raqueue[j].ra_fs != fs) {
+			buffer_raqueue[(buffer_rahead + buffer_ranum++) %
+				       BUFFER_RAQUEUE] = buffer_raqueue[j];
+		}
+	}
+	while (buffer_rafs == fs) {
+		cv_wait(buffer_radonecv, buffer_lock);
+	}
+
+	for (i=0; i<buffer_count; i++) {
+		b = &buffers[i];
+		while (b->b_fs == fs && b->b_busy) {
+			cv_wait(b->b_cv, buffer_lock);
+		}
+		if (b->b_fs == fs && b->b_dirty) {
+			lock_release(buffer_lock);
+			return EIO;
+		}
+	}
+
+	/* Nothing can have come along since; we checked them all. */
+	for (i=0; i<buffer_count; i++) {
+		b = &buffers[i];
+		if (b->b_fs != fs) {
+			continue;
+		}
+		KASSERT(!b->b_busy);
+		KASSERT(!b->b_dirty);
+		buffer_lruremove(b);
+		buffer_hashremove(b);
+		b->b_valid = false;
+		buffer_lruadd(b, true);
+	}
+	lock_release(buffer_lock);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Setup
+
+/*
+ * Wait for a read-ahead run and hand its buffers over, or forget
+ * them if the read failed.
+ */
+static
+int
+buffer_finishread(struct fs *fs, struct bufio *io)
+{
+	unsigned i;
+	int result;
+
+	result = io->bi_started;
+	if (result == 0) {
+		result = FSOP_FINISHIO(fs, &io->bi_req);
+	}
+	for (i=0; i<io->bi_n; i++) {
+		if (result == 0) {
+			memcpy(io->bi_bufs[i]->b_data,
+			       (char *)io->bi_data + i * BUFFER_SIZE,
+			       BUFFER_SIZE);
+			io->bi_bufs[i]->b_valid = true;
+		}
+		/* unbusy forgets the invalid ones */
+		buffer_release(io->bi_bufs[i]);
+	}
+	return result;
+}
+
+/*
+ * Do one read-ahead request: read each run of blocks that aren't
+ * already cached with a single transfer, starting the next run
+ * before waiting for the one before it. Never waits for a busy
+ * buffer; whoever has it is reading or changing it anyway, and
+ * waiting could deadlock with them.
+ */
+static
+void
+buffer_doreadahead(struct fs *fs, daddr_t block, unsigned count)
+{
+	struct bufio io[2];
+	struct buf *b;
+	unsigned n, done, slot;
+	int result = 0;
+
+	io[0].bi_n = io[1].bi_n = 0;
+	slot = 0;
+	done = 0;
+	while (done < count) {
+		/* Collect a run of blocks that need reading. */
+		n = 0;
+		lock_acquire(buffer_lock);
+		while (done + n < count && n < BUFFER_MAXCLUSTER) {
+			b = buffer_find(fs, block + done + n);
+			if (b != NULL) {
+				break;
+			}
+			if (buffer_evict(false, &b)) {
+				break;
+			}
+			if (buffer_find(fs, block + done + n) != NULL) {
+				buffer_unbusy(b);
+				break;
+			}
+			b->b_fs = fs;
+			b->b_block = block + done + n;
+			buffer_hashadd(b);
+			io[slot].bi_bufs[n++] = b;
+		}
+		lock_release(buffer_lock);
+
+		if (n == 0) {
+			/* this one's cached or busy; skip it */
+			done++;
+			continue;
+		}
+
+		io[slot].bi_n = n;
+		io[slot].bi_data = (char *)buffer_radata +
+			slot * BUFFER_MAXCLUSTER * BUFFER_SIZE;
+		io[slot].bi_req.dr_block = block + done;
+		io[slot].bi_req.dr_nblocks = n;
+		io[slot].bi_req.dr_data = io[slot].bi_data;
+		io[slot].bi_req.dr_write = false;
+		io[slot].bi_started = FSOP_STARTIO(fs, &io[slot].bi_req);
+		done += n;
+
+		/* Now wait for the previous run, if there is one. */
+		slot = !slot;
+		if (io[slot].bi_n > 0) {
+			result = buffer_finishread(fs, &io[slot]);
+			io[slot].bi_n = 0;
+			if (result) {
+				break;
+			}
+		}
+	}
+
+	for (slot = 0; slot < 2; slot++) {
+		if (io[slot].bi_n > 0) {
+			buffer_finishread(fs, &io[slot]);
+		}
+	}
+}
+
+/*
+ * The read-ahead thread.
+ */
+static
+void
+buffer_reader(void *junk1, unsigned long junk2)
+{
+	struct rarequest ra;
+
+	(void)junk1;
+	(void)junk2;
+
+	lock_acquire(buffer_lock);
+	while (1) {
+		while (buffer_ranum == 0) {
+			cv_wait(buffer_racv, buffer_lock);
+		}
+		ra = buffer_raqueue[buffer_rahead];
+		buffer_rahead = (buffer_rahead + 1) % BUFFER_RAQUEUE;
+		buffer_ranum--;
+		buffer_rafs = ra.ra_fs;
+		lock_release(buffer_lock);
+
+		buffer_doreadahead(ra.ra_fs, ra.ra_block, ra.ra_count);
+
+		lock_acquire(buffer_lock);
+		buffer_rafs = NULL;
+		cv_broadcast(buffer_radonecv, buffer_lock);
+	}
+}
+
+/*
+ * The syncer: write everything back every so often, so a crash
+ * loses at most a few seconds of changes.
+ */
+static
+void
+buffer_syncer(void *junk1, unsigned long junk2)
+{
+	(void)junk1;
+	(void)junk2;
+
+	while (1) {
+		clocksleep(BUFFER_SYNCINTERVAL);
+		vfs_sync();
+	}
+}
+
+void
+buffer_bootstrap(void)
+{
+	struct buf *b;
+	unsigned i;
+	int result;
+
+	buffer_count = mainbus_ramsize() / BUFFER_RAMFRACTION / BUFFER_SIZE;
+	if (buffer_count < BUFFER_MIN) {
+		buffer_count = BUFFER_MIN;
+	}
+	/* about one buffer per chain */
+	buffer_hashsize = buffer_count;
+
+	buffer_lock = lock_create("buffer cache");
+	if (buffer_lock == NULL) {
+		panic("Cannot create buffer cache lock\n");
+	}
+	buffer_freecv = cv_create("buffer free");
+	buffer_racv = cv_create("readahead");
+	buffer_radonecv = cv_create("readahead done");
+	if (buffer_freecv == NULL || buffer_racv == NULL ||
+	    buffer_radonecv == NULL) {
+		panic("Cannot create buffer cache cvs\n");
+	}
+
+	buffers = kmalloc(buffer_count * sizeof(*buffers));
+	buffer_hash = kmalloc(buffer_hashsize * sizeof(*buffer_hash));
+	if (buffers == NULL || buffer_hash == NULL) {
+		panic("Cannot allocate buffer cache\n");
+	}
+	for (i=0; i<buffer_hashsize; i++) {
+		buffer_hash[i] = NULL;
+	}
+
+	buffer_lruhead = buffer_lrutail = NULL;
+	for (i=0; i<buffer_count; i++) {
+		b = &buffers[i];
+		b->b_fs = NULL;
+		b->b_block = 0;
+		b->b_hashnext = NULL;
+		b->b_busy = false;
+		b->b_writing = false;
+		b->b_valid = false;
+		b->b_dirty = false;
+		b->b_cv = cv_create("buffer");
+		b->b_data = kmalloc(BUFFER_SIZE);
+		if (b->b_cv == NULL || b->b_data == NULL) {
+			panic("Cannot allocate buffer cache\n");
+		}
+		buffer_lruadd(b, false);
+	}
+
+	buffer_rahead = buffer_ranum = 0;
+	buffer_rafs = NULL;
+	buffer_radata = kmalloc(2 * BUFFER_MAXCLUSTER * BUFFER_SIZE);
+	if (buffer_radata == NULL) {
+		panic("Cannot allocate buffer cache\n");
+	}
+
+	result = thread_fork("syncer", NULL, buffer_syncer, NULL, 0);
+	if (result) {
+		panic("Cannot start syncer: %s\n", strerror(result));
+	}
+	result = thread_fork("readahead", NULL, buffer_reader, NULL, 0);
+	if (result) {
+		panic("Cannot start read-ahead thread: %s\n",
+		      strerror(result));
+	}
+
+	kprintf("buffer cache: %u buffers (%uk)\n", buffer_count,
+		buffer_count * BUFFER_SIZE / 1024);
+}
@@ -350,6 +350,47 @@ static const struct vnode_ops dev_vnode_ops = {
 	.vop_lookparent = vopfail_lookparent_notdir,
 };
 
+/*
+ * Start a block transfer. If the device can't queue requests, do it
+ * now with devop_io and leave the result for dev_wait.
+ */
+int
+dev_submit(struct device *d, struct devrequest *r)
+{
+	struct iovec iov;
+	struct uio ku;
+
+	KASSERT(d->d_blocksize > 0);
+	KASSERT(r->dr_nblocks > 0);
+
+	if (d->d_ops->devop_submit != NULL) {
+		return d->d_ops->devop_submit(d, r);
+	}
+
+	uio_kinit(&iov, &ku, r->dr_data, r->dr_nblocks * d->d_blocksize,
+		  (off_t)r->dr_block * d->d_blocksize,
+		  r->dr_write ? UIO_WRITE : UIO_READ);
+	r->dr_result = DEVOP_IO(d, &ku);
+	if (r->dr_result == EINVAL) {
+		return EINVAL;
+	}
+	r->dr_done = true;
+	return 0;
+}
+
+/*
+ * Wait for a transfer started with dev_submit.
+ */
+int
+dev_wait(struct device *d, struct devrequest *r)
+{
+	if (d->d_ops->devop_wait != NULL) {
+		return d->d_ops->devop_wait(d, r);
+	}
+	KASSERT(r->dr_done);
+	return r->dr_result;
+}
+
 /*
  * Function to create a vnode for a VFS device.
  */
@@ -0,0 +1,383 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Name lookup cache.
+ *
+ * This maps (directory vnode, name) to the vnode the name refers to,
+ * or to nothing for names known not to exist, so that looking up a
+ * hot name doesn't have to search the directory. There is a fixed
+ * pool of entries, recycled least recently used first; names too
+ * long to fit in an entry just aren't cached.
+ *
+ * Only single path components are cached. A name with a slash in it
+ * is never entered or found, even though a flat filesystem like SFS
+ * may hand one over as a whole file name; a multi-part path has to
+ * go to the filesystem, which might not resolve it the same way.
+ *
+ * Entries are only made by filesystems, which must keep them right:
+ * a filesystem enters, replaces and removes the entries for a
+ * directory while holding that directory's own lock, so an entry
+ * never disagrees with the directory as seen by anyone holding that
+ * lock. Readers need no filesystem lock. The cache does not hold
+ * references to vnodes; instead, a filesystem's reclaim must call
+ * vfs_dcache_purge before deciding whether the vnode is really
+ * unused. A lookup that got in first will have taken a reference, so
+ * reclaim will see it and back off; one that comes later misses.
+ *
+ * The cache lock is a spinlock and comes after everything else.
+ */
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vfs.h>
+#include <vnode.h>
+
+#define DCACHE_SIZE     512     /* number of entries */
+#define DCACHE_HASHSIZE 257     /* number of hash chains */
+#define DCACHE_NAMELEN  32      /* space for a name, including the null */
+
+struct dcentry {
+	struct vnode *dc_dir;           /* directory (NULL if entry unused) */
+	struct vnode *dc_vn;            /* what the name is (NULL if none) */
+	unsigned dc_hash;               /* hash of dir and name */
+	char dc_name[DCACHE_NAMELEN];   /* the name */
+	struct dcentry *dc_hashnext;    /* hash chain */
+	struct dcentry *dc_lruprev;     /* LRU list */
+	struct dcentry *dc_lrunext;
+};
+
+static struct spinlock dcache_lock = SPINLOCK_INITIALIZER;
+static struct dcentry dcache_entries[DCACHE_SIZE];
+static struct dcentry *dcache_hash[DCACHE_HASHSIZE];
+static struct dcentry *dcache_lruhead, *dcache_lrutail;
+static bool dcache_ready;      /* set up on first enter */
+
+/* Statistics */
+static unsigned dcache_hits, dcache_neghits, dcache_misses;
+
+////////////////////////////////////////////////////////////
+// Hash table and LRU list
+
+/*
+ * Check if NAME is something we keep entries for.
+ */
+static
+bool
+dcache_cacheable(const char *name)
+{
+	return strlen(name) < DCACHE_NAMELEN && strchr(name, '/') == NULL;
+}
+
+static
+unsigned
+dcache_hashfn(struct vnode *dir, const char *name)
+{
+	unsigned h;
+
+	h = (uintptr_t)dir >> 4;
+	while (*name) {
+		h = h*33 + (unsigned char)*name++;
+	}
+	return h;
+}
+
+static
+void
+dcache_lruremove(struct dcentry *dc)
+{
+	if (dc->dc_lruprev != NULL) {
+		dc->dc_lruprev->dc_lrunext = dc->dc_lrunext;
+	}
+	else {
+		KASSERT(dcache_lruhead == dc);
+		dcache_lruhead = dc->dc_lrunext;
+	}
+	if (dc->dc_lrunext != NULL) {
+		dc->dc_lrunext->dc_lruprev = dc->dc_lruprev;
+	}
+	else {
+		KASSERT(dcache_lrutail == dc);
+		dcache_lrutail = dc->dc_lruprev;
+	}
+	dc->dc_lruprev = dc->dc_lrunext = NULL;
+}
+
+/*
+ * Put an entry on the LRU list: at the tail if it's just been used,
+ * or at the head if it's unused and should be recycled first.
+ */
+static
+void
+dcache_lruadd(struct dcentry *dc, bool athead)
+{
+	if (dcache_lruhead == NULL) {
+		dc->dc_lruprev = dc->dc_lrunext = NULL;
+		dcache_lruhead = dcache_lrutail = dc;
+	}
+	else if (athead) {
+		dc->dc_lruprev = NULL;
+		dc->dc_lrunext = dcache_lruhead;
+		dcache_lruhead->dc_lruprev = dc;
+		dcache_lruhead = dc;
+	}
+	else {
+		dc->dc_lruprev = dcache_lrutail;
+		dc->dc_lrunext = NULL;
+		dcache_lrutail->dc_lrunext = dc;
+		dcache_lrutail = dc;
+	}
+}
+
+/*
+ * Find the entry for DIR and NAME. Must hold dcache_lock.
+ */
+static
+struct dcentry *
+dcache_find(struct vnode *dir, const char *name, unsigned hash)
+{
+	struct dcentry *dc;
+
+	KASSERT(spinlock_do_i_hold(&dcache_lock));
+
+	dc = dcache_hash[hash % DCACHE_HASHSIZE];
+	while (dc != NULL) {
+		if (dc->dc_hash == hash && dc->dc_dir == dir &&
+		    !strcmp(dc->dc_name, name)) {
+			return dc;
+		}
+		dc = dc->dc_hashnext;
+	}
+	return NULL;
+}
+
+/*
+ * Take an entry out of the hash table and mark it unused, leaving it
+ * first in line to be recycled. Must hold dcache_lock.
+ */
+static
+void
+dcache_kill(struct dcentry *dc)
+{
+	struct dcentry **pp;
+
+	KASSERT(dc->dc_dir != NULL);
+
+	pp = &dcache_hash[dc->dc_hash % DCACHE_HASHSIZE];
+	while (*pp != dc) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->dc_hashnext;
+	}
+	*pp = dc->dc_hashnext;
+	dc->dc_hashnext = NULL;
+	dc->dc_dir = NULL;
+	dc->dc_vn = NULL;
+
+	dcache_lruremove(dc);
+	dcache_lruadd(dc, true);
+}
+
+static
+void
+dcache_init(void)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&dcache_lock));
+
+	for (i=0; i<DCACHE_HASHSIZE; i++) {
+		dcache_hash[i] = NULL;
+	}
+	dcache_lruhead = dcache_lrutail = NULL;
+	for (i=0; i<DCACHE_SIZE; i++) {
+		dcache_entries[i].dc_dir = NULL;
+		dcache_entries[i].dc_vn = NULL;
+		dcache_entries[i].dc_hashnext = NULL;
+		dcache_lruadd(&dcache_entries[i], false);
+	}
+	dcache_ready = true;
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
+/*
+ * Look up NAME in DIR. Returns true if the cache knows the answer,
+ * in which case *RET is the vnode, with a reference, or NULL if the
+ * name doesn't exist. Returns false if the directory has to be
+ * searched.
+ */
+bool
+vfs_dcache_lookup(struct vnode *dir, const char *name, struct vnode **ret)
+{
+	struct dcentry *dc;
+	unsigned hash;
+
+	if (!dcache_cacheable(name)) {
+		return false;
+	}
+	hash = dcache_hashfn(dir, name);
+
+	spinlock_acquire(&dcache_lock);
+	if (!dcache_ready) {
+		spinlock_release(&dcache_lock);
+		return false;
+	}
+	dc = dcache_find(dir, name, hash);
+	if (dc == NULL) {
+		dcache_misses++;
+		spinlock_release(&dcache_lock);
+		return false;
+	}
+	if (dc->dc_vn != NULL) {
+		VOP_INCREF(dc->dc_vn);
+		dcache_hits++;
+	}
+	else {
+		dcache_neghits++;
+	}
+	*ret = dc->dc_vn;
+	dcache_lruremove(dc);
+	dcache_lruadd(dc, false);
+	spinlock_release(&dcache_lock);
+	return true;
+}
+
+/*
+ * Record that NAME in DIR is VN, or doesn't exist if VN is NULL,
+ * replacing whatever was known before. The caller must hold the
+ * filesystem's lock on DIR.
+ */
+void
+vfs_dcache_enter(struct vnode *dir, const char *name, struct vnode *vn)
+{
+	struct dcentry *dc;
+	unsigned hash;
+
+	if (!dcache_cacheable(name)) {
+		return;
+	}
+	hash = dcache_hashfn(dir, name);
+
+	spinlock_acquire(&dcache_lock);
+	if (!dcache_ready) {
+		dcache_init();
+	}
+	dc = dcache_find(dir, name, hash);
+	if (dc == NULL) {
+		dc = dcache_lruhead;
+		KASSERT(dc != NULL);
+		if (dc->dc_dir != NULL) {
+			dcache_kill(dc);
+		}
+		dc->dc_dir = dir;
+		dc->dc_hash = hash;
+		strcpy(dc->dc_name, name);
+		dc->dc_hashnext = dcache_hash[hash % DCACHE_HASHSIZE];
+		dcache_hash[hash % DCACHE_HASHSIZE] = dc;
+	}
+	dc->dc_vn = vn;
+	dcache_lruremove(dc);
+	dcache_lruadd(dc, false);
+	spinlock_release(&dcache_lock);
+}
+
+/*
+ * Forget NAME in DIR. The caller must hold the filesystem's lock on
+ * DIR.
+ */
+void
+vfs_dcache_remove(struct vnode *dir, const char *name)
+{
+	struct dcentry *dc;
+	unsigned hash;
+
+	if (!dcache_cacheable(name)) {
+		return;
+	}
+	hash = dcache_hashfn(dir, name);
+
+	spinlock_acquire(&dcache_lock);
+	if (dcache_ready) {
+		dc = dcache_find(dir, name, hash);
+		if (dc != NULL) {
+			dcache_kill(dc);
+		}
+	}
+	spinlock_release(&dcache_lock);
+}
+
+/*
+ * Forget everything about VN: entries in it, if it's a directory,
+ * and entries that name it.
+ */
+void
+vfs_dcache_purge(struct vnode *vn)
+{
+	unsigned i;
+
+	spinlock_acquire(&dcache_lock);
+	if (dcache_ready) {
+		for (i=0; i<DCACHE_SIZE; i++) {
+			struct dcentry *dc = &dcache_entries[i];
+
+			if (dc->dc_dir != NULL &&
+			    (dc->dc_dir == vn || dc->dc_vn == vn)) {
+				dcache_kill(dc);
+			}
+		}
+	}
+	spinlock_release(&dcache_lock);
+}
+
+/*
+ * Print the hit rates.
+ */
+void
+vfs_dcache_printstats(void)
+{
+	unsigned hits, neghits, misses;
+
+	spinlock_acquire(&dcache_lock);
+	hits = dcache_hits;
+	neghits = dcache_neghits;
+	misses = dcache_misses;
+	spinlock_release(&dcache_lock);
+
+	kprintf("dcache: %u hits, %u negative hits, %u misses\n",
+		hits, neghits, misses);
+}
+
+void
+vfs_dcache_resetstats(void)
+{
+	spinlock_acquire(&dcache_lock);
+	dcache_hits = dcache_neghits = dcache_misses = 0;
+	spinlock_release(&dcache_lock);
+}
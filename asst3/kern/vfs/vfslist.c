@@ -90,7 +90,19 @@ DEFARRAY(knowndev, static __UNUSED inline);
 
 static struct knowndevarray *knowndevs;
 
-/* The big lock for all FS ops. Remove for filesystem assignment. */
+/*
+ * Lock for knowndevs and the kd_fs fields of its entries. Name
+ * lookups only read the table, so take it shared; adding devices and
+ * mounting or unmounting take it exclusive. It comes before
+ * vfs_biglock in the lock order, as FSOP calls made while holding it
+ * may take the big lock.
+ */
+static struct rwlock *knowndevs_lock;
+
+/*
+ * The big lock for FS ops. SFS does its own locking now; only emufs
+ * still relies on this.
+ */
 static struct lock *vfs_biglock;
 static unsigned vfs_biglock_depth;
 
@@ -106,6 +118,11 @@ vfs_bootstrap(void)
 		panic("vfs: Could not create knowndevs array\n");
 	}
 
+	knowndevs_lock = rwlock_create("knowndevs");
+	if (knowndevs_lock==NULL) {
+		panic("vfs: Could not create knowndevs lock\n");
+	}
+
 	vfs_biglock = lock_create("vfs_biglock");
 	if (vfs_biglock==NULL) {
 		panic("vfs: Could not create vfs big lock\n");
@@ -175,7 +192,7 @@ vfs_sync(void)
 	struct knowndev *dev;
 	unsigned i, num;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_read(knowndevs_lock);
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -185,7 +202,7 @@ vfs_sync(void)
 		}
 	}
 
-	vfs_biglock_release();
+	rwlock_release_read(knowndevs_lock);
 
 	return 0;
 }
@@ -194,14 +211,13 @@ vfs_sync(void)
  * Given a device name (lhd0, emu0, somevolname, null, etc.), hand
  * back an appropriate vnode.
  */
+static
 int
-vfs_getroot(const char *devname, struct vnode **ret)
+vfs_dogetroot(const char *devname, struct vnode **ret)
 {
 	struct knowndev *kd;
 	unsigned i, num;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
 		kd = knowndevarray_get(knowndevs, i);
@@ -270,6 +286,21 @@ vfs_getroot(const char *devname, struct vnode **ret)
 	return ENODEV;
 }
 
+/*
+ * Wrapper for the above that takes the device table lock. Any number
+ * of lookups can be in here at once.
+ */
+int
+vfs_getroot(const char *devname, struct vnode **ret)
+{
+	int result;
+
+	rwlock_acquire_read(knowndevs_lock);
+	result = vfs_dogetroot(devname, ret);
+	rwlock_release_read(knowndevs_lock);
+	return result;
+}
+
 /*
  * Given a filesystem, hand back the name of the device it's mounted on.
  */
@@ -277,12 +308,12 @@ const char *
 vfs_getdevname(struct fs *fs)
 {
 	struct knowndev *kd;
+	const char *name = NULL;
 	unsigned i, num;
 
 	KASSERT(fs != NULL);
 
-	KASSERT(vfs_biglock_do_i_hold());
-
+	rwlock_acquire_read(knowndevs_lock);
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
 		kd = knowndevarray_get(knowndevs, i);
@@ -294,11 +325,13 @@ vfs_getdevname(struct fs *fs)
 			 * the fs cannot go away, and the device can't
 			 * go away until the fs goes away.
 			 */
-			return kd->kd_name;
+			name = kd->kd_name;
+			break;
 		}
 	}
+	rwlock_release_read(knowndevs_lock);
 
-	return NULL;
+	return name;
 }
 
 /*
@@ -358,7 +391,7 @@ badnames(const char *n1, const char *n2, const char *n3)
 	unsigned i, num;
 	struct knowndev *kd;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(rwlock_do_i_hold_write(knowndevs_lock));
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -401,7 +434,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	/* Silence warning with gcc 4.8 -Og (but not -O2) */
 	index = 0;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(knowndevs_lock);
 
 	name = kstrdup(dname);
 	if (name==NULL) {
@@ -453,7 +486,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 		dev->d_devnumber = index+1;
 	}
 
-	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 	return 0;
 
  fail:
@@ -470,7 +503,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 		kfree(kd);
 	}
 
-	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 	return result;
 }
 
@@ -499,7 +532,7 @@ vfs_addfs(const char *devname, struct fs *fs)
 
 /*
  * Look for a mountable device named DEVNAME.
- * Should already hold knowndevs_lock.
+ * Should already hold knowndevs_lock for writing.
  */
 static
 int
@@ -509,7 +542,7 @@ findmount(const char *devname, struct knowndev **result)
 	unsigned i, num;
 	bool found = false;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(rwlock_do_i_hold_write(knowndevs_lock));
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; !found && i<num; i++) {
@@ -543,16 +576,16 @@ vfs_mount(const char *devname, void *data,
 	struct fs *fs;
 	int result;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(knowndevs_lock);
 
 	result = findmount(devname, &kd);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(knowndevs_lock);
 		return result;
 	}
 
 	if (kd->kd_fs != NULL) {
-		vfs_biglock_release();
+		rwlock_release_write(knowndevs_lock);
 		return EBUSY;
 	}
 	KASSERT(kd->kd_rawname != NULL);
@@ -560,7 +593,7 @@ vfs_mount(const char *devname, void *data,
 
 	result = mountfunc(data, kd->kd_device, &fs);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(knowndevs_lock);
 		return result;
 	}
 
@@ -573,7 +606,7 @@ vfs_mount(const char *devname, void *data,
 	kprintf("vfs: Mounted %s: on %s\n",
 		volname ? volname : kd->kd_name, kd->kd_name);
 
-	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 	return 0;
 }
 
@@ -601,7 +634,7 @@ vfs_swapon(const char *devname, struct vnode **ret)
 		devname = myname;
 	}
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(knowndevs_lock);
 
 	result = findmount(devname, &kd);
 	if (result) {
@@ -622,7 +655,7 @@ vfs_swapon(const char *devname, struct vnode **ret)
 	*ret = kd->kd_vnode;
 
  out:
-	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 	if (myname != NULL) {
 		kfree(myname);
 	}
@@ -640,7 +673,7 @@ vfs_unmount(const char *devname)
 	struct knowndev *kd;
 	int result;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(knowndevs_lock);
 
 	result = findmount(devname, &kd);
 	if (result) {
@@ -673,7 +706,7 @@ vfs_unmount(const char *devname)
 	KASSERT(result==0);
 
  fail:
-	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 	return result;
 }
 
@@ -690,7 +723,7 @@ vfs_swapoff(const char *devname)
 	struct knowndev *kd;
 	int result;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(knowndevs_lock);
 
 	result = findmount(devname, &kd);
 	if (result) {
@@ -710,7 +743,7 @@ vfs_swapoff(const char *devname)
 	KASSERT(result==0);
 
  fail:
-	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 	return result;
 }
 
@@ -724,7 +757,7 @@ vfs_unmountall(void)
 	unsigned i, num;
 	int result;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(knowndevs_lock);
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -780,7 +813,7 @@ vfs_unmountall(void)
 		dev->kd_fs = NULL;
 	}
 
-	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 
 	return 0;
 }
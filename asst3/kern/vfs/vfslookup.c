@@ -40,7 +40,14 @@
 #include <fs.h>
 #include <vnode.h>
 
+/*
+ * bootfs_vnode is read on every absolute path lookup, so it is
+ * protected by a spinlock rather than anything that can sleep; the
+ * lock only needs to cover reading the pointer and taking a
+ * reference.
+ */
 static struct vnode *bootfs_vnode = NULL;
+static struct spinlock bootfs_lock = SPINLOCK_INITIALIZER;
 
 /*
  * Helper function for actually changing bootfs_vnode.
@@ -51,8 +58,10 @@ change_bootfs(struct vnode *newvn)
 {
 	struct vnode *oldvn;
 
+	spinlock_acquire(&bootfs_lock);
 	oldvn = bootfs_vnode;
 	bootfs_vnode = newvn;
+	spinlock_release(&bootfs_lock);
 
 	if (oldvn != NULL) {
 		VOP_DECREF(oldvn);
@@ -75,14 +84,11 @@ vfs_setbootfs(const char *fsname)
 	int result;
 	struct vnode *newguy;
 
-	vfs_biglock_acquire();
-
 	snprintf(tmp, sizeof(tmp)-1, "%s", fsname);
 	s = strchr(tmp, ':');
 	if (s) {
 		/* If there's a colon, it must be at the end */
 		if (strlen(s)>0) {
-			vfs_biglock_release();
 			return EINVAL;
 		}
 	}
@@ -92,19 +98,16 @@ vfs_setbootfs(const char *fsname)
 
 	result = vfs_chdir(tmp);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	result = vfs_getcurdir(&newguy);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	change_bootfs(newguy);
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -114,9 +117,7 @@ vfs_setbootfs(const char *fsname)
 void
 vfs_clearbootfs(void)
 {
-	vfs_biglock_acquire();
 	change_bootfs(NULL);
-	vfs_biglock_release();
 }
 
 
@@ -133,8 +134,6 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	struct vnode *vn;
 	int result;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/*
 	 * Entirely empty filenames aren't legal.
 	 */
@@ -195,11 +194,16 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	KASSERT(colon==0 || slash==0);
 
 	if (path[0]=='/') {
-		if (bootfs_vnode==NULL) {
+		spinlock_acquire(&bootfs_lock);
+		vn = bootfs_vnode;
+		if (vn != NULL) {
+			VOP_INCREF(vn);
+		}
+		spinlock_release(&bootfs_lock);
+		if (vn == NULL) {
 			return ENOENT;
 		}
-		VOP_INCREF(bootfs_vnode);
-		*startvn = bootfs_vnode;
+		*startvn = vn;
 	}
 	else {
 		KASSERT(path[0]==':');
@@ -246,11 +250,8 @@ vfs_lookparent(char *path, struct vnode **retval,
 	struct vnode *startvn;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -268,7 +269,6 @@ vfs_lookparent(char *path, struct vnode **retval,
 
 	VOP_DECREF(startvn);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -278,23 +278,31 @@ vfs_lookup(char *path, struct vnode **retval)
 	struct vnode *startvn;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (strlen(path)==0) {
 		*retval = startvn;
-		vfs_biglock_release();
 		return 0;
 	}
 
+	/*
+	 * A single name may be in the name cache. (Only filesystems
+	 * that keep the cache up to date put anything there.) Longer
+	 * paths are resolved by the filesystem in one go and aren't
+	 * cached at all, not even component by component; none of our
+	 * filesystems has subdirectories to walk.
+	 */
+	if (strchr(path, '/') == NULL &&
+	    vfs_dcache_lookup(startvn, path, retval)) {
+		VOP_DECREF(startvn);
+		return *retval != NULL ? 0 : ENOENT;
+	}
+
 	result = VOP_LOOKUP(startvn, path, retval);
 
 	VOP_DECREF(startvn);
-	vfs_biglock_release();
 	return result;
 }
@@ -37,6 +37,14 @@
 #include <vfs.h>
 #include <vnode.h>
 
+/*
+ * Source of initial vnode generations. Each vnode counts its own
+ * changes in the low 32 bits of vn_gen, starting from a fresh high
+ * half, so vnodes never need this lock after vnode_init.
+ */
+static struct spinlock vnode_genlock = SPINLOCK_INITIALIZER_NAMED("vnodegen");
+static uint32_t vnode_nextgen;
+
 /*
  * Initialize an abstract vnode.
  */
@@ -52,6 +60,11 @@ vnode_init(struct vnode *vn, const struct vnode_ops *ops,
 	spinlock_init(&vn->vn_countlock);
 	vn->vn_fs = fs;
 	vn->vn_data = fsdata;
+
+	spinlock_acquire(&vnode_genlock);
+	vn->vn_gen = (uint64_t)vnode_nextgen++ << 32;
+	spinlock_release(&vnode_genlock);
+
 	return 0;
 }
 
@@ -122,6 +135,60 @@ vnode_decref(struct vnode *vn)
 	}
 }
 
+/*
+ * Get the content generation.
+ */
+uint64_t
+vnode_getgen(struct vnode *vn)
+{
+	uint64_t gen;
+
+	spinlock_acquire(&vn->vn_countlock);
+	gen = vn->vn_gen;
+	spinlock_release(&vn->vn_countlock);
+	return gen;
+}
+
+/*
+ * Note that the contents have changed. This is done after the
+ * change, so anything that read the old generation also counts as
+ * having seen the old contents.
+ */
+static
+void
+vnode_changed(struct vnode *vn)
+{
+	spinlock_acquire(&vn->vn_countlock);
+	vn->vn_gen++;
+	spinlock_release(&vn->vn_countlock);
+}
+
+/*
+ * VOP_WRITE.
+ */
+int
+vnode_write(struct vnode *vn, struct uio *uio)
+{
+	int result;
+
+	result = __VOP(vn, write)(vn, uio);
+	vnode_changed(vn);
+	return result;
+}
+
+/*
+ * VOP_TRUNCATE.
+ */
+int
+vnode_truncate(struct vnode *vn, off_t len)
+{
+	int result;
+
+	result = __VOP(vn, truncate)(vn, len);
+	vnode_changed(vn);
+	return result;
+}
+
 /*
  * Check for various things being valid.
  * Called before all VOP_* calls.
@@ -32,6 +32,7 @@
 #include <lib.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <synch.h>
 #include <current.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
@@ -71,6 +72,13 @@ as_create(void)
         return NULL;
     }
 
+	as->pt_lock = rwlock_create("pt_lock");
+	if (as->pt_lock == NULL) {
+		kfree(as->hash_table);
+		kfree(as);
+		return NULL;
+	}
+
 	return as;
 }
 
@@ -104,8 +112,10 @@ as_copy(struct addrspace *old, struct addrspace **ret)
         old_region = old_region->next;
     }
 
-    // Copy the page table
+    // Copy the page table; faults in the old space may still read it
+    rwlock_acquire_read(old->pt_lock);
     int result = copy_page_table(old, newas);
+    rwlock_release_read(old->pt_lock);
     if (result != 0) {
         as_destroy(newas);
         return result;
@@ -131,6 +141,7 @@ as_destroy(struct addrspace *as)
 	}
 	// delete page table
 	delete_hash_table(as);
+	rwlock_destroy(as->pt_lock);
 	kfree(as);
 }
 
@@ -7,6 +7,8 @@
 #include <machine/tlb.h>
 #include <spl.h>
 #include <proc.h>
+#include <current.h>
+#include <synch.h>
 
 uint32_t hash_func(struct addrspace *as, vaddr_t vaddr)
 {
@@ -95,6 +97,8 @@ void vm_bootstrap(void)
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
+    curthread->t_usage.u_faults++;
+
     /*check does faulttype is READONLY*/
 
     if (faulttype == VM_FAULT_READONLY){
@@ -110,51 +114,70 @@ vm_fault(int faulttype, vaddr_t faultaddress)
     /*to get index to find entry in page table*/
     // uint32_t index = hash_func(as, faultaddress);
 
-    /*lookup PT*/
+    /*lookup PT; concurrent faults on the same space only read it*/
+    rwlock_acquire_read(as->pt_lock);
     struct PTE *valid_pte = pte_find(as, faultaddress);
-
-    /*If there is no vaid entry in pt then look up region
-      if there is a valid entry in pt then load TLB*/
-    if (valid_pte == NULL) {
-        struct region *region = as->region;
-        int valid_region = 0;
-
-        /*look up region*/
-        while (region != NULL) {
-            if(region->vaddr == faultaddress) {
-                valid_region = 1;
-                break;
-            }
-            region = region->next;
-        }
-        if (valid_region == 0) {
-            return EFAULT;
-        } else {
-            /*allocate frame*/
-            paddr_t paddr = alloc_kpages(1);
-            if (paddr == 0) {
-		        return 0;
-	        }
-            /*create new pte then insert it into PTE*/
-            valid_pte = kmalloc(sizeof(struct PTE));
-            if (valid_pte == NULL) {
-                return ENOMEM;
-            }
-            valid_pte->VPN = vpn;
-            valid_pte->PFN = paddr >> 12;
-            pte_insert(as, valid_pte);
-            /*load TLB*/
-            uint32_t EntryHi = faultaddress;
-            uint32_t EntryLo = paddr;
-            tlb_random(EntryHi, EntryLo);
-        }
-    }
-    else {
+    if (valid_pte != NULL) {
         /*Load TLB*/
         uint32_t EntryHi = faultaddress & PAGE_FRAME;
         uint32_t EntryLo = valid_pte->PFN << 12;
+        rwlock_release_read(as->pt_lock);
+        int spl = splhigh();
         tlb_random(EntryHi, EntryLo);
+        splx(spl);
+        return 0;
+    }
+    rwlock_release_read(as->pt_lock);
+
+    /*If there is no vaid entry in pt then look up region*/
+    struct region *region = as->region;
+    int valid_region = 0;
+
+    /*look up region*/
+    while (region != NULL) {
+        if(region->vaddr == faultaddress) {
+            valid_region = 1;
+            break;
+        }
+        region = region->next;
+    }
+    if (valid_region == 0) {
+        return EFAULT;
+    }
+
+    /*allocate frame*/
+    paddr_t paddr = alloc_kpages(1);
+    if (paddr == 0) {
+        return 0;
+    }
+    /*create new pte*/
+    valid_pte = kmalloc(sizeof(struct PTE));
+    if (valid_pte == NULL) {
+        return ENOMEM;
+    }
+    valid_pte->VPN = vpn;
+    valid_pte->PFN = paddr >> 12;
+
+    /*insert it, unless another thread faulted the page in meanwhile*/
+    rwlock_acquire_write(as->pt_lock);
+    struct PTE *raced_pte = pte_find(as, faultaddress);
+    if (raced_pte != NULL) {
+        kfree(valid_pte);
+        free_kpages(paddr);
+        valid_pte = raced_pte;
+        paddr = valid_pte->PFN << 12;
+    }
+    else {
+        pte_insert(as, valid_pte);
     }
+    rwlock_release_write(as->pt_lock);
+
+    /*load TLB*/
+    uint32_t EntryHi = faultaddress;
+    uint32_t EntryLo = paddr;
+    int spl = splhigh();
+    tlb_random(EntryHi, EntryLo);
+    splx(spl);
     return 0;
 
 }
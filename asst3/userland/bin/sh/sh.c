@@ -71,6 +71,7 @@ static int timing = 0;
 
 /* array of backgrounded jobs (allows "foregrounding") */
 #define MAXBG 128
+#define MAXREAP 16
 static pid_t bgpids[MAXBG];
 
 /*
@@ -210,47 +211,34 @@ dowait(pid_t pid)
 }
 
 #ifdef WNOHANG
-/*
- * dowaitpoll
- * like dowait, but uses WNOHANG. returns true if we got something.
- */
-static
-int
-dowaitpoll(pid_t pid)
-{
-	struct exitinfo ei;
-	pid_t foundpid;
-	int status;
-
-	foundpid = waitpid(pid, &status, WNOHANG);
-	if (foundpid < 0) {
-		warn("pid %d", pid);
-	}
-	else if (foundpid != 0) {
-		printf("pid %d: ", pid);
-		readstatus(status, &ei);
-		printstatus(&ei, 1);
-		return 1;
-	}
-	return 0;
-}
-
 /*
  * waitpoll
- * poll all background jobs for having exited.
+ * poll all background jobs for having exited. waitmany hands back
+ * everything that has exited in one go, so we don't need a syscall
+ * per background job.
  */
 static
 void
 waitpoll(void)
 {
-	int i;
-	for (i=0; i < MAXBG; i++) {
-		if (bgpids[i] != 0) {
-			if (dowaitpoll(bgpids[i])) {
-				bgpids[i] = 0;
+	struct exitinfo ei;
+	pid_t pids[MAXREAP];
+	int statuses[MAXREAP];
+	int i, j, n;
+
+	do {
+		n = waitmany(pids, statuses, MAXREAP, WNOHANG);
+		for (i=0; i<n; i++) {
+			printf("pid %d: ", pids[i]);
+			readstatus(statuses[i], &ei);
+			printstatus(&ei, 1);
+			for (j=0; j < MAXBG; j++) {
+				if (bgpids[j] == pids[i]) {
+					bgpids[j] = 0;
+				}
 			}
 		}
-	}
+	} while (n == MAXREAP);
 }
 #endif /* WNOHANG */
 
@@ -421,27 +409,16 @@ docommand(char *buf, struct exitinfo *ei)
 		__time(&startsecs, &startnsecs);
 	}
 
-	pid = fork();
-	switch (pid) {
-		case -1:
-			/* error */
-			warn("fork");
-			exitinfo_exit(ei, 255);
-			return;
-		case 0:
-			/* child */
-			execvp(args[0], args);
-			warn("%s", args[0]);
-			/*
-			 * Use _exit() instead of exit() in the child
-			 * process to avoid calling atexit() functions,
-			 * which would cause hostcompat (if present) to
-			 * reset the tty state and mess up our input
-			 * handling.
-			 */
-			_exit(1);
-		default:
-			break;
+	/*
+	 * Use spawnp rather than fork and execvp; it doesn't copy our
+	 * address space just to throw it away again, and a command
+	 * that can't be run fails here instead of in a child.
+	 */
+	pid = spawnp(args[0], args, NULL, 0);
+	if (pid < 0) {
+		warn("%s", args[0]);
+		exitinfo_exit(ei, 1);
+		return;
 	}
 
 	/* parent */
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+/*
+ * time - run a program and report the resources it used.
+ * Usage: time command [args...]
+ *
+ * Runs the command with spawnp, waits for it, and prints the elapsed
+ * time and the child's usage from getrusage(RUSAGE_CHILDREN) on
+ * stderr. Exits with the command's exit code.
+ */
+
+/*
+ * There's no stdio stderr; format into a buffer and write it.
+ */
+static
+void
+eprintf(const char *fmt, ...)
+{
+	char buf[128];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	write(STDERR_FILENO, buf, strlen(buf));
+}
+
+static
+void
+printtime(const char *what, time_t secs, long usecs)
+{
+	eprintf(" %6lld.%02ld %s", (long long)secs, usecs / 10000, what);
+}
+
+int
+main(int argc, char *argv[])
+{
+	time_t startsecs, endsecs;
+	unsigned long startnsecs, endnsecs;
+	struct rusage ru;
+	pid_t pid;
+	int status;
+	long nsecs;
+
+	if (argc < 2) {
+		errx(1, "Usage: time command [args...]");
+	}
+
+	__time(&startsecs, &startnsecs);
+
+	pid = spawnp(argv[1], argv+1, NULL, 0);
+	if (pid < 0) {
+		err(1, "%s", argv[1]);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+
+	__time(&endsecs, &endnsecs);
+
+	if (getrusage(RUSAGE_CHILDREN, &ru) < 0) {
+		err(1, "getrusage");
+	}
+
+	nsecs = (long)endnsecs - (long)startnsecs;
+	if (nsecs < 0) {
+		nsecs += 1000000000;
+		endsecs--;
+	}
+	printtime("real", endsecs - startsecs, nsecs / 1000);
+	printtime("user", ru.ru_utime.tv_sec, ru.ru_utime.tv_usec);
+	printtime("sys", ru.ru_stime.tv_sec, ru.ru_stime.tv_usec);
+	eprintf("\n");
+	eprintf(" %llu faults, %llu+%llu switches (vol+invol), "
+		"%llu+%llu blocks (in+out)\n",
+		(unsigned long long)ru.ru_minflt,
+		(unsigned long long)ru.ru_nvcsw,
+		(unsigned long long)ru.ru_nivcsw,
+		(unsigned long long)ru.ru_inblock,
+		(unsigned long long)ru.ru_oublock);
+
+	if (WIFSIGNALED(status)) {
+		warnx("%s: signal %d", argv[1], WTERMSIG(status));
+		return 1;
+	}
+	return WEXITSTATUS(status);
+}
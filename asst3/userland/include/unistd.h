@@ -40,9 +40,12 @@
  */
 #include <kern/fcntl.h>
 #include <kern/ioctl.h>
+#include <kern/ktrace.h>
 #include <kern/reboot.h>
 #include <kern/seek.h>
+#include <kern/spawn.h>
 #include <kern/time.h>
+#include <kern/resource.h>	/* after kern/time.h */
 #include <kern/unistd.h>
 #include <kern/wait.h>
 
@@ -148,6 +151,16 @@ int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
 int __time(time_t *seconds, unsigned long *nanoseconds);
 ssize_t __getcwd(char *buf, size_t buflen);
+int waitmany(pid_t *pids, int *returncodes, unsigned max, int flags);
+int getrusage(int who, struct rusage *usage);
+int ktrace(int op, unsigned mask);
+int ktrace_read(struct ktrace_event *buf, unsigned max);
+pid_t spawn(const char *prog, char *const *args,
+	    const struct spawn_action *actions, unsigned nactions);
+int __thread_create(void (*entry)(void *(*)(void *), void *),
+		    void *(*func)(void *), void *arg, void *stacktop);
+int thread_join(int tid, void **retval);
+__DEAD void thread_exit(void *retval);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
 
@@ -156,8 +169,12 @@ ssize_t __getcwd(char *buf, size_t buflen);
  */
 
 int execvp(const char *prog, char *const *args); /* calls execv */
+pid_t spawnp(const char *prog, char *const *args,	/* calls spawn */
+	     const struct spawn_action *actions, unsigned nactions);
 char *getcwd(char *buf, size_t buflen);		/* calls __getcwd */
 time_t time(time_t *seconds);			/* calls __time */
+int thread_create(void *(*func)(void *), void *arg,	/* calls */
+		  void *stack, size_t stacksize);	/* __thread_create */
 
 /* UNSW versions of mmap() and munmap()
  * This are simplified compared to the standard version on UNIX
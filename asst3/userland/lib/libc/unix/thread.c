@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+
+/*
+ * User-level thread creation. Uses the system call __thread_create(),
+ * which starts the new thread at a given address with two arguments
+ * and a given stack pointer. We start it in __thread_start below so
+ * that returning from the thread function calls thread_exit().
+ *
+ * The kernel doesn't make stacks, so the caller has to provide one.
+ * It must stay valid until the thread has been joined.
+ */
+
+/* Room the MIPS calling convention lets a callee use in our frame */
+#define ARGSAVE 16
+
+static
+void
+__thread_start(void *(*func)(void *), void *arg)
+{
+	thread_exit(func(arg));
+}
+
+int
+thread_create(void *(*func)(void *), void *arg,
+	      void *stack, size_t stacksize)
+{
+	uintptr_t top;
+
+	if (stack == NULL || stacksize < 2*ARGSAVE) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Stack grows down; start at the top, doubleword-aligned. */
+	top = ((uintptr_t)stack + stacksize) & ~(uintptr_t)7;
+	top -= ARGSAVE;
+
+	return __thread_create(__thread_start, func, arg, (void *)top);
+}
@@ -150,6 +150,7 @@ void
 dumpsb(void)
 {
 	struct sfs_superblock sb;
+	struct sfs_jnlheader jh;
 	unsigned i;
 
 	diskread(&sb, SFS_SUPER_BLOCK);
@@ -163,6 +164,24 @@ dumpsb(void)
 		 SFS_FREEMAPBLOCKS(SWAP32(sb.sb_nblocks)));
 	dumpvalf("Block size", "%u bytes", SFS_BLOCKSIZE);
 	dumplval("Volume name", sb.sb_volname);
+	dumpvalf("Features", "0x%x%s%s%s%s", SWAP32(sb.sb_features),
+		 (SWAP32(sb.sb_features) & SFS_FEATURE_BIGFILE) ?
+		 " (bigfile)" : "",
+		 (SWAP32(sb.sb_features) & SFS_FEATURE_EXTENTS) ?
+		 " (extents)" : "",
+		 (SWAP32(sb.sb_features) & SFS_FEATURE_DIRHASH) ?
+		 " (dirhash)" : "",
+		 (SWAP32(sb.sb_features) & SFS_FEATURE_JOURNAL) ?
+		 " (journal)" : "");
+	if (SWAP32(sb.sb_features) & SFS_FEATURE_JOURNAL) {
+		dumpvalf("Journal", "%u blocks at block %u",
+			 SWAP32(sb.sb_journalblocks),
+			 SWAP32(sb.sb_journalstart));
+		diskread(&jh, SWAP32(sb.sb_journalstart));
+		dumpvalf("Journal magic", "0x%8x", SWAP32(jh.jh_magic));
+		dumpvalf("Journal head", "transaction %u at log block %u",
+			 SWAP32(jh.jh_seq), SWAP32(jh.jh_head));
+	}
 
 	for (i=0; i<ARRAYCOUNT(sb.reserved); i++) {
 		if (sb.reserved[i] != 0) {
@@ -230,7 +249,7 @@ dumpfreemap(uint32_t fsblocks)
 
 static
 void
-dumpindirect(uint32_t block)
+dumpindirect(uint32_t block, unsigned indirection)
 {
 	uint32_t ib[SFS_BLOCKSIZE/sizeof(uint32_t)];
 	char tmp[128];
@@ -239,7 +258,7 @@ dumpindirect(uint32_t block)
 	if (block == 0) {
 		return;
 	}
-	printf("Indirect block %u\n", block);
+	printf("Indirect block %u (level %u)\n", block, indirection);
 
 	diskread(ib, block);
 	for (i=0; i<ARRAYCOUNT(ib); i++) {
@@ -253,12 +272,17 @@ dumpindirect(uint32_t block)
 			printf("\n");
 		}
 	}
+	if (indirection > 1) {
+		for (i=0; i<ARRAYCOUNT(ib); i++) {
+			dumpindirect(SWAP32(ib[i]), indirection - 1);
+		}
+	}
 }
 
 static
 uint32_t
 traverse_ib(uint32_t fileblock, uint32_t numblocks, uint32_t block,
-	    void (*doblock)(uint32_t, uint32_t))
+	    unsigned indirection, void (*doblock)(uint32_t, uint32_t))
 {
 	uint32_t ib[SFS_BLOCKSIZE/sizeof(uint32_t)];
 	unsigned i;
@@ -270,11 +294,77 @@ traverse_ib(uint32_t fileblock, uint32_t numblocks, uint32_t block,
 		diskread(ib, block);
 	}
 	for (i=0; i<ARRAYCOUNT(ib) && fileblock < numblocks; i++) {
-		doblock(fileblock++, SWAP32(ib[i]));
+		if (indirection > 1) {
+			fileblock = traverse_ib(fileblock, numblocks,
+						SWAP32(ib[i]),
+						indirection - 1, doblock);
+		}
+		else {
+			doblock(fileblock++, SWAP32(ib[i]));
+		}
 	}
 	return fileblock;
 }
 
+/*
+ * Get extent IDX of an extent-mapped inode, following the chain of
+ * extent blocks if it isn't in the inode itself.
+ */
+static
+void
+getextent(const struct sfs_dinode *sfi, uint32_t idx, struct sfs_extent *ret)
+{
+	struct sfs_extentblock seb;
+	const struct sfs_extent *se;
+	uint32_t block, n;
+
+	if (idx < SFS_NIEXTENTS) {
+		se = &sfi->sfi_extents[idx];
+	}
+	else {
+		idx -= SFS_NIEXTENTS;
+		block = SWAP32(sfi->sfi_extblock);
+		for (n = idx / SFS_EXTPERBLOCK; ; n--) {
+			if (block == 0) {
+				errx(1, "Extent block chain too short");
+			}
+			diskread(&seb, block);
+			if (n == 0) {
+				break;
+			}
+			block = SWAP32(seb.seb_next);
+		}
+		se = &seb.seb_extents[idx % SFS_EXTPERBLOCK];
+	}
+	ret->se_fileblock = SWAP32(se->se_fileblock);
+	ret->se_diskblock = SWAP32(se->se_diskblock);
+	ret->se_nblocks = SWAP32(se->se_nblocks);
+}
+
+static
+void
+traverse_ext(const struct sfs_dinode *sfi, uint32_t numblocks,
+	     void (*doblock)(uint32_t, uint32_t))
+{
+	struct sfs_extent ext;
+	uint32_t fileblock, i, j;
+
+	fileblock = 0;
+	for (i=0; i<SWAP32(sfi->sfi_nextents); i++) {
+		getextent(sfi, i, &ext);
+		/* holes */
+		while (fileblock < ext.se_fileblock && fileblock < numblocks) {
+			doblock(fileblock++, 0);
+		}
+		for (j=0; j<ext.se_nblocks && fileblock < numblocks; j++) {
+			doblock(fileblock++, ext.se_diskblock + j);
+		}
+	}
+	while (fileblock < numblocks) {
+		doblock(fileblock++, 0);
+	}
+}
+
 static
 void
 traverse(const struct sfs_dinode *sfi, void (*doblock)(uint32_t, uint32_t))
@@ -285,17 +375,35 @@ traverse(const struct sfs_dinode *sfi, void (*doblock)(uint32_t, uint32_t))
 
 	numblocks = DIVROUNDUP(SWAP32(sfi->sfi_size), SFS_BLOCKSIZE);
 
+	if (SWAP32(sfi->sfi_flags) & SFS_IFLAG_EXTENTS) {
+		traverse_ext(sfi, numblocks, doblock);
+		return;
+	}
+
 	fileblock = 0;
 	for (i=0; i<SFS_NDIRECT && fileblock < numblocks; i++) {
 		doblock(fileblock++, SWAP32(sfi->sfi_direct[i]));
 	}
 	if (fileblock < numblocks) {
 		fileblock = traverse_ib(fileblock, numblocks,
-					SWAP32(sfi->sfi_indirect), doblock);
+					SWAP32(sfi->sfi_indirect), 1, doblock);
+	}
+	if (fileblock < numblocks) {
+		fileblock = traverse_ib(fileblock, numblocks,
+					SWAP32(sfi->sfi_dindirect), 2,
+					doblock);
+	}
+	if (fileblock < numblocks) {
+		fileblock = traverse_ib(fileblock, numblocks,
+					SWAP32(sfi->sfi_tindirect), 3,
+					doblock);
 	}
 	assert(fileblock == numblocks);
 }
 
+/* Set by dumpdir for dumpdirblock: is the directory hash-indexed? */
+static int dirhashed;
+
 static
 void
 dumpdirblock(uint32_t fileblock, uint32_t diskblock)
@@ -314,7 +422,24 @@ dumpdirblock(uint32_t fileblock, uint32_t diskblock)
 	printf("    [block %u]\n", diskblock);
 	for (i=0; i<nsds; i++) {
 		uint32_t ino = SWAP32(sds[i].sfd_ino);
-		if (ino==SFS_NOINO) {
+		if (dirhashed && i == 0) {
+			struct sfs_dirbucket sdb;
+
+			memcpy(&sdb, &sds[0], sizeof(sdb));
+			if (SWAP32(sdb.sdb_magic) != SFS_DIRBUCKET_MAGIC) {
+				printf("        [bad bucket header]\n");
+				continue;
+			}
+			printf("        [%s: depth %u, prefix 0x%x, "
+			       "next %u]\n",
+			       (SWAP32(sdb.sdb_flags) &
+				SFS_DIRBUCKET_OVERFLOW) ?
+			       "overflow" : "bucket",
+			       SWAP32(sdb.sdb_depth),
+			       SWAP32(sdb.sdb_prefix),
+			       SWAP32(sdb.sdb_next));
+		}
+		else if (ino==SFS_NOINO) {
 			printf("        [free entry]\n");
 		}
 		else {
@@ -335,6 +460,7 @@ dumpdir(uint32_t ino, const struct sfs_dinode *sfi)
 		warnx("Warning: dir size is not a multiple of dir entry size");
 	}
 	printf("Directory contents for inode %u: %d entries\n", ino, nentries);
+	dirhashed = (SWAP32(sfi->sfi_flags) & SFS_IFLAG_DIRHASH) != 0;
 	traverse(sfi, dumpdirblock);
 }
 
@@ -423,6 +549,25 @@ dumpfile(uint32_t ino, const struct sfs_dinode *sfi)
 	traverse(sfi, dumpfileblock);
 }
 
+static
+void
+dumpextents(const struct sfs_dinode *sfi)
+{
+	struct sfs_extent ext;
+	uint32_t i;
+
+	printf("    Extents: %u, first extent block %u (0x%x)\n",
+	       SWAP32(sfi->sfi_nextents), SWAP32(sfi->sfi_extblock),
+	       SWAP32(sfi->sfi_extblock));
+	for (i=0; i<SWAP32(sfi->sfi_nextents); i++) {
+		getextent(sfi, i, &ext);
+		printf("@%-4u  file blocks %u-%u at disk block %u (0x%x)\n",
+		       i, ext.se_fileblock,
+		       ext.se_fileblock + ext.se_nblocks - 1,
+		       ext.se_diskblock, ext.se_diskblock);
+	}
+}
+
 static
 void
 dumpinode(uint32_t ino, const char *name)
@@ -449,8 +594,17 @@ dumpinode(uint32_t ino, const char *name)
 	dumpvalf("Type", "%u (%s)", SWAP16(sfi.sfi_type), typename);
 	dumpvalf("Size", "%u", SWAP32(sfi.sfi_size));
 	dumpvalf("Link count", "%u", SWAP16(sfi.sfi_linkcount));
+	dumpvalf("Flags", "0x%x%s%s", SWAP32(sfi.sfi_flags),
+		 (SWAP32(sfi.sfi_flags) & SFS_IFLAG_EXTENTS) ?
+		 " (extents)" : "",
+		 (SWAP32(sfi.sfi_flags) & SFS_IFLAG_DIRHASH) ?
+		 " (hashed)" : "");
 	printf("\n");
 
+	if (SWAP32(sfi.sfi_flags) & SFS_IFLAG_EXTENTS) {
+		dumpextents(&sfi);
+	}
+
         printf("    Direct blocks:\n");
         for (i=0; i<SFS_NDIRECT; i++) {
 		if (i % 4 == 0) {
@@ -476,6 +630,10 @@ dumpinode(uint32_t ino, const char *name)
 	}
 	printf("    Indirect block: %u (0x%x)\n",
 	       SWAP32(sfi.sfi_indirect), SWAP32(sfi.sfi_indirect));
+	printf("    Double indirect block: %u (0x%x)\n",
+	       SWAP32(sfi.sfi_dindirect), SWAP32(sfi.sfi_dindirect));
+	printf("    Triple indirect block: %u (0x%x)\n",
+	       SWAP32(sfi.sfi_tindirect), SWAP32(sfi.sfi_tindirect));
 	for (i=0; i<ARRAYCOUNT(sfi.sfi_waste); i++) {
 		if (sfi.sfi_waste[i] != 0) {
 			printf("    Word %u in waste area: 0x%x\n",
@@ -484,7 +642,9 @@ dumpinode(uint32_t ino, const char *name)
 	}
 
 	if (doindirect) {
-		dumpindirect(SWAP32(sfi.sfi_indirect));
+		dumpindirect(SWAP32(sfi.sfi_indirect), 1);
+		dumpindirect(SWAP32(sfi.sfi_dindirect), 2);
+		dumpindirect(SWAP32(sfi.sfi_tindirect), 3);
 	}
 
 	if (SWAP16(sfi.sfi_type) == SFS_TYPE_DIR && dodirs) {
@@ -0,0 +1,321 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <kern/syscall.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+/*
+ * ktrace - run a program with kernel event tracing on.
+ * Usage: ktrace [-a] [-d] [-e events] command [args...]
+ *
+ * Turns on the kernel trace, runs the command, and when it exits
+ * reads the trace back and summarizes it: syscalls by total latency,
+ * vm faults, and context switches. Times are in cycles.
+ *
+ *    -a         count events from all processes, not just the command
+ *    -d         also print every record
+ *    -e events  trace only these: any of s (syscalls), f (faults),
+ *               w (switches); default all
+ *
+ * The kernel keeps a fixed number of records per cpu; if the command
+ * produces more than that between reads, the summary says how many
+ * were lost.
+ */
+
+#define NSYSCALLS	128
+#define BUFRECORDS	KTRACE_READMAX
+
+/* Syscall names, for the ones that exist */
+static const char *const syscallnames[NSYSCALLS] = {
+	[SYS_fork] = "fork",
+	[SYS_execv] = "execv",
+	[SYS__exit] = "_exit",
+	[SYS_waitpid] = "waitpid",
+	[SYS_getpid] = "getpid",
+	[SYS_sbrk] = "sbrk",
+	[SYS_getrusage] = "getrusage",
+	[SYS_open] = "open",
+	[SYS_pipe] = "pipe",
+	[SYS_dup2] = "dup2",
+	[SYS_close] = "close",
+	[SYS_read] = "read",
+	[SYS_getdirentry] = "getdirentry",
+	[SYS_write] = "write",
+	[SYS_lseek] = "lseek",
+	[SYS_ftruncate] = "ftruncate",
+	[SYS_fsync] = "fsync",
+	[SYS_ioctl] = "ioctl",
+	[SYS_link] = "link",
+	[SYS_remove] = "remove",
+	[SYS_mkdir] = "mkdir",
+	[SYS_rmdir] = "rmdir",
+	[SYS_rename] = "rename",
+	[SYS_chdir] = "chdir",
+	[SYS___getcwd] = "__getcwd",
+	[SYS_fstat] = "fstat",
+	[SYS___time] = "__time",
+	[SYS_sync] = "sync",
+	[SYS_reboot] = "reboot",
+	[SYS_waitmany] = "waitmany",
+	[SYS_spawn] = "spawn",
+	[SYS___thread_create] = "__thread_create",
+	[SYS_thread_join] = "thread_join",
+	[SYS_thread_exit] = "thread_exit",
+	[SYS_ktrace] = "ktrace",
+	[SYS_ktrace_read] = "ktrace_read",
+};
+
+/* Fault type names (VM_FAULT_* in the kernel's vm.h) */
+static const char *const faultnames[] = { "read", "write", "readonly" };
+#define NFAULTTYPES (sizeof(faultnames) / sizeof(faultnames[0]))
+
+struct counter {
+	unsigned code;
+	unsigned count;
+	unsigned errors;
+	unsigned long long total;
+	unsigned max;
+};
+
+static struct counter syscalls[NSYSCALLS];
+static struct counter faults[NFAULTTYPES];
+static struct counter switches;
+static unsigned long long lost;
+
+static struct ktrace_event buf[BUFRECORDS];
+
+static
+void
+count(struct counter *c, const struct ktrace_event *ke)
+{
+	c->count++;
+	if (ke->ke_result != 0) {
+		c->errors++;
+	}
+	c->total += ke->ke_latency;
+	if (ke->ke_latency > c->max) {
+		c->max = ke->ke_latency;
+	}
+}
+
+static
+void
+printcounter(const char *name, const struct counter *c)
+{
+	printf("  %-16s %8u %6u %12llu %10llu %10u\n", name, c->count,
+	       c->errors, c->total, c->total / c->count, c->max);
+}
+
+static
+void
+dump(const struct ktrace_event *ke)
+{
+	static const char *const typenames[] = {
+		[KTRACE_SYSCALL] = "syscall",
+		[KTRACE_FAULT] = "fault",
+		[KTRACE_SWITCH] = "switch",
+		[KTRACE_LOST] = "lost",
+	};
+	const char *name;
+
+	name = NULL;
+	if (ke->ke_type == KTRACE_SYSCALL && ke->ke_code < NSYSCALLS) {
+		name = syscallnames[ke->ke_code];
+	}
+	else if (ke->ke_type == KTRACE_FAULT && ke->ke_code < NFAULTTYPES) {
+		name = faultnames[ke->ke_code];
+	}
+
+	printf("cpu%u %10u pid %3d %-7s %-12s",
+	       ke->ke_cpu, ke->ke_cycles, ke->ke_pid,
+	       ke->ke_type < 4 ? typenames[ke->ke_type] : "?",
+	       name != NULL ? name : "-");
+	printf(" arg 0x%08x lat %8u err %d\n",
+	       ke->ke_arg, ke->ke_latency, ke->ke_result);
+}
+
+/*
+ * Sort by total latency, biggest first.
+ */
+static
+int
+bytotal(const void *av, const void *bv)
+{
+	const struct counter *a = av, *b = bv;
+
+	if (a->total > b->total) {
+		return -1;
+	}
+	if (a->total < b->total) {
+		return 1;
+	}
+	return 0;
+}
+
+static
+void
+summarize(void)
+{
+	const char *name;
+	char tmp[16];
+	unsigned i;
+
+	printf("\n  %-16s %8s %6s %12s %10s %10s\n", "syscall", "count",
+	       "errors", "total", "avg", "max");
+	for (i=0; i<NSYSCALLS; i++) {
+		syscalls[i].code = i;
+	}
+	qsort(syscalls, NSYSCALLS, sizeof(syscalls[0]), bytotal);
+	for (i=0; i<NSYSCALLS && syscalls[i].count > 0; i++) {
+		name = syscallnames[syscalls[i].code];
+		if (name == NULL) {
+			snprintf(tmp, sizeof(tmp), "#%u", syscalls[i].code);
+			name = tmp;
+		}
+		printcounter(name, &syscalls[i]);
+	}
+
+	printf("\n  %-16s %8s %6s %12s %10s %10s\n", "fault", "count",
+	       "errors", "total", "avg", "max");
+	for (i=0; i<NFAULTTYPES; i++) {
+		if (faults[i].count > 0) {
+			printcounter(faultnames[i], &faults[i]);
+		}
+	}
+
+	if (switches.count > 0) {
+		printf("\n  %-16s %8s %6s %12s %10s %10s\n", "switches",
+		       "count", "", "wait", "avg", "max");
+		printcounter("", &switches);
+	}
+
+	if (lost > 0) {
+		printf("\n%llu events lost (trace ring overflowed)\n", lost);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	int allpids = 0, dumpall = 0;
+	unsigned mask = KTRACE_ALL;
+	const char *s;
+	pid_t pid;
+	int i, n, status;
+
+	for (i=1; i<argc && argv[i][0] == '-'; i++) {
+		if (!strcmp(argv[i], "-a")) {
+			allpids = 1;
+		}
+		else if (!strcmp(argv[i], "-d")) {
+			dumpall = 1;
+		}
+		else if (!strcmp(argv[i], "-e") && i+1 < argc) {
+			mask = 0;
+			for (s = argv[++i]; *s; s++) {
+				switch (*s) {
+				    case 's':
+					mask |= KTRACE_MASK(KTRACE_SYSCALL);
+					break;
+				    case 'f':
+					mask |= KTRACE_MASK(KTRACE_FAULT);
+					break;
+				    case 'w':
+					mask |= KTRACE_MASK(KTRACE_SWITCH);
+					break;
+				    default:
+					errx(1, "Unknown event type %c", *s);
+				}
+			}
+		}
+		else {
+			break;
+		}
+	}
+	if (i >= argc || mask == 0) {
+		errx(1, "Usage: ktrace [-a] [-d] [-e sfw] command [args...]");
+	}
+
+	if (ktrace(KTRACE_CLEAR, 0) < 0 || ktrace(KTRACE_START, mask) < 0) {
+		err(1, "ktrace");
+	}
+	pid = spawnp(argv[i], argv+i, NULL, 0);
+	if (pid < 0) {
+		warn("%s", argv[i]);
+		ktrace(KTRACE_STOP, 0);
+		return 1;
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		warn("waitpid");
+	}
+	ktrace(KTRACE_STOP, 0);
+
+	while ((n = ktrace_read(buf, BUFRECORDS)) > 0) {
+		for (i=0; i<n; i++) {
+			if (buf[i].ke_type == KTRACE_LOST) {
+				lost += buf[i].ke_arg;
+				continue;
+			}
+			if (!allpids && buf[i].ke_pid != pid) {
+				continue;
+			}
+			if (dumpall) {
+				dump(&buf[i]);
+			}
+			switch (buf[i].ke_type) {
+			    case KTRACE_SYSCALL:
+				if (buf[i].ke_code < NSYSCALLS) {
+					count(&syscalls[buf[i].ke_code],
+					      &buf[i]);
+				}
+				break;
+			    case KTRACE_FAULT:
+				if (buf[i].ke_code < NFAULTTYPES) {
+					count(&faults[buf[i].ke_code],
+					      &buf[i]);
+				}
+				break;
+			    case KTRACE_SWITCH:
+				count(&switches, &buf[i]);
+				break;
+			}
+		}
+	}
+	if (n < 0) {
+		err(1, "ktrace_read");
+	}
+
+	summarize();
+	return 0;
+}
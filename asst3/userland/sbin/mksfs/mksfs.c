@@ -72,6 +72,8 @@ check(void)
 {
 	assert(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_extentblock)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_jnlheader)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
 }
 
@@ -89,12 +91,22 @@ allocblock(uint32_t block)
 	freemapbuf[mapbyte] |= mask;
 }
 
+/*
+ * Where the journal goes, if there is one: right after the freemap.
+ */
+static
+uint32_t
+journalstart(uint32_t fsblocks)
+{
+	return SFS_FREEMAP_START + SFS_FREEMAPBLOCKS(fsblocks);
+}
+
 /*
  * Initialize the free block bitmap.
  */
 static
 void
-initfreemap(uint32_t fsblocks)
+initfreemap(uint32_t fsblocks, uint32_t features)
 {
 	uint32_t freemapbits = SFS_FREEMAPBITS(fsblocks);
 	uint32_t freemapblocks = SFS_FREEMAPBLOCKS(fsblocks);
@@ -114,6 +126,16 @@ initfreemap(uint32_t fsblocks)
 		allocblock(SFS_FREEMAP_START + i);
 	}
 
+	/* so must the journal */
+	if (features & SFS_FEATURE_JOURNAL) {
+		if (journalstart(fsblocks) + SFS_JNL_DEFBLOCKS > fsblocks) {
+			errx(1, "Filesystem too small for a journal");
+		}
+		for (i=0; i<SFS_JNL_DEFBLOCKS; i++) {
+			allocblock(journalstart(fsblocks) + i);
+		}
+	}
+
 	/* all blocks in the freemap but past the volume end are "in use" */
 	for (i=fsblocks; i<freemapbits; i++) {
 		allocblock(i);
@@ -125,7 +147,7 @@ initfreemap(uint32_t fsblocks)
  */
 static
 void
-writesuper(const char *volname, uint32_t nblocks)
+writesuper(const char *volname, uint32_t nblocks, uint32_t features)
 {
 	struct sfs_superblock sb;
 
@@ -140,6 +162,11 @@ writesuper(const char *volname, uint32_t nblocks)
 	sb.sb_magic = SWAP32(SFS_MAGIC);
 	sb.sb_nblocks = SWAP32(nblocks);
 	strcpy(sb.sb_volname, volname);
+	sb.sb_features = SWAP32(features);
+	if (features & SFS_FEATURE_JOURNAL) {
+		sb.sb_journalstart = SWAP32(journalstart(nblocks));
+		sb.sb_journalblocks = SWAP32(SFS_JNL_DEFBLOCKS);
+	}
 
 	/* and write it out. */
 	diskwrite(&sb, SFS_SUPER_BLOCK);
@@ -164,20 +191,55 @@ writefreemap(uint32_t fsblocks)
 	}
 }
 
+/*
+ * Write out an empty journal: a header saying the log starts at its
+ * first block, and zeros, which don't look like any transaction.
+ */
+static
+void
+writejournal(uint32_t fsblocks)
+{
+	char zeros[SFS_BLOCKSIZE];
+	struct sfs_jnlheader jh;
+	uint32_t start, i;
+
+	start = journalstart(fsblocks);
+
+	bzero((void *)zeros, sizeof(zeros));
+	for (i=1; i<SFS_JNL_DEFBLOCKS; i++) {
+		diskwrite(zeros, start + i);
+	}
+
+	bzero((void *)&jh, sizeof(jh));
+	jh.jh_magic = SWAP32(SFS_JNL_MAGIC);
+	jh.jh_seq = SWAP32(1);
+	jh.jh_head = SWAP32(1);
+	diskwrite(&jh, start);
+}
+
 /*
  * Write out the root directory inode.
  */
 static
 void
-writerootdir(void)
+writerootdir(uint32_t features)
 {
 	struct sfs_dinode sfi;
+	uint32_t flags = 0;
 
 	/* Initialize the dinode */
 	bzero((void *)&sfi, sizeof(sfi));
 	sfi.sfi_size = SWAP32(0);
 	sfi.sfi_type = SWAP16(SFS_TYPE_DIR);
 	sfi.sfi_linkcount = SWAP16(1);
+	if (features & SFS_FEATURE_EXTENTS) {
+		flags |= SFS_IFLAG_EXTENTS;
+	}
+	if (features & SFS_FEATURE_DIRHASH) {
+		/* An empty hashed directory has no blocks yet */
+		flags |= SFS_IFLAG_DIRHASH;
+	}
+	sfi.sfi_flags = SWAP32(flags);
 
 	/* Write it out */
 	diskwrite(&sfi, SFS_ROOTDIR_INO);
@@ -189,15 +251,36 @@ writerootdir(void)
 int
 main(int argc, char **argv)
 {
-	uint32_t size, blocksize;
+	uint32_t size, blocksize, features;
 	char *volname, *s;
 
 #ifdef HOST
 	hostcompat_init(argc, argv);
 #endif
 
+	features = SFS_FEATURE_BIGFILE;
+	while (argc > 1 && argv[1][0] == '-') {
+		if (!strcmp(argv[1], "-e")) {
+			/* New files get extents instead of block pointers */
+			features |= SFS_FEATURE_EXTENTS;
+		}
+		else if (!strcmp(argv[1], "-d")) {
+			/* Directories are hash-indexed */
+			features |= SFS_FEATURE_DIRHASH;
+		}
+		else if (!strcmp(argv[1], "-j")) {
+			/* Metadata changes are journaled */
+			features |= SFS_FEATURE_JOURNAL;
+		}
+		else {
+			break;
+		}
+		argc--;
+		argv++;
+	}
+
 	if (argc!=3) {
-		errx(1, "Usage: mksfs device/diskfile volume-name");
+		errx(1, "Usage: mksfs [-e] [-d] [-j] device/diskfile volume-name");
 	}
 
 	check();
@@ -229,10 +312,13 @@ main(int argc, char **argv)
 	size = diskblocks();
 
 	/* Write out the on-disk structures */
-	initfreemap(size);
-	writesuper(volname, size);
+	initfreemap(size, features);
+	writesuper(volname, size, features);
 	writefreemap(size);
-	writerootdir();
+	if (features & SFS_FEATURE_JOURNAL) {
+		writejournal(size);
+	}
+	writerootdir(features);
 
 	closedisk();
 
@@ -78,6 +78,13 @@ freemap_setup(void)
 	for (i=0; i < mapblocks; i++) {
 		freemap_blockinuse(SFS_FREEMAP_START+i, B_FREEMAPBLOCK, i);
 	}
+
+	/* and the journal, if any */
+	if (sb_features() & SFS_FEATURE_JOURNAL) {
+		for (i=0; i < sb_journalblocks(); i++) {
+			freemap_blockinuse(sb_journalstart()+i, B_JOURNAL, i);
+		}
+	}
 }
 
 /*
@@ -95,6 +102,10 @@ blockusagestr(blockusage_t how, uint32_t howdesc)
 		snprintf(rv, sizeof(rv), "freemap block %lu",
 			 (unsigned long) howdesc);
 		break;
+	    case B_JOURNAL:
+		snprintf(rv, sizeof(rv), "journal block %lu",
+			 (unsigned long) howdesc);
+		break;
 	    case B_INODE:
 		snprintf(rv, sizeof(rv), "inode %lu",
 			 (unsigned long) howdesc);
@@ -103,6 +114,10 @@ blockusagestr(blockusage_t how, uint32_t howdesc)
 		snprintf(rv, sizeof(rv), "indirect block of inode %lu",
 			 (unsigned long) howdesc);
 		break;
+	    case B_EXTBLOCK:
+		snprintf(rv, sizeof(rv), "extent block of inode %lu",
+			 (unsigned long) howdesc);
+		break;
 	    case B_DIRDATA:
 		snprintf(rv, sizeof(rv), "directory data from inode %lu",
 			 (unsigned long) howdesc);
@@ -41,8 +41,10 @@
 typedef enum {
 	B_SUPERBLOCK,	/* Block that is the superblock */
 	B_FREEMAPBLOCK,	/* Block used by free-block bitmap */
+	B_JOURNAL,	/* Block of the journal */
 	B_INODE,	/* Block that is an inode */
 	B_IBLOCK,	/* Indirect (or doubly-indirect etc.) block */
+	B_EXTBLOCK,	/* Extent block */
 	B_DIRDATA,	/* Data block of a directory */
 	B_DATA,		/* Data block */
 	B_PASTEND,	/* Block off the end of the fs */
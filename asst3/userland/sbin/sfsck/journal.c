@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2006, 2009, 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <err.h>
+
+#include "compat.h"
+#include <kern/sfs.h>
+
+#include "disk.h"
+#include "utils.h"
+#include "sb.h"
+#include "journal.h"
+#include "main.h"
+
+/* A block revoked by a transaction */
+struct revoke {
+	uint32_t block;
+	uint32_t seq;
+};
+
+/* What a pass over the log does */
+#define SCAN_CHECK	0	/* find the complete transactions */
+#define SCAN_REVOKES	1	/* collect the revoked blocks */
+#define SCAN_REPLAY	2	/* write the logged blocks home */
+
+static uint32_t jstart, jsize;		/* where the journal is */
+static uint32_t ntxns;			/* complete transactions */
+static uint32_t logend;			/* log position after them */
+static unsigned nrevokes;		/* blocks they revoke */
+static struct revoke *revokes;		/* which (once collected) */
+
+/*
+ * Add the bytes of a block, as on disk, to a checksum (FNV-1a).
+ */
+static
+uint32_t
+jnlsum(uint32_t sum, const void *block)
+{
+	const unsigned char *p = block;
+	unsigned i;
+
+	for (i=0; i<SFS_BLOCKSIZE; i++) {
+		sum ^= p[i];
+		sum *= 16777619U;
+	}
+	return sum;
+}
+
+/*
+ * Step to the next position in the log.
+ */
+static
+uint32_t
+lognext(uint32_t pos)
+{
+	pos++;
+	return pos == jsize ? 1 : pos;
+}
+
+/*
+ * Write the journal header.
+ */
+static
+void
+writeheader(uint32_t seq, uint32_t head)
+{
+	struct sfs_jnlheader jh;
+
+	memset(&jh, 0, sizeof(jh));
+	jh.jh_magic = SWAP32(SFS_JNL_MAGIC);
+	jh.jh_seq = SWAP32(seq);
+	jh.jh_head = SWAP32(head);
+	diskwrite(&jh, jstart);
+}
+
+/*
+ * Write a logged block home, unless revoked by its own or a later
+ * transaction.
+ */
+static
+void
+replayblock(uint32_t block, uint32_t seq, const void *data)
+{
+	unsigned i;
+
+	for (i=0; i<nrevokes; i++) {
+		if (revokes[i].block == block && revokes[i].seq >= seq) {
+			return;
+		}
+	}
+	if (block >= sb_totalblocks() ||
+	    (block >= jstart && block < jstart + jsize)) {
+		warnx("Journal logs invalid block %lu (skipped)",
+		      (unsigned long)block);
+		setbadness(EXIT_UNRECOV);
+		return;
+	}
+	diskwrite(data, block);
+}
+
+/*
+ * Go over the transactions in the log, starting at HEAD with SEQ.
+ * With SCAN_CHECK, find how many are complete; the other modes go
+ * over that many again.
+ */
+static
+void
+scan(uint32_t head, uint32_t seq, int mode)
+{
+	struct sfs_jnlrec rec;
+	char data[SFS_BLOCKSIZE];
+	uint32_t pos, count, sum, i, t, txnstart, rcount;
+	unsigned nrev, txnrev;
+
+	pos = head;
+	nrev = 0;
+	for (t=0; mode == SCAN_CHECK || t < ntxns; t++, seq++) {
+		txnstart = pos;
+		txnrev = nrev;
+		count = 0;
+		sum = 2166136261U;
+
+		/* Read records until the commit */
+		while (1) {
+			if (count >= jsize - 1) {
+				goto incomplete;
+			}
+			diskread(&rec, jstart + pos);
+			rcount = SWAP32(rec.jr_count);
+			if (SWAP32(rec.jr_magic) != SFS_JNL_MAGIC ||
+			    SWAP32(rec.jr_seq) != seq ||
+			    rcount > SFS_JNLRECBLOCKS) {
+				goto incomplete;
+			}
+			if (SWAP32(rec.jr_type) == SFS_JNLREC_COMMIT) {
+				if (rcount != count ||
+				    SWAP32(rec.jr_sum) != sum) {
+					goto incomplete;
+				}
+				pos = lognext(pos);
+				break;
+			}
+			if (SWAP32(rec.jr_type) != SFS_JNLREC_DESC &&
+			    SWAP32(rec.jr_type) != SFS_JNLREC_REVOKE) {
+				goto incomplete;
+			}
+			sum = jnlsum(sum, &rec);
+			count++;
+			pos = lognext(pos);
+
+			if (SWAP32(rec.jr_type) == SFS_JNLREC_REVOKE) {
+				if (mode == SCAN_REVOKES) {
+					for (i=0; i<rcount; i++) {
+						revokes[nrev+i].block =
+							SWAP32(rec.jr_blocks[i]);
+						revokes[nrev+i].seq = seq;
+					}
+				}
+				nrev += rcount;
+				continue;
+			}
+
+			/* The blocks listed follow the descriptor */
+			for (i=0; i<rcount; i++) {
+				if (count >= jsize - 1) {
+					goto incomplete;
+				}
+				diskread(data, jstart + pos);
+				sum = jnlsum(sum, data);
+				count++;
+				pos = lognext(pos);
+				if (mode == SCAN_REPLAY) {
+					replayblock(SWAP32(rec.jr_blocks[i]),
+						    seq, data);
+				}
+			}
+		}
+	}
+	return;
+
+ incomplete:
+	/* The first one that didn't make it; the log ends before it */
+	assert(mode == SCAN_CHECK);
+	ntxns = t;
+	logend = txnstart;
+	nrevokes = txnrev;
+}
+
+/*
+ * Throw away whatever is in the log and start over, as mksfs does.
+ */
+static
+void
+resetlog(void)
+{
+	char zeros[SFS_BLOCKSIZE];
+	uint32_t i;
+
+	memset(zeros, 0, sizeof(zeros));
+	for (i=1; i<jsize; i++) {
+		diskwrite(zeros, jstart + i);
+	}
+	writeheader(1, 1);
+}
+
+/*
+ * Replay the journal.
+ */
+int
+journal_replay(void)
+{
+	struct sfs_jnlheader jh;
+	uint32_t head, seq;
+
+	if ((sb_features() & SFS_FEATURE_JOURNAL) == 0) {
+		return 0;
+	}
+	jstart = sb_journalstart();
+	jsize = sb_journalblocks();
+
+	diskread(&jh, jstart);
+	head = SWAP32(jh.jh_head);
+	seq = SWAP32(jh.jh_seq);
+	if (SWAP32(jh.jh_magic) != SFS_JNL_MAGIC ||
+	    head == 0 || head >= jsize) {
+		warnx("Journal header invalid (journal reset)");
+		setbadness(EXIT_RECOV);
+		resetlog();
+		return 0;
+	}
+
+	/* Find the complete transactions, then the revokes, then replay */
+	scan(head, seq, SCAN_CHECK);
+	if (ntxns == 0) {
+		return 0;
+	}
+	if (nrevokes > 0) {
+		revokes = domalloc(nrevokes * sizeof(*revokes));
+		scan(head, seq, SCAN_REVOKES);
+	}
+	scan(head, seq, SCAN_REPLAY);
+	if (revokes != NULL) {
+		free(revokes);
+		revokes = NULL;
+	}
+
+	/* It's all home; empty the log */
+	writeheader(seq + ntxns, logend);
+
+	warnx("Replayed %lu journal transaction%s",
+	      (unsigned long)ntxns, ntxns == 1 ? "" : "s");
+	setbadness(EXIT_RECOV);
+	return 1;
+}
@@ -187,6 +187,7 @@ check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 	struct ibstate ibs;
 	uint32_t size, datablock;
 	int changed;
+	int bigfile = 0;
 	int i;
 
 	size = SFS_ROUNDUP(sfi->sfi_size, SFS_BLOCKSIZE);
@@ -233,9 +234,23 @@ check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 	}
 	for (i=0; i<NUM_II; i++) {
 		check_indirect_block(&ibs, &SET_II(sfi, i), &changed, 2);
+		if (GET_II(sfi, i) != 0) {
+			bigfile = 1;
+		}
 	}
 	for (i=0; i<NUM_III; i++) {
 		check_indirect_block(&ibs, &SET_III(sfi, i), &changed, 3);
+		if (GET_III(sfi, i) != 0) {
+			bigfile = 1;
+		}
+	}
+
+	if (bigfile && (sb_features() & SFS_FEATURE_BIGFILE) == 0) {
+		warnx("Inode %lu: uses 2x/3x indirect blocks but volume "
+		      "does not have the bigfile feature (fixed)",
+		      (unsigned long) ibs.ino);
+		setbadness(EXIT_RECOV);
+		sb_addfeatures(SFS_FEATURE_BIGFILE);
 	}
 
 	if (ibs.pasteofcount > 0) {
@@ -247,6 +262,228 @@ check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 	return changed;
 }
 
+/*
+ * Check the blocks belonging to extent-mapped inode INO, whose inode
+ * has already been loaded into SFI. ISDIR is a shortcut telling us if
+ * the inode is a directory.
+ *
+ * Extents that are empty, out of order or overlapping, or outside
+ * the volume are dropped; ones past EOF are freed, and one crossing
+ * EOF is trimmed. If anything changes, the remaining extents are
+ * written back in order and extent blocks no longer needed are let
+ * go.
+ *
+ * Returns nonzero if SFI has been modified and needs to be written
+ * back.
+ */
+static
+int
+check_inode_extents(uint32_t ino, struct sfs_dinode *sfi, int isdir)
+{
+	struct sfs_extentblock seb;
+	struct sfs_extent *exts, *se;
+	uint32_t *chain;
+	uint32_t nextents, nchain, nchainneeded;
+	uint32_t volblocks, fileblocks, block, end, keep;
+	uint32_t i, j, k, n;
+	unsigned pasteofcount = 0;
+	blockusage_t usagetype = isdir ? B_DIRDATA : B_DATA;
+	int changed = 0, rewrite = 0;
+
+	volblocks = sb_totalblocks();
+	fileblocks = SFS_ROUNDUP(sfi->sfi_size, SFS_BLOCKSIZE)/SFS_BLOCKSIZE;
+
+	/* The block pointers aren't used. */
+	for (i=0; i<NUM_D; i++) {
+		if (GET_D(sfi, i) != 0) {
+			SET_D(sfi, i) = 0;
+			changed = 1;
+		}
+	}
+	for (i=0; i<NUM_I; i++) {
+		if (GET_I(sfi, i) != 0) {
+			SET_I(sfi, i) = 0;
+			changed = 1;
+		}
+	}
+	for (i=0; i<NUM_II; i++) {
+		if (GET_II(sfi, i) != 0) {
+			SET_II(sfi, i) = 0;
+			changed = 1;
+		}
+	}
+	for (i=0; i<NUM_III; i++) {
+		if (GET_III(sfi, i) != 0) {
+			SET_III(sfi, i) = 0;
+			changed = 1;
+		}
+	}
+	if (changed) {
+		warnx("Inode %lu: block pointers in extent-mapped inode "
+		      "(cleared)", (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+	}
+
+	/* Every extent takes at least one block of the volume. */
+	nextents = sfi->sfi_nextents;
+	if (nextents > volblocks) {
+		warnx("Inode %lu: extent count %lu too large",
+		      (unsigned long) ino, (unsigned long) nextents);
+		setbadness(EXIT_RECOV);
+		nextents = volblocks;
+		rewrite = 1;
+	}
+
+	exts = domalloc((nextents + 1) * sizeof(exts[0]));
+	chain = domalloc((nextents / SFS_EXTPERBLOCK + 1) * sizeof(chain[0]));
+
+	/* Collect the extents, following the chain of extent blocks. */
+	nchain = 0;
+	block = sfi->sfi_extblock;
+	for (i=0; i<nextents; i++) {
+		if (i < SFS_NIEXTENTS) {
+			exts[i] = sfi->sfi_extents[i];
+			continue;
+		}
+		if ((i - SFS_NIEXTENTS) % SFS_EXTPERBLOCK == 0) {
+			if (block == 0 || block >= volblocks) {
+				warnx("Inode %lu: extent blocks end after "
+				      "%lu extents (truncated)",
+				      (unsigned long) ino, (unsigned long) i);
+				setbadness(EXIT_RECOV);
+				rewrite = 1;
+				break;
+			}
+			sfs_readextblock(block, &seb);
+			chain[nchain++] = block;
+			block = seb.seb_next;
+		}
+		exts[i] = seb.seb_extents[(i - SFS_NIEXTENTS) %
+					  SFS_EXTPERBLOCK];
+	}
+	nextents = i;
+	if (i > SFS_NIEXTENTS && block != 0) {
+		/* Extra extent blocks past the last one we need */
+		warnx("Inode %lu: extra extent blocks (freed)",
+		      (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		rewrite = 1;
+	}
+
+	/* Check them in order, keeping the good ones. */
+	n = 0;
+	end = 0;
+	for (i=0; i<nextents; i++) {
+		se = &exts[i];
+		if (se->se_nblocks == 0 || se->se_fileblock < end) {
+			warnx("Inode %lu: extent %lu empty or out of order "
+			      "(dropped)", (unsigned long) ino,
+			      (unsigned long) i);
+			setbadness(EXIT_RECOV);
+			rewrite = 1;
+			continue;
+		}
+		if (se->se_diskblock == 0 || se->se_diskblock >= volblocks ||
+		    se->se_nblocks > volblocks - se->se_diskblock) {
+			warnx("Inode %lu: extent %lu outside of volume: "
+			      "%lu+%lu (dropped)", (unsigned long) ino,
+			      (unsigned long) i,
+			      (unsigned long) se->se_diskblock,
+			      (unsigned long) se->se_nblocks);
+			setbadness(EXIT_RECOV);
+			rewrite = 1;
+			continue;
+		}
+
+		keep = se->se_nblocks;
+		if (se->se_fileblock >= fileblocks) {
+			keep = 0;
+		}
+		else if (keep > fileblocks - se->se_fileblock) {
+			keep = fileblocks - se->se_fileblock;
+		}
+		for (j=keep; j<se->se_nblocks; j++) {
+			setbadness(EXIT_RECOV);
+			pasteofcount++;
+			freemap_blockfree(se->se_diskblock + j);
+			rewrite = 1;
+		}
+		if (keep == 0) {
+			continue;
+		}
+		se->se_nblocks = keep;
+
+		for (j=0; j<se->se_nblocks; j++) {
+			freemap_blockinuse(se->se_diskblock + j, usagetype,
+					   ino);
+		}
+		end = se->se_fileblock + se->se_nblocks;
+		exts[n++] = *se;
+	}
+
+	if (pasteofcount > 0) {
+		warnx("Inode %lu: %u blocks after EOF (freed)",
+		     (unsigned long) ino, pasteofcount);
+	}
+
+	if (n <= SFS_NIEXTENTS) {
+		nchainneeded = 0;
+	}
+	else {
+		nchainneeded = (n - SFS_NIEXTENTS + SFS_EXTPERBLOCK - 1) /
+			SFS_EXTPERBLOCK;
+	}
+	assert(nchainneeded <= nchain);
+
+	if (rewrite) {
+		/* Write the list back, compacted. */
+		sfi->sfi_nextents = n;
+		for (i=0; i<SFS_NIEXTENTS; i++) {
+			if (i < n) {
+				sfi->sfi_extents[i] = exts[i];
+			}
+			else {
+				memset(&sfi->sfi_extents[i], 0,
+				       sizeof(sfi->sfi_extents[i]));
+			}
+		}
+		sfi->sfi_extblock = nchainneeded > 0 ? chain[0] : 0;
+		for (j=0; j<nchainneeded; j++) {
+			memset(&seb, 0, sizeof(seb));
+			if (j + 1 < nchainneeded) {
+				seb.seb_next = chain[j + 1];
+			}
+			for (i=0; i<SFS_EXTPERBLOCK; i++) {
+				k = SFS_NIEXTENTS + j * SFS_EXTPERBLOCK + i;
+				if (k < n) {
+					seb.seb_extents[i] = exts[k];
+				}
+			}
+			sfs_writeextblock(chain[j], &seb);
+		}
+		for (j=nchainneeded; j<nchain; j++) {
+			freemap_blockfree(chain[j]);
+		}
+		nchain = nchainneeded;
+		changed = 1;
+	}
+	for (j=0; j<nchain; j++) {
+		freemap_blockinuse(chain[j], B_EXTBLOCK, ino);
+	}
+
+	free(chain);
+	free(exts);
+
+	if ((sb_features() & SFS_FEATURE_EXTENTS) == 0) {
+		warnx("Inode %lu: uses extents but volume does not have "
+		      "the extents feature (fixed)", (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		sb_addfeatures(SFS_FEATURE_EXTENTS);
+	}
+
+	return changed;
+}
+
 /*
  * Do the pass1 inode-level checks on inode INO, which has already
  * been loaded into SFI. Note that sfi_type has already been
@@ -277,10 +514,53 @@ pass1_inode(uint32_t ino, struct sfs_dinode *sfi, int alreadychanged)
 		changed = 1;
 	}
 
-	if (check_inode_blocks(ino, sfi, isdir)) {
+	if (sfi->sfi_flags & ~SFS_IFLAGS_KNOWN) {
+		warnx("Inode %lu: unknown flags 0x%lx (cleared)",
+		      (unsigned long) ino,
+		      (unsigned long) (sfi->sfi_flags & ~SFS_IFLAGS_KNOWN));
+		setbadness(EXIT_RECOV);
+		sfi->sfi_flags &= SFS_IFLAGS_KNOWN;
 		changed = 1;
 	}
 
+	if (sfi->sfi_flags & SFS_IFLAG_DIRHASH) {
+		if (!isdir) {
+			warnx("Inode %lu: hash-indexed flag on a file "
+			      "(cleared)", (unsigned long) ino);
+			setbadness(EXIT_RECOV);
+			sfi->sfi_flags &= ~SFS_IFLAG_DIRHASH;
+			changed = 1;
+		}
+		else if ((sb_features() & SFS_FEATURE_DIRHASH) == 0) {
+			warnx("Inode %lu: hash-indexed directory but volume "
+			      "does not have the dirhash feature (fixed)",
+			      (unsigned long) ino);
+			setbadness(EXIT_RECOV);
+			sb_addfeatures(SFS_FEATURE_DIRHASH);
+		}
+	}
+
+	if (sfi->sfi_flags & SFS_IFLAG_EXTENTS) {
+		if (check_inode_extents(ino, sfi, isdir)) {
+			changed = 1;
+		}
+	}
+	else {
+		/* (checkzeroed first, since it zaps what it finds) */
+		if (checkzeroed(sfi->sfi_extents, sizeof(sfi->sfi_extents)) ||
+		    sfi->sfi_nextents != 0 || sfi->sfi_extblock != 0) {
+			warnx("Inode %lu: extents in block-mapped inode "
+			      "(cleared)", (unsigned long) ino);
+			setbadness(EXIT_RECOV);
+			sfi->sfi_nextents = 0;
+			sfi->sfi_extblock = 0;
+			changed = 1;
+		}
+		if (check_inode_blocks(ino, sfi, isdir)) {
+			changed = 1;
+		}
+	}
+
 	if (changed) {
 		sfs_writeinode(ino, sfi);
 	}
@@ -350,6 +630,128 @@ pass1_direntry(const char *path, uint32_t index, struct sfs_direntry *sfd)
 	return dchanged;
 }
 
+/*
+ * Check the hash index of a hash-indexed directory D with ND entries,
+ * whose names have already been checked. The bucket headers must
+ * cover each hash value exactly once, any overflow chains must be
+ * sane, and every name must be in the bucket its hash says.
+ *
+ * Returns nonzero if the index is bad. We don't try to rebuild it;
+ * the caller turns the directory into a plain one instead, which
+ * keeps all the entries and which the kernel can still use.
+ */
+static
+int
+pass1_dirhash(struct sfs_direntry *d, uint32_t nd)
+{
+	struct sfs_dirbucket sdb;
+	uint32_t nblocks, maxdepth, nhashes, nseen, mask;
+	uint32_t b, i, j, next, count;
+	uint8_t *seen;
+	int bad = 0;
+
+	if (nd % SFS_DIRPERBLOCK != 0) {
+		return 1;
+	}
+	nblocks = nd / SFS_DIRPERBLOCK;
+
+	/* Check each header by itself, and find the deepest bucket */
+	maxdepth = 0;
+	for (b=0; b<nblocks; b++) {
+		sfsdir_getbucket(&d[b*SFS_DIRPERBLOCK], &sdb);
+		if (sdb.sdb_noino != SFS_NOINO ||
+		    sdb.sdb_magic != SFS_DIRBUCKET_MAGIC ||
+		    sdb.sdb_depth > SFS_DIRHASH_MAXDEPTH ||
+		    sdb.sdb_prefix >= ((uint32_t)1 << sdb.sdb_depth) ||
+		    (sdb.sdb_flags & ~SFS_DIRBUCKET_OVERFLOW) != 0 ||
+		    sdb.sdb_next >= nblocks) {
+			return 1;
+		}
+		if (sdb.sdb_depth > maxdepth) {
+			maxdepth = sdb.sdb_depth;
+		}
+	}
+
+	/*
+	 * Each block must be reached exactly once: primary buckets
+	 * from the hash space, overflow blocks from one chain.
+	 */
+	nhashes = (uint32_t)1 << maxdepth;
+	nseen = nblocks > nhashes ? nblocks : nhashes;
+	seen = domalloc(nseen);
+	bzero(seen, nseen);
+
+	for (b=0; b<nblocks && !bad; b++) {
+		sfsdir_getbucket(&d[b*SFS_DIRPERBLOCK], &sdb);
+		if (sdb.sdb_flags & SFS_DIRBUCKET_OVERFLOW) {
+			continue;
+		}
+		for (j=sdb.sdb_prefix; j<nhashes; j += 1U << sdb.sdb_depth) {
+			if (seen[j]) {
+				bad = 1;
+				break;
+			}
+			seen[j] = 1;
+		}
+	}
+	for (j=0; j<nhashes && !bad && nblocks > 0; j++) {
+		if (!seen[j]) {
+			bad = 1;
+		}
+	}
+
+	bzero(seen, nseen);
+	count = 0;
+	for (b=0; b<nblocks && !bad; b++) {
+		struct sfs_dirbucket head;
+
+		sfsdir_getbucket(&d[b*SFS_DIRPERBLOCK], &head);
+		if (head.sdb_flags & SFS_DIRBUCKET_OVERFLOW) {
+			continue;
+		}
+		seen[b] = 1;
+		count++;
+		for (next = head.sdb_next; next != 0; next = sdb.sdb_next) {
+			sfsdir_getbucket(&d[next*SFS_DIRPERBLOCK], &sdb);
+			if (seen[next] ||
+			    (sdb.sdb_flags & SFS_DIRBUCKET_OVERFLOW) == 0 ||
+			    sdb.sdb_depth != head.sdb_depth ||
+			    sdb.sdb_prefix != head.sdb_prefix) {
+				bad = 1;
+				break;
+			}
+			seen[next] = 1;
+			count++;
+		}
+	}
+	if (count != nblocks) {
+		/* unreachable overflow blocks */
+		bad = 1;
+	}
+	free(seen);
+	if (bad) {
+		return 1;
+	}
+
+	/* Every name must hash into the bucket holding it */
+	for (b=0; b<nblocks; b++) {
+		sfsdir_getbucket(&d[b*SFS_DIRPERBLOCK], &sdb);
+		mask = ((uint32_t)1 << sdb.sdb_depth) - 1;
+		for (i=1; i<SFS_DIRPERBLOCK; i++) {
+			struct sfs_direntry *sfd = &d[b*SFS_DIRPERBLOCK + i];
+
+			if (sfd->sfd_ino == SFS_NOINO) {
+				continue;
+			}
+			if ((sfsdir_hash(sfd->sfd_name) & mask) !=
+			    sdb.sdb_prefix) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
 /*
  * Check a directory. INO is the inode number; PATHSOFAR is the path
  * to this directory. This traverses the volume directory tree
@@ -362,7 +764,7 @@ pass1_dir(uint32_t ino, const char *pathsofar)
 	struct sfs_dinode sfi;
 	struct sfs_direntry *direntries;
 	uint32_t ndirentries, i;
-	int ichanged=0, dchanged=0;
+	int ichanged=0, dchanged=0, hashed;
 
 	sfs_readinode(ino, &sfi);
 
@@ -385,13 +787,27 @@ pass1_dir(uint32_t ino, const char *pathsofar)
 	direntries = domalloc(sfi.sfi_size);
 
 	sfs_readdir(&sfi, direntries, ndirentries);
+	hashed = (sfi.sfi_flags & SFS_IFLAG_DIRHASH) != 0;
 
 	for (i=0; i<ndirentries; i++) {
+		if (hashed && i % SFS_DIRPERBLOCK == 0) {
+			/* bucket header; checked below */
+			continue;
+		}
 		if (pass1_direntry(pathsofar, i, &direntries[i])) {
 			dchanged = 1;
 		}
 	}
 
+	if (hashed && pass1_dirhash(direntries, ndirentries)) {
+		setbadness(EXIT_RECOV);
+		warnx("Directory %s: bad hash index (converted to a plain "
+		      "directory)", pathsofar);
+		sfsdir_unhash(&sfi, direntries, ndirentries);
+		sfs_writeinode(ino, &sfi);
+		dchanged = 1;
+	}
+
 	for (i=0; i<ndirentries; i++) {
 		if (direntries[i].sfd_ino == SFS_NOINO) {
 			/* nothing */
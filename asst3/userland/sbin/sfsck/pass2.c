@@ -47,6 +47,35 @@
 #include "passes.h"
 #include "main.h"
 
+/*
+ * Add NAME/INO to the directory D with ND entries, belonging to the
+ * inode SFI, which may be hash-indexed. If the name's bucket is full
+ * we give up on the index and make it a plain directory, and set
+ * *ICHANGEDP as the inode then needs writing back too.
+ *
+ * Returns 0 on success and nonzero on failure.
+ */
+static
+int
+pass2_tryadd(const char *path, struct sfs_dinode *sfi, int *ichangedp,
+	     struct sfs_direntry *d, int nd, const char *name, uint32_t ino)
+{
+	if (sfi->sfi_flags & SFS_IFLAG_DIRHASH) {
+		if (sfsdir_tryhashadd(d, nd, name, ino) == 0) {
+			return 0;
+		}
+		if (nd == 0) {
+			/* flattening won't make room */
+			return -1;
+		}
+		warnx("Directory %s: no room in hash bucket for `%s' "
+		      "(converted to a plain directory)", path, name);
+		sfsdir_unhash(sfi, d, nd);
+		*ichangedp = 1;
+	}
+	return sfsdir_tryadd(d, nd, name, ino);
+}
+
 /*
  * Process a directory. INO is the inode number; PARENTINO is the
  * parent's inode number; PATHSOFAR is the path to this directory.
@@ -123,6 +152,12 @@ pass2_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 				d1->sfd_name[0] = 0;
 			}
 			else {
+				if (sfi.sfi_flags & SFS_IFLAG_DIRHASH) {
+					/* new name won't hash the same */
+					sfsdir_unhash(&sfi, direntries,
+						      ndirentries);
+					ichanged = 1;
+				}
 				/* XXX: what if FSCK.n.m already exists? */
 				snprintf(d1->sfd_name, sizeof(d1->sfd_name),
 					 "FSCK.%lu.%lu",
@@ -173,7 +208,8 @@ pass2_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 	 */
 
 	if (!dotseen) {
-		if (sfsdir_tryadd(direntries, ndirentries, ".", ino)==0) {
+		if (pass2_tryadd(pathsofar, &sfi, &ichanged,
+				 direntries, ndirentries, ".", ino)==0) {
 			setbadness(EXIT_RECOV);
 			warnx("Directory %s: No `.' entry (added)",
 			      pathsofar);
@@ -201,8 +237,8 @@ pass2_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 	 */
 
 	if (!dotdotseen) {
-		if (sfsdir_tryadd(direntries, ndirentries, "..",
-				  parentino)==0) {
+		if (pass2_tryadd(pathsofar, &sfi, &ichanged,
+				 direntries, ndirentries, "..", parentino)==0) {
 			setbadness(EXIT_RECOV);
 			warnx("Directory %s: No `..' entry (added)",
 			      pathsofar);
@@ -55,6 +55,11 @@ sb_load(void)
 		errx(EXIT_FATAL, "Not an sfs filesystem");
 	}
 
+	if (sb.sb_features & ~SFS_FEATURES_KNOWN) {
+		errx(EXIT_FATAL, "Unsupported features in superblock (0x%lx)",
+		     (unsigned long)(sb.sb_features & ~SFS_FEATURES_KNOWN));
+	}
+
 	assert(sb.sb_nblocks > 0);
 	assert(SFS_FREEMAPBLOCKS(sb.sb_nblocks) > 0);
 }
@@ -83,6 +88,26 @@ sb_check(void)
 		setbadness(EXIT_RECOV);
 		schanged = 1;
 	}
+	if (sb.sb_features & SFS_FEATURE_JOURNAL) {
+		if (sb.sb_journalstart < SFS_FREEMAP_START +
+		    SFS_FREEMAPBLOCKS(sb.sb_nblocks) ||
+		    sb.sb_journalblocks < SFS_JNL_MINBLOCKS ||
+		    sb.sb_journalblocks > sb.sb_nblocks - sb.sb_journalstart) {
+			warnx("Invalid journal location (journal removed)");
+			setbadness(EXIT_RECOV);
+			sb.sb_features &= ~SFS_FEATURE_JOURNAL;
+			sb.sb_journalstart = 0;
+			sb.sb_journalblocks = 0;
+			schanged = 1;
+		}
+	}
+	else if (sb.sb_journalstart != 0 || sb.sb_journalblocks != 0) {
+		warnx("Journal location set without a journal (fixed)");
+		setbadness(EXIT_RECOV);
+		sb.sb_journalstart = 0;
+		sb.sb_journalblocks = 0;
+		schanged = 1;
+	}
 	if (checkzeroed(sb.reserved, sizeof(sb.reserved))) {
 		warnx("Reserved section of superblock not zeroed (fixed)");
 		setbadness(EXIT_RECOV);
@@ -114,6 +139,43 @@ sb_freemapblocks(void)
 	return SFS_FREEMAPBLOCKS(sb.sb_nblocks);
 }
 
+/*
+ * Return the journal location. Only meaningful with
+ * SFS_FEATURE_JOURNAL.
+ */
+uint32_t
+sb_journalstart(void)
+{
+	return sb.sb_journalstart;
+}
+
+uint32_t
+sb_journalblocks(void)
+{
+	return sb.sb_journalblocks;
+}
+
+/*
+ * Return the feature flags.
+ */
+uint32_t
+sb_features(void)
+{
+	return sb.sb_features;
+}
+
+/*
+ * Turn on feature flags, writing the superblock back.
+ */
+void
+sb_addfeatures(uint32_t features)
+{
+	if ((sb.sb_features & features) != features) {
+		sb.sb_features |= features;
+		sfs_writesb(SFS_SUPER_BLOCK, &sb);
+	}
+}
+
 /*
  * Return the volume name.
  */
@@ -52,4 +52,12 @@ const char *sb_volname(void);
 /* Check the superblock. Must load it first. */
 void sb_check(void);
 
+/* After the superblock is checked: return the journal location. */
+uint32_t sb_journalstart(void);
+uint32_t sb_journalblocks(void);
+
+/* After the superblock is loaded: return/add SFS_FEATURE_* flags. */
+uint32_t sb_features(void);
+void sb_addfeatures(uint32_t features);
+
 #endif /* SB_H */
@@ -50,6 +50,7 @@ sfs_setup(void)
 {
 	assert(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_extentblock)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
 }
 
@@ -62,6 +63,9 @@ swapsb(struct sfs_superblock *sb)
 {
 	sb->sb_magic = SWAP32(sb->sb_magic);
 	sb->sb_nblocks = SWAP32(sb->sb_nblocks);
+	sb->sb_features = SWAP32(sb->sb_features);
+	sb->sb_journalstart = SWAP32(sb->sb_journalstart);
+	sb->sb_journalblocks = SWAP32(sb->sb_journalblocks);
 }
 
 static
@@ -72,6 +76,28 @@ swapbits(uint8_t *bits)
 	(void)bits;
 }
 
+static
+void
+swapextent(struct sfs_extent *se)
+{
+	se->se_fileblock = SWAP32(se->se_fileblock);
+	se->se_diskblock = SWAP32(se->se_diskblock);
+	se->se_nblocks = SWAP32(se->se_nblocks);
+}
+
+static
+void
+swapextblock(struct sfs_extentblock *seb)
+{
+	int i;
+
+	seb->seb_next = SWAP32(seb->seb_next);
+	seb->seb_waste = SWAP32(seb->seb_waste);
+	for (i=0; i<SFS_EXTPERBLOCK; i++) {
+		swapextent(&seb->seb_extents[i]);
+	}
+}
+
 static
 void
 swapinode(struct sfs_dinode *sfi)
@@ -97,6 +123,13 @@ swapinode(struct sfs_dinode *sfi)
 	for (i=0; i<NUM_III; i++) {
 		SET_III(sfi, i) = SWAP32(GET_III(sfi, i));
 	}
+
+	sfi->sfi_flags = SWAP32(sfi->sfi_flags);
+	sfi->sfi_nextents = SWAP32(sfi->sfi_nextents);
+	sfi->sfi_extblock = SWAP32(sfi->sfi_extblock);
+	for (i=0; i<SFS_NIEXTENTS; i++) {
+		swapextent(&sfi->sfi_extents[i]);
+	}
 }
 
 static
@@ -152,6 +185,42 @@ ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
 	}
 }
 
+/*
+ * Extent bmap: look through the extents for one covering FILEBLOCK.
+ */
+static
+uint32_t
+extbmap(const struct sfs_dinode *sfi, uint32_t fileblock)
+{
+	struct sfs_extentblock seb;
+	const struct sfs_extent *se;
+	uint32_t i, block;
+
+	block = sfi->sfi_extblock;
+	for (i=0; i<sfi->sfi_nextents; i++) {
+		if (i < SFS_NIEXTENTS) {
+			se = &sfi->sfi_extents[i];
+		}
+		else {
+			if ((i - SFS_NIEXTENTS) % SFS_EXTPERBLOCK == 0) {
+				if (block == 0) {
+					return 0;
+				}
+				sfs_readextblock(block, &seb);
+				block = seb.seb_next;
+			}
+			se = &seb.seb_extents[(i - SFS_NIEXTENTS) %
+					      SFS_EXTPERBLOCK];
+		}
+		if (fileblock >= se->se_fileblock &&
+		    fileblock - se->se_fileblock < se->se_nblocks) {
+			return se->se_diskblock +
+				(fileblock - se->se_fileblock);
+		}
+	}
+	return 0;
+}
+
 /*
  * bmap() for SFS.
  *
@@ -163,6 +232,9 @@ bmap(const struct sfs_dinode *sfi, uint32_t fileblock)
 {
 	uint32_t iblock, offset;
 
+	if (sfi->sfi_flags & SFS_IFLAG_EXTENTS) {
+		return extbmap(sfi, fileblock);
+	}
 	if (fileblock < INOMAX_D) {
 		return GET_D(sfi, fileblock);
 	}
@@ -264,6 +336,25 @@ sfs_writeindirect(uint32_t blocknum, uint32_t *entries)
 	swapindir(entries);
 }
 
+/*
+ *  extent blocks - blocknum is a disk block number.
+ */
+
+void
+sfs_readextblock(uint32_t blocknum, struct sfs_extentblock *seb)
+{
+	diskread(seb, blocknum);
+	swapextblock(seb);
+}
+
+void
+sfs_writeextblock(uint32_t blocknum, struct sfs_extentblock *seb)
+{
+	swapextblock(seb);
+	diskwrite(seb, blocknum);
+	swapextblock(seb);
+}
+
 ////////////////////////////////////////////////////////////
 // directory I/O
 
@@ -442,6 +533,60 @@ sfsdir_sort(struct sfs_direntry *d, unsigned nd, int *vector)
 	qsort(vector, nd, sizeof(int), dirsortfunc);
 }
 
+/*
+ * Hash a name for a hash-indexed directory. This must match the
+ * kernel (see struct sfs_dirbucket in kern/sfs.h).
+ */
+uint32_t
+sfsdir_hash(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/*
+ * Get the bucket header out of the first slot D of a block of a
+ * hash-indexed directory. sfs_readdir only byte-swaps the inode
+ * number, so the rest is still in disk byte order.
+ */
+void
+sfsdir_getbucket(const struct sfs_direntry *d, struct sfs_dirbucket *sdb)
+{
+	unsigned i;
+
+	memcpy(sdb, d, sizeof(*sdb));
+	sdb->sdb_magic = SWAP32(sdb->sdb_magic);
+	sdb->sdb_depth = SWAP32(sdb->sdb_depth);
+	sdb->sdb_prefix = SWAP32(sdb->sdb_prefix);
+	sdb->sdb_next = SWAP32(sdb->sdb_next);
+	sdb->sdb_flags = SWAP32(sdb->sdb_flags);
+	for (i=0; i<sizeof(sdb->sdb_waste)/sizeof(sdb->sdb_waste[0]); i++) {
+		sdb->sdb_waste[i] = SWAP32(sdb->sdb_waste[i]);
+	}
+}
+
+/*
+ * Turn the hash-indexed directory D (with ND entries) belonging to
+ * the inode SFI into a plain directory, by clearing the bucket
+ * headers and the inode flag. The entries stay where they are. The
+ * caller must write back both the inode and the directory.
+ */
+void
+sfsdir_unhash(struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd)
+{
+	unsigned i;
+
+	for (i=0; i<nd; i+=SFS_DIRPERBLOCK) {
+		memset(&d[i], 0, sizeof(d[i]));
+	}
+	sfi->sfi_flags &= ~SFS_IFLAG_DIRHASH;
+}
+
 /*
  * Try to add an entry NAME/INO to D (which has ND entries) by
  * finding an empty slot. Cannot allocate new space.
@@ -462,3 +607,33 @@ sfsdir_tryadd(struct sfs_direntry *d, int nd, const char *name, uint32_t ino)
 	}
 	return -1;
 }
+
+/*
+ * Like sfsdir_tryadd, but for a hash-indexed directory, whose index
+ * must be valid: the entry can only go in a free slot of the bucket
+ * (or overflow block) its hash says.
+ *
+ * Returns 0 on success and nonzero on failure.
+ */
+int
+sfsdir_tryhashadd(struct sfs_direntry *d, int nd,
+		  const char *name, uint32_t ino)
+{
+	struct sfs_dirbucket sdb;
+	uint32_t hash, mask;
+	int b;
+
+	hash = sfsdir_hash(name);
+	for (b=0; b+SFS_DIRPERBLOCK<=nd; b+=SFS_DIRPERBLOCK) {
+		sfsdir_getbucket(&d[b], &sdb);
+		mask = ((uint32_t)1 << sdb.sdb_depth) - 1;
+		if ((hash & mask) != sdb.sdb_prefix) {
+			continue;
+		}
+		/* slot 0 is the header */
+		if (sfsdir_tryadd(d+b+1, SFS_DIRPERBLOCK-1, name, ino) == 0) {
+			return 0;
+		}
+	}
+	return -1;
+}
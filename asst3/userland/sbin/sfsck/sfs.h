@@ -40,7 +40,9 @@
 
 struct sfs_superblock;
 struct sfs_dinode;
+struct sfs_extentblock;
 struct sfs_direntry;
+struct sfs_dirbucket;
 
 /* Call this before anything else in this module */
 void sfs_setup(void);
@@ -65,6 +67,10 @@ void sfs_writeinode(uint32_t inum, struct sfs_dinode *sfi);
 void sfs_readindirect(uint32_t blocknum, uint32_t *entries);
 void sfs_writeindirect(uint32_t blocknum, uint32_t *entries);
 
+/* extent block */
+void sfs_readextblock(uint32_t blocknum, struct sfs_extentblock *seb);
+void sfs_writeextblock(uint32_t blocknum, struct sfs_extentblock *seb);
+
 /* directory - ND should be the number of directory entries D points to */
 void sfs_readdir(struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd);
 void sfs_writedir(const struct sfs_dinode *sfi,
@@ -74,6 +80,14 @@ void sfs_writedir(const struct sfs_dinode *sfi,
 int sfsdir_tryadd(struct sfs_direntry *d, int nd,
 		  const char *name, uint32_t ino);
 
+/* Hash-indexed directory support. */
+uint32_t sfsdir_hash(const char *name);
+void sfsdir_getbucket(const struct sfs_direntry *d, struct sfs_dirbucket *sdb);
+void sfsdir_unhash(struct sfs_dinode *sfi,
+		   struct sfs_direntry *d, unsigned nd);
+int sfsdir_tryhashadd(struct sfs_direntry *d, int nd,
+		      const char *name, uint32_t ino);
+
 /* Sort a directory by creating a permutation vector. */
 void sfsdir_sort(struct sfs_direntry *d, unsigned nd, int *vector);
 
@@ -70,15 +70,19 @@ void
 waitall(void)
 {
 	int i, status;
+	pid_t pid;
+
+	/* Take them in whatever order they finish. */
 	for (i=0; i<npids; i++) {
-		if (waitpid(pids[i], &status, 0)<0) {
-			warn("waitpid for %d", pids[i]);
+		pid = waitpid(WAIT_ANY, &status, 0);
+		if (pid<0) {
+			warn("waitpid");
 		}
 		else if (WIFSIGNALED(status)) {
-			warnx("pid %d: signal %d", pids[i], WTERMSIG(status));
+			warnx("pid %d: signal %d", pid, WTERMSIG(status));
 		}
 		else if (WEXITSTATUS(status) != 0) {
-			warnx("pid %d: exit %d", pids[i], WEXITSTATUS(status));
+			warnx("pid %d: exit %d", pid, WEXITSTATUS(status));
 		}
 	}
 }
@@ -29,20 +29,15 @@
 
 /*
  * Test multiple user level threads inside a process. The program
- * forks 3 threads off 2 to functions, each of which displays a string
- * every once in a while.
+ * creates 3 threads running 2 functions, each of which displays a
+ * string every once in a while, then waits for them all.
  *
- * This won't do much of anything unless you implement user-level
- * threads.
- *
- * It also makes various assumptions about the thread API. In
- * particular, it believes (1) that you create a thread by calling
- * "threadfork()" and passing the address for execution of the new
- * thread to begin at, (2) that if the parent thread exits any child
- * threads will keep running, and (3) child threads will exit if they
- * return from the function they started in. If any or all of these
- * assumptions are not met by your user-level threads, you will need
- * to patch this test accordingly.
+ * Threads are made with thread_create(), which takes the function
+ * to run, an argument for it, and a stack (the kernel doesn't make
+ * one). A thread exits when it returns from its function or calls
+ * thread_exit(), and thread_join() waits for it and collects the
+ * value. If the main thread exits the process, the other threads go
+ * with it, so it has to join them first.
  *
  * This is also a rather basic test and you'll probably want to write
  * some more of your own.
@@ -51,35 +46,52 @@
 
 #include <unistd.h>
 #include <stdio.h>
+#include <err.h>
 
 #define NTHREADS  3
 #define MAX       1<<25
+#define STACKSIZE 16384
 
 /* counter for the loop in the threads:
    This variable is shared and incremented by each
    thread during his computation */
 volatile int count = 0;
 
+/* stacks for the threads */
+static char stacks[NTHREADS][STACKSIZE];
+
 /* the 2 threads : */
-void ThreadRunner(void);
-void BladeRunner(void);
+void *ThreadRunner(void *);
+void *BladeRunner(void *);
 
 int
 main(int argc, char *argv[])
 {
+    int tids[NTHREADS];
+    void *ret;
     int i;
 
     (void)argc;
     (void)argv;
 
     for (i=0; i<NTHREADS; i++) {
-	if (i)
-	    threadfork(ThreadRunner);
-        else
-	    threadfork(BladeRunner);
+	tids[i] = thread_create(i ? ThreadRunner : BladeRunner, stacks[i],
+				stacks[i], STACKSIZE);
+	if (tids[i] < 0) {
+	    err(1, "thread_create");
+	}
+    }
+
+    for (i=0; i<NTHREADS; i++) {
+	if (thread_join(tids[i], &ret) < 0) {
+	    err(1, "thread_join");
+	}
+	if (ret != stacks[i]) {
+	    errx(1, "thread %d returned %p", tids[i], ret);
+	}
     }
 
-    printf("Parent has left.\n");
+    printf("\nParent has left.\n");
     return 0;
 }
 
@@ -88,22 +100,24 @@ main(int argc, char *argv[])
    random results.
 */
 
-void
-BladeRunner()
+void *
+BladeRunner(void *arg)
 {
     while (count < MAX) {
 	if (count % 500 == 0)
 	    printf("Blade ");
 	count++;
     }
+    return arg;
 }
 
-void
-ThreadRunner()
+void *
+ThreadRunner(void *arg)
 {
     while (count < MAX) {
 	if (count % 513 == 0)
 	    printf(" Runner\n");
 	count++;
     }
+    return arg;
 }